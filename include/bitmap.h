@@ -47,6 +47,22 @@ bool bitmap_test(const bitmap_t *const bitmap, const size_t bit);
 ///
 void bitmap_flip(bitmap_t *const bitmap, const size_t bit);
 
+///
+/// Sets a run of bits in bitmap, a word at a time
+/// \param bitmap The bitmap
+/// \param start The first bit to set
+/// \param count The number of bits to set
+///
+void bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Clears a run of bits in bitmap, a word at a time
+/// \param bitmap The bitmap
+/// \param start The first bit to clear
+/// \param count The number of bits to clear
+///
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
 ///
 /// Flips all bits in the bitmap
 /// \param bitmap The bitmap to invert
@@ -67,6 +83,90 @@ size_t bitmap_ffs(const bitmap_t *const bitmap);
 ///
 size_t bitmap_ffz(const bitmap_t *const bitmap);
 
+///
+/// Find first zero at or after a given bit
+/// \param bitmap The bitmap
+/// \param from The bit to start looking at
+/// \return The first zero bit address at or after from, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_from(const bitmap_t *const bitmap, const size_t from);
+
+///
+/// Find first zero in a range
+///  Only the words covering the range are read
+/// \param bitmap The bitmap
+/// \param start The first bit of the range
+/// \param count The number of bits in the range
+/// \return The first zero bit address in [start, start + count), SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_range(const bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Find first run of zeroes
+///  Scans a word at a time, whole empty and full words cost one compare
+/// \param bitmap The bitmap
+/// \param count The number of consecutive zero bits wanted
+/// \return The address of the first bit of the first such run, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_run(const bitmap_t *const bitmap, const size_t count);
+
+///
+/// Find first run of zeroes that starts at or after a given bit
+/// \param bitmap The bitmap
+/// \param from The bit to start looking at
+/// \param count The number of consecutive zero bits wanted
+/// \return The address of the first bit of the first such run, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_run_from(const bitmap_t *const bitmap, const size_t from, const size_t count);
+
+///
+/// Find the smallest run of zeroes that is at least count long
+///  Ties go to the lowest address, an exact fit ends the search early
+/// \param bitmap The bitmap
+/// \param count The number of consecutive zero bits wanted
+/// \return The address of the first bit of the run, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_run_best(const bitmap_t *const bitmap, const size_t count);
+
+///
+/// Sets the first count zero bits in one pass
+///  Each word is written once no matter how many of its bits are claimed
+/// \param bitmap The bitmap
+/// \param count The number of zero bits to claim
+/// \param bits Filled with the addresses of the claimed bits, in increasing order
+/// \return The number of bits claimed, less than count when the bitmap ran out of zeroes
+///
+size_t bitmap_claim_zeros(bitmap_t *const bitmap, const size_t count, size_t *const bits);
+
+///
+/// Atomically sets a bit
+///  The atomic variants (test_and_set, test_and_reset, ffz_claim) can be called from any number of
+///  threads at once, alongside each other and alongside bitmap_test and the ffz/ffs scans.
+///  They don't maintain the hierarchical summary, so use them on flat bitmaps only.
+/// \param bitmap The bitmap
+/// \param bit The bit to set
+/// \return The value the bit had before, true if another thread already set it
+///
+bool bitmap_test_and_set(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Atomically clears a bit
+/// \param bitmap The bitmap
+/// \param bit The bit to clear
+/// \return The value the bit had before, false if another thread already cleared it
+///
+bool bitmap_test_and_reset(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Atomically finds a zero and sets it, lock-free
+///  Scans from the hint to the end and then wraps around, so threads with different hints
+///  start out in different words and rarely fight over the same one
+/// \param bitmap The bitmap
+/// \param hint The bit to start looking at
+/// \return The address of the bit this call claimed, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_claim(bitmap_t *const bitmap, const size_t hint);
+
 ///
 /// Count all bits set
 /// \param bitmap the bitmap
@@ -100,6 +200,7 @@ size_t bitmap_get_bits(const bitmap_t *const bitmap);
 
 ///
 /// Gets total number of bytes in bitmap
+///  (storage is padded to 64-bit words internally, this is the exported size)
 /// \param bitmap The bitmap
 /// \return number of bytes used by bitmap storage array
 ///
@@ -112,6 +213,25 @@ size_t bitmap_get_bytes(const bitmap_t *const bitmap);
 ///
 bitmap_t *bitmap_create(const size_t n_bits);
 
+///
+/// Creates a hierarchical bitmap to contain n bits (zero initialized)
+///  Summary levels on top of the bits record which words still hold a zero or a one,
+///  so ffz/ffs cost a few word loads regardless of size.
+///  set/reset/flip pay a little extra to keep the summary up to date.
+/// \param n_bits
+/// \return New bitmap pointer, NULL on error
+///
+bitmap_t *bitmap_create_hierarchical(const size_t n_bits);
+
+///
+/// (Re)builds the summary levels from the current bitmap contents,
+///  turning any bitmap (imported and overlaid ones included) into a hierarchical one
+///  Call it again if overlaid memory was changed behind the bitmap's back
+/// \param bitmap The bitmap
+/// \return true on success, false on error
+///
+bool bitmap_summarize(bitmap_t *const bitmap);
+
 ///
 /// Gets pointer to the internal data for exporting
 ///  Be sure to query the bit and byte size if it's unknown
@@ -134,9 +254,12 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data);
 /// Creates a new bitmap using the provided data
 /// Note: This uses the given block of memory
 ///  and does not free this pointer on destruction
+///  Storage is accessed as 64-bit words, so the memory must be 8-byte aligned.
+///  Only the bytes the bits need are touched: a last word the memory stops short of
+///  is read and written a byte at a time
 /// \param n_bits The number of bits in the bitmap
 /// \param bitmap_data The data to import
-/// \return New bitmap pointer, NULL on error
+/// \return New bitmap pointer, NULL on error or if bitmap_data isn't 8-byte aligned
 ///
 bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data);
 
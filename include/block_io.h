@@ -0,0 +1,132 @@
+#ifndef BLOCK_IO_H__
+#define BLOCK_IO_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+	// Asynchronous file I/O with a bounded number of requests in flight
+	// Linux builds submit through io_uring, everywhere else (or where the kernel says no) a pool of
+	//  threads runs plain pread/pwrite calls. Either way callbacks only ever run inside block_io calls
+	//  made by the submitting thread, so they need no locking of their own.
+	// An engine belongs to one thread at a time.
+
+#define BLOCK_IO_DEPTH 32        // Requests in flight when nobody asks for something else
+#define BLOCK_IO_MAX_DEPTH 4096  // Largest depth block_io_create accepts
+#define BLOCK_IO_POOL_THREADS 16 // Threads block_io_create gives a pool at most, whatever the depth
+#define BLOCK_IO_MAX_THREADS 64  // Largest pool block_io_create_pool accepts
+
+	// Flags for block_io_create
+#define BLOCK_IO_POOL 0x01 // Use the thread pool even where io_uring works
+
+	typedef struct block_io block_io_t;
+
+	///
+	/// What a finished request reports
+	/// \param arg The arg given with the request
+	///  A short transfer goes again for the rest, so anything short of the whole length means the file ended first
+	/// \param result Bytes transferred, or a negative errno
+	///
+	typedef void (*block_io_callback_t)(void *arg, ssize_t result);
+
+	///
+	/// Creates an engine that keeps up to depth requests going at once
+	/// \param depth Requests in flight, 1 to BLOCK_IO_MAX_DEPTH
+	/// \param flags BLOCK_IO_POOL or 0
+	/// \return Pointer to the engine, NULL on error
+	///
+	block_io_t *block_io_create(const size_t depth, const int flags);
+
+	///
+	/// Creates an engine running on a pool of exactly threads threads, even where io_uring works
+	///  Requests are handed to the threads in order, so spreading a big transfer over several requests
+	///  spreads it over the threads
+	/// \param depth Requests in flight, 1 to BLOCK_IO_MAX_DEPTH
+	/// \param threads Pool threads, 1 to BLOCK_IO_MAX_THREADS
+	/// \return Pointer to the engine, NULL on error
+	///
+	block_io_t *block_io_create_pool(const size_t depth, const size_t threads);
+
+	///
+	/// Queues a read of len bytes at offset into buf
+	///  When depth requests are already out this waits for one of them, running callbacks
+	///  Queued reads go to the kernel by the next block_io_poll or block_io_wait at the latest
+	/// \param io The engine
+	/// \param fd File to read
+	/// \param buf Where the bytes go, has to stay put until the callback
+	/// \param len Bytes to read
+	/// \param offset File offset to read at
+	/// \param callback Run once the read is done, may be NULL
+	/// \param arg Handed to callback
+	/// \return true if the read is queued, false on error
+	///
+	bool block_io_read(block_io_t *const io, const int fd, void *const buf, const size_t len, const off_t offset, block_io_callback_t callback, void *const arg);
+
+	///
+	/// Queues a write of len bytes from buf at offset, otherwise the same as block_io_read
+	/// \param io The engine
+	/// \param fd File to write
+	/// \param buf The bytes to write, have to stay put until the callback
+	/// \param len Bytes to write
+	/// \param offset File offset to write at
+	/// \param callback Run once the write is done, may be NULL
+	/// \param arg Handed to callback
+	/// \return true if the write is queued, false on error
+	///
+	bool block_io_write(block_io_t *const io, const int fd, const void *const buf, const size_t len, const off_t offset, block_io_callback_t callback, void *const arg);
+
+	///
+	/// Queues a request that is already done, for work finished without going to the kernel
+	///  Its callback runs like any other, by the next block_io_poll or block_io_wait
+	/// \param io The engine
+	/// \param result What the callback reports
+	/// \param callback Run by the next poll, may be NULL
+	/// \param arg Handed to callback
+	/// \return true if queued, false on error
+	///
+	bool block_io_complete(block_io_t *const io, const ssize_t result, block_io_callback_t callback, void *const arg);
+
+	///
+	/// Submits what is queued and runs the callbacks of everything finished, without waiting
+	/// \param io The engine
+	/// \return Number of requests completed
+	///
+	size_t block_io_poll(block_io_t *const io);
+
+	///
+	/// Submits what is queued and waits until every request has completed
+	/// \param io The engine
+	/// \return Number of requests completed
+	///
+	size_t block_io_wait(block_io_t *const io);
+
+	///
+	/// Requests queued or in flight whose callbacks haven't run yet
+	/// \param io The engine
+	/// \return Outstanding requests, 0 on error
+	///
+	size_t block_io_pending(const block_io_t *const io);
+
+	///
+	/// Tells which backend the engine ended up with
+	/// \param io The engine
+	/// \return true for io_uring, false for the thread pool or on error
+	///
+	bool block_io_uses_uring(const block_io_t *const io);
+
+	///
+	/// Waits for everything outstanding, running the callbacks, then frees the engine
+	/// \param io The engine, NULL is ignored
+	///
+	void block_io_destroy(block_io_t *const io);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
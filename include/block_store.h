@@ -8,6 +8,8 @@ extern "C"
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <sys/uio.h>
+#include "block_io.h"
 
 	// Constants
 #define BITMAP_SIZE_BYTES 32         //  
@@ -16,6 +18,20 @@ extern "C"
 #define BLOCK_SIZE_BYTES 256         // 2^8 BYTES per block
 #define BLOCK_SIZE_BITS (BLOCK_SIZE_BYTES*8)
 #define BLOCK_STORE_NUM_BYTES (BLOCK_STORE_NUM_BLOCKS * BLOCK_SIZE_BYTES)
+#define BLOCK_STORE_MIN_BLOCK_SIZE 64 // Smallest block size block_store_create_ex accepts (one cache line)
+
+	// Flags for block_store_open_mmap
+#define BLOCK_STORE_MMAP_READONLY 0x01 // Map the file read-only, writes and allocations fail
+#define BLOCK_STORE_MMAP_CREATE 0x02   // Format a missing or empty file with the default geometry
+
+	// Journal bytes past the last checkpoint that start a new one in the background (see block_store_set_journal_limit)
+#define BLOCK_STORE_JOURNAL_LIMIT (64 * 1024 * 1024)
+
+	// Flags for block_store_create_flags
+#define BLOCK_STORE_THREAD_SAFE 0x01   // Calls from several threads at once are safe, see block_store_create_flags
+#define BLOCK_STORE_THREAD_CACHE 0x02  // BLOCK_STORE_THREAD_SAFE plus per-thread caches of free blocks
+#define BLOCK_STORE_CHECKSUMS 0x04     // Keep a CRC-32C of every block and check it on the way out
+#define BLOCK_STORE_DEDUP 0x08         // Keep one copy of blocks with the same contents, see block_store_create_flags
 
 
 	// Declaring the struct but not implementing in the header allows us to prevent users
@@ -24,14 +40,163 @@ extern "C"
 	// This enforces a black box device, but it can be restricting
 	typedef struct block_store block_store_t;
 
+	// An image file open for reading single blocks, see block_store_image_open
+	typedef struct block_store_image block_store_image_t;
+
+	// Allocation policies for block_store_set_policy
+	typedef enum {
+		BLOCK_STORE_FIRST_FIT, // Lowest free block or run (the default)
+		BLOCK_STORE_NEXT_FIT,  // First fit starting after the last allocation, wrapping around
+		BLOCK_STORE_BEST_FIT   // Smallest free run that fits, leaves the big runs for big extents
+	} block_store_policy_t;
+
+	// What the per-thread caches of a BLOCK_STORE_THREAD_CACHE store have been up to
+	// Hit rate is hits / (hits + misses)
+	typedef struct {
+		size_t hits;    // allocates and releases served by the calling thread's cache alone
+		size_t misses;  // ones that had to refill or drain the cache against the FBM first
+		size_t refills; // batches pulled out of the FBM
+		size_t drains;  // batches pushed back into the FBM
+		size_t cached;  // free blocks sitting in caches right now
+	} block_store_cache_stats_t;
+
+	// What the write-ahead journal of a store made by block_store_create_wal/open_wal has been up to
+	// Commits per sync is how well group commit is doing
+	typedef struct {
+		size_t commits;     // calls that waited for their changes to be in the journal
+		size_t syncs;       // transactions appended, one fdatasync each
+		size_t blocks;      // blocks those transactions held
+		size_t checkpoints; // times the journal was folded into the image
+	} block_store_journal_stats_t;
+
 	///
 	/// This creates a new BS device, ready to go
 	/// \return Pointer to a new block storage device, NULL on error
 	///
 	block_store_t *block_store_create();
 
+	///
+	/// This creates a new BS device with the given geometry
+	///  block_store_create() is block_store_create_ex(BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES)
+	///  The leading blocks hold the FBM, the rest are user-addressable (see block_store_get_avail_blocks)
+	/// \param num_blocks Total number of blocks on the device, FBM blocks included
+	/// \param block_size Bytes per block, a power of two no smaller than BLOCK_STORE_MIN_BLOCK_SIZE
+	/// \return Pointer to a new block storage device, NULL on error
+	///
+	block_store_t *block_store_create_ex(const size_t num_blocks, const size_t block_size);
+
+	///
+	/// block_store_create_ex with options
+	///  With BLOCK_STORE_THREAD_SAFE allocate, request, release (and their batch/extent/near forms), the block
+	///  reads and writes, borrow and return may be called from any number of threads at once.
+	///  The FBM only changes through the atomic bitmap calls, so allocators never block each other.
+	///  Each thread starts looking in its own slice of the device, so block_store_allocate no longer hands out
+	///  the lowest free block and ignores the policy. Every block has a seqlock: a read never sees half of a
+	///  write, readers of a block never wait on each other, and writers of a block take turns. Multi-block
+	///  calls are atomic per block, not as a whole. Borrowed pointers bypass all of this.
+	///  Flush, serialize and destroy must not run alongside anything else.
+	/// \param num_blocks Total number of blocks on the device, FBM blocks included
+	/// \param block_size Bytes per block, a power of two no smaller than BLOCK_STORE_MIN_BLOCK_SIZE
+	///  BLOCK_STORE_THREAD_CACHE puts a small per-thread cache of free blocks in front of block_store_allocate
+	///  and block_store_release. They refill and drain it in batches, so most calls never touch the shared FBM.
+	///  Blocks sitting in a cache count as free but can't be requested, and a thread's cache empties when it exits.
+	///  The serialize calls empty every cache first.
+	///  BLOCK_STORE_CHECKSUMS keeps a CRC-32C of every user block in the metadata blocks after the FBM, so images
+	///  carry them too. Writes bring them up to date, whole-block writes summing the caller's buffer; reads and
+	///  deserialize check allocated blocks against them, and fail rather than hand out a block that doesn't match.
+	///  Uses the SSE4.2 or ARMv8 CRC instructions where the CPU has them. Journaled devices can't have them.
+	///  BLOCK_STORE_DEDUP stores each distinct block once. Every write hashes the block (CRC-32C, then a full compare)
+	///  and maps it onto a copy already held if there is one; zeroed blocks take no copy at all. The map is kept in
+	///  the metadata blocks, so images are deduplicated too: block_store_serialize leaves the unused part as holes,
+	///  block_store_serialize_compressed and block_store_serialize_incremental skip it. A released block reads back
+	///  zeroed, and a borrowed one has a copy to itself until it is returned (writes to it while it is shared don't
+	///  show through an earlier borrow of another block). Can't be combined with the thread flags.
+	/// \param flags BLOCK_STORE_THREAD_SAFE, BLOCK_STORE_THREAD_CACHE, BLOCK_STORE_CHECKSUMS, BLOCK_STORE_DEDUP, or them combined, or 0
+	/// \return Pointer to a new block storage device, NULL on error
+	///
+	block_store_t *block_store_create_flags(const size_t num_blocks, const size_t block_size, const int flags);
+
+	///
+	/// Creates a BS device whose blocks live in the given file, mapped straight into memory
+	///  The file is created (or truncated) and sized to num_blocks * block_size bytes,
+	///  block 0 holds a header with the geometry followed by the FBM
+	/// \param path The backing file
+	/// \param num_blocks Total number of blocks on the device, FBM blocks included
+	/// \param block_size Bytes per block, a power of two no smaller than BLOCK_STORE_MIN_BLOCK_SIZE
+	/// \return Pointer to a new block storage device, NULL on error
+	///
+	block_store_t *block_store_create_mmap(const char *const path, const size_t num_blocks, const size_t block_size);
+
+	///
+	/// Opens a BS device previously made by block_store_create_mmap, mapping the file as the device
+	///  Only the header is read, blocks are paged in as they are used
+	/// \param path The backing file
+	/// \param flags BLOCK_STORE_MMAP_* flags
+	/// \return Pointer to the block storage device, NULL on error
+	///
+	block_store_t *block_store_open_mmap(const char *const path, const int flags);
+
+	///
+	/// Creates a BS device that lives in memory, made durable by a write-ahead journal
+	///  The image at path is created (or truncated), the journal is path with ".wal" on the end.
+	///  block_store_write and the other block writes return once the change is in the journal: one sequential
+	///  append and one fdatasync, shared by every thread writing at the time (group commit). FBM changes from
+	///  allocate and release go into the journal with the next write or block_store_flush.
+	///  A background thread folds the journal into the image once it grows past BLOCK_STORE_JOURNAL_LIMIT.
+	///  Journaled devices are always BLOCK_STORE_THREAD_SAFE, and have no per-thread caches.
+	/// \param path The image file
+	/// \param num_blocks Total number of blocks on the device, FBM blocks included
+	/// \param block_size Bytes per block, a power of two no smaller than BLOCK_STORE_MIN_BLOCK_SIZE
+	/// \return Pointer to a new block storage device, NULL on error
+	///
+	block_store_t *block_store_create_wal(const char *const path, const size_t num_blocks, const size_t block_size);
+
+	///
+	/// Opens a BS device made by block_store_create_wal, after a crash as well as a clean shutdown
+	///  The image is read in and whatever whole transactions the journal holds are replayed on top of it,
+	///  a torn last transaction is left out. The result is folded into the image before this returns.
+	/// \param path The image file
+	/// \return Pointer to the block storage device, NULL on error
+	///
+	block_store_t *block_store_open_wal(const char *const path);
+
+	///
+	/// Folds a journaled BS device's journal into its image now, rather than waiting for the background thread
+	///  Writers carry on while it runs
+	/// \param bs BS device
+	/// \return true on success, false on error or if the device has no journal
+	///
+	bool block_store_checkpoint(block_store_t *const bs);
+
+	///
+	/// Sets how much a journaled BS device's journal grows past its last checkpoint before the next one
+	/// \param bs BS device
+	/// \param bytes Journal bytes, BLOCK_STORE_JOURNAL_LIMIT to start with
+	/// \return true on success, false on error or if the device has no journal
+	///
+	bool block_store_set_journal_limit(block_store_t *const bs, const size_t bytes);
+
+	///
+	/// Reports what a journaled BS device's journal has done since the device was opened
+	/// \param bs BS device
+	/// \param stats Filled with the totals
+	/// \return true on success, false on error or if the device has no journal
+	///
+	bool block_store_get_journal_stats(block_store_t *const bs, block_store_journal_stats_t *const stats);
+
+	///
+	/// Makes every change to a file-backed BS device durable
+	///  Only the blocks written (or whose FBM bits changed) since the last flush are synced
+	///  Journaled devices append what changed to the journal
+	///  Devices that only live in memory have nothing to flush and always succeed
+	/// \param bs BS device
+	/// \return true on success, false on error
+	///
+	bool block_store_flush(block_store_t *const bs);
+
 	///
 	/// Destroys the provided block storage device
+	///  File-backed devices are flushed first, journaled ones fold their journal into the image
 	/// This is an idempotent operation, so there is no return value
 	/// \param bs BS device
 	///
@@ -39,11 +204,37 @@ extern "C"
 
 	///
 	/// Searches for a free block, marks it as in use, and returns the block's id
+	///  Which free block is picked depends on the store's policy, see block_store_set_policy
 	/// \param bs BS device
 	/// \return Allocated block's id, SIZE_MAX on error
 	///
 	size_t block_store_allocate(block_store_t *const bs);
 
+	///
+	/// Allocates the first free block at or after hint, wrapping around to the start of the device
+	///  Useful to keep blocks of the same object close together whatever the policy
+	/// \param bs BS device
+	/// \param hint The block id the new block should be near
+	/// \return Allocated block's id, SIZE_MAX on error
+	///
+	size_t block_store_allocate_near(block_store_t *const bs, const size_t hint);
+
+	///
+	/// Sums up the per-thread caches of a BLOCK_STORE_THREAD_CACHE store, exited threads included
+	/// \param bs BS device
+	/// \param stats Filled with the totals
+	/// \return true on success, false on error or if the store has no caches
+	///
+	bool block_store_get_cache_stats(block_store_t *const bs, block_store_cache_stats_t *const stats);
+
+	///
+	/// Picks how block_store_allocate and block_store_allocate_extent choose free blocks
+	/// \param bs BS device
+	/// \param policy One of the block_store_policy_t values
+	/// \return true on success, false on error
+	///
+	bool block_store_set_policy(block_store_t *const bs, const block_store_policy_t policy);
+
 	///
 	/// Attempts to allocate the requested block id
 	/// \param bs the block store object
@@ -54,11 +245,46 @@ extern "C"
 
 	///
 	/// Frees the specified block
+	///  Blocks that are borrowed (see block_store_borrow) are left allocated
 	/// \param bs BS device
 	/// \param block_id The block to free
 	///
 	void block_store_release(block_store_t *const bs, const size_t block_id);
 
+	///
+	/// Allocates count adjacent blocks from a run of free blocks chosen by the store's policy
+	/// \param bs BS device
+	/// \param count Number of blocks wanted
+	/// \param first Set to the id of the first block of the extent
+	/// \return true on success, false on error or if there is no run that long
+	///
+	bool block_store_allocate_extent(block_store_t *const bs, const size_t count, size_t *const first);
+
+	///
+	/// Frees count adjacent blocks, the same as releasing each of them
+	/// \param bs BS device
+	/// \param first The first block to free
+	/// \param count Number of blocks to free
+	///
+	void block_store_release_extent(block_store_t *const bs, const size_t first, const size_t count);
+
+	///
+	/// Allocates up to n blocks in a single pass over the FBM, lowest ids first
+	/// \param bs BS device
+	/// \param n Number of blocks wanted
+	/// \param block_ids Filled with the allocated ids, in increasing order
+	/// \return Number of blocks allocated, less than n only when the device ran out, 0 on error
+	///
+	size_t block_store_allocate_batch(block_store_t *const bs, const size_t n, size_t *const block_ids);
+
+	///
+	/// Frees n blocks, the same as releasing each of them
+	/// \param bs BS device
+	/// \param block_ids The blocks to free, invalid ids are skipped
+	/// \param n Number of ids
+	///
+	void block_store_release_batch(block_store_t *const bs, const size_t *const block_ids, const size_t n);
+
 	///
 	/// Counts the number of blocks marked as in use
 	/// \param bs BS device
@@ -73,6 +299,15 @@ extern "C"
 	///
 	size_t block_store_get_free_blocks(const block_store_t *const bs);
 
+	///
+	/// Counts the blocks of memory holding user data
+	///  For a BLOCK_STORE_DEDUP device that is one per distinct block that isn't all zeroes,
+	///  for any other it is the same as block_store_get_used_blocks
+	/// \param bs BS device
+	/// \return Blocks stored, SIZE_MAX on error
+	///
+	size_t block_store_get_stored_blocks(const block_store_t *const bs);
+
 	///
 	/// Returns the total number of user-addressable blocks
 	///  (since this is constant, you don't even need the bs object)
@@ -80,12 +315,34 @@ extern "C"
 	///
 	size_t block_store_get_total_blocks();
 
+	///
+	/// Returns the number of user-addressable blocks of this device
+	///  (block_store_get_total_blocks for stores made by block_store_create_ex)
+	/// \param bs BS device
+	/// \return Total blocks, SIZE_MAX on error
+	///
+	size_t block_store_get_avail_blocks(const block_store_t *const bs);
+
+	///
+	/// Returns the number of blocks on the device, including the ones holding the FBM
+	/// \param bs BS device
+	/// \return Device size in blocks, SIZE_MAX on error
+	///
+	size_t block_store_get_num_blocks(const block_store_t *const bs);
+
+	///
+	/// Returns the size of one block of this device
+	/// \param bs BS device
+	/// \return Bytes per block, SIZE_MAX on error
+	///
+	size_t block_store_get_block_size(const block_store_t *const bs);
+
 	///
 	/// Reads data from the specified block and writes it to the designated buffer
 	/// \param bs BS device
 	/// \param block_id Source block id
 	/// \param buffer Data buffer to write to
-	/// \return Number of bytes read, 0 on error
+	/// \return Number of bytes read, 0 on error or if the block doesn't match its checksum
 	///
 	size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer);
 
@@ -98,21 +355,293 @@ extern "C"
 	///
 	size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer);
 
+	///
+	/// Reads part of a block, the span has to stay inside the block
+	///  With BLOCK_STORE_CHECKSUMS the whole block is read to check it
+	/// \param bs BS device
+	/// \param block_id Source block id
+	/// \param offset Byte offset into the block
+	/// \param len Number of bytes to read
+	/// \param buffer Data buffer to write to
+	/// \return Number of bytes read, 0 on error
+	///
+	size_t block_store_pread(const block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, void *buffer);
+
+	///
+	/// Writes part of a block, leaving the rest of it untouched
+	///  The span has to stay inside the block
+	/// \param bs BS device
+	/// \param block_id Destination block id
+	/// \param offset Byte offset into the block
+	/// \param len Number of bytes to write
+	/// \param buffer Data buffer to read from
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_store_pwrite(block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, const void *buffer);
+
+	///
+	/// Hands out the block's memory for parsing in place, no copy
+	///  The block is pinned until block_store_return: it can't be released or moved,
+	///  so the pointer stays good. Writes to the block show through the pointer.
+	/// \param bs BS device
+	/// \param block_id The block to borrow
+	/// \return Pointer to the block_size bytes of the block, NULL on error
+	///
+	const void *block_store_borrow(block_store_t *const bs, const size_t block_id);
+
+	///
+	/// Hands out the block's memory for changing in place, no copy
+	///  Pinned like block_store_borrow, the block counts as written when it is borrowed and again when returned
+	/// \param bs BS device
+	/// \param block_id The block to borrow
+	/// \return Pointer to the block_size bytes of the block, NULL on error
+	///
+	void *block_store_borrow_mut(block_store_t *const bs, const size_t block_id);
+
+	///
+	/// Gives back a borrowed block, once every borrow is back it can be released again
+	///  On a journaled device a block borrowed for changing is logged before this returns, like a write.
+	///  The borrow is given back even if that fails.
+	/// \param bs BS device
+	/// \param block_id The borrowed block
+	/// \return true on success, false on error, if the block wasn't borrowed, or if the change couldn't be journaled
+	///
+	bool block_store_return(block_store_t *const bs, const size_t block_id);
+
+	///
+	/// Reads several blocks in one call, block_ids[i] goes to iov[i]
+	///  Runs of consecutive ids landing in back-to-back buffers are copied in one go
+	///  Nothing is read unless every id and buffer is valid
+	/// \param bs BS device
+	/// \param block_ids Source block ids
+	/// \param iov Buffers to write to, each at least one block long
+	/// \param count Number of blocks
+	/// \return Number of bytes read, 0 on error
+	///
+	size_t block_store_readv(const block_store_t *const bs, const size_t *const block_ids, const struct iovec *const iov, const size_t count);
+
+	///
+	/// Writes several blocks in one call, iov[i] goes to block_ids[i]
+	///  Runs of consecutive ids coming from back-to-back buffers are copied in one go
+	///  Nothing is written unless every id and buffer is valid
+	/// \param bs BS device
+	/// \param block_ids Destination block ids
+	/// \param iov Buffers to read from, each at least one block long
+	/// \param count Number of blocks
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_store_writev(block_store_t *const bs, const size_t *const block_ids, const struct iovec *const iov, const size_t count);
+
+	///
+	/// Reads count consecutive blocks starting at first into one buffer
+	/// \param bs BS device
+	/// \param first First source block id
+	/// \param count Number of blocks
+	/// \param buffer Data buffer to write to, count blocks long
+	/// \return Number of bytes read, 0 on error
+	///
+	size_t block_store_read_range(const block_store_t *const bs, const size_t first, const size_t count, void *buffer);
+
+	///
+	/// Writes count consecutive blocks starting at first from one buffer
+	/// \param bs BS device
+	/// \param first First destination block id
+	/// \param count Number of blocks
+	/// \param buffer Data buffer to read from, count blocks long
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_store_write_range(block_store_t *const bs, const size_t first, const size_t count, const void *buffer);
+
+	///
+	/// Sets how many requests the async reads and block_store_serialize keep in flight (BLOCK_IO_DEPTH to start with)
+	///  Waits for the async reads already out first, running their callbacks
+	/// \param bs BS device
+	/// \param depth Requests in flight, 1 to BLOCK_IO_MAX_DEPTH
+	/// \return true on success, false on error
+	///
+	bool block_store_set_io_depth(block_store_t *const bs, const size_t depth);
+
+	///
+	/// Starts reading a block into buffer, callback(arg, bytes read or -errno) runs once it is there
+	///  A file-backed store reads the block from its file through io_uring (or a thread pool where there is none),
+	///  so a cold block doesn't stall the caller on a page fault. Other stores copy the block right away.
+	///  So do BLOCK_STORE_CHECKSUMS stores, a block that doesn't match its checksum reports -EIO.
+	///  Callbacks only run inside block_store_poll, block_store_wait, block_store_set_io_depth, block_store_destroy,
+	///  or a block_store_read_async that has to wait for room. The async calls are for one thread at a time,
+	///  even on a BLOCK_STORE_THREAD_SAFE store.
+	/// \param bs BS device
+	/// \param block_id Source block id
+	/// \param buffer Data buffer to write to, has to stay put until the callback
+	/// \param callback Run when the read is done, may be NULL
+	/// \param arg Handed to callback
+	/// \return true if the read is under way, false on error
+	///
+	bool block_store_read_async(block_store_t *const bs, const size_t block_id, void *buffer, block_io_callback_t callback, void *const arg);
+
+	///
+	/// Sets how many threads block_store_serialize splits the image between (1 to start with)
+	///  With more than one the image goes out as pwrite calls at fixed offsets, shared out by a pool of
+	///  that many threads, and the io depth is raised to at least twice the thread count
+	/// \param bs BS device
+	/// \param threads Worker threads, 1 to BLOCK_IO_MAX_THREADS
+	/// \return true on success, false on error
+	///
+	bool block_store_set_io_threads(block_store_t *const bs, const size_t threads);
+
+	///
+	/// Runs the callbacks of the async reads that are done, without waiting
+	/// \param bs BS device
+	/// \return Number of reads completed, 0 on error
+	///
+	size_t block_store_poll(block_store_t *const bs);
+
+	///
+	/// Waits for every async read, running the callbacks
+	/// \param bs BS device
+	/// \return Number of reads completed, 0 on error
+	///
+	size_t block_store_wait(block_store_t *const bs);
+
+	///
+	/// Checks every allocated block of a BLOCK_STORE_CHECKSUMS device against its checksum
+	///  Blocks out on a mutable borrow are skipped, their checksums catch up on return
+	/// \param bs BS device
+	/// \return Number of blocks that don't match, SIZE_MAX on error or if the device has no checksums
+	///
+	size_t block_store_verify(const block_store_t *const bs);
+
+	///
+	/// Takes a read-only snapshot of the BS device, as it is right now
+	///  Only the metadata blocks are copied, the snapshot shares every other block with the device,
+	///  and the device copies a block into the snapshot before it first changes it after this
+	///  Blocks out on a mutable borrow are copied straight away
+	///  Every read and serialize call works on a snapshot except block_store_serialize_incremental, every write fails
+	///  Reads of the snapshot can run alongside writes to a thread-safe device, but taking or destroying
+	///   a snapshot can't run alongside anything else on the device
+	///  A snapshot outlives its device, which copies over the blocks it still needs when it is destroyed
+	///  Snapshots of snapshots aren't supported
+	/// \param bs BS device
+	/// \return Pointer to the snapshot, destroy it with block_store_destroy, NULL on error
+	///
+	block_store_t *block_store_snapshot(block_store_t *const bs);
+
 	///
 	/// Imports BS device from the given file - for grads/bonus
+	///  The header and FBM in block 0 restore the geometry and which blocks are in use
+	///  An image with checksums keeps them, and is refused if any allocated block doesn't match
+	///  Compressed images from block_store_serialize_compressed are read as well
 	/// \param filename The file to load
 	/// \return Pointer to new BS device, NULL on error
 	///
 	block_store_t *block_store_deserialize(const char *const filename);
 
+	///
+	/// block_store_deserialize with the image read by several threads at once, pread calls at fixed offsets
+	///  The new device keeps the thread count for its own serialize (see block_store_set_io_threads)
+	///  block_store_deserialize(filename) is block_store_deserialize_ex(filename, 1)
+	/// \param filename The file to load
+	/// \param threads Worker threads, 1 to BLOCK_IO_MAX_THREADS
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_deserialize_ex(const char *const filename, const size_t threads);
+
 	///
 	/// Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
+	///  The image goes out in large chunks, the store's io depth of them at once (see block_store_set_io_depth)
+	///  A BLOCK_STORE_DEDUP device or a snapshot only writes the blocks in use, the rest of the file is left sparse
 	/// \param bs BS device
 	/// \param filename The file to write to
 	/// \return Number of bytes written, 0 on error
 	///
 	size_t block_store_serialize(const block_store_t *const bs, const char *const filename);
 
+	///
+	/// Reads a BS device image from an open file, pipe or socket, from where it is up to the end of the image
+	///  The image goes straight into the new device's memory, chunk bytes per read, a pipe is grown to match
+	///  A compressed image (block_store_serialize_compressed) comes through the same way, nothing past its end is read
+	///  Blocking descriptors only
+	/// \param fd Where the image comes from
+	/// \param chunk Bytes per read, 0 for a default of 1 MiB
+	/// \return Pointer to new BS device, NULL on error or if the stream ends early
+	///
+	block_store_t *block_store_deserialize_fd(const int fd, const size_t chunk);
+
+	///
+	/// Writes the image block_store_serialize would to an open file, pipe or socket, at its current position
+	///  The image goes straight out of the device's memory, chunk bytes per write, a pipe is grown to match.
+	///  File-backed devices hand the kernel their file instead (sendfile), the bytes never pass through the caller.
+	///  Blocking descriptors only
+	/// \param bs BS device
+	/// \param fd Where the image goes
+	/// \param chunk Bytes per write, 0 for a default of 1 MiB
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_store_serialize_fd(const block_store_t *const bs, const int fd, const size_t chunk);
+
+	///
+	/// Brings an image of this BS device up to date by writing only what changed
+	///  If the file already holds this device as of its last checkpoint, only the blocks
+	///  changed since then are written and blocks released since then become holes.
+	///  Anything else (no file, another device, an older image) gets a fresh sparse image
+	///  holding just the FBM and the allocated blocks. Free blocks read back as zeroes, with checksums to match.
+	///  Either way this is a checkpoint, other incremental images of the device fall out of date
+	/// \param bs BS device
+	/// \param filename The image to update
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_store_serialize_incremental(block_store_t *const bs, const char *const filename);
+
+	///
+	/// Writes the BS device to file as a compressed image, overwriting it if it exists
+	///  Each block is compressed on its own with a built-in LZ codec (see lz.h) and an index at the front of the
+	///  file says where each one is, so block_store_image_read can pull out a single block. Blocks that don't get
+	///  smaller are stored as they are, free and all-zero blocks aren't stored at all and read back as zeroes
+	///  (a free block's checksum in the image is a zeroed block's too).
+	///  block_store_deserialize and block_store_deserialize_fd take compressed images as well as plain ones.
+	/// \param bs BS device
+	/// \param filename The file to write to
+	/// \return Size of the image in bytes, 0 on error
+	///
+	size_t block_store_serialize_compressed(const block_store_t *const bs, const char *const filename);
+
+	///
+	/// Opens an image, compressed or plain, for reading blocks without loading the device
+	///  Only the header, the index of a compressed image and the FBM blocks are read up front
+	/// \param filename The image
+	/// \return Pointer to the open image, NULL on error
+	///
+	block_store_image_t *block_store_image_open(const char *const filename);
+
+	///
+	/// Reads one block out of an image, decompressing just that block
+	///  Safe to call from several threads at once. With checksums in the image, allocated blocks are checked.
+	/// \param image The image
+	/// \param block_id Source block id, the same ids the device had
+	/// \param buffer Data buffer to write to, block size bytes
+	/// \return Number of bytes read, 0 on error or if the block doesn't match its checksum
+	///
+	size_t block_store_image_read(const block_store_image_t *const image, const size_t block_id, void *buffer);
+
+	///
+	/// User-addressable blocks in an image
+	/// \param image The image
+	/// \return Number of blocks, SIZE_MAX on error
+	///
+	size_t block_store_image_get_avail_blocks(const block_store_image_t *const image);
+
+	///
+	/// Block size of an image
+	/// \param image The image
+	/// \return Bytes per block, SIZE_MAX on error
+	///
+	size_t block_store_image_get_block_size(const block_store_image_t *const image);
+
+	///
+	/// Closes an image
+	/// \param image The image, NULL is ignored
+	///
+	void block_store_image_close(block_store_image_t *const image);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,45 @@
+#ifndef CRC32C_H__
+#define CRC32C_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+	// CRC-32C (Castagnoli), the checksum of iSCSI, ext4 and btrfs
+	// Uses the SSE4.2 or ARMv8 CRC instructions when the CPU has them, slicing-by-8 tables otherwise
+
+	///
+	/// Extends a CRC-32C over len more bytes
+	///  crc32c(0, buf, len) is the checksum of buf, crc32c(crc32c(0, a, n), b, m) that of a followed by b
+	/// \param crc The CRC so far, 0 to start
+	/// \param buf The bytes
+	/// \param len Number of bytes
+	/// \return The CRC including buf
+	///
+	uint32_t crc32c(uint32_t crc, const void *const buf, const size_t len);
+
+	///
+	/// crc32c without the CPU instructions, always slicing-by-8
+	/// \param crc The CRC so far, 0 to start
+	/// \param buf The bytes
+	/// \param len Number of bytes
+	/// \return The CRC including buf
+	///
+	uint32_t crc32c_sw(uint32_t crc, const void *const buf, const size_t len);
+
+	///
+	/// Tells whether crc32c runs on CPU instructions
+	/// \return true for SSE4.2 or ARMv8 CRC, false for the tables
+	///
+	bool crc32c_hw(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef LZ_H__
+#define LZ_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+	// A small LZ77 codec in the style of LZ4, for compressing blocks one at a time
+	// Each buffer is compressed on its own, so any one of them can be decompressed without the others.
+	// A compressed buffer is a run of sequences: a token byte (literal count in the high nibble, match
+	//  length - 4 in the low one, 15 meaning more length bytes follow), the literals, a two-byte
+	//  little-endian distance back into the output and the match. The last sequence has literals only.
+
+#define LZ_MIN_MATCH 4        // Shortest match worth a sequence
+#define LZ_MAX_DISTANCE 65535 // Farthest back a match can reach
+
+	// Worst case compressed size of len bytes, incompressible data grows a little
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+	///
+	/// Compresses len bytes of src into dst
+	/// \param src The bytes to compress
+	/// \param len Number of bytes
+	/// \param dst Where the compressed bytes go
+	/// \param cap Room in dst, LZ_BOUND(len) is always enough
+	/// \return Compressed size, 0 if it doesn't fit in cap or on error
+	///
+	size_t lz_compress(const void *const src, const size_t len, void *const dst, const size_t cap);
+
+	///
+	/// Decompresses what lz_compress made, checking every length and distance against the buffers
+	/// \param src The compressed bytes
+	/// \param len Number of compressed bytes
+	/// \param dst Where the original bytes go
+	/// \param cap Room in dst
+	/// \return Number of bytes produced, SIZE_MAX if src is damaged or doesn't fit in cap
+	///
+	size_t lz_decompress(const void *const src, const size_t len, void *const dst, const size_t cap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
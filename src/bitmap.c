@@ -1,16 +1,43 @@
 #include "bitmap.h"
 #include <string.h>
 
-// Just the one for now. Indicates we're an overlay and should not free
+// The word layout only matches the byte-oriented export/import/overlay contract
+// when bit i of a word lives in byte i / 8 of that word, i.e. on little-endian targets
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#error "bitmap word storage assumes a little-endian target"
+#endif
+
+// OVERLAY indicates we're an overlay and should not free
+// SUMMARY indicates the hierarchical summary levels are attached and must be kept up to date
 // (also, make sure that ALL is as wide as ll of the flags)
-typedef enum { NONE = 0x00, OVERLAY = 0x01, ALL = 0xFF } BITMAP_FLAGS;
+typedef enum { NONE = 0x00, OVERLAY = 0x01, SUMMARY = 0x02, ALL = 0xFF } BITMAP_FLAGS;
+
+// Enough levels to summarize any size_t worth of bits (64^11 > 2^64)
+#define SUMMARY_MAX_LEVELS 11
+
+// Summary levels for the hierarchical variant
+// Level 0 has one bit per data word, every level above has one bit per word of the level below,
+// the top level is a single word. A has_zero bit means "somewhere under here is a zero",
+// a has_one bit means the same for ones, so finding either is one ctz per level.
+typedef struct bitmap_summary 
+{
+    size_t depth;
+    uint64_t *has_zero[SUMMARY_MAX_LEVELS];
+    uint64_t *has_one[SUMMARY_MAX_LEVELS];
+    size_t storage_words;
+    uint64_t storage[];  // Both trees, level by level
+} bitmap_summary_t;
 
 struct bitmap 
 {
     unsigned leftover_bits;  // Packing will increase this to an int anyway
     BITMAP_FLAGS flags;      // Generic place to store flags. Not enough flags to worry about width yet.
-    uint8_t *data;
-    size_t bit_count, byte_count;
+    uint64_t *data;
+    size_t bit_count, byte_count, word_count;
+    uint64_t tail_mask;      // Bits of the last word that are actually part of the bitmap
+    unsigned tail_bytes;     // Overlays only: bytes of the last word in the caller's buffer, 0 if it has all 8
+    size_t short_word;       // The last word if tail_bytes says it is short, SIZE_MAX otherwise
+    bitmap_summary_t *summary;  // Only when SUMMARY is set
 };
 
 #define FLAG_CHECK(bitmap, flag) ((bitmap)->flags & flag)
@@ -18,72 +45,186 @@ struct bitmap
 // #define FLAG_SET(bitmap, flag) bitmap->flags |= flag
 // #define FLAG_UNSET(bitmap, flag) bitmap->flags &= ~flag
 
-// lookup instead of always shifting bits. Should be faster? Confirmed: 10% faster
-// Also, using native int width because it should be faster as well? - Negligible/indeterminate
-//  Won't help until bitmap uses native width for the array
-static const uint8_t mask[8] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
-
-// Mask for all bits at index i and lower
-static const uint8_t mask_down_inclusive[8] = {0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F, 0xFF};
-
-// Inverted mask
-static const uint8_t invert_mask[8] = {0xFE, 0xFD, 0xFB, 0xF7, 0xEF, 0xDF, 0xBF, 0x7F};
-
-// Way more testing than I should waste my time on suggested uint8_t was faster
-// but it may still be negligible/indeterminate.
-// Since the data store is uint8_t, we already get punished for our bad alignment
-// so this doesn't really matter until everything gets moved to generic int
-
-// Total bits set in the given byte in a handy lookup table
-// Macros, man...
-// http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetTable
-#define B2(n) n, n + 1, n + 1, n + 2
-#define B4(n) B2(n), B2(n + 1), B2(n + 1), B2(n + 2)
-#define B6(n) B4(n), B4(n + 1), B4(n + 1), B4(n + 2)
-static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
-#undef B6
-#undef B4
-#undef B2
-// There is an alternative for getting bit count that only loops as many times as there are bits set
-// but that's still a loop and this table is 256B.
-/*
-   unsigned int v; // count the number of bits set in v
-   unsigned int c; // c accumulates the total bits set in v
-
-   for (c = 0; v; v >>= 1)
-   {
-   c += v & 1;
-   }
- */
+// Storage is native 64-bit words now, so the old byte lookup tables are gone.
+// A shift is a single instruction on a register-width word and the scans below
+// lean on ctz/popcount. popcount is only used to count a whole map (on load), so it's left
+// to the target's baseline ISA rather than built for popcnt, which older x86-64 parts lack.
+#define WORD_BITS 64
+#define WORD_SHIFT 6
+#define WORD_INDEX(bit) ((bit) >> WORD_SHIFT)
+#define WORD_MASK(bit) (UINT64_C(1) << ((bit) & (WORD_BITS - 1)))
+
+// An overlay only has byte_count bytes of the caller's buffer, which needn't run to a whole word.
+// Then the last word is read and written a byte at a time, so nothing past the buffer is touched.
+static inline bool bitmap_short_word(const bitmap_t *const bitmap, const size_t word) 
+{
+    return word == bitmap->short_word;
+}
+
+__attribute__((noinline)) static uint64_t bitmap_short_load(const bitmap_t *const bitmap, const size_t word) 
+{
+    const uint8_t *const bytes = (const uint8_t *) bitmap->data + (word << 3);
+    uint64_t value = 0;
+    for (unsigned i = 0; i < bitmap->tail_bytes; ++i) 
+    {
+        value |= (uint64_t) __atomic_load_n(&bytes[i], __ATOMIC_RELAXED) << (i * 8);
+    }
+    return value;
+}
+
+__attribute__((noinline)) static void bitmap_short_store(bitmap_t *const bitmap, const size_t word, const uint64_t value) 
+{
+    uint8_t *const bytes = (uint8_t *) bitmap->data + (word << 3);
+    for (unsigned i = 0; i < bitmap->tail_bytes; ++i) 
+    {
+        __atomic_store_n(&bytes[i], (uint8_t) (value >> (i * 8)), __ATOMIC_RELAXED);
+    }
+}
+
+// The scans read words with relaxed atomic loads, which are plain loads on every target we build for,
+// so they can run alongside the atomic variants (bitmap_test_and_set and friends) without a data race
+// WORD_LOAD is for words before the last, which are always whole, bitmap_load_word for any of them
+#define WORD_LOAD(bitmap, word) __atomic_load_n(&(bitmap)->data[word], __ATOMIC_RELAXED)
+
+static inline uint64_t bitmap_load_word(const bitmap_t *const bitmap, const size_t word) 
+{
+    if (bitmap_short_word(bitmap, word)) 
+    {
+        return bitmap_short_load(bitmap, word);
+    }
+    return WORD_LOAD(bitmap, word);
+}
+
+static inline void bitmap_store_word(bitmap_t *const bitmap, const size_t word, const uint64_t value) 
+{
+    if (bitmap_short_word(bitmap, word)) 
+    {
+        bitmap_short_store(bitmap, word, value);
+        return;
+    }
+    bitmap->data[word] = value;
+}
+
+// Single bits of a short last word are changed in the byte that holds them, bit i is in byte i / 8
+#define BIT_BYTE(bitmap, bit) ((uint8_t *) (bitmap)->data + ((bit) >> 3))
+#define BIT_BYTE_MASK(bit) ((uint8_t) (1u << ((bit) & 7)))
+
+// The last word may hang past bit_count, those bits are undetermined and must not be reported
+static inline uint64_t bitmap_word(const bitmap_t *const bitmap, const size_t word) 
+{
+    return word + 1 == bitmap->word_count ? bitmap_load_word(bitmap, word) & bitmap->tail_mask : WORD_LOAD(bitmap, word);
+}
 
 // A place to generalize the creation process and setup
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags);
 
+// Summary upkeep, see the bottom of the file
+static void bitmap_summary_refresh(bitmap_t *const bitmap, const size_t word);
+static void bitmap_summary_rebuild(bitmap_t *const bitmap);
+static size_t bitmap_summary_find(uint64_t *const *levels, const size_t depth);
+
 void bitmap_set(bitmap_t *const bitmap, const size_t bit) 
 {
-    bitmap->data[bit >> 3] |= mask[bit & 0x07];
+    if (bitmap_short_word(bitmap, WORD_INDEX(bit))) 
+    {
+        *BIT_BYTE(bitmap, bit) |= BIT_BYTE_MASK(bit);
+    } 
+    else 
+    {
+        bitmap->data[WORD_INDEX(bit)] |= WORD_MASK(bit);
+    }
+    if (FLAG_CHECK(bitmap, SUMMARY)) 
+    {
+        bitmap_summary_refresh(bitmap, WORD_INDEX(bit));
+    }
 }
 
 void bitmap_reset(bitmap_t *const bitmap, const size_t bit) 
 {
-    bitmap->data[bit >> 3] &= invert_mask[bit & 0x07];
+    if (bitmap_short_word(bitmap, WORD_INDEX(bit))) 
+    {
+        *BIT_BYTE(bitmap, bit) &= (uint8_t) ~BIT_BYTE_MASK(bit);
+    } 
+    else 
+    {
+        bitmap->data[WORD_INDEX(bit)] &= ~WORD_MASK(bit);
+    }
+    if (FLAG_CHECK(bitmap, SUMMARY)) 
+    {
+        bitmap_summary_refresh(bitmap, WORD_INDEX(bit));
+    }
 }
 
 bool bitmap_test(const bitmap_t *const bitmap, const size_t bit) 
 {
-    return bitmap->data[bit >> 3] & mask[bit & 0x07];
+    if (bitmap_short_word(bitmap, WORD_INDEX(bit))) 
+    {
+        return __atomic_load_n(BIT_BYTE(bitmap, bit), __ATOMIC_RELAXED) & BIT_BYTE_MASK(bit);
+    }
+    return WORD_LOAD(bitmap, WORD_INDEX(bit)) & WORD_MASK(bit);
 }
 
 void bitmap_flip(bitmap_t *const bitmap, const size_t bit) 
 {
-    bitmap->data[bit >> 3] ^= mask[bit & 0x07];
+    if (bitmap_short_word(bitmap, WORD_INDEX(bit))) 
+    {
+        *BIT_BYTE(bitmap, bit) ^= BIT_BYTE_MASK(bit);
+    } 
+    else 
+    {
+        bitmap->data[WORD_INDEX(bit)] ^= WORD_MASK(bit);
+    }
+    if (FLAG_CHECK(bitmap, SUMMARY)) 
+    {
+        bitmap_summary_refresh(bitmap, WORD_INDEX(bit));
+    }
+}
+
+// Sets or clears bits [start, start + count), one masked word at a time
+static void bitmap_assign_range(bitmap_t *const bitmap, const size_t start, const size_t count, const bool value) 
+{
+    const size_t end = start + count;
+    for (size_t bit = start; bit < end;) 
+    {
+        const size_t word   = WORD_INDEX(bit);
+        const size_t offset = bit & (WORD_BITS - 1);
+        const size_t span   = end - bit < WORD_BITS - offset ? end - bit : WORD_BITS - offset;
+        const uint64_t mask = (span == WORD_BITS ? ~UINT64_C(0) : WORD_MASK(span) - 1) << offset;
+        if (value) 
+        {
+            bitmap_store_word(bitmap, word, bitmap_load_word(bitmap, word) | mask);
+        } 
+        else 
+        {
+            bitmap_store_word(bitmap, word, bitmap_load_word(bitmap, word) & ~mask);
+        }
+        if (FLAG_CHECK(bitmap, SUMMARY)) 
+        {
+            bitmap_summary_refresh(bitmap, word);
+        }
+        bit += span;
+    }
+}
+
+void bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+    bitmap_assign_range(bitmap, start, count, true);
+}
+
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+    bitmap_assign_range(bitmap, start, count, false);
 }
 
 void bitmap_invert(bitmap_t *const bitmap) 
 {
-    for (size_t byte = 0; byte < bitmap->byte_count; ++byte) 
+    for (size_t word = 0; word < bitmap->word_count; ++word) 
+    {
+        bitmap_store_word(bitmap, word, ~bitmap_load_word(bitmap, word));
+    }
+    if (FLAG_CHECK(bitmap, SUMMARY)) 
     {
-        bitmap->data[byte] = ~bitmap->data[byte];
+        bitmap_summary_rebuild(bitmap);
     }
 }
 
@@ -91,11 +232,19 @@ size_t bitmap_ffs(const bitmap_t *const bitmap)
 {
     if (bitmap) 
     {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && !bitmap_test(bitmap, result); ++result) 
+        if (FLAG_CHECK(bitmap, SUMMARY)) 
         {
+            const size_t word = bitmap_summary_find(bitmap->summary->has_one, bitmap->summary->depth);
+            return word == SIZE_MAX ? SIZE_MAX : (word << WORD_SHIFT) + __builtin_ctzll(bitmap_word(bitmap, word));
+        }
+        for (size_t word = 0; word < bitmap->word_count; ++word) 
+        {
+            const uint64_t bits = bitmap_word(bitmap, word);
+            if (bits) 
+            {
+                return (word << WORD_SHIFT) + __builtin_ctzll(bits);
+            }
         }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
     }
     return SIZE_MAX;
 }
@@ -104,11 +253,306 @@ size_t bitmap_ffz(const bitmap_t *const bitmap)
 {
     if (bitmap) 
     {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && bitmap_test(bitmap, result); ++result) 
+        if (FLAG_CHECK(bitmap, SUMMARY)) 
+        {
+            const size_t word = bitmap_summary_find(bitmap->summary->has_zero, bitmap->summary->depth);
+            return word == SIZE_MAX ? SIZE_MAX : (word << WORD_SHIFT) + __builtin_ctzll(~bitmap_load_word(bitmap, word));
+        }
+        // Flip each word so the zeroes become ones, the last one is done on its own
+        const size_t last = bitmap->word_count - 1;
+        for (size_t word = 0; word < last; ++word) 
+        {
+            const uint64_t zeroes = ~WORD_LOAD(bitmap, word);
+            if (zeroes) 
+            {
+                return (word << WORD_SHIFT) + __builtin_ctzll(zeroes);
+            }
+        }
+        // Mask off anything past the end
+        const uint64_t zeroes = ~bitmap_load_word(bitmap, last) & bitmap->tail_mask;
+        if (zeroes) 
+        {
+            return (last << WORD_SHIFT) + __builtin_ctzll(zeroes);
+        }
+    }
+    return SIZE_MAX;
+}
+
+// First set (ones) or clear (!ones) bit in [from, to), SIZE_MAX if there is none
+// Never reads a word outside the range, so callers can own just part of the map
+static size_t bitmap_scan(const bitmap_t *const bitmap, const size_t from, size_t to, const bool ones) 
+{
+    if (to > bitmap->bit_count) 
+    {
+        to = bitmap->bit_count;
+    }
+    if (from >= to) 
+    {
+        return SIZE_MAX;
+    }
+    const size_t last = WORD_INDEX(to - 1);
+    for (size_t word = WORD_INDEX(from); word <= last; ++word) 
+    {
+        const uint64_t loaded = word == last ? bitmap_load_word(bitmap, word) : WORD_LOAD(bitmap, word);
+        uint64_t bits = ones ? loaded : ~loaded;
+        if (word == WORD_INDEX(from)) 
+        {
+            bits &= ~(WORD_MASK(from) - 1);
+        }
+        if (word == last && (to & (WORD_BITS - 1))) 
+        {
+            bits &= WORD_MASK(to) - 1;
+        }
+        if (bits) 
+        {
+            return (word << WORD_SHIFT) + __builtin_ctzll(bits);
+        }
+    }
+    return SIZE_MAX;
+}
+
+static size_t bitmap_scan_from(const bitmap_t *const bitmap, const size_t from, const bool ones) 
+{
+    return bitmap_scan(bitmap, from, bitmap->bit_count, ones);
+}
+
+size_t bitmap_ffz_from(const bitmap_t *const bitmap, const size_t from) 
+{
+    return bitmap ? bitmap_scan_from(bitmap, from, false) : SIZE_MAX;
+}
+
+size_t bitmap_ffz_range(const bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+    if (bitmap && start < bitmap->bit_count) 
+    {
+        return bitmap_scan(bitmap, start, count > bitmap->bit_count - start ? bitmap->bit_count : start + count, false);
+    }
+    return SIZE_MAX;
+}
+
+size_t bitmap_ffz_run(const bitmap_t *const bitmap, const size_t count) 
+{
+    return bitmap_ffz_run_from(bitmap, 0, count);
+}
+
+size_t bitmap_ffz_run_from(const bitmap_t *const bitmap, const size_t from, const size_t count) 
+{
+    if (bitmap && count && from < bitmap->bit_count && count <= bitmap->bit_count - from) 
+    {
+        size_t start = 0, run = 0;
+        for (size_t word = WORD_INDEX(from); word < bitmap->word_count; ++word) 
+        {
+            // Bits past the end count as taken so no run can hang off the end,
+            // and so do the ones before from
+            uint64_t used = WORD_LOAD(bitmap, word);
+            if (word + 1 == bitmap->word_count) 
+            {
+                used = bitmap_load_word(bitmap, word) | ~bitmap->tail_mask;
+            }
+            if (word == WORD_INDEX(from)) 
+            {
+                used |= WORD_MASK(from) - 1;
+            }
+            const size_t base = word << WORD_SHIFT;
+
+            // The common cases are whole words, empty ones extend the run and full ones end it
+            if (!used) 
+            {
+                if (!run) 
+                {
+                    start = base;
+                }
+                run += WORD_BITS;
+                if (run >= count) 
+                {
+                    return start;
+                }
+                continue;
+            }
+            if (!~used) 
+            {
+                run = 0;
+                continue;
+            }
+
+            // Mixed word, hop from one stretch of zeroes to the next with ctz
+            for (size_t bit = 0; bit < WORD_BITS;) 
+            {
+                const uint64_t rest = used >> bit;
+                const size_t zeroes = rest ? (size_t) __builtin_ctzll(rest) : WORD_BITS - bit;
+                if (zeroes) 
+                {
+                    if (!run) 
+                    {
+                        start = base + bit;
+                    }
+                    run += zeroes;
+                    if (run >= count) 
+                    {
+                        return start;
+                    }
+                    bit += zeroes;
+                    if (bit == WORD_BITS) 
+                    {
+                        break;
+                    }
+                }
+                // Now sitting on a one, skip the stretch of ones
+                run = 0;
+                const uint64_t free_bits = ~(used >> bit);
+                bit += free_bits ? (size_t) __builtin_ctzll(free_bits) : WORD_BITS - bit;
+            }
+        }
+    }
+    return SIZE_MAX;
+}
+
+size_t bitmap_ffz_run_best(const bitmap_t *const bitmap, const size_t count) 
+{
+    size_t best = SIZE_MAX, best_length = SIZE_MAX;
+    if (bitmap && count) 
+    {
+        // Hop from run to run, each hop is a word scan for the next one and then the next zero
+        for (size_t start = bitmap_scan_from(bitmap, 0, false); start != SIZE_MAX;) 
+        {
+            size_t end = bitmap_scan_from(bitmap, start, true);
+            if (end == SIZE_MAX) 
+            {
+                end = bitmap->bit_count;
+            }
+            const size_t length = end - start;
+            if (length >= count && length < best_length) 
+            {
+                best = start;
+                best_length = length;
+                if (length == count) 
+                {
+                    break;  // Can't do better than exact
+                }
+            }
+            start = bitmap_scan_from(bitmap, end, false);
+        }
+    }
+    return best;
+}
+
+size_t bitmap_claim_zeros(bitmap_t *const bitmap, const size_t count, size_t *const bits) 
+{
+    size_t claimed = 0;
+    if (bitmap && bits && count) 
+    {
+        // Everything before the first zero is full, and the summary gets there without a scan
+        const size_t first = bitmap_ffz(bitmap);
+        if (first == SIZE_MAX) 
         {
+            return 0;
+        }
+        for (size_t word = WORD_INDEX(first); word < bitmap->word_count && claimed < count; ++word) 
+        {
+            uint64_t zeroes = ~WORD_LOAD(bitmap, word);
+            if (word + 1 == bitmap->word_count) 
+            {
+                zeroes = ~bitmap_load_word(bitmap, word) & bitmap->tail_mask;
+            }
+            if (!zeroes) 
+            {
+                continue;
+            }
+
+            // Collect the claimed bits of the word, then store them all at once
+            uint64_t taken = 0;
+            for (; zeroes && claimed < count; zeroes &= zeroes - 1) 
+            {
+                bits[claimed++] = (word << WORD_SHIFT) + __builtin_ctzll(zeroes);
+                taken |= zeroes & -zeroes;
+            }
+            bitmap_store_word(bitmap, word, bitmap_load_word(bitmap, word) | taken);
+            if (FLAG_CHECK(bitmap, SUMMARY)) 
+            {
+                bitmap_summary_refresh(bitmap, word);
+            }
+        }
+    }
+    return claimed;
+}
+
+bool bitmap_test_and_set(bitmap_t *const bitmap, const size_t bit) 
+{
+    if (bitmap_short_word(bitmap, WORD_INDEX(bit))) 
+    {
+        return __atomic_fetch_or(BIT_BYTE(bitmap, bit), BIT_BYTE_MASK(bit), __ATOMIC_ACQ_REL) & BIT_BYTE_MASK(bit);
+    }
+    uint64_t *const word = &bitmap->data[WORD_INDEX(bit)];
+    const uint64_t mask = WORD_MASK(bit);
+    // Looking first keeps a bit that is already set from pulling the line in exclusive
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) & mask) 
+    {
+        return true;
+    }
+    return __atomic_fetch_or(word, mask, __ATOMIC_ACQ_REL) & mask;
+}
+
+bool bitmap_test_and_reset(bitmap_t *const bitmap, const size_t bit) 
+{
+    if (bitmap_short_word(bitmap, WORD_INDEX(bit))) 
+    {
+        return __atomic_fetch_and(BIT_BYTE(bitmap, bit), (uint8_t) ~BIT_BYTE_MASK(bit), __ATOMIC_ACQ_REL) & BIT_BYTE_MASK(bit);
+    }
+    uint64_t *const word = &bitmap->data[WORD_INDEX(bit)];
+    const uint64_t mask = WORD_MASK(bit);
+    if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & mask)) 
+    {
+        return false;
+    }
+    return __atomic_fetch_and(word, ~mask, __ATOMIC_ACQ_REL) & mask;
+}
+
+size_t bitmap_ffz_claim(bitmap_t *const bitmap, const size_t hint) 
+{
+    if (bitmap && bitmap->bit_count) 
+    {
+        const size_t from = hint < bitmap->bit_count ? hint : 0;
+        const size_t first = WORD_INDEX(from);
+        // One lap of the words starting at the hint's, then the bits of that word below the hint
+        for (size_t i = 0; i <= bitmap->word_count; ++i) 
+        {
+            const size_t word = (first + i) % bitmap->word_count;
+            uint64_t valid = word + 1 == bitmap->word_count ? bitmap->tail_mask : ~UINT64_C(0);
+            if (i == 0) 
+            {
+                valid &= ~(WORD_MASK(from) - 1);
+            }
+            else if (i == bitmap->word_count) 
+            {
+                valid &= WORD_MASK(from) - 1;
+            }
+
+            if (bitmap_short_word(bitmap, word)) 
+            {
+                // Claimed a byte at a time, a lost race just means looking again
+                for (uint64_t zeroes = ~bitmap_load_word(bitmap, word) & valid; zeroes; zeroes = ~bitmap_load_word(bitmap, word) & valid) 
+                {
+                    const size_t bit = (word << WORD_SHIFT) + __builtin_ctzll(zeroes);
+                    if (!bitmap_test_and_set(bitmap, bit)) 
+                    {
+                        return bit;
+                    }
+                }
+                continue;
+            }
+
+            uint64_t *const slot = &bitmap->data[word];
+            uint64_t current = __atomic_load_n(slot, __ATOMIC_RELAXED);
+            for (uint64_t zeroes = ~current & valid; zeroes; zeroes = ~current & valid) 
+            {
+                // Losing the race reloads current, so the next try only sees the zeroes still left
+                const uint64_t claim = zeroes & -zeroes;
+                if (__atomic_compare_exchange_n(slot, &current, current | claim, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) 
+                {
+                    return (word << WORD_SHIFT) + __builtin_ctzll(claim);
+                }
+            }
         }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
     }
     return SIZE_MAX;
 }
@@ -118,19 +562,9 @@ size_t bitmap_total_set(const bitmap_t *const bitmap)
     size_t total = 0;
     if (bitmap) 
     {
-        // If we have leftover, stop a byte early because we have to handle it differently.
-        size_t stop = bitmap->leftover_bits ? bitmap->byte_count - 1 : bitmap->byte_count;
-        for (size_t idx = 0; idx < stop; ++idx) 
+        for (size_t word = 0; word < bitmap->word_count; ++word) 
         {
-            total += bit_totals[bitmap->data[idx]];
-        }
-        if (bitmap->leftover_bits) 
-        {
-            // haha, this is readable
-            // get the byte at the end of the bitmap, mask it so we're only looking at the bits in use
-            // then feed that to the bit_total lookup so we don't count the bits past our bit total
-            // (which whould be considered undetermined)
-            total += bit_totals[bitmap->data[bitmap->byte_count - 1] & mask_down_inclusive[bitmap->leftover_bits - 1]];
+            total += __builtin_popcountll(bitmap_word(bitmap, word));
         }
     }
     return total;
@@ -140,11 +574,12 @@ void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *),
 {
     if (bitmap && func) 
     {
-        for (size_t idx = 0; idx < bitmap->bit_count; ++idx) 
+        for (size_t word = 0; word < bitmap->word_count; ++word) 
         {
-            if (bitmap_test(bitmap, idx)) 
+            // Only loops as many times as there are bits set in the word
+            for (uint64_t bits = bitmap_word(bitmap, word); bits; bits &= bits - 1) 
             {
-                func(idx, arg);
+                func((word << WORD_SHIFT) + __builtin_ctzll(bits), arg);
             }
         }
     }
@@ -153,6 +588,10 @@ void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *),
 void bitmap_format(bitmap_t *const bitmap, const uint8_t pattern) 
 {
     memset(bitmap->data, pattern, bitmap->byte_count);
+    if (FLAG_CHECK(bitmap, SUMMARY)) 
+    {
+        bitmap_summary_rebuild(bitmap);
+    }
 }
 
 size_t bitmap_get_bits(const bitmap_t *const bitmap) 
@@ -170,9 +609,61 @@ bitmap_t *bitmap_create(const size_t n_bits)
     return bitmap_initialize(n_bits, NONE);
 }
 
+bitmap_t *bitmap_create_hierarchical(const size_t n_bits) 
+{
+    bitmap_t *bitmap = bitmap_initialize(n_bits, NONE);
+    if (bitmap && !bitmap_summarize(bitmap)) 
+    {
+        bitmap_destroy(bitmap);
+        return NULL;
+    }
+    return bitmap;
+}
+
+bool bitmap_summarize(bitmap_t *const bitmap) 
+{
+    if (!bitmap) 
+    {
+        return false;
+    }
+    if (!FLAG_CHECK(bitmap, SUMMARY)) 
+    {
+        // Work out how many words each level needs, bottom up, until one word covers everything
+        size_t words[SUMMARY_MAX_LEVELS];
+        size_t depth = 0, total = 0, below = bitmap->word_count;
+        do 
+        {
+            below = (below + WORD_BITS - 1) >> WORD_SHIFT;
+            words[depth++] = below;
+            total += below;
+        } while (below > 1);
+
+        bitmap_summary_t *summary =
+            (bitmap_summary_t *) malloc(sizeof(bitmap_summary_t) + 2 * total * sizeof(uint64_t));
+        if (!summary) 
+        {
+            return false;
+        }
+        summary->depth         = depth;
+        summary->storage_words = 2 * total;
+        uint64_t *next = summary->storage;
+        for (size_t level = 0; level < depth; ++level) 
+        {
+            summary->has_zero[level] = next;
+            next += words[level];
+            summary->has_one[level] = next;
+            next += words[level];
+        }
+        bitmap->summary = summary;
+        bitmap->flags |= SUMMARY;
+    }
+    bitmap_summary_rebuild(bitmap);
+    return true;
+}
+
 const uint8_t *bitmap_export(const bitmap_t *const bitmap) 
 {
-    return bitmap->data;
+    return (const uint8_t *) bitmap->data;
 }
 
 bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data) 
@@ -183,6 +674,10 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data)
         if (bitmap) 
         {
             memcpy(bitmap->data, bitmap_data, bitmap->byte_count);
+            if (FLAG_CHECK(bitmap, SUMMARY)) 
+            {
+                bitmap_summary_rebuild(bitmap);
+            }
             return bitmap;
         }
     }
@@ -191,12 +686,15 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data)
 
 bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data) 
 {
-    if (bitmap_data) 
+    // Whole words are accessed in place, so they have to be aligned like one
+    if (bitmap_data && ((uintptr_t) bitmap_data & (sizeof(uint64_t) - 1)) == 0) 
     {
         bitmap_t *bitmap = bitmap_initialize(n_bits, OVERLAY);
         if (bitmap) 
         {
-            bitmap->data = (uint8_t *) bitmap_data;
+            bitmap->data = (uint64_t *) bitmap_data;
+            bitmap->tail_bytes = bitmap->byte_count & (sizeof(uint64_t) - 1);
+            bitmap->short_word = bitmap->tail_bytes ? bitmap->word_count - 1 : SIZE_MAX;
             return bitmap;
         }
     }
@@ -212,6 +710,7 @@ void bitmap_destroy(bitmap_t *bitmap)
             // don't free memory that isn't ours!
             free(bitmap->data);
         }
+        free(bitmap->summary);
         free(bitmap);
     }
 }
@@ -234,6 +733,11 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags)
             bitmap->byte_count    = n_bits >> 3;
             bitmap->leftover_bits = n_bits & 0x07;
             bitmap->byte_count += (bitmap->leftover_bits ? 1 : 0);
+            bitmap->word_count    = (n_bits + WORD_BITS - 1) >> WORD_SHIFT;
+            bitmap->tail_mask     = (n_bits & (WORD_BITS - 1)) ? WORD_MASK(n_bits) - 1 : ~UINT64_C(0);
+            bitmap->tail_bytes    = 0;
+            bitmap->short_word    = SIZE_MAX;
+            bitmap->summary       = NULL;
 
             // FLAG HANDLING HERE
 
@@ -249,7 +753,8 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags)
             } 
             else 
             {
-                bitmap->data = (uint8_t *) calloc(bitmap->byte_count, 1);
+                // Round up to whole words, the padding past byte_count stays zero
+                bitmap->data = (uint64_t *) calloc(bitmap->word_count, sizeof(uint64_t));
                 if (bitmap->data) 
                 {
                     return bitmap;
@@ -261,3 +766,55 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags)
     }
     return NULL;
 }
+
+// Marks index at the bottom level of one summary tree and carries the change upwards
+// Parents only care whether a word is empty, so stop as soon as that stops changing
+static void bitmap_summary_mark(uint64_t *const *levels, const size_t depth, size_t index, const bool value) 
+{
+    for (size_t level = 0; level < depth; ++level) 
+    {
+        uint64_t *const word = &levels[level][WORD_INDEX(index)];
+        const uint64_t old   = *word;
+        *word = value ? old | WORD_MASK(index) : old & ~WORD_MASK(index);
+        if ((old != 0) == (*word != 0)) 
+        {
+            break;
+        }
+        index = WORD_INDEX(index);
+    }
+}
+
+// Walks down from the single top word, one ctz per level
+// Returns the data word index, SIZE_MAX when the tree is empty
+static size_t bitmap_summary_find(uint64_t *const *levels, const size_t depth) 
+{
+    size_t index = 0;
+    for (size_t level = depth; level-- > 0;) 
+    {
+        const uint64_t word = levels[level][index];
+        if (!word) 
+        {
+            // Only the top can be empty, everything below a set bit has a set bit
+            return SIZE_MAX;
+        }
+        index = (index << WORD_SHIFT) + __builtin_ctzll(word);
+    }
+    return index;
+}
+
+static void bitmap_summary_refresh(bitmap_t *const bitmap, const size_t word) 
+{
+    const uint64_t valid = word + 1 == bitmap->word_count ? bitmap->tail_mask : ~UINT64_C(0);
+    const uint64_t bits = bitmap_load_word(bitmap, word);
+    bitmap_summary_mark(bitmap->summary->has_one, bitmap->summary->depth, word, bits & valid);
+    bitmap_summary_mark(bitmap->summary->has_zero, bitmap->summary->depth, word, ~bits & valid);
+}
+
+static void bitmap_summary_rebuild(bitmap_t *const bitmap) 
+{
+    memset(bitmap->summary->storage, 0, bitmap->summary->storage_words * sizeof(uint64_t));
+    for (size_t word = 0; word < bitmap->word_count; ++word) 
+    {
+        bitmap_summary_refresh(bitmap, word);
+    }
+}
@@ -0,0 +1,474 @@
+#define _GNU_SOURCE //syscall
+#include <stdint.h>
+#include "block_io.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <string.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+//One request, sitting in the free list, the pool's queue, the done list or the kernel
+typedef struct block_io_req{
+    struct iovec iov;    //readv/writev of a single buffer works on every kernel with io_uring
+    int fd;
+    off_t offset;
+    bool write;
+    block_io_callback_t callback;
+    void *arg;
+    ssize_t result;
+    size_t done;         //bytes moved so far, a short transfer goes again for the rest with iov and offset moved on
+    struct block_io_req *next;
+} block_io_req_t;
+
+struct block_io{
+    size_t depth;
+    size_t outstanding;  //requests handed out of the free list, only the submitting thread touches it
+    block_io_req_t *reqs;
+    block_io_req_t *free;
+    pthread_mutex_t lock; //guards queue, done and stop
+    pthread_cond_t work;  //the queue got a request, or stop
+    pthread_cond_t finished; //done got a request
+    block_io_req_t *queue, *queue_tail; //pool only, waiting for a worker
+    block_io_req_t *done, *done_tail;   //finished, callback not run yet
+    bool stop;
+    pthread_t *threads;
+    size_t thread_count;
+    int ring_fd;         //-1 unless io_uring is in use
+#ifdef HAVE_IO_URING
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_bytes, cq_ring_bytes, sqes_bytes;
+    unsigned unsubmitted; //SQEs in the ring the kernel hasn't been told about
+#endif
+};
+
+static void block_io_push(block_io_req_t **head, block_io_req_t **tail, block_io_req_t *const req)
+{
+    req->next = NULL;
+    if(*head == NULL) {
+        *head = req;
+    } else {
+        (*tail)->next = req;
+    }
+    *tail = req;
+}
+
+//Moves a request on past bytes it has already transferred
+static void block_io_advance(block_io_req_t *const req, const size_t bytes)
+{
+    req->done += bytes;
+    req->iov.iov_base = (char *)req->iov.iov_base + bytes;
+    req->iov.iov_len -= bytes;
+    req->offset += bytes;
+}
+
+//Hands the slot back before the callback, so the callback can queue more I/O
+static void block_io_finish(block_io_t *const io, block_io_req_t *const req)
+{
+    block_io_callback_t callback = req->callback;
+    void *arg = req->arg;
+    ssize_t result = req->result;
+    req->next = io->free;
+    io->free = req;
+    io->outstanding--;
+    if(callback != NULL) callback(arg, result);
+}
+
+//Runs the callbacks on the done list, waiting for the pool to finish something first if wait
+static size_t block_io_run_done(block_io_t *const io, const bool wait)
+{
+    pthread_mutex_lock(&io->lock);
+    while(wait && io->done == NULL) {
+        pthread_cond_wait(&io->finished, &io->lock);
+    }
+    block_io_req_t *req = io->done;
+    io->done = io->done_tail = NULL;
+    pthread_mutex_unlock(&io->lock);
+
+    size_t count = 0;
+    while(req != NULL) {
+        block_io_req_t *next = req->next;
+        block_io_finish(io, req);
+        req = next;
+        count++;
+    }
+    return count;
+}
+
+static void *block_io_worker(void *arg)
+{
+    block_io_t *io = arg;
+    pthread_mutex_lock(&io->lock);
+    for(;;) {
+        while(io->queue == NULL && !io->stop) {
+            pthread_cond_wait(&io->work, &io->lock);
+        }
+        if(io->queue == NULL) break;
+        block_io_req_t *req = io->queue;
+        io->queue = req->next;
+        pthread_mutex_unlock(&io->lock);
+
+        //short transfers keep going until the whole buffer is done, the file ends or a call fails
+        ssize_t result = 0;
+        while(req->iov.iov_len > 0) {
+            result = req->write ? pwrite(req->fd, req->iov.iov_base, req->iov.iov_len, req->offset)
+                                : pread(req->fd, req->iov.iov_base, req->iov.iov_len, req->offset);
+            if(result == -1 && errno == EINTR) continue;
+            if(result <= 0) break;
+            block_io_advance(req, result);
+        }
+        req->result = result == -1 ? -errno : (ssize_t)req->done;
+
+        pthread_mutex_lock(&io->lock);
+        block_io_push(&io->done, &io->done_tail, req);
+        pthread_cond_signal(&io->finished);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+static bool block_io_pool_start(block_io_t *const io, const size_t threads)
+{
+    io->threads = calloc(threads, sizeof(pthread_t));
+    if(io->threads == NULL) return false;
+    for(; io->thread_count < threads; io->thread_count++) {
+        if(pthread_create(&io->threads[io->thread_count], NULL, block_io_worker, io) != 0) {
+            //a smaller pool still works
+            return io->thread_count > 0;
+        }
+    }
+    return true;
+}
+
+static void block_io_pool_stop(block_io_t *const io)
+{
+    pthread_mutex_lock(&io->lock);
+    io->stop = true;
+    pthread_cond_broadcast(&io->work);
+    pthread_mutex_unlock(&io->lock);
+    for(size_t i = 0; i < io->thread_count; i++) {
+        pthread_join(io->threads[i], NULL);
+    }
+    free(io->threads);
+}
+
+#ifdef HAVE_IO_URING
+//No liburing, the two system calls and the ring layout are all it takes
+static bool block_io_uring_start(block_io_t *const io)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, (unsigned)io->depth, &params);
+    if(fd == -1) return false; //ENOSYS, or turned off by seccomp or sysctl
+
+    io->sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single) {
+        if(io->cq_ring_bytes > io->sq_ring_bytes) io->sq_ring_bytes = io->cq_ring_bytes;
+        io->cq_ring_bytes = io->sq_ring_bytes;
+    }
+    io->sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    io->sq_ring = mmap(NULL, io->sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    io->cq_ring = single ? io->sq_ring
+                         : mmap(NULL, io->cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    io->sqes = mmap(NULL, io->sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(io->sq_ring == MAP_FAILED || io->cq_ring == MAP_FAILED || io->sqes == MAP_FAILED) {
+        if(io->sqes != MAP_FAILED) munmap(io->sqes, io->sqes_bytes);
+        if(!single && io->cq_ring != MAP_FAILED) munmap(io->cq_ring, io->cq_ring_bytes);
+        if(io->sq_ring != MAP_FAILED) munmap(io->sq_ring, io->sq_ring_bytes);
+        close(fd);
+        return false;
+    }
+
+    char *sq = io->sq_ring, *cq = io->cq_ring;
+    io->sq_head = (unsigned *)(sq + params.sq_off.head);
+    io->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    io->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    io->sq_array = (unsigned *)(sq + params.sq_off.array);
+    io->cq_head = (unsigned *)(cq + params.cq_off.head);
+    io->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    io->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    io->ring_fd = fd;
+    return true;
+}
+
+static void block_io_uring_stop(block_io_t *const io)
+{
+    munmap(io->sqes, io->sqes_bytes);
+    if(io->cq_ring != io->sq_ring) munmap(io->cq_ring, io->cq_ring_bytes);
+    munmap(io->sq_ring, io->sq_ring_bytes);
+    close(io->ring_fd);
+}
+
+//Never more than depth requests are out, so the SQ always has room and the CQ can't overflow
+static void block_io_uring_queue(block_io_t *const io, block_io_req_t *const req)
+{
+    const unsigned tail = *io->sq_tail;
+    const unsigned index = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = &io->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = req->fd;
+    sqe->addr = (uintptr_t)&req->iov;
+    sqe->len = 1;
+    sqe->off = req->offset;
+    sqe->user_data = (uintptr_t)req;
+    io->sq_array[index] = index;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    io->unsubmitted++;
+}
+
+//Tells the kernel about queued SQEs, waiting for min_complete completions as well
+//If the kernel won't take them, the SQEs it didn't take come back off the ring and their requests
+//finish with the error, nothing else would ever complete them
+static size_t block_io_uring_enter(block_io_t *const io, const unsigned min_complete)
+{
+    while(io->unsubmitted > 0 || min_complete > 0) {
+        int submitted = (int)syscall(__NR_io_uring_enter, io->ring_fd, io->unsubmitted, min_complete,
+                                     min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(submitted == -1) {
+            if(errno == EINTR || errno == EAGAIN) continue;
+            break;
+        }
+        io->unsubmitted -= submitted;
+        //the wait was for at least one completion, it is there now
+        if(min_complete == 0 || io->unsubmitted == 0) return 0;
+    }
+    if(io->unsubmitted == 0) return 0;
+
+    //without SQPOLL the kernel only looks at the SQ inside io_uring_enter, so the tail can come back
+    const int error = errno;
+    unsigned tail = *io->sq_tail;
+    block_io_req_t *failed = NULL;
+    for(; io->unsubmitted > 0; io->unsubmitted--) {
+        block_io_req_t *req = (block_io_req_t *)(uintptr_t)io->sqes[--tail & *io->sq_mask].user_data;
+        req->next = failed;
+        failed = req;
+    }
+    __atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+    size_t count = 0;
+    while(failed != NULL) {
+        block_io_req_t *req = failed;
+        failed = req->next;
+        req->result = -error;
+        block_io_finish(io, req);
+        count++;
+    }
+    return count;
+}
+
+//Tells the kernel about queued SQEs, then runs the callbacks of whatever is in the CQ
+//With wait and an empty CQ it blocks until at least one request completes
+//A short transfer goes back in the ring for the rest, it only finishes once it is whole, hits the end of the file or fails
+static size_t block_io_uring_reap(block_io_t *const io, const bool wait)
+{
+    unsigned head = *io->cq_head;
+    const bool ready = head != __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+    size_t count = block_io_uring_enter(io, wait && !ready ? 1 : 0);
+
+    while(head != __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+        block_io_req_t *req = (block_io_req_t *)(uintptr_t)cqe->user_data;
+        const int res = cqe->res;
+        __atomic_store_n(io->cq_head, ++head, __ATOMIC_RELEASE);
+        if(res > 0 && (size_t)res < req->iov.iov_len) {
+            block_io_advance(req, res);
+            block_io_uring_queue(io, req);
+            continue;
+        }
+        req->result = res < 0 ? res : (ssize_t)(req->done + res);
+        block_io_finish(io, req);
+        head = *io->cq_head; //the callback may have reaped too
+        count++;
+    }
+    //whatever went back in goes to the kernel now rather than on the next call
+    if(io->unsubmitted > 0) count += block_io_uring_enter(io, 0);
+    return count;
+}
+#endif
+
+//Runs every finished callback, and with wait makes sure there was at least one
+static size_t block_io_reap(block_io_t *const io, const bool wait)
+{
+    if(io->ring_fd == -1) return block_io_run_done(io, wait);
+    size_t count = block_io_run_done(io, false);
+#ifdef HAVE_IO_URING
+    //block_io_complete can leave the done list as the only thing outstanding
+    count += block_io_uring_reap(io, wait && count == 0 && io->outstanding > 0);
+#endif
+    return count;
+}
+
+//Everything but the backend
+static block_io_t *block_io_alloc(const size_t depth)
+{
+    block_io_t *io = calloc(1, sizeof(block_io_t));
+    if(io == NULL) return NULL;
+    io->depth = depth;
+    io->ring_fd = -1;
+    io->reqs = calloc(depth, sizeof(block_io_req_t));
+    if(io->reqs == NULL) {
+        free(io);
+        return NULL;
+    }
+    for(size_t i = depth; i-- > 0;) {
+        io->reqs[i].next = io->free;
+        io->free = &io->reqs[i];
+    }
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->work, NULL);
+    pthread_cond_init(&io->finished, NULL);
+    return io;
+}
+
+block_io_t *block_io_create(const size_t depth, const int flags)
+{
+    if(depth == 0 || depth > BLOCK_IO_MAX_DEPTH) return NULL;
+    block_io_t *io = block_io_alloc(depth);
+    if(io == NULL) return NULL;
+
+#ifdef HAVE_IO_URING
+    if(!(flags & BLOCK_IO_POOL) && block_io_uring_start(io)) return io;
+#else
+    (void)flags;
+#endif
+    if(!block_io_pool_start(io, depth < BLOCK_IO_POOL_THREADS ? depth : BLOCK_IO_POOL_THREADS)) {
+        block_io_destroy(io);
+        return NULL;
+    }
+    return io;
+}
+
+block_io_t *block_io_create_pool(const size_t depth, const size_t threads)
+{
+    if(depth == 0 || depth > BLOCK_IO_MAX_DEPTH) return NULL;
+    if(threads == 0 || threads > BLOCK_IO_MAX_THREADS) return NULL;
+    block_io_t *io = block_io_alloc(depth);
+    if(io == NULL) return NULL;
+
+    if(!block_io_pool_start(io, threads)) {
+        block_io_destroy(io);
+        return NULL;
+    }
+    return io;
+}
+
+static bool block_io_submit(block_io_t *const io, block_io_req_t *const req)
+{
+#ifdef HAVE_IO_URING
+    if(io->ring_fd != -1) {
+        block_io_uring_queue(io, req);
+        return true;
+    }
+#endif
+    pthread_mutex_lock(&io->lock);
+    block_io_push(&io->queue, &io->queue_tail, req);
+    pthread_cond_signal(&io->work);
+    pthread_mutex_unlock(&io->lock);
+    return true;
+}
+
+//Takes a free slot, making room by waiting for a completion if they are all out
+static block_io_req_t *block_io_slot(block_io_t *const io, block_io_callback_t callback, void *const arg)
+{
+    while(io->free == NULL) {
+        block_io_reap(io, true);
+    }
+    block_io_req_t *req = io->free;
+    io->free = req->next;
+    io->outstanding++;
+    req->callback = callback;
+    req->arg = arg;
+    req->result = 0;
+    req->done = 0;
+    return req;
+}
+
+static bool block_io_queue(block_io_t *const io, const int fd, void *const buf, const size_t len, const off_t offset, const bool write, block_io_callback_t callback, void *const arg)
+{
+    if(io == NULL || fd < 0 || (buf == NULL && len > 0) || offset < 0) return false;
+    block_io_req_t *req = block_io_slot(io, callback, arg);
+    req->iov.iov_base = buf;
+    req->iov.iov_len = len;
+    req->fd = fd;
+    req->offset = offset;
+    req->write = write;
+    return block_io_submit(io, req);
+}
+
+bool block_io_read(block_io_t *const io, const int fd, void *const buf, const size_t len, const off_t offset, block_io_callback_t callback, void *const arg)
+{
+    return block_io_queue(io, fd, buf, len, offset, false, callback, arg);
+}
+
+bool block_io_write(block_io_t *const io, const int fd, const void *const buf, const size_t len, const off_t offset, block_io_callback_t callback, void *const arg)
+{
+    //the buffer is only ever read from, the iovec just has no const
+    return block_io_queue(io, fd, (void *)buf, len, offset, true, callback, arg);
+}
+
+bool block_io_complete(block_io_t *const io, const ssize_t result, block_io_callback_t callback, void *const arg)
+{
+    if(io == NULL) return false;
+    block_io_req_t *req = block_io_slot(io, callback, arg);
+    req->result = result;
+    pthread_mutex_lock(&io->lock);
+    block_io_push(&io->done, &io->done_tail, req);
+    pthread_mutex_unlock(&io->lock);
+    return true;
+}
+
+size_t block_io_poll(block_io_t *const io)
+{
+    if(io == NULL) return 0;
+    return block_io_reap(io, false);
+}
+
+size_t block_io_wait(block_io_t *const io)
+{
+    if(io == NULL) return 0;
+    size_t count = 0;
+    while(io->outstanding > 0) {
+        count += block_io_reap(io, true);
+    }
+    return count;
+}
+
+size_t block_io_pending(const block_io_t *const io)
+{
+    if(io == NULL) return 0;
+    return io->outstanding;
+}
+
+bool block_io_uses_uring(const block_io_t *const io)
+{
+    return io != NULL && io->ring_fd != -1;
+}
+
+void block_io_destroy(block_io_t *const io)
+{
+    if(io == NULL) return;
+    block_io_wait(io);
+#ifdef HAVE_IO_URING
+    if(io->ring_fd != -1) block_io_uring_stop(io);
+#endif
+    if(io->threads != NULL) block_io_pool_stop(io);
+    pthread_cond_destroy(&io->finished);
+    pthread_cond_destroy(&io->work);
+    pthread_mutex_destroy(&io->lock);
+    free(io->reqs);
+    free(io);
+}
@@ -1,11 +1,21 @@
+#define _GNU_SOURCE //MAP_ANONYMOUS, fallocate
 #include <stdio.h>
 #include <stdint.h>
 #include "bitmap.h"
 #include "block_store.h"
+#include "block_io.h"
+#include "crc32c.h"
+#include "lz.h"
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <string.h>
 // include more if you need
@@ -14,283 +24,3560 @@
 // remove it before you submit. Just allows things to compile initially.
 #define UNUSED(x) (void)(x)
 
+// Past this many blocks a worst-case linear bitmap_ffz costs more than keeping
+// the summary levels up to date on every allocate/release (see hw3_bench ffz_hierarchical)
+#define BLOCK_STORE_SUMMARY_THRESHOLD 4096
+
+//Store flags
+#define BS_MAPPED 0x01   //the arena is a shared mapping of a file, flushed with msync
+#define BS_READONLY 0x02 //mapped read-only, every mutator fails
+#define BS_THREAD_SAFE 0x04 //created with BLOCK_STORE_THREAD_SAFE, FBM and dirty bits only change atomically
+#define BS_THREAD_CACHE 0x08 //created with BLOCK_STORE_THREAD_CACHE, allocate/release go through per-thread magazines
+#define BS_CHECKSUM 0x10 //created with BLOCK_STORE_CHECKSUMS, every user block has a CRC-32C in the metadata blocks
+#define BS_DEDUP 0x20    //created with BLOCK_STORE_DEDUP, user blocks map onto shared slots, see block_store_dedup_t
+
+//Upper bound on FBM shards in a thread-safe store, enough to keep a few dozen cores apart
+#define BLOCK_STORE_MAX_SHARDS 64
+
+//Blocks a thread's magazine holds at most, it refills and drains half of that at a time
+#define BLOCK_STORE_CACHE_SIZE 64
+
+//Serialize and deserialize move the image in requests of about this many bytes, io_depth of them at a time
+#define BLOCK_STORE_IO_CHUNK (256 * 1024)
+
+//Bytes the streaming calls move per system call when the caller doesn't say
+#define BLOCK_STORE_STREAM_CHUNK (1024 * 1024)
+
+//A checked block_store_pread sums the block through a stack buffer of this many bytes, whatever the block size
+#define BLOCK_STORE_CHECK_PIECE 4096
+
+//Block 0 starts with this header, the FBM follows it and runs on through the FBM blocks
+//Fixed-width fields so an image means the same thing to every build
+#define BLOCK_STORE_MAGIC 0x4B4F4C42u //"BLOK"
+#define BLOCK_STORE_VERSION 1
+//Feature bits, an image with a bit this build doesn't know is turned away
+#define BLOCK_STORE_FEATURE_CHECKSUMS 0x0001 //a CRC-32C per user block follows the FBM
+#define BLOCK_STORE_FEATURE_DEDUP 0x0002     //a slot map per user block follows the FBM and checksums
+#define BLOCK_STORE_FEATURES (BLOCK_STORE_FEATURE_CHECKSUMS | BLOCK_STORE_FEATURE_DEDUP)
+typedef struct block_store_header{
+    uint32_t magic;
+    uint16_t version;     //was a uint32_t, images from before features read the same on little-endian machines
+    uint16_t features;
+    uint64_t num_blocks;
+    uint64_t block_size;
+    uint64_t fbm_blocks;
+    uint64_t store_id;    //random, tells images of different stores apart
+    uint64_t generation;  //bumped by every checkpoint, see block_store_serialize_incremental
+    uint64_t journal_generation; //journaled stores only, transactions older than this are in the image already
+    uint64_t journal_start;      //journaled stores only, where replay starts in the journal
+} block_store_header_t;         //64 bytes, keeps the FBM word aligned
+
 typedef struct block_store{
-    char* data[BLOCK_STORE_AVAIL_BLOCKS][BLOCK_STORE_AVAIL_BLOCKS];
+    size_t num_blocks;   //every block on the device, FBM blocks included
+    size_t block_size;   //bytes per block, a power of two
+    size_t fbm_blocks;   //leading blocks reserved for the header and FBM
+    size_t avail_blocks; //user-addressable blocks, num_blocks - fbm_blocks
+    char* data;          //page-aligned arena, block i at data + i * block_size
+    size_t data_bytes;   //num_blocks * block_size
     bitmap_t* bitmap;
+    size_t used_blocks;  //bits set in the FBM, kept up to date so the counts don't need a popcount
+    bitmap_t* dirty;     //one bit per device block changed since the last checkpoint (flush or incremental serialize)
+    uint32_t* pins;      //outstanding borrows per user block, a pinned block can't be released or moved
+    bitmap_t* borrowed_mut; //user blocks with a mutable borrow out, they get marked dirty again on return
+    block_store_policy_t policy;
+    size_t cursor;       //where next-fit picks up, one past the last allocation
+    unsigned flags;
+    int fd;              //backing file of a mapped store, -1 otherwise
+    struct block_store_shard* shards; //thread-safe stores only, shard s covers the blocks with id >> shard_shift == s
+    size_t shard_count;
+    unsigned shard_shift;
+    uint32_t* seq;       //thread-safe stores only, a seqlock per user block, odd while a write is in progress
+    uint32_t* crc;       //checksummed stores only, the CRC-32C of each user block, in the arena right after the FBM
+    uint32_t zero_crc;   //checksummed stores only, the CRC-32C of a zeroed block
+    bitmap_t* cached;    //thread-cached stores only, blocks sitting in a magazine: taken in the FBM but not handed out
+    pthread_key_t magazine_key;
+    pthread_mutex_t magazine_lock; //guards the list below and retired
+    struct block_store_magazine* magazines; //every live magazine, so checkpoints can empty them
+    block_store_cache_stats_t retired; //what the magazines of exited threads did
+    struct block_store_journal* journal; //write-ahead log of a store made by block_store_create_wal/open_wal
+    struct block_store_dedup* dedup; //deduplicating stores only, which slot each user block's bytes are in
+    struct block_store* origin;    //snapshots only, the live store the blocks not copied yet are read from
+    bitmap_t* copied;              //snapshots only, user blocks (slots, if deduplicating) copied before the origin changed them
+    struct block_store* snapshots; //live store, its snapshots linked through next_snapshot
+    struct block_store* next_snapshot;
+    block_io_t* io;      //block_store_read_async's engine, made on first use
+    size_t io_depth;     //requests the async calls and serialize keep in flight
+    size_t io_threads;   //threads serialize splits the image between, 1 leaves it to block_io_create
 } block_store_t;
 
-//Yuto Wada
-//Resources for errno.h: https://www.tutorialspoint.com/cprogramming/c_error_handling.htm
-block_store_t *block_store_create()
+//A thread's private stack of free blocks, tcmalloc style
+//The counters are only written by the owning thread, block_store_get_cache_stats reads them relaxed
+typedef struct block_store_magazine{
+    block_store_t *bs;
+    struct block_store_magazine *next, *prev;
+    size_t hits, misses, refills, drains;
+    size_t count;
+    size_t ids[BLOCK_STORE_CACHE_SIZE];
+} block_store_magazine_t;
+
+//Bumps a magazine counter, a plain increment as far as the owning thread is concerned
+#define MAGAZINE_COUNT(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+//Write-ahead log of a journaled store
+//Changed device blocks pile up in pending, and block_store_journal_commit logs them as one transaction.
+//Committers take a ticket; whoever finds no commit running leads one for every ticket handed out so far,
+//so writers arriving during an fsync share the next one. The checkpointer thread folds logged blocks into
+//the image in the background and lets go of the part of the journal the image no longer needs.
+typedef struct block_store_journal{
+    int fd;               //<image>.wal
+    int image_fd;
+    pthread_mutex_t lock; //guards everything down to limit
+    pthread_cond_t done;  //a commit (or the switch to a new checkpoint) finished
+    pthread_cond_t wake;  //the checkpointer has work, or has to stop
+    bool committing;      //a leader is appending, or a checkpoint is switching generations
+    bool failed;          //an append failed, nothing after it can be promised
+    bool wanted;          //the journal has grown past limit
+    bool stop;
+    uint64_t requested;   //commit tickets handed out
+    uint64_t durable;     //tickets covered by an fsync
+    uint64_t generation;  //stamped on every transaction, bumped by each checkpoint
+    off_t tail;           //where the next transaction goes
+    off_t start;          //first transaction the image doesn't have, read without the lock by the leader
+    size_t limit;
+    block_store_journal_stats_t stats;
+    bitmap_t *pending;    //device blocks changed but not logged yet, set atomically by block_store_mark_dirty
+    bitmap_t *logged;     //logged since the last checkpoint began, leader only
+    bitmap_t *folding;    //what the running checkpoint writes to the image
+    uint64_t *ids;        //the leader's transaction, block numbers and contents
+    char *buffer;
+    size_t buffer_bytes;
+    char *scratch;        //the checkpointer's copy of a block
+    pthread_mutex_t checkpoint_lock; //one checkpoint at a time
+    pthread_t checkpointer;
+    bool running;
+} block_store_journal_t;
+
+//A lock per slice of the device guarding the pins and borrow bits, padded out so two shards never share a cache line
+//The FBM itself is lock-free, see bitmap_ffz_claim
+typedef struct block_store_shard{
+    pthread_mutex_t lock;
+    char pad[64 - sizeof(pthread_mutex_t) % 64];
+} block_store_shard_t;
+
+//The slots of a deduplicating store
+//The user blocks' part of the arena holds one copy of each distinct block, in slots handed out lowest first,
+//and each user block maps onto the slot with its bytes, or onto none at all while it is zeroed.
+//Slots are found by the CRC-32C of their bytes and compared in full before one is shared.
+//A borrowed block gets a slot to itself, kept out of the index until its last borrow comes back.
+//Only the map is in the arena (and so in images), the rest is rebuilt from it by block_store_dedup_create.
+typedef struct block_store_dedup{
+    uint32_t *map;     //slot + 1 of each user block, 0 for a zeroed one
+    uint32_t *refs;    //user blocks mapped onto each slot, 0 for a free slot
+    uint32_t *hash;    //CRC-32C of each indexed slot
+    uint32_t *next;    //slot + 1 of the next slot in the same bucket, 0 ends the chain
+    uint32_t *buckets; //slot + 1 of the first slot in each bucket
+    size_t mask;       //buckets - 1, there are a power of two of them
+    bitmap_t *slots;   //slots in use
+    size_t used;       //bits set in slots
+    char *zero;        //a zeroed block, where zeroed user blocks read from
+    uint32_t zero_sum; //its CRC-32C
+    char *scratch;     //a block where block_store_pwrite puts a partial write together, writable stores only
+} block_store_dedup_t;
+
+//Shard a user block belongs to, every shard covers whole FBM words
+#define SHARD_OF(bs, block_id) ((block_id) >> (bs)->shard_shift)
+
+//Address of a user block in the data arena, the FBM blocks come first
+#define BLOCK_PTR(bs, block_id) ((bs)->data + ((bs)->fbm_blocks + (block_id)) * (bs)->block_size)
+
+//Device block holding the FBM bit of a user block, so FBM changes can be flushed
+#define FBM_BLOCK(bs, block_id) ((sizeof(block_store_header_t) + (block_id) / 8) / (bs)->block_size)
+
+//Where the checksums start in the arena, after the FBM padded out to whole words for every device block
+#define CRC_OFFSET(bs) (sizeof(block_store_header_t) + ((bs)->num_blocks + 63) / 64 * sizeof(uint64_t))
+
+//Device block holding the checksum of a user block
+#define CRC_BLOCK(bs, block_id) ((CRC_OFFSET(bs) + (block_id) * sizeof(uint32_t)) / (bs)->block_size)
+
+//Where a deduplicating store's slot map starts in the arena, after the checksums if there are any
+#define MAP_OFFSET(bs) (CRC_OFFSET(bs) + (((bs)->flags & BS_CHECKSUM) ? (bs)->num_blocks * sizeof(uint32_t) : 0))
+
+//Device block holding the map entry of a user block
+#define MAP_BLOCK(bs, block_id) ((MAP_OFFSET(bs) + (block_id) * sizeof(uint32_t)) / (bs)->block_size)
+
+//The locks are only taken in thread-safe stores, everything else pays a flag test
+static void block_store_lock_shard(const block_store_t *const bs, const size_t shard)
+{
+    if(bs->flags & BS_THREAD_SAFE) pthread_mutex_lock(&bs->shards[shard].lock);
+}
+
+static void block_store_unlock_shard(const block_store_t *const bs, const size_t shard)
+{
+    if(bs->flags & BS_THREAD_SAFE) pthread_mutex_unlock(&bs->shards[shard].lock);
+}
+
+//Marks count device blocks from first as changed since the last checkpoint
+//Neighbouring blocks share dirty words, so a thread-safe store sets them atomically
+static void block_store_mark_dirty(block_store_t *const bs, const size_t first, const size_t count)
+{
+    if(bs->flags & BS_THREAD_SAFE) {
+        for(size_t block = first; block < first + count; block++) {
+            bitmap_test_and_set(bs->dirty, block);
+            //journaled stores are always thread-safe
+            if(bs->journal != NULL) bitmap_test_and_set(bs->journal->pending, block);
+        }
+        return;
+    }
+    bitmap_set_range(bs->dirty, first, count);
+}
+
+//Marks the metadata blocks holding the checksums of count blocks from first as changed
+static void block_store_mark_crc(block_store_t *const bs, const size_t first, const size_t count)
+{
+    if(bs->flags & BS_CHECKSUM) {
+        size_t crc_first = CRC_BLOCK(bs, first);
+        block_store_mark_dirty(bs, crc_first, CRC_BLOCK(bs, first + count - 1) - crc_first + 1);
+    }
+}
+
+//Marks count blocks from first as changed along with the FBM blocks holding their bits
+//Their checksums go too, an incremental image records a free block's as a zeroed one's (see block_store_image_meta)
+static void block_store_mark_fbm(block_store_t *const bs, const size_t first, const size_t count)
+{
+    size_t fbm_first = FBM_BLOCK(bs, first);
+    block_store_mark_dirty(bs, fbm_first, FBM_BLOCK(bs, first + count - 1) - fbm_first + 1);
+    block_store_mark_crc(bs, first, count);
+    block_store_mark_dirty(bs, bs->fbm_blocks + first, count);
+}
+
+//Marks count blocks from first as written, along with the metadata blocks holding their checksums
+static void block_store_mark_written(block_store_t *const bs, const size_t first, const size_t count)
+{
+    block_store_mark_crc(bs, first, count);
+    block_store_mark_dirty(bs, bs->fbm_blocks + first, count);
+}
+
+//Takes a free block, false if it was already in use
+//Thread-safe stores race for it with a single atomic, the others test and set
+static bool block_store_fbm_claim(block_store_t *const bs, const size_t block_id)
+{
+    if(bs->flags & BS_THREAD_SAFE) {
+        return !bitmap_test_and_set(bs->bitmap, block_id);
+    }
+    if(bitmap_test(bs->bitmap, block_id)) {
+        return false;
+    }
+    bitmap_set(bs->bitmap, block_id);
+    return true;
+}
+
+//Frees a block, false if it was already free
+//A block parked in a magazine is already free as far as the caller is concerned, so it is left there
+static bool block_store_fbm_unclaim(block_store_t *const bs, const size_t block_id)
+{
+    if(bs->cached != NULL && bitmap_test(bs->cached, block_id)) {
+        return false;
+    }
+    if(bs->flags & BS_THREAD_SAFE) {
+        return bitmap_test_and_reset(bs->bitmap, block_id);
+    }
+    if(!bitmap_test(bs->bitmap, block_id)) {
+        return false;
+    }
+    bitmap_reset(bs->bitmap, block_id);
+    return true;
+}
+
+//The FBM lives in the device itself, right after the header
+//Large stores get a hierarchical bitmap so allocate does not scan the whole FBM,
+//except thread-safe ones: the atomic bitmap calls don't keep a summary up to date
+static bitmap_t *block_store_bitmap_overlay(const size_t blocks, void *const fbm, const bool summarize)
+{
+    bitmap_t *bitmap = bitmap_overlay(blocks, fbm);
+    if(bitmap != NULL && summarize && blocks >= BLOCK_STORE_SUMMARY_THRESHOLD && !bitmap_summarize(bitmap)){
+        bitmap_destroy(bitmap);
+        return NULL;
+    }
+    return bitmap;
+}
+
+//One flat, page-aligned, zero-filled arena for the whole device
+//Anonymous mappings come back zeroed and only take memory once a page is touched,
+//so a big device that is mostly unused costs next to nothing
+//Block sizes are powers of two >= 64, so every block starts on a cache line, and on a page once blocks are page sized
+static char *block_store_arena_create(const size_t bytes)
+{
+    void *arena = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(arena == MAP_FAILED) {
+        return NULL;
+    }
+    return arena;
+}
+
+static void block_store_arena_destroy(char *const arena, const size_t bytes)
+{
+    if(arena != NULL) {
+        munmap(arena, bytes);
+    }
+}
+
+//Works out the layout for a geometry, false if the geometry is unusable
+static bool block_store_layout(block_store_t *const bs, const size_t num_blocks, const size_t block_size)
+{
+    //block sizes have to be a power of two so blocks never straddle cache lines oddly
+    if(block_size < BLOCK_STORE_MIN_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) {
+        return false;
+    }
+    //the device size has to fit in a size_t
+    if(num_blocks == 0 || num_blocks > SIZE_MAX / block_size) {
+        return false;
+    }
+    //the header plus one FBM bit per block (padded to whole words, which bitmap_overlay handles fastest),
+    //a checksum per block if the store keeps them, a map entry per block if it deduplicates,
+    //and at least one block left over for data
+    size_t fbm_bytes = sizeof(block_store_header_t) + (num_blocks + 63) / 64 * sizeof(uint64_t);
+    if(bs->flags & BS_CHECKSUM) {
+        if(num_blocks > (SIZE_MAX - fbm_bytes) / sizeof(uint32_t)) return false;
+        fbm_bytes += num_blocks * sizeof(uint32_t);
+    }
+    if(bs->flags & BS_DEDUP) {
+        //map entries are slot + 1 in 32 bits
+        if(num_blocks >= UINT32_MAX || num_blocks > (SIZE_MAX - fbm_bytes) / sizeof(uint32_t)) return false;
+        fbm_bytes += num_blocks * sizeof(uint32_t);
+    }
+    size_t fbm_blocks = (fbm_bytes + block_size - 1) / block_size;
+    if(fbm_blocks >= num_blocks) {
+        return false;
+    }
+
+    bs->num_blocks = num_blocks;
+    bs->block_size = block_size;
+    bs->fbm_blocks = fbm_blocks;
+    bs->avail_blocks = num_blocks - fbm_blocks;
+    bs->data_bytes = num_blocks * block_size;
+    return true;
+}
+
+//Feature bits an image of bs is stamped with
+static uint16_t block_store_features(const block_store_t *const bs)
+{
+    return ((bs->flags & BS_CHECKSUM) ? BLOCK_STORE_FEATURE_CHECKSUMS : 0) | ((bs->flags & BS_DEDUP) ? BLOCK_STORE_FEATURE_DEDUP : 0);
+}
+
+//Gives bs the features of an image, they change its layout
+static void block_store_take_features(block_store_t *const bs, const uint16_t features)
+{
+    bs->flags &= ~(BS_CHECKSUM | BS_DEDUP);
+    if(features & BLOCK_STORE_FEATURE_CHECKSUMS) bs->flags |= BS_CHECKSUM;
+    if(features & BLOCK_STORE_FEATURE_DEDUP) bs->flags |= BS_DEDUP;
+}
+
+//The block_store_create_flags options for a store with the same features as geometry
+static int block_store_feature_options(const block_store_t *const geometry)
+{
+    return ((geometry->flags & BS_CHECKSUM) ? BLOCK_STORE_CHECKSUMS : 0) | ((geometry->flags & BS_DEDUP) ? BLOCK_STORE_DEDUP : 0);
+}
+
+//splitmix64, just enough to turn a few clock and address bits into a store id
+static uint64_t block_store_new_id(const void *const seed)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t x = (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec + (uintptr_t)seed + ((uint64_t)getpid() << 32);
+    x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return x ^ (x >> 31);
+}
+
+//Stamps the header into block 0 so the device image describes itself
+static void block_store_write_header(block_store_t *const bs)
+{
+    block_store_header_t *header = (block_store_header_t *)bs->data;
+    header->magic = BLOCK_STORE_MAGIC;
+    header->version = BLOCK_STORE_VERSION;
+    header->features = block_store_features(bs);
+    header->num_blocks = bs->num_blocks;
+    header->block_size = bs->block_size;
+    header->fbm_blocks = bs->fbm_blocks;
+    header->store_id = block_store_new_id(bs);
+    header->generation = 0;
+    bitmap_set(bs->dirty, 0);
+}
+
+//Checks a header read off an image of image_size bytes and lays bs out to match it
+//bs takes on the image's features along with its geometry
+static bool block_store_read_header(block_store_t *const bs, const block_store_header_t *const header, const uint64_t image_size)
+{
+    block_store_take_features(bs, header->features);
+    return header->magic == BLOCK_STORE_MAGIC && header->version == BLOCK_STORE_VERSION
+        && (header->features & ~BLOCK_STORE_FEATURES) == 0
+        && header->num_blocks <= SIZE_MAX && header->block_size <= SIZE_MAX
+        && block_store_layout(bs, header->num_blocks, header->block_size)
+        && header->fbm_blocks == bs->fbm_blocks && image_size >= bs->data_bytes;
+}
+
+//Tells whether a block is all zeroes
+static bool block_store_zeroed(const char *const block, const size_t block_size)
+{
+    return block[0] == 0 && memcmp(block, block + 1, block_size - 1) == 0;
+}
+
+//A writer racing a seqlock reader is expected, so both sides copy with relaxed atomics,
+//words where the block lines up and bytes at the ragged ends of a partial span
+static void block_store_load_words(char *dst, const char *src, size_t len)
+{
+    for(; len > 0 && ((uintptr_t)src & 7) != 0; len--) {
+        *dst++ = __atomic_load_n(src++, __ATOMIC_RELAXED);
+    }
+    for(; len >= 8; len -= 8, src += 8, dst += 8) {
+        uint64_t word = __atomic_load_n((const uint64_t *)src, __ATOMIC_RELAXED);
+        memcpy(dst, &word, 8);
+    }
+    for(; len > 0; len--) {
+        *dst++ = __atomic_load_n(src++, __ATOMIC_RELAXED);
+    }
+}
+
+static void block_store_store_words(char *dst, const char *src, size_t len)
+{
+    for(; len > 0 && ((uintptr_t)dst & 7) != 0; len--) {
+        __atomic_store_n(dst++, *src++, __ATOMIC_RELAXED);
+    }
+    for(; len >= 8; len -= 8, src += 8, dst += 8) {
+        uint64_t word;
+        memcpy(&word, src, 8);
+        __atomic_store_n((uint64_t *)dst, word, __ATOMIC_RELAXED);
+    }
+    for(; len > 0; len--) {
+        __atomic_store_n(dst++, *src++, __ATOMIC_RELAXED);
+    }
+}
+
+//Copies one user block (a slot, if deduplicating) of bs into a snapshot still reading it from bs
+//A zeroed block needs no copy, the snapshot's arena is zeroed wherever nothing was copied to it
+//In a thread-safe store the caller has the block's seqlock for writing, so the bytes hold still
+static void block_store_snapshot_keep(const block_store_t *const bs, block_store_t *const snapshot, const size_t pos)
+{
+    if(bitmap_test(snapshot->copied, pos)) return;
+    const char *block = BLOCK_PTR(bs, pos);
+    //a thread-safe snapshot's readers copy with relaxed atomics, same as for the seqlock
+    if(!block_store_zeroed(block, bs->block_size)) {
+        if(bs->flags & BS_THREAD_SAFE) {
+            block_store_store_words(BLOCK_PTR(snapshot, pos), block, bs->block_size);
+        } else {
+            memcpy(BLOCK_PTR(snapshot, pos), block, bs->block_size);
+        }
+    }
+    //the bit goes up after the copy, a reader that sees it sees the copy
+    bitmap_test_and_set(snapshot->copied, pos);
+}
+
+//Has to run before bs changes a user block (a slot, if deduplicating), every snapshot sharing it gets its own copy
+static void block_store_preserve(block_store_t *const bs, const size_t pos)
+{
+    for(block_store_t *snapshot = bs->snapshots; snapshot != NULL; snapshot = snapshot->next_snapshot) {
+        block_store_snapshot_keep(bs, snapshot, pos);
+    }
+}
+
+static void block_store_preserve_range(block_store_t *const bs, const size_t first, const size_t count)
+{
+    if(bs->snapshots == NULL) return;
+    for(size_t pos = first; pos < first + count; pos++) {
+        block_store_preserve(bs, pos);
+    }
+}
+
+//Deduplicating stores are never thread-safe, nothing below takes a lock
+
+static void block_store_dedup_destroy(block_store_dedup_t *const dedup)
+{
+    if(dedup == NULL) return;
+    bitmap_destroy(dedup->slots);
+    free(dedup->buckets);
+    free(dedup->next);
+    free(dedup->hash);
+    free(dedup->refs);
+    free(dedup->zero);
+    free(dedup->scratch);
+    free(dedup);
+}
+
+//Puts a slot holding bytes with the CRC-32C sum where block_store_dedup_find can see it
+static void block_store_dedup_index(block_store_dedup_t *const dedup, const size_t slot, const uint32_t sum)
+{
+    uint32_t *head = &dedup->buckets[sum & dedup->mask];
+    dedup->hash[slot] = sum;
+    dedup->next[slot] = *head;
+    *head = (uint32_t)(slot + 1);
+}
+
+//Takes a slot out of the index, if it is there
+static void block_store_dedup_unindex(block_store_dedup_t *const dedup, const size_t slot)
+{
+    for(uint32_t *link = &dedup->buckets[dedup->hash[slot] & dedup->mask]; *link != 0; link = &dedup->next[*link - 1]) {
+        if(*link == slot + 1) {
+            *link = dedup->next[slot];
+            return;
+        }
+    }
+}
+
+//The indexed slot holding exactly the bytes of block, SIZE_MAX if there is none
+static size_t block_store_dedup_find(const block_store_t *const bs, const char *const block, const uint32_t sum)
+{
+    const block_store_dedup_t *dedup = bs->dedup;
+    for(uint32_t link = dedup->buckets[sum & dedup->mask]; link != 0; link = dedup->next[link - 1]) {
+        if(dedup->hash[link - 1] == sum && memcmp(BLOCK_PTR(bs, link - 1), block, bs->block_size) == 0) {
+            return link - 1;
+        }
+    }
+    return SIZE_MAX;
+}
+
+//Takes the lowest free slot, so the slots in use stay packed at the front of the arena
+//There is always one: no more slots are in use than there are user blocks mapped onto them,
+//and a user block that needs a new slot is either mapped onto none or shares the one it has
+static size_t block_store_dedup_take(block_store_t *const bs)
+{
+    block_store_dedup_t *dedup = bs->dedup;
+    const size_t slot = bitmap_ffz(dedup->slots);
+    //a snapshot may still map a block onto whatever the slot held before it was freed
+    block_store_preserve(bs, slot);
+    bitmap_set(dedup->slots, slot);
+    dedup->used++;
+    block_store_mark_dirty(bs, bs->fbm_blocks + slot, 1);
+    return slot;
+}
+
+//Drops one user block's hold on a slot, the last one to go frees it
+static void block_store_dedup_put(block_store_t *const bs, const size_t slot)
+{
+    block_store_dedup_t *dedup = bs->dedup;
+    if(--dedup->refs[slot] > 0) return;
+    block_store_dedup_unindex(dedup, slot);
+    bitmap_reset(dedup->slots, slot);
+    dedup->used--;
+    //an incremental image punches it out
+    block_store_mark_dirty(bs, bs->fbm_blocks + slot, 1);
+}
+
+//Maps a user block onto slot + 1 (0 for zeroed) and gives it the checksum of those bytes
+static void block_store_dedup_map(block_store_t *const bs, const size_t block_id, const uint32_t target, const uint32_t sum)
+{
+    block_store_dedup_t *dedup = bs->dedup;
+    const uint32_t old = dedup->map[block_id];
+    if(target != old) {
+        if(target != 0) dedup->refs[target - 1]++;
+        dedup->map[block_id] = target;
+        if(old != 0) block_store_dedup_put(bs, old - 1);
+        block_store_mark_dirty(bs, MAP_BLOCK(bs, block_id), 1);
+    }
+    if(bs->flags & BS_CHECKSUM) {
+        bs->crc[block_id] = sum;
+        block_store_mark_dirty(bs, CRC_BLOCK(bs, block_id), 1);
+    }
+}
+
+//Stores a whole block's worth of bytes for a user block: onto a slot that holds them already if there is one,
+//else over its own slot if nothing else is mapped onto it, else into a new slot
+static void block_store_dedup_write(block_store_t *const bs, const size_t block_id, const void *const buffer)
+{
+    block_store_dedup_t *dedup = bs->dedup;
+    const uint32_t sum = crc32c(0, buffer, bs->block_size);
+    const uint32_t old = dedup->map[block_id];
+    //a borrowed block keeps the slot it was lent in, the borrower is looking at it
+    if(bs->pins[block_id] > 0) {
+        block_store_preserve(bs, old - 1);
+        memcpy(BLOCK_PTR(bs, old - 1), buffer, bs->block_size);
+        block_store_mark_dirty(bs, bs->fbm_blocks + old - 1, 1);
+        block_store_dedup_map(bs, block_id, old, sum);
+        return;
+    }
+    uint32_t target = 0;
+    if(sum != dedup->zero_sum || !block_store_zeroed(buffer, bs->block_size)) {
+        size_t slot = block_store_dedup_find(bs, buffer, sum);
+        if(slot == SIZE_MAX) {
+            if(old != 0 && dedup->refs[old - 1] == 1) {
+                slot = old - 1;
+                block_store_dedup_unindex(dedup, slot);
+                block_store_preserve(bs, slot);
+                block_store_mark_dirty(bs, bs->fbm_blocks + slot, 1);
+            } else {
+                slot = block_store_dedup_take(bs);
+            }
+            memcpy(BLOCK_PTR(bs, slot), buffer, bs->block_size);
+            block_store_dedup_index(dedup, slot, sum);
+        }
+        target = (uint32_t)(slot + 1);
+    }
+    block_store_dedup_map(bs, block_id, target, sum);
+}
+
+//Gives a user block about to be borrowed a slot of its own, out of the index, and returns it
+//Nothing else sees what a borrower does to it, and it stays where it is until block_store_dedup_settle
+static char *block_store_dedup_pin(block_store_t *const bs, const size_t block_id)
+{
+    block_store_dedup_t *dedup = bs->dedup;
+    const uint32_t old = dedup->map[block_id];
+    if(old != 0 && dedup->refs[old - 1] == 1) {
+        block_store_dedup_unindex(dedup, old - 1);
+        block_store_preserve(bs, old - 1);
+        return BLOCK_PTR(bs, old - 1);
+    }
+    const size_t slot = block_store_dedup_take(bs);
+    memcpy(BLOCK_PTR(bs, slot), old != 0 ? BLOCK_PTR(bs, old - 1) : dedup->zero, bs->block_size);
+    //same bytes, same checksum
+    block_store_dedup_map(bs, block_id, (uint32_t)(slot + 1), (bs->flags & BS_CHECKSUM) ? bs->crc[block_id] : 0);
+    return BLOCK_PTR(bs, slot);
+}
+
+//Matches a user block whose last borrow just came back the same way a write would,
+//it gives up its slot if another one holds the same bytes
+static void block_store_dedup_settle(block_store_t *const bs, const size_t block_id)
+{
+    block_store_dedup_t *dedup = bs->dedup;
+    const size_t slot = dedup->map[block_id] - 1;
+    const char *block = BLOCK_PTR(bs, slot);
+    const uint32_t sum = crc32c(0, block, bs->block_size);
+    //the borrower may have written to it since it was handed out
+    block_store_mark_dirty(bs, bs->fbm_blocks + slot, 1);
+    uint32_t target = 0;
+    if(sum != dedup->zero_sum || !block_store_zeroed(block, bs->block_size)) {
+        size_t same = block_store_dedup_find(bs, block, sum);
+        if(same == SIZE_MAX) {
+            block_store_dedup_index(dedup, slot, sum);
+            same = slot;
+        }
+        target = (uint32_t)(same + 1);
+    }
+    block_store_dedup_map(bs, block_id, target, sum);
+}
+
+//A released block goes back to zeroed, letting go of its slot
+static void block_store_dedup_drop(block_store_t *const bs, const size_t block_id)
+{
+    block_store_dedup_map(bs, block_id, 0, bs->dedup->zero_sum);
+}
+
+//Where in the arena a user block's bytes are: its slot in a deduplicating store (SIZE_MAX while it is zeroed),
+//its own place in any other
+static size_t block_store_position(const block_store_t *const bs, const size_t block_id)
+{
+    if(bs->dedup == NULL) return block_id;
+    const uint32_t slot = bs->dedup->map[block_id];
+    return slot != 0 ? slot - 1 : SIZE_MAX;
+}
+
+//A user block's bytes, not for snapshots
+static const char *block_store_source(const block_store_t *const bs, const size_t block_id)
+{
+    const size_t pos = block_store_position(bs, block_id);
+    return pos != SIZE_MAX ? BLOCK_PTR(bs, pos) : bs->dedup->zero;
+}
+
+//Which places in the user part of the arena hold something: the slots in use of a deduplicating store,
+//the allocated blocks of any other
+static const bitmap_t *block_store_in_use(const block_store_t *const bs)
+{
+    return bs->dedup != NULL ? bs->dedup->slots : bs->bitmap;
+}
+
+//Builds the refcounts and the index from the map in the arena, NULL if it is out of memory
+//or the map points past the last slot
+//A read-only store never looks anything up, it goes without the index
+static block_store_dedup_t *block_store_dedup_create(const block_store_t *const bs, const bool index)
+{
+    block_store_dedup_t *dedup = calloc(1, sizeof(block_store_dedup_t));
+    if(dedup == NULL) return NULL;
+    size_t buckets = 1;
+    while(buckets < bs->avail_blocks) {
+        buckets <<= 1;
+    }
+    dedup->map = (uint32_t *)(bs->data + MAP_OFFSET(bs));
+    dedup->mask = buckets - 1;
+    //calloc'd pages stay untouched until the slots that use them do
+    dedup->refs = calloc(bs->avail_blocks, sizeof(uint32_t));
+    if(index) {
+        dedup->hash = calloc(bs->avail_blocks, sizeof(uint32_t));
+        dedup->next = calloc(bs->avail_blocks, sizeof(uint32_t));
+        dedup->buckets = calloc(buckets, sizeof(uint32_t));
+        dedup->scratch = malloc(bs->block_size);
+    }
+    dedup->slots = bs->avail_blocks >= BLOCK_STORE_SUMMARY_THRESHOLD ? bitmap_create_hierarchical(bs->avail_blocks)
+                                                                      : bitmap_create(bs->avail_blocks);
+    dedup->zero = calloc(1, bs->block_size);
+    bool ok = dedup->refs != NULL
+        && (!index || (dedup->hash != NULL && dedup->next != NULL && dedup->buckets != NULL && dedup->scratch != NULL))
+        && dedup->slots != NULL && dedup->zero != NULL;
+    if(ok) dedup->zero_sum = crc32c(0, dedup->zero, bs->block_size);
+
+    for(size_t block_id = 0; ok && block_id < bs->avail_blocks; block_id++) {
+        const uint32_t slot = dedup->map[block_id];
+        if(slot == 0) continue;
+        ok = slot <= bs->avail_blocks;
+        if(ok && dedup->refs[slot - 1]++ == 0) {
+            bitmap_set(dedup->slots, slot - 1);
+            dedup->used++;
+        }
+    }
+    //slots shared in the image are found again from what they hold, borrows don't outlive the store
+    for(size_t slot = 0; ok && index && slot < bs->avail_blocks; slot++) {
+        if(dedup->refs[slot] != 0) {
+            block_store_dedup_index(dedup, slot, crc32c(0, BLOCK_PTR(bs, slot), bs->block_size));
+        }
+    }
+    if(!ok) {
+        block_store_dedup_destroy(dedup);
+        return NULL;
+    }
+    return dedup;
+}
+
+//Allocates an empty store object, no arena or bitmaps yet
+static block_store_t *block_store_alloc()
+{
+    int errornum;
+
+    //Allocate memory for the block that is being created
+    block_store_t *block = calloc(1, sizeof(block_store_t));
+    if(block == NULL){
+        //errno number stuff
+        errornum = errno;
+        fprintf(stderr, "Value of errno: %d\n", errno);
+        perror("Error printed by perror");
+        fprintf(stderr, "Error Null Check: %s\n", strerror( errornum ));
+        return NULL;
+    }
+    block->fd = -1;
+    block->io_depth = BLOCK_IO_DEPTH;
+    block->io_threads = 1;
+    return block;
+}
+
+static bool block_store_journal_commit(block_store_t *const bs);
+static void block_store_journal_close(block_store_t *const bs);
+static bool block_store_journal_reset(block_store_t *const bs);
+
+static void block_store_detach_block(size_t pos, void *arg)
+{
+    block_store_t *snapshot = arg;
+    block_store_snapshot_keep(snapshot->origin, snapshot, pos);
+}
+
+//Gives a snapshot its own copy of every block it still reads from its origin, which is about to go
+static void block_store_detach(block_store_t *const snapshot)
+{
+    bitmap_for_each(block_store_in_use(snapshot), block_store_detach_block, snapshot);
+    snapshot->origin = NULL;
+    snapshot->next_snapshot = NULL;
+}
+
+//Tears down whatever part of the store got built, shared by destroy and the failure paths
+static void block_store_free(block_store_t *const bs)
+{
+    //a snapshot drops out of its origin's list, and a store's snapshots carry on without it
+    if(bs->origin != NULL) {
+        block_store_t **link = &bs->origin->snapshots;
+        while(*link != bs) {
+            link = &(*link)->next_snapshot;
+        }
+        *link = bs->next_snapshot;
+    }
+    while(bs->snapshots != NULL) {
+        block_store_t *snapshot = bs->snapshots;
+        bs->snapshots = snapshot->next_snapshot;
+        block_store_detach(snapshot);
+    }
+    bitmap_destroy(bs->copied);
+    if(bs->journal != NULL) block_store_journal_close(bs);
+    //async reads still out land in the arena, they have to finish before it goes
+    block_io_destroy(bs->io);
+    bitmap_destroy(bs->bitmap);
+    bitmap_destroy(bs->dirty);
+    bitmap_destroy(bs->borrowed_mut);
+    free(bs->pins);
+    block_store_dedup_destroy(bs->dedup);
+    if(bs->cached != NULL) {
+        //no destructor runs for a deleted key, so the magazines of live threads are freed here
+        pthread_key_delete(bs->magazine_key);
+        while(bs->magazines != NULL) {
+            block_store_magazine_t *magazine = bs->magazines;
+            bs->magazines = magazine->next;
+            free(magazine);
+        }
+        pthread_mutex_destroy(&bs->magazine_lock);
+        bitmap_destroy(bs->cached);
+    }
+    free(bs->seq);
+    if(bs->shards != NULL) {
+        for(size_t shard = 0; shard < bs->shard_count; shard++) {
+            pthread_mutex_destroy(&bs->shards[shard].lock);
+        }
+        free(bs->shards);
+    }
+    block_store_arena_destroy(bs->data, bs->data_bytes);
+    if(bs->fd != -1) {
+        close(bs->fd);
+    }
+    free(bs);
+}
+
+//Splits a thread-safe store into shards of whole FBM words, at most BLOCK_STORE_MAX_SHARDS of them
+static bool block_store_shard_init(block_store_t *const bs)
+{
+    bs->shard_shift = 6;
+    while((bs->avail_blocks - 1) >> bs->shard_shift >= BLOCK_STORE_MAX_SHARDS) {
+        bs->shard_shift++;
+    }
+    bs->shard_count = SHARD_OF(bs, bs->avail_blocks - 1) + 1;
+    bs->shards = calloc(bs->shard_count, sizeof(block_store_shard_t));
+    bs->seq = calloc(bs->avail_blocks, sizeof(uint32_t));
+    if(bs->shards == NULL || bs->seq == NULL) {
+        free(bs->shards);
+        bs->shards = NULL;
+        return false;
+    }
+    for(size_t shard = 0; shard < bs->shard_count; shard++) {
+        pthread_mutex_init(&bs->shards[shard].lock, NULL);
+    }
+    return true;
+}
+
+static void block_store_magazine_exit(void *arg);
+
+//Sets up the per-thread magazines of a thread-cached store
+static bool block_store_cache_init(block_store_t *const bs)
+{
+    if(pthread_key_create(&bs->magazine_key, block_store_magazine_exit) != 0) {
+        return false;
+    }
+    bs->cached = bitmap_create(bs->avail_blocks);
+    if(bs->cached == NULL) {
+        pthread_key_delete(bs->magazine_key);
+        return false;
+    }
+    pthread_mutex_init(&bs->magazine_lock, NULL);
+    return true;
+}
+
+//Builds the in-memory state that sits on top of an arena:
+//the FBM overlay, the dirty map and the pin counts
+static bool block_store_attach(block_store_t *const bs)
+{
+    if((bs->flags & BS_THREAD_SAFE) && !block_store_shard_init(bs)) {
+        return false;
+    }
+    if((bs->flags & BS_THREAD_CACHE) && !block_store_cache_init(bs)) {
+        return false;
+    }
+    bs->bitmap = block_store_bitmap_overlay(bs->avail_blocks, bs->data + sizeof(block_store_header_t), !(bs->flags & BS_THREAD_SAFE));
+    bs->dirty = bitmap_create(bs->num_blocks);
+    bs->borrowed_mut = bitmap_create(bs->avail_blocks);
+    //calloc'd pages stay untouched until a block actually gets borrowed
+    bs->pins = calloc(bs->avail_blocks, sizeof(uint32_t));
+    bs->used_blocks = bitmap_total_set(bs->bitmap);
+    if(bs->flags & BS_CHECKSUM) {
+        static const char zeroes[BLOCK_STORE_MIN_BLOCK_SIZE];
+        bs->crc = (uint32_t *)(bs->data + CRC_OFFSET(bs));
+        for(size_t done = 0; done < bs->block_size; done += sizeof(zeroes)) {
+            bs->zero_crc = crc32c(bs->zero_crc, zeroes, sizeof(zeroes));
+        }
+    }
+    if(bs->flags & BS_DEDUP) {
+        bs->dedup = block_store_dedup_create(bs, !(bs->flags & BS_READONLY));
+        if(bs->dedup == NULL) return false;
+    }
+    return bs->bitmap != NULL && bs->dirty != NULL && bs->borrowed_mut != NULL && bs->pins != NULL;
+}
+
+//Yuto Wada
+//Resources for errno.h: https://www.tutorialspoint.com/cprogramming/c_error_handling.htm
+block_store_t *block_store_create()
+{
+    //the fixed 256 x 256 device is just one geometry of the runtime-sized one
+    return block_store_create_ex(BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES);
+}
+
+block_store_t *block_store_create_ex(const size_t num_blocks, const size_t block_size)
+{
+    return block_store_create_flags(num_blocks, block_size, 0);
+}
+
+block_store_t *block_store_create_flags(const size_t num_blocks, const size_t block_size, const int flags)
+{
+    block_store_t *block = block_store_alloc();
+    if(block == NULL) {
+        return NULL;
+    }
+    if(flags & (BLOCK_STORE_THREAD_SAFE | BLOCK_STORE_THREAD_CACHE)) {
+        block->flags |= BS_THREAD_SAFE;
+    }
+    if(flags & BLOCK_STORE_THREAD_CACHE) {
+        block->flags |= BS_THREAD_CACHE;
+    }
+    if(flags & BLOCK_STORE_CHECKSUMS) {
+        block->flags |= BS_CHECKSUM;
+    }
+    if(flags & BLOCK_STORE_DEDUP) {
+        //the slot map isn't guarded against other threads
+        if(block->flags & BS_THREAD_SAFE) {
+            free(block);
+            return NULL;
+        }
+        block->flags |= BS_DEDUP;
+    }
+    if(!block_store_layout(block, num_blocks, block_size)) {
+        free(block);
+        return NULL;
+    }
+
+    //Create the arena for every block, the FBM (one bit per available block) lives in block 0 after the header
+    block->data = block_store_arena_create(block->data_bytes);
+    if(block->data == NULL) {
+        block_store_free(block);
+        return NULL;
+    }
+    if(!block_store_attach(block)) {
+        block_store_free(block);
+        return NULL;
+    }
+    if(block->flags & BS_CHECKSUM) {
+        //every block starts out zeroed, so they all start with the checksum of a zeroed block
+        for(size_t block_id = 0; block_id < block->avail_blocks; block_id++) {
+            block->crc[block_id] = block->zero_crc;
+        }
+    }
+    block_store_write_header(block);
+    return block;
+}
+
+//Maps the file behind fd as the arena and hooks the FBM up to block 0
+static block_store_t *block_store_map(block_store_t *const bs)
+{
+    int prot = (bs->flags & BS_READONLY) ? PROT_READ : PROT_READ | PROT_WRITE;
+    void *arena = mmap(NULL, bs->data_bytes, prot, MAP_SHARED, bs->fd, 0);
+    if(arena == MAP_FAILED) {
+        block_store_free(bs);
+        return NULL;
+    }
+    bs->data = arena;
+    if(!block_store_attach(bs)) {
+        block_store_free(bs);
+        return NULL;
+    }
+    return bs;
+}
+
+//Formats an open, empty backing file and maps it
+static block_store_t *block_store_format_mmap(block_store_t *const bs, const size_t num_blocks, const size_t block_size)
+{
+    //ftruncate leaves the file sparse and zero-filled, so the FBM starts out all free
+    if(!block_store_layout(bs, num_blocks, block_size) || ftruncate(bs->fd, bs->data_bytes) == -1) {
+        block_store_free(bs);
+        return NULL;
+    }
+    if(block_store_map(bs) == NULL) {
+        return NULL;
+    }
+    block_store_write_header(bs);
+    return bs;
+}
+
+block_store_t *block_store_create_mmap(const char *const path, const size_t num_blocks, const size_t block_size)
+{
+    if(path == NULL) return NULL;
+
+    block_store_t *bs = block_store_alloc();
+    if(bs == NULL) return NULL;
+    bs->flags = BS_MAPPED;
+    bs->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if(bs->fd == -1) {
+        block_store_free(bs);
+        return NULL;
+    }
+    return block_store_format_mmap(bs, num_blocks, block_size);
+}
+
+block_store_t *block_store_open_mmap(const char *const path, const int flags)
+{
+    if(path == NULL) return NULL;
+    //a read-only store can't be formatted
+    if((flags & BLOCK_STORE_MMAP_READONLY) && (flags & BLOCK_STORE_MMAP_CREATE)) return NULL;
+
+    block_store_t *bs = block_store_alloc();
+    if(bs == NULL) return NULL;
+    bs->flags = BS_MAPPED | ((flags & BLOCK_STORE_MMAP_READONLY) ? BS_READONLY : 0);
+
+    int open_flags = (flags & BLOCK_STORE_MMAP_READONLY) ? O_RDONLY : O_RDWR;
+    if(flags & BLOCK_STORE_MMAP_CREATE) open_flags |= O_CREAT;
+    bs->fd = open(path, open_flags, S_IRUSR | S_IWUSR);
+    struct stat st;
+    if(bs->fd == -1 || fstat(bs->fd, &st) == -1) {
+        block_store_free(bs);
+        return NULL;
+    }
+    if(st.st_size == 0 && (flags & BLOCK_STORE_MMAP_CREATE)) {
+        return block_store_format_mmap(bs, BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES);
+    }
+
+    //only the header is read up front, everything else comes in through page faults as it's used
+    block_store_header_t header;
+    if(pread(bs->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+        || !block_store_read_header(bs, &header, st.st_size)) {
+        block_store_free(bs);
+        return NULL;
+    }
+    return block_store_map(bs);
+}
+
+//Context for coalescing dirty blocks into msync calls
+typedef struct dirty_range{
+    const block_store_t *bs;
+    size_t first, end; //current run of dirty blocks [first, end)
+    bool ok;
+} dirty_range_t;
+
+//msync's a run of blocks, widened out to the pages that hold it
+static void block_store_sync_range(dirty_range_t *const range)
+{
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = range->first * range->bs->block_size / page * page;
+    size_t end = range->end * range->bs->block_size;
+    if(msync(range->bs->data + start, end - start, MS_SYNC) == -1) {
+        range->ok = false;
+    }
+}
+
+static void block_store_sync_block(size_t block, void *arg)
+{
+    dirty_range_t *range = arg;
+    if(range->end != block) {
+        if(range->end != range->first) {
+            block_store_sync_range(range);
+        }
+        range->first = block;
+    }
+    range->end = block + 1;
+}
+
+//msync's only the dirty blocks of a mapped store, in as few contiguous calls as possible
+static bool block_store_sync_dirty(const block_store_t *const bs)
+{
+    dirty_range_t range = {bs, 0, 0, true};
+    bitmap_for_each(bs->dirty, block_store_sync_block, &range);
+    if(range.end != range.first) {
+        block_store_sync_range(&range);
+    }
+    return range.ok;
+}
+
+bool block_store_flush(block_store_t *const bs)
+{
+    if(bs == NULL) return false;
+    //a journaled store is durable once what changed is in the journal
+    if(bs->journal != NULL) return block_store_journal_commit(bs);
+    //memory-only stores have nowhere to flush to
+    if(!(bs->flags & BS_MAPPED) || (bs->flags & BS_READONLY)) return true;
+
+    //the file is its own checkpoint, any other image of this store is now out of date
+    ((block_store_header_t *)bs->data)->generation++;
+    bitmap_set(bs->dirty, 0);
+
+    if(!block_store_sync_dirty(bs)) {
+        return false;
+    }
+    bitmap_format(bs->dirty, 0x00);
+    return true;
+}
+
+//Yuto Wada
+void block_store_destroy(block_store_t *const bs)
+{
+    int errornum;
+
+    if (bs == NULL){
+        errornum = errno;
+        fprintf(stderr, "Value of errno: %d\n", errno);
+        perror("Error printed by perror");
+        fprintf(stderr, "Error Null Check: %s\n", strerror( errornum )); 
+        return;
+    }
+
+    //If the parameter is not null, push anything still dirty out to the backing file,
+    //then destroy the bitmaps and release the arena
+    block_store_flush(bs);
+    //a journaled store leaves a complete image and an empty journal behind
+    if(bs->journal != NULL) block_store_journal_reset(bs);
+    block_store_free(bs);
+    return; 
+}
+
+//Finds a free run of count blocks according to the store's policy, SIZE_MAX if there is none
+static size_t block_store_find_free(const block_store_t *const bs, const size_t count)
+{
+    size_t found;
+    switch(__atomic_load_n(&bs->policy, __ATOMIC_RELAXED)) {
+    case BLOCK_STORE_NEXT_FIT:
+        //from the cursor to the end, then wrap around to the start
+        found = __atomic_load_n(&bs->cursor, __ATOMIC_RELAXED);
+        found = count == 1 ? bitmap_ffz_from(bs->bitmap, found) : bitmap_ffz_run_from(bs->bitmap, found, count);
+        if(found == SIZE_MAX) {
+            found = bitmap_ffz_run(bs->bitmap, count);
+        }
+        return found;
+    case BLOCK_STORE_BEST_FIT:
+        return bitmap_ffz_run_best(bs->bitmap, count);
+    default:
+        return count == 1 ? bitmap_ffz(bs->bitmap) : bitmap_ffz_run(bs->bitmap, count);
+    }
+}
+
+//Claims count blocks from start, all or nothing
+//In a thread-safe store another thread can get to one of them between the search and the claim,
+//then whatever was claimed so far is handed back
+static bool block_store_claim_run(block_store_t *const bs, const size_t start, const size_t count)
+{
+    if(!(bs->flags & BS_THREAD_SAFE)) {
+        bitmap_set_range(bs->bitmap, start, count);
+        return true;
+    }
+    for(size_t i = 0; i < count; i++) {
+        if(bitmap_test_and_set(bs->bitmap, start + i)) {
+            while(i > 0) {
+                bitmap_test_and_reset(bs->bitmap, start + --i);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+//The used count is shared by every thread, so it only ever moves atomically
+static void block_store_count_used(block_store_t *const bs, const size_t count)
+{
+    __atomic_fetch_add(&bs->used_blocks, count, __ATOMIC_RELAXED);
+}
+
+static void block_store_count_freed(block_store_t *const bs, const size_t count)
+{
+    __atomic_fetch_sub(&bs->used_blocks, count, __ATOMIC_RELAXED);
+}
+
+//Each thread gets a home shard the first time it allocates, handed out round robin
+static size_t next_home_shard;
+static _Thread_local size_t home_shard = SIZE_MAX;
+
+//Where the calling thread starts looking in a thread-safe store, the first block of its home shard
+static size_t block_store_home(const block_store_t *const bs)
+{
+    if(home_shard == SIZE_MAX) {
+        home_shard = __atomic_fetch_add(&next_home_shard, 1, __ATOMIC_RELAXED);
+    }
+    return (home_shard % bs->shard_count) << bs->shard_shift;
+}
+
+//Hands a magazine's blocks back to the FBM until only keep are left
+//Const so block_store_serialize can empty the magazines, parked blocks aren't part of what the store holds
+static void block_store_magazine_drain(const block_store_t *const bs, block_store_magazine_t *const magazine, const size_t keep)
+{
+    while(magazine->count > keep) {
+        size_t block_id = magazine->ids[--magazine->count];
+        //no longer parked first, so a concurrent release can't park it a second time
+        bitmap_test_and_reset(bs->cached, block_id);
+        bitmap_test_and_reset(bs->bitmap, block_id);
+        bitmap_test_and_set(bs->dirty, FBM_BLOCK(bs, block_id));
+        //an incremental image records a free block's checksum as a zeroed one's (see block_store_image_meta)
+        if(bs->flags & BS_CHECKSUM) bitmap_test_and_set(bs->dirty, CRC_BLOCK(bs, block_id));
+        bitmap_test_and_set(bs->dirty, bs->fbm_blocks + block_id);
+    }
+}
+
+//Empties every magazine, for checkpoints that must not see parked blocks as taken
+//Only safe while no other thread is using the store, like the checkpoints themselves
+static void block_store_magazine_drain_all(const block_store_t *const bs)
+{
+    for(block_store_magazine_t *magazine = bs->magazines; magazine != NULL; magazine = magazine->next) {
+        block_store_magazine_drain(bs, magazine, 0);
+    }
+}
+
+//Pulls half a magazine of free blocks out of the FBM, lowest first
+static void block_store_magazine_refill(block_store_t *const bs, block_store_magazine_t *const magazine)
+{
+    size_t claimed[BLOCK_STORE_CACHE_SIZE / 2], count = 0, hint = block_store_home(bs);
+    while(count < BLOCK_STORE_CACHE_SIZE / 2) {
+        size_t block_id = bitmap_ffz_claim(bs->bitmap, hint);
+        if(block_id == SIZE_MAX) break;
+        bitmap_test_and_set(bs->cached, block_id);
+        block_store_mark_fbm(bs, block_id, 1);
+        claimed[count++] = block_id;
+        hint = block_id + 1;
+    }
+    //the magazine pops from the top, so the lowest block goes on last
+    while(count > 0) {
+        magazine->ids[magazine->count++] = claimed[--count];
+    }
+    MAGAZINE_COUNT(magazine->refills, 1);
+}
+
+//The calling thread's magazine for this store, made on first use, NULL if it can't be
+static block_store_magazine_t *block_store_magazine(block_store_t *const bs)
+{
+    block_store_magazine_t *magazine = pthread_getspecific(bs->magazine_key);
+    if(magazine == NULL) {
+        magazine = calloc(1, sizeof(block_store_magazine_t));
+        if(magazine == NULL) return NULL;
+        magazine->bs = bs;
+        if(pthread_setspecific(bs->magazine_key, magazine) != 0) {
+            free(magazine);
+            return NULL;
+        }
+        pthread_mutex_lock(&bs->magazine_lock);
+        magazine->next = bs->magazines;
+        if(bs->magazines != NULL) {
+            bs->magazines->prev = magazine;
+        }
+        bs->magazines = magazine;
+        pthread_mutex_unlock(&bs->magazine_lock);
+    }
+    return magazine;
+}
+
+//Thread exit: the parked blocks go back to the FBM and the counters into the store's totals
+static void block_store_magazine_exit(void *arg)
+{
+    block_store_magazine_t *magazine = arg;
+    block_store_t *bs = magazine->bs;
+    block_store_magazine_drain(bs, magazine, 0);
+
+    pthread_mutex_lock(&bs->magazine_lock);
+    bs->retired.hits += magazine->hits;
+    bs->retired.misses += magazine->misses;
+    bs->retired.refills += magazine->refills;
+    bs->retired.drains += magazine->drains;
+    if(magazine->prev != NULL) {
+        magazine->prev->next = magazine->next;
+    } else {
+        bs->magazines = magazine->next;
+    }
+    if(magazine->next != NULL) {
+        magazine->next->prev = magazine->prev;
+    }
+    pthread_mutex_unlock(&bs->magazine_lock);
+    free(magazine);
+}
+
+//Allocate for a thread-cached store, the FBM only sees a refill every BLOCK_STORE_CACHE_SIZE / 2 allocations
+static size_t block_store_cache_allocate(block_store_t *const bs, block_store_magazine_t *const magazine)
+{
+    if(magazine->count == 0) {
+        MAGAZINE_COUNT(magazine->misses, 1);
+        block_store_magazine_refill(bs, magazine);
+        if(magazine->count == 0) return SIZE_MAX;
+    } else {
+        MAGAZINE_COUNT(magazine->hits, 1);
+    }
+    size_t block_id = magazine->ids[--magazine->count];
+    bitmap_test_and_reset(bs->cached, block_id);
+    block_store_count_used(bs, 1);
+    return block_id;
+}
+
+//Release for a thread-cached store, the block stays taken in the FBM and gets parked in the magazine
+static void block_store_cache_release(block_store_t *const bs, block_store_magazine_t *const magazine, const size_t block_id)
+{
+    if(magazine->count == BLOCK_STORE_CACHE_SIZE) {
+        MAGAZINE_COUNT(magazine->misses, 1);
+        MAGAZINE_COUNT(magazine->drains, 1);
+        block_store_magazine_drain(bs, magazine, BLOCK_STORE_CACHE_SIZE / 2);
+    } else {
+        MAGAZINE_COUNT(magazine->hits, 1);
+    }
+    magazine->ids[magazine->count++] = block_id;
+    block_store_count_freed(bs, 1);
+}
+
+bool block_store_get_cache_stats(block_store_t *const bs, block_store_cache_stats_t *const stats)
+{
+    if(bs == NULL || stats == NULL || !(bs->flags & BS_THREAD_CACHE)) return false;
+
+    pthread_mutex_lock(&bs->magazine_lock);
+    *stats = bs->retired;
+    stats->cached = 0;
+    for(block_store_magazine_t *magazine = bs->magazines; magazine != NULL; magazine = magazine->next) {
+        stats->hits += __atomic_load_n(&magazine->hits, __ATOMIC_RELAXED);
+        stats->misses += __atomic_load_n(&magazine->misses, __ATOMIC_RELAXED);
+        stats->refills += __atomic_load_n(&magazine->refills, __ATOMIC_RELAXED);
+        stats->drains += __atomic_load_n(&magazine->drains, __ATOMIC_RELAXED);
+        stats->cached += __atomic_load_n(&magazine->count, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&bs->magazine_lock);
+    return true;
+}
+
+//Yuto Wada
+size_t block_store_allocate(block_store_t *const bs)
+{
+    //If bs is NULL, return SIZE_MAX (Stated in the test cases)
+    if (bs == NULL || (bs->flags & BS_READONLY)){
+        return SIZE_MAX;
+    }
+    if (bs->flags & BS_THREAD_CACHE){
+        block_store_magazine_t *magazine = block_store_magazine(bs);
+        if (magazine != NULL){
+            return block_store_cache_allocate(bs, magazine);
+        }
+    }
+    if (bs->flags & BS_THREAD_SAFE){
+        //lock-free, threads start in different shards and only meet once those fill up
+        size_t block_id = bitmap_ffz_claim(bs->bitmap, block_store_home(bs));
+        if (block_id != SIZE_MAX){
+            block_store_count_used(bs, 1);
+            block_store_mark_fbm(bs, block_id, 1);
+        }
+        return block_id;
+    }
+
+    //Find the free block the policy wants
+    size_t adressZero = block_store_find_free(bs, 1);
+
+
+    if (adressZero == SIZE_MAX || adressZero >= bs->avail_blocks) {
+        return SIZE_MAX;
+    }
+
+    //Set the bs to where the first zero is.
+    bitmap_set(bs->bitmap, adressZero);
+    block_store_count_used(bs, 1);
+    block_store_mark_fbm(bs, adressZero, 1);
+    bs->cursor = adressZero + 1;
+    return adressZero;
+}
+
+size_t block_store_allocate_near(block_store_t *const bs, const size_t hint)
+{
+    if(bs == NULL || (bs->flags & BS_READONLY)) return SIZE_MAX;
+
+    //first free block from the hint on, wrapping around like next-fit
+    size_t block_id;
+    if(bs->flags & BS_THREAD_SAFE) {
+        block_id = bitmap_ffz_claim(bs->bitmap, hint);
+    } else {
+        block_id = bitmap_ffz_from(bs->bitmap, hint);
+        if(block_id == SIZE_MAX) {
+            block_id = bitmap_ffz(bs->bitmap);
+        }
+        if(block_id != SIZE_MAX) {
+            bitmap_set(bs->bitmap, block_id);
+        }
+    }
+    if(block_id == SIZE_MAX) return SIZE_MAX;
+
+    block_store_count_used(bs, 1);
+    block_store_mark_fbm(bs, block_id, 1);
+    return block_id;
+}
+
+bool block_store_set_policy(block_store_t *const bs, const block_store_policy_t policy)
+{
+    if(bs == NULL) return false;
+    if(policy != BLOCK_STORE_FIRST_FIT && policy != BLOCK_STORE_NEXT_FIT && policy != BLOCK_STORE_BEST_FIT) return false;
+    __atomic_store_n(&bs->policy, policy, __ATOMIC_RELAXED);
+    return true;
+}
+
+//Yuto Wada
+bool block_store_request(block_store_t *const bs, const size_t block_id)
+{
+    if(bs == NULL || (block_id >= bs->avail_blocks) || (bs->flags & BS_READONLY)) {
+        return 0;
+    }
+
+    //If the bit is already set, exit, otherwise it is ours now
+    if(!block_store_fbm_claim(bs, block_id)) {
+        return 0; 
+    }
+    block_store_count_used(bs, 1);
+    block_store_mark_fbm(bs, block_id, 1);
+
+    return 1;
+}
+
+//Yuto Wada
+void block_store_release(block_store_t *const bs, const size_t block_id)
+{
+    //checks if the block store is null and the block exists
+    if(bs != NULL && block_id < bs->avail_blocks && !(bs->flags & BS_READONLY)){
+        block_store_magazine_t *magazine = (bs->flags & BS_THREAD_CACHE) ? block_store_magazine(bs) : NULL;
+
+        //pinned blocks stay put until every borrow has been returned,
+        //the shard lock keeps a borrow from slipping in between the check and the reset
+        block_store_lock_shard(bs, SHARD_OF(bs, block_id));
+        //a thread-cached store parks the block instead, as long as it really was handed out
+        if(magazine != NULL) {
+            bool parked = bs->pins[block_id] == 0 && bitmap_test(bs->bitmap, block_id)
+                && !bitmap_test_and_set(bs->cached, block_id);
+            block_store_unlock_shard(bs, SHARD_OF(bs, block_id));
+            if(parked) {
+                block_store_cache_release(bs, magazine, block_id);
+            }
+            return;
+        }
+        //resets the bit representing the selected block
+        bool freed = bs->pins[block_id] == 0 && block_store_fbm_unclaim(bs, block_id);
+        block_store_unlock_shard(bs, SHARD_OF(bs, block_id));
+
+        if(freed) {
+            block_store_count_freed(bs, 1);
+            block_store_mark_fbm(bs, block_id, 1);
+            if(bs->dedup != NULL) block_store_dedup_drop(bs, block_id);
+        }
+    }
+    return;
+}
+
+bool block_store_allocate_extent(block_store_t *const bs, const size_t count, size_t *const first)
+{
+    if(bs == NULL || first == NULL || count == 0) return false;
+    if(bs->flags & BS_READONLY) return false;
+
+    //a run of count free blocks in a row, wherever the policy puts it
+    //if another thread beats us to part of it, look again
+    size_t start;
+    do {
+        start = block_store_find_free(bs, count);
+        if(start == SIZE_MAX) return false;
+    } while(!block_store_claim_run(bs, start, count));
+
+    __atomic_store_n(&bs->cursor, start + count, __ATOMIC_RELAXED);
+    block_store_count_used(bs, count);
+    block_store_mark_fbm(bs, start, count);
+    *first = start;
+    return true;
+}
+
+void block_store_release_extent(block_store_t *const bs, const size_t first, const size_t count)
+{
+    if(bs == NULL || count == 0 || first >= bs->avail_blocks || count > bs->avail_blocks - first) return;
+    if(bs->flags & BS_READONLY) return;
+
+    //same as releasing them one by one, pinned blocks stay allocated
+    size_t freed = 0;
+    if(bs->flags & BS_THREAD_SAFE) {
+        for(size_t block_id = first; block_id < first + count; block_id++) {
+            block_store_lock_shard(bs, SHARD_OF(bs, block_id));
+            freed += bs->pins[block_id] == 0 && block_store_fbm_unclaim(bs, block_id);
+            block_store_unlock_shard(bs, SHARD_OF(bs, block_id));
+        }
+    } else {
+        size_t run = first;
+        for(size_t block_id = first; block_id < first + count; block_id++) {
+            if(bs->pins[block_id] == 0) {
+                const bool used = bitmap_test(bs->bitmap, block_id);
+                if(used && bs->dedup != NULL) block_store_dedup_drop(bs, block_id);
+                freed += used;
+            } else {
+                if(block_id > run) {
+                    bitmap_reset_range(bs->bitmap, run, block_id - run);
+                }
+                run = block_id + 1;
+            }
+        }
+        if(first + count > run) {
+            bitmap_reset_range(bs->bitmap, run, first + count - run);
+        }
+    }
+
+    block_store_count_freed(bs, freed);
+    block_store_mark_fbm(bs, first, count);
+}
+
+size_t block_store_allocate_batch(block_store_t *const bs, const size_t n, size_t *const block_ids)
+{
+    if(bs == NULL || block_ids == NULL || (bs->flags & BS_READONLY)) return 0;
+
+    //a thread-safe store claims them one at a time, each claim picking up where the last one left off
+    if(bs->flags & BS_THREAD_SAFE) {
+        size_t claimed = 0, hint = block_store_home(bs);
+        for(; claimed < n; claimed++) {
+            block_ids[claimed] = bitmap_ffz_claim(bs->bitmap, hint);
+            if(block_ids[claimed] == SIZE_MAX) break;
+            block_store_mark_fbm(bs, block_ids[claimed], 1);
+            hint = block_ids[claimed] + 1;
+        }
+        block_store_count_used(bs, claimed);
+        return claimed;
+    }
+
+    //one pass over the FBM instead of an ffz from block 0 per block
+    size_t claimed = bitmap_claim_zeros(bs->bitmap, n, block_ids);
+    if(claimed == 0) return 0;
+    block_store_count_used(bs, claimed);
+
+    //the ids come back sorted, so they are marked a run of consecutive ids at a time
+    for(size_t start = 0, i = 1; i <= claimed; i++) {
+        if(i == claimed || block_ids[i] != block_ids[i - 1] + 1) {
+            block_store_mark_fbm(bs, block_ids[start], i - start);
+            start = i;
+        }
+    }
+    return claimed;
+}
+
+void block_store_release_batch(block_store_t *const bs, const size_t *const block_ids, const size_t n)
+{
+    if(bs == NULL || block_ids == NULL || (bs->flags & BS_READONLY)) return;
+
+    size_t freed = 0;
+    for(size_t i = 0; i < n; i++) {
+        size_t block_id = block_ids[i];
+        if(block_id >= bs->avail_blocks) continue;
+
+        block_store_lock_shard(bs, SHARD_OF(bs, block_id));
+        bool release = bs->pins[block_id] == 0 && block_store_fbm_unclaim(bs, block_id);
+        block_store_unlock_shard(bs, SHARD_OF(bs, block_id));
+
+        if(release) {
+            block_store_mark_fbm(bs, block_id, 1);
+            if(bs->dedup != NULL) block_store_dedup_drop(bs, block_id);
+            freed++;
+        }
+    }
+    block_store_count_freed(bs, freed);
+}
+
+size_t block_store_get_used_blocks(const block_store_t *const bs)
+{
+    //checks if the block store is null
+    if(bs != NULL) {
+        //returns the count of set bits kept alongside the bitmap
+        return __atomic_load_n(&bs->used_blocks, __ATOMIC_RELAXED);
+    }
+    //returns zero if the block store is null
+    return SIZE_MAX;
+}
+
+size_t block_store_get_stored_blocks(const block_store_t *const bs)
+{
+    if(bs == NULL) return SIZE_MAX;
+    //one per distinct block that isn't zeroed
+    if(bs->dedup != NULL) return bs->dedup->used;
+    return __atomic_load_n(&bs->used_blocks, __ATOMIC_RELAXED);
+}
+
+size_t block_store_get_free_blocks(const block_store_t *const bs)
+{
+    //checks if the block store is null
+    if(bs != NULL) {
+        //returns the number of unset bits in the block store's bitmap by subtracting the set bits from the total bits
+        return bs->avail_blocks - __atomic_load_n(&bs->used_blocks, __ATOMIC_RELAXED);
+    }
+    //returns zero if the block store is null
+    return SIZE_MAX; 
+}
+
+//Yuto Wada
+size_t block_store_get_total_blocks()
+{
+    //returns the constant that represents the total blocks in the block store
+    return BLOCK_STORE_AVAIL_BLOCKS;
+}
+
+size_t block_store_get_avail_blocks(const block_store_t *const bs)
+{
+    if(bs == NULL) return SIZE_MAX;
+    return bs->avail_blocks;
+}
+
+size_t block_store_get_num_blocks(const block_store_t *const bs)
+{
+    if(bs == NULL) return SIZE_MAX;
+    return bs->num_blocks;
+}
+
+size_t block_store_get_block_size(const block_store_t *const bs)
+{
+    if(bs == NULL) return SIZE_MAX;
+    return bs->block_size;
+}
+
+static void block_store_snapshot_copy_out(const block_store_t *const snapshot, const size_t pos, const size_t offset, void *buffer, const size_t len);
+
+//Copies a span out of one block, and the block's checksum with it if sum isn't NULL
+//In a thread-safe store this is a seqlock read: readers never block each other or the writer,
+//they just go again if a write got in while they were copying
+static void block_store_copy_out_sum(const block_store_t *const bs, const size_t block_id, const size_t offset, void *buffer, const size_t len, uint32_t *const sum)
+{
+    if(bs->origin != NULL) {
+        const size_t pos = block_store_position(bs, block_id);
+        if(pos == SIZE_MAX) {
+            memset(buffer, 0, len);
+        } else {
+            block_store_snapshot_copy_out(bs, pos, offset, buffer, len);
+        }
+        //a snapshot's checksums are its own, nothing changes them
+        if(sum != NULL) *sum = bs->crc[block_id];
+        return;
+    }
+    if(!(bs->flags & BS_THREAD_SAFE)) {
+        memcpy(buffer, block_store_source(bs, block_id) + offset, len);
+        if(sum != NULL) *sum = bs->crc[block_id];
+        return;
+    }
+    uint32_t *seq = &bs->seq[block_id];
+    for(;;) {
+        uint32_t before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if(before & 1) {
+            sched_yield();
+            continue;
+        }
+        block_store_load_words(buffer, BLOCK_PTR(bs, block_id) + offset, len);
+        if(sum != NULL) *sum = __atomic_load_n(&bs->crc[block_id], __ATOMIC_RELAXED);
+        //the copy has to be done before the second look at the counter
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(seq, __ATOMIC_RELAXED) == before) {
+            return;
+        }
+    }
+}
+
+static void block_store_copy_out(const block_store_t *const bs, const size_t block_id, const size_t offset, void *buffer, const size_t len)
+{
+    block_store_copy_out_sum(bs, block_id, offset, buffer, len, NULL);
+}
+
+//Copies a span of one user block (a slot, if deduplicating) of a snapshot: out of its own arena once it has been
+//copied there, out of the origin until then, through the origin's seqlock if it has them
+//A write to the origin copies the block over before changing it, so a copy out of the origin only counts
+//if the block still hasn't been copied afterwards, and a writer holding the seqlock means it already has been:
+//the reader goes to the arena instead of waiting on writers that may never let up
+static void block_store_snapshot_copy_out(const block_store_t *const snapshot, const size_t pos, const size_t offset, void *buffer, const size_t len)
+{
+    const block_store_t *origin = snapshot->origin;
+    if(origin != NULL && !(origin->flags & BS_THREAD_SAFE)) {
+        if(!bitmap_test(snapshot->copied, pos)) {
+            memcpy(buffer, BLOCK_PTR(origin, pos) + offset, len);
+            return;
+        }
+    } else if(origin != NULL) {
+        uint32_t *seq = &origin->seq[pos];
+        while(!bitmap_test(snapshot->copied, pos)) {
+            uint32_t before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+            if(before & 1) {
+                sched_yield();
+                continue;
+            }
+            block_store_load_words(buffer, BLOCK_PTR(origin, pos) + offset, len);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(__atomic_load_n(seq, __ATOMIC_RELAXED) == before && !bitmap_test(snapshot->copied, pos)) return;
+        }
+    }
+    //pairs with the bit going up after the copy in block_store_snapshot_keep
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(snapshot->flags & BS_THREAD_SAFE) {
+        block_store_load_words(buffer, BLOCK_PTR(snapshot, pos) + offset, len);
+    } else {
+        memcpy(buffer, BLOCK_PTR(snapshot, pos) + offset, len);
+    }
+}
+
+//Copies a device block out while writers carry on: user blocks through their seqlock, FBM blocks a word at a time
+//A snapshot's user blocks may still be in its origin, everything else is copied as it is in the arena,
+//a deduplicated store's slots included
+static void block_store_copy_device_block(const block_store_t *const bs, const size_t block, char *const buf)
+{
+    if(block >= bs->fbm_blocks && bs->origin != NULL) {
+        block_store_snapshot_copy_out(bs, block - bs->fbm_blocks, 0, buf, bs->block_size);
+    } else if(block >= bs->fbm_blocks && (bs->flags & BS_THREAD_SAFE)) {
+        block_store_copy_out(bs, block - bs->fbm_blocks, 0, buf, bs->block_size);
+    } else {
+        block_store_load_words(buf, bs->data + block * bs->block_size, bs->block_size);
+    }
+}
+
+//Copies a metadata block out for an image that leaves free blocks zeroed (compressed, sparse and incremental ones)
+//A free block keeps its bytes and checksum in the store, so in the image its checksum becomes a zeroed block's
+static void block_store_image_meta(const block_store_t *const bs, const size_t block, char *const buf)
+{
+    block_store_copy_device_block(bs, block, buf);
+    if(!(bs->flags & BS_CHECKSUM)) return;
+    //checksums are 4-byte aligned and block sizes powers of two, none of them straddles two blocks
+    const size_t start = block * bs->block_size, end = start + bs->block_size;
+    const size_t crc_start = CRC_OFFSET(bs), crc_end = crc_start + bs->avail_blocks * sizeof(uint32_t);
+    if(end <= crc_start || start >= crc_end) return;
+    const size_t first = start > crc_start ? (start - crc_start) / sizeof(uint32_t) : 0;
+    const size_t last = end < crc_end ? (end - crc_start) / sizeof(uint32_t) : bs->avail_blocks;
+    for(size_t block_id = first; block_id < last; block_id++) {
+        if(!bitmap_test(bs->bitmap, block_id)) {
+            memcpy(buf + crc_start + block_id * sizeof(uint32_t) - start, &bs->zero_crc, sizeof(uint32_t));
+        }
+    }
+}
+
+//Takes a block's seqlock for writing, only in thread-safe stores
+//The writer takes the counter from even to odd, so writers of the same block take turns and readers
+//know to wait, then block_store_write_end bumps it back to even
+static uint32_t block_store_write_begin(const block_store_t *const bs, const size_t block_id)
+{
+    uint32_t *seq = &bs->seq[block_id];
+    uint32_t current = __atomic_load_n(seq, __ATOMIC_RELAXED);
+    while((current & 1) || !__atomic_compare_exchange_n(seq, &current, current + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        if(current & 1) {
+            sched_yield();
+            current = __atomic_load_n(seq, __ATOMIC_RELAXED);
+        }
+    }
+    return current;
+}
+
+static void block_store_write_end(const block_store_t *const bs, const size_t block_id, const uint32_t current)
+{
+    __atomic_store_n(&bs->seq[block_id], current + 2, __ATOMIC_RELEASE);
+}
+
+//Checksum of a user block as it sits in the arena, only with the block's writer side to itself
+static uint32_t block_store_sum_block(const block_store_t *const bs, const size_t block_id)
+{
+    return crc32c(0, BLOCK_PTR(bs, block_id), bs->block_size);
+}
+
+//Copies a span into one block, and brings a checksummed block's checksum up to date
+static void block_store_copy_in(block_store_t *const bs, const size_t block_id, const size_t offset, const void *buffer, const size_t len)
+{
+    //a whole block is summed from the caller's copy, before any reader has to wait on it
+    const bool whole = offset == 0 && len == bs->block_size;
+    const uint32_t sum = (bs->flags & BS_CHECKSUM) && whole ? crc32c(0, buffer, len) : 0;
+    if(!(bs->flags & BS_THREAD_SAFE)) {
+        block_store_preserve(bs, block_id);
+        memcpy(BLOCK_PTR(bs, block_id) + offset, buffer, len);
+        if(bs->flags & BS_CHECKSUM) bs->crc[block_id] = whole ? sum : block_store_sum_block(bs, block_id);
+        return;
+    }
+    const uint32_t current = block_store_write_begin(bs, block_id);
+    block_store_preserve(bs, block_id);
+    block_store_store_words(BLOCK_PTR(bs, block_id) + offset, buffer, len);
+    if(bs->flags & BS_CHECKSUM) {
+        __atomic_store_n(&bs->crc[block_id], whole ? sum : block_store_sum_block(bs, block_id), __ATOMIC_RELAXED);
+    }
+    block_store_write_end(bs, block_id, current);
+}
+
+//Tells whether a block's checksum is held to, see block_store_check
+static bool block_store_checked(const block_store_t *const bs, const size_t block_id)
+{
+    return bitmap_test(bs->bitmap, block_id) && !bitmap_test(bs->borrowed_mut, block_id);
+}
+
+//Tells whether a copy of a whole user block matches the checksum read along with it
+//Free blocks hold nothing anyone can count on (block_store_serialize_incremental leaves them as holes),
+//and a mutable borrower can be halfway through a block, its checksum catches up on return
+static bool block_store_check(const block_store_t *const bs, const size_t block_id, const void *const copy, const uint32_t sum)
+{
+    if(!block_store_checked(bs, block_id)) return true;
+    return crc32c(0, copy, bs->block_size) == sum;
+}
+
+//Copies a whole block out, false if it doesn't match its checksum
+static bool block_store_copy_out_checked(const block_store_t *const bs, const size_t block_id, void *buffer)
+{
+    if(!(bs->flags & BS_CHECKSUM)) {
+        block_store_copy_out(bs, block_id, 0, buffer, bs->block_size);
+        return true;
+    }
+    uint32_t sum;
+    block_store_copy_out_sum(bs, block_id, 0, buffer, bs->block_size, &sum);
+    return block_store_check(bs, block_id, buffer, sum);
+}
+
+//Copies a span of a block out, false if the whole block doesn't match its checksum
+//The checksum covers the whole block, which goes through a stack buffer a piece at a time rather than
+//into a block-sized one: the sum is carried from piece to piece and the span is kept on the way past.
+//A thread-safe store reads every piece in one go under the seqlock, so they all come from the same write.
+static bool block_store_pread_checked(const block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, void *buffer)
+{
+    char piece[BLOCK_STORE_CHECK_PIECE];
+    //a snapshot's blocks never change under it, piece by piece is as good as all at once
+    const bool seqlocked = bs->origin == NULL && (bs->flags & BS_THREAD_SAFE);
+    for(;;) {
+        const uint32_t before = seqlocked ? __atomic_load_n(&bs->seq[block_id], __ATOMIC_ACQUIRE) : 0;
+        if(before & 1) {
+            sched_yield();
+            continue;
+        }
+        uint32_t crc = 0, sum = 0;
+        for(size_t at = 0; at < bs->block_size; at += sizeof(piece)) {
+            const size_t bytes = bs->block_size - at < sizeof(piece) ? bs->block_size - at : sizeof(piece);
+            if(seqlocked) {
+                block_store_load_words(piece, BLOCK_PTR(bs, block_id) + at, bytes);
+            } else {
+                block_store_copy_out_sum(bs, block_id, at, piece, bytes, &sum);
+            }
+            crc = crc32c(crc, piece, bytes);
+            //whatever part of the span falls in this piece
+            const size_t from = offset > at ? offset : at;
+            const size_t to = offset + len < at + bytes ? offset + len : at + bytes;
+            if(from < to) memcpy((char *)buffer + (from - offset), piece + (from - at), to - from);
+        }
+        if(seqlocked) {
+            sum = __atomic_load_n(&bs->crc[block_id], __ATOMIC_RELAXED);
+            //the pieces have to be done before the second look at the counter
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(__atomic_load_n(&bs->seq[block_id], __ATOMIC_RELAXED) != before) continue;
+        }
+        return !block_store_checked(bs, block_id) || crc == sum;
+    }
+}
+
+//Micah 
+size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer)
+{
+
+    //error checking
+    if(bs == NULL) return 0;
+    if(block_id >= bs->avail_blocks) return 0;
+    if(buffer == NULL) return 0;
+
+    if(!block_store_copy_out_checked(bs, block_id, buffer)) return 0;
+    return bs->block_size;
+}
+
+
+//Micah
+size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer)
+{    
+    // error checking
+    if(bs == NULL) return 0;
+    if(block_id >= bs->avail_blocks) return 0;
+    if(buffer == NULL) return 0;
+    if(bs->flags & BS_READONLY) return 0;
+
+    //a deduplicating store looks for the same bytes first
+    if(bs->dedup != NULL) {
+        block_store_dedup_write(bs, block_id, buffer);
+        return bs->block_size;
+    }
+  
+    // copy the buffer into the block
+    block_store_copy_in(bs, block_id, 0, buffer, bs->block_size);
+    block_store_mark_written(bs, block_id, 1);
+
+    //a journaled store only returns once the block is in the journal
+    if(bs->journal != NULL && !block_store_journal_commit(bs)) return 0;
+    return bs->block_size;
+}
+
+size_t block_store_pread(const block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, void *buffer)
+{
+    //error checking, the span has to stay inside the block
+    if(bs == NULL) return 0;
+    if(block_id >= bs->avail_blocks) return 0;
+    if(len == 0 || offset >= bs->block_size || len > bs->block_size - offset) return 0;
+    if(buffer == NULL) return 0;
+
+    if(bs->flags & BS_CHECKSUM) {
+        return block_store_pread_checked(bs, block_id, offset, len, buffer) ? len : 0;
+    }
+    block_store_copy_out(bs, block_id, offset, buffer, len);
+    return len;
+}
+
+size_t block_store_pwrite(block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, const void *buffer)
+{
+    //error checking, the span has to stay inside the block
+    if(bs == NULL) return 0;
+    if(block_id >= bs->avail_blocks) return 0;
+    if(len == 0 || offset >= bs->block_size || len > bs->block_size - offset) return 0;
+    if(buffer == NULL) return 0;
+    if(bs->flags & BS_READONLY) return 0;
+
+    //a deduplicating store keeps whole blocks, the rest of this one comes from what it holds now
+    //(never thread-safe, so the one scratch block is enough)
+    if(bs->dedup != NULL) {
+        char *block = bs->dedup->scratch;
+        memcpy(block, block_store_source(bs, block_id), bs->block_size);
+        memcpy(block + offset, buffer, len);
+        block_store_dedup_write(bs, block_id, block);
+        return len;
+    }
+
+    //only the bytes asked for, the rest of the block is left alone
+    block_store_copy_in(bs, block_id, offset, buffer, len);
+    block_store_mark_written(bs, block_id, 1);
+    if(bs->journal != NULL && !block_store_journal_commit(bs)) return 0;
+    return len;
+}
+
+//Makes sure a snapshot has its own copy of a user block to hand out, the origin's can still change
+static const void *block_store_snapshot_pin(block_store_t *const snapshot, const size_t block_id)
+{
+    const size_t pos = block_store_position(snapshot, block_id);
+    if(pos == SIZE_MAX) return snapshot->dedup->zero;
+    block_store_t *origin = snapshot->origin;
+    if(!bitmap_test(snapshot->copied, pos)) {
+        //copied the way a write to the origin would, so writers of the block wait for it
+        if(origin->flags & BS_THREAD_SAFE) {
+            const uint32_t current = block_store_write_begin(origin, pos);
+            block_store_snapshot_keep(origin, snapshot, pos);
+            block_store_write_end(origin, pos, current);
+        } else {
+            block_store_snapshot_keep(origin, snapshot, pos);
+        }
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return BLOCK_PTR(snapshot, pos);
+}
+
+const void *block_store_borrow(block_store_t *const bs, const size_t block_id)
+{
+    if(bs == NULL) return NULL;
+    if(block_id >= bs->avail_blocks) return NULL;
+
+    //pins live with the FBM bits they guard against release
+    block_store_lock_shard(bs, SHARD_OF(bs, block_id));
+    bool pinned = bs->pins[block_id] != UINT32_MAX;
+    if(pinned) {
+        bs->pins[block_id]++;
+    }
+    block_store_unlock_shard(bs, SHARD_OF(bs, block_id));
+    if(!pinned) return NULL;
+    if(bs->origin != NULL) return block_store_snapshot_pin(bs, block_id);
+    //a deduplicated block gets a slot to itself for as long as it is borrowed, unless nothing can change it
+    if(bs->dedup != NULL) {
+        return (bs->flags & BS_READONLY) ? block_store_source(bs, block_id) : block_store_dedup_pin(bs, block_id);
+    }
+    return BLOCK_PTR(bs, block_id);
+}
+
+void *block_store_borrow_mut(block_store_t *const bs, const size_t block_id)
+{
+    if(bs == NULL) return NULL;
+    if(block_id >= bs->avail_blocks) return NULL;
+    if(bs->flags & BS_READONLY) return NULL;
+
+    block_store_lock_shard(bs, SHARD_OF(bs, block_id));
+    bool pinned = bs->pins[block_id] != UINT32_MAX;
+    if(pinned) {
+        bs->pins[block_id]++;
+        bitmap_set(bs->borrowed_mut, block_id);
+    }
+    block_store_unlock_shard(bs, SHARD_OF(bs, block_id));
+    if(!pinned) return NULL;
+
+    if(bs->dedup != NULL) return block_store_dedup_pin(bs, block_id);
+    //the borrower changes it without a word to anyone, snapshots need their copies now
+    if(bs->snapshots != NULL) {
+        if(bs->flags & BS_THREAD_SAFE) {
+            const uint32_t current = block_store_write_begin(bs, block_id);
+            block_store_preserve(bs, block_id);
+            block_store_write_end(bs, block_id, current);
+        } else {
+            block_store_preserve(bs, block_id);
+        }
+    }
+    block_store_mark_written(bs, block_id, 1);
+    return BLOCK_PTR(bs, block_id);
+}
+
+bool block_store_return(block_store_t *const bs, const size_t block_id)
+{
+    if(bs == NULL || block_id >= bs->avail_blocks) return false;
+
+    block_store_lock_shard(bs, SHARD_OF(bs, block_id));
+    if(bs->pins[block_id] == 0) {
+        block_store_unlock_shard(bs, SHARD_OF(bs, block_id));
+        return false;
+    }
+    //the borrower may have written to it since it was handed out, possibly after a checkpoint
+    bool written = bitmap_test(bs->borrowed_mut, block_id);
+    //the checksum has to be right again before reads start checking it, that is before the borrow bit goes
+    //(a deduplicating store sorts out the checksum along with the slot once the last borrow is back)
+    if(written && (bs->flags & BS_CHECKSUM) && bs->dedup == NULL) {
+        if(bs->flags & BS_THREAD_SAFE) {
+            const uint32_t current = block_store_write_begin(bs, block_id);
+            __atomic_store_n(&bs->crc[block_id], block_store_sum_block(bs, block_id), __ATOMIC_RELAXED);
+            block_store_write_end(bs, block_id, current);
+        } else {
+            bs->crc[block_id] = block_store_sum_block(bs, block_id);
+        }
+    }
+    const bool last = --bs->pins[block_id] == 0;
+    if(last) {
+        bitmap_reset(bs->borrowed_mut, block_id);
+    }
+    block_store_unlock_shard(bs, SHARD_OF(bs, block_id));
+
+    if(bs->dedup != NULL) {
+        if(last && !(bs->flags & BS_READONLY)) block_store_dedup_settle(bs, block_id);
+        return true;
+    }
+    if(written) {
+        block_store_mark_written(bs, block_id, 1);
+        //the borrow is back either way, but the caller has to hear the change didn't make it into the journal
+        if(bs->journal != NULL) return block_store_journal_commit(bs);
+    }
+    return true;
+}
+
+//Checks a whole batch of block ids up front so vectored calls are all or nothing
+static bool block_store_valid_ids(const block_store_t *const bs, const size_t *const block_ids, const struct iovec *const iov, const size_t count)
+{
+    if(block_ids == NULL || iov == NULL || count == 0) return false;
+    for(size_t i = 0; i < count; i++) {
+        if(block_ids[i] >= bs->avail_blocks || iov[i].iov_base == NULL || iov[i].iov_len < bs->block_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//Length of the run starting at i where both the block ids and the buffers are back to back,
+//so the whole run is one memcpy against the arena
+static size_t block_store_iov_run(const block_store_t *const bs, const size_t *const block_ids, const struct iovec *const iov, const size_t i, const size_t count)
+{
+    size_t run = 1;
+    while(i + run < count && block_ids[i + run] == block_ids[i] + run
+        && (char *)iov[i + run].iov_base == (char *)iov[i].iov_base + run * bs->block_size) {
+        run++;
+    }
+    return run;
+}
+
+size_t block_store_readv(const block_store_t *const bs, const size_t *const block_ids, const struct iovec *const iov, const size_t count)
+{
+    if(bs == NULL) return 0;
+    if(!block_store_valid_ids(bs, block_ids, iov, count)) return 0;
+
+    //each block is read on its own in a thread-safe store, so none of them can come back torn,
+    //and in a deduplicating one or a snapshot, where they are wherever their slots or copies are
+    if((bs->flags & (BS_THREAD_SAFE | BS_DEDUP)) || bs->origin != NULL) {
+        for(size_t i = 0; i < count; i++) {
+            if(!block_store_copy_out_checked(bs, block_ids[i], iov[i].iov_base)) return 0;
+        }
+        return count * bs->block_size;
+    }
+    for(size_t i = 0; i < count;) {
+        size_t run = block_store_iov_run(bs, block_ids, iov, i, count);
+        memcpy(iov[i].iov_base, BLOCK_PTR(bs, block_ids[i]), run * bs->block_size);
+        i += run;
+    }
+    if(bs->flags & BS_CHECKSUM) {
+        for(size_t i = 0; i < count; i++) {
+            if(!block_store_check(bs, block_ids[i], iov[i].iov_base, bs->crc[block_ids[i]])) return 0;
+        }
+    }
+    return count * bs->block_size;
+}
+
+size_t block_store_writev(block_store_t *const bs, const size_t *const block_ids, const struct iovec *const iov, const size_t count)
+{
+    if(bs == NULL) return 0;
+    if(bs->flags & BS_READONLY) return 0;
+    if(!block_store_valid_ids(bs, block_ids, iov, count)) return 0;
+
+    if(bs->dedup != NULL) {
+        for(size_t i = 0; i < count; i++) {
+            block_store_dedup_write(bs, block_ids[i], iov[i].iov_base);
+        }
+        return count * bs->block_size;
+    }
+    if(bs->flags & BS_THREAD_SAFE) {
+        for(size_t i = 0; i < count; i++) {
+            block_store_copy_in(bs, block_ids[i], 0, iov[i].iov_base, bs->block_size);
+            block_store_mark_written(bs, block_ids[i], 1);
+        }
+        //the whole batch goes into the journal as one transaction
+        if(bs->journal != NULL && !block_store_journal_commit(bs)) return 0;
+        return count * bs->block_size;
+    }
+    for(size_t i = 0; i < count;) {
+        size_t run = block_store_iov_run(bs, block_ids, iov, i, count);
+        block_store_preserve_range(bs, block_ids[i], run);
+        memcpy(BLOCK_PTR(bs, block_ids[i]), iov[i].iov_base, run * bs->block_size);
+        block_store_mark_written(bs, block_ids[i], run);
+        i += run;
+    }
+    if(bs->flags & BS_CHECKSUM) {
+        for(size_t i = 0; i < count; i++) {
+            bs->crc[block_ids[i]] = crc32c(0, iov[i].iov_base, bs->block_size);
+        }
+    }
+    return count * bs->block_size;
+}
+
+size_t block_store_read_range(const block_store_t *const bs, const size_t first, const size_t count, void *buffer)
+{
+    if(bs == NULL) return 0;
+    if(count == 0 || first >= bs->avail_blocks || count > bs->avail_blocks - first) return 0;
+    if(buffer == NULL) return 0;
+
+    //each block is read on its own in a thread-safe store, so none of them can come back torn,
+    //and in a deduplicating one or a snapshot, where they are wherever their slots or copies are
+    if((bs->flags & (BS_THREAD_SAFE | BS_DEDUP)) || bs->origin != NULL) {
+        for(size_t i = 0; i < count; i++) {
+            if(!block_store_copy_out_checked(bs, first + i, (char *)buffer + i * bs->block_size)) return 0;
+        }
+        return count * bs->block_size;
+    }
+
+    //the blocks sit back to back in the arena, so this is one copy
+    memcpy(buffer, BLOCK_PTR(bs, first), count * bs->block_size);
+    if(bs->flags & BS_CHECKSUM) {
+        for(size_t i = 0; i < count; i++) {
+            if(!block_store_check(bs, first + i, (char *)buffer + i * bs->block_size, bs->crc[first + i])) return 0;
+        }
+    }
+    return count * bs->block_size;
+}
+
+size_t block_store_write_range(block_store_t *const bs, const size_t first, const size_t count, const void *buffer)
+{
+    if(bs == NULL) return 0;
+    if(count == 0 || first >= bs->avail_blocks || count > bs->avail_blocks - first) return 0;
+    if(buffer == NULL) return 0;
+    if(bs->flags & BS_READONLY) return 0;
+
+    if(bs->dedup != NULL) {
+        for(size_t i = 0; i < count; i++) {
+            block_store_dedup_write(bs, first + i, (const char *)buffer + i * bs->block_size);
+        }
+        return count * bs->block_size;
+    }
+    if(bs->flags & BS_THREAD_SAFE) {
+        for(size_t i = 0; i < count; i++) {
+            block_store_copy_in(bs, first + i, 0, (const char *)buffer + i * bs->block_size, bs->block_size);
+        }
+    } else {
+        block_store_preserve_range(bs, first, count);
+        memcpy(BLOCK_PTR(bs, first), buffer, count * bs->block_size);
+        if(bs->flags & BS_CHECKSUM) {
+            for(size_t i = 0; i < count; i++) {
+                bs->crc[first + i] = crc32c(0, (const char *)buffer + i * bs->block_size, bs->block_size);
+            }
+        }
+    }
+    block_store_mark_written(bs, first, count);
+    if(bs->journal != NULL && !block_store_journal_commit(bs)) return 0;
+    return count * bs->block_size;
+}
+
+bool block_store_set_io_depth(block_store_t *const bs, const size_t depth)
+{
+    if(bs == NULL) return false;
+    if(depth == 0 || depth > BLOCK_IO_MAX_DEPTH) return false;
+
+    //the engine has its depth baked in, the next async read makes a new one
+    block_io_destroy(bs->io);
+    bs->io = NULL;
+    bs->io_depth = depth;
+    return true;
+}
+
+bool block_store_read_async(block_store_t *const bs, const size_t block_id, void *buffer, block_io_callback_t callback, void *const arg)
+{
+    if(bs == NULL) return false;
+    if(block_id >= bs->avail_blocks) return false;
+    if(buffer == NULL) return false;
+
+    if(bs->io == NULL) {
+        bs->io = block_io_create(bs->io_depth, 0);
+        if(bs->io == NULL) return false;
+    }
+
+    //a mapped store's blocks can come straight from the file, without faulting the thread on a cold page
+    //the mapping is shared, so the file already has every write made through the arena
+    //thread-safe stores copy through the seqlock instead, the file knows nothing about it,
+    //and checksummed ones so the block can be checked before the callback hears about it
+    //a deduplicated block is wherever its slot is, the copy knows where that is
+    if((bs->flags & BS_MAPPED) && !(bs->flags & (BS_THREAD_SAFE | BS_CHECKSUM | BS_DEDUP))) {
+        const off_t offset = (off_t)(bs->fbm_blocks + block_id) * bs->block_size;
+        return block_io_read(bs->io, bs->fd, buffer, bs->block_size, offset, callback, arg);
+    }
+    const bool ok = block_store_copy_out_checked(bs, block_id, buffer);
+    return block_io_complete(bs->io, ok ? (ssize_t)bs->block_size : -EIO, callback, arg);
+}
+
+bool block_store_set_io_threads(block_store_t *const bs, const size_t threads)
+{
+    if(bs == NULL) return false;
+    if(threads == 0 || threads > BLOCK_IO_MAX_THREADS) return false;
+    bs->io_threads = threads;
+    return true;
+}
+
+size_t block_store_poll(block_store_t *const bs)
+{
+    if(bs == NULL) return 0;
+    return block_io_poll(bs->io);
+}
+
+size_t block_store_wait(block_store_t *const bs)
+{
+    if(bs == NULL) return 0;
+    return block_io_wait(bs->io);
+}
+
+//Tally of an image transfer, every request adds what it moved
+typedef struct image_io{
+    size_t bytes;
+    bool ok;
+} image_io_t;
+
+static void block_store_image_done(void *arg, ssize_t result)
+{
+    image_io_t *image = arg;
+    if(result < 0) {
+        image->ok = false;
+    } else {
+        image->bytes += result;
+    }
+}
+
+//Moves the whole arena to or from fd, chunk by chunk, with up to depth requests in flight at once
+//With more than one thread the chunks are pread/pwrite calls at their own offsets, shared out by a pool of that
+//many threads, so the copies to and from the page cache run side by side
+static bool block_store_image_io(const block_store_t *const bs, const int fd, const size_t depth, const size_t threads, const bool write)
+{
+    //every thread needs something to do, and one more request waiting behind it
+    block_io_t *io = threads > 1 ? block_io_create_pool(depth > 2 * threads ? depth : 2 * threads, threads)
+                                 : block_io_create(depth, 0);
+    if(io == NULL) return false;
+
+    const size_t chunk = bs->block_size < BLOCK_STORE_IO_CHUNK ? BLOCK_STORE_IO_CHUNK : bs->block_size;
+    image_io_t image = {0, true};
+    bool queued = true;
+    for(size_t offset = 0; queued && offset < bs->data_bytes; offset += chunk) {
+        const size_t len = bs->data_bytes - offset < chunk ? bs->data_bytes - offset : chunk;
+        queued = write ? block_io_write(io, fd, bs->data + offset, len, (off_t)offset, block_store_image_done, &image)
+                       : block_io_read(io, fd, bs->data + offset, len, (off_t)offset, block_store_image_done, &image);
+    }
+    block_io_destroy(io);
+    //a short transfer (a truncated image, a full disk) comes up short on bytes
+    return queued && image.ok && image.bytes == bs->data_bytes;
+}
+
+//Context for checking every allocated block against its checksum
+typedef struct verify_run{
+    const block_store_t *bs;
+    char *scratch; //thread-safe stores check a seqlocked copy, snapshots one from wherever the block is
+    size_t bad;
+} verify_run_t;
+
+static void block_store_verify_block(size_t block_id, void *arg)
+{
+    verify_run_t *run = arg;
+    const block_store_t *bs = run->bs;
+    if((bs->flags & BS_THREAD_SAFE) || bs->origin != NULL) {
+        run->bad += !block_store_copy_out_checked(bs, block_id, run->scratch);
+    } else {
+        run->bad += !block_store_check(bs, block_id, block_store_source(bs, block_id), bs->crc[block_id]);
+    }
+}
+
+size_t block_store_verify(const block_store_t *const bs)
+{
+    if(bs == NULL || !(bs->flags & BS_CHECKSUM)) return SIZE_MAX;
+    verify_run_t run = {bs, NULL, 0};
+    if((bs->flags & BS_THREAD_SAFE) || bs->origin != NULL) {
+        run.scratch = malloc(bs->block_size);
+        if(run.scratch == NULL) return SIZE_MAX;
+    }
+    bitmap_for_each(bs->bitmap, block_store_verify_block, &run);
+    free(run.scratch);
+    return run.bad;
+}
+
+//Catches the store up with an image just read into its arena
+//An image with checksums has to match them, every allocated block of it, and a deduplicated one needs a sound map
+static bool block_store_loaded(block_store_t *const bs)
+{
+    //the FBM came in with block 0, only the summary levels of a large FBM need redoing
+    //(thread-safe stores have none)
+    if(bs->avail_blocks >= BLOCK_STORE_SUMMARY_THRESHOLD && !(bs->flags & BS_THREAD_SAFE) && !bitmap_summarize(bs->bitmap)) {
+        return false;
+    }
+    bs->used_blocks = bitmap_total_set(bs->bitmap);
+    //the map came in too, the slots have to be counted and indexed over again
+    if(bs->dedup != NULL) {
+        block_store_dedup_destroy(bs->dedup);
+        bs->dedup = block_store_dedup_create(bs, true);
+        if(bs->dedup == NULL) return false;
+    }
+    return !(bs->flags & BS_CHECKSUM) || block_store_verify(bs) == 0;
+}
+
+static void block_store_snapshot_borrowed(size_t block_id, void *arg)
+{
+    block_store_t *snapshot = arg;
+    block_store_snapshot_keep(snapshot->origin, snapshot, block_store_position(snapshot->origin, block_id));
+}
+
+block_store_t *block_store_snapshot(block_store_t *const bs)
+{
+    if(bs == NULL || bs->origin != NULL) return NULL;
+    //blocks parked in thread caches are free, the snapshot has to say so
+    if(bs->flags & BS_THREAD_CACHE) block_store_magazine_drain_all(bs);
+
+    block_store_t *snapshot = block_store_alloc();
+    if(snapshot == NULL) return NULL;
+    snapshot->flags = BS_READONLY | (bs->flags & (BS_THREAD_SAFE | BS_CHECKSUM | BS_DEDUP));
+    snapshot->io_depth = bs->io_depth;
+    snapshot->io_threads = bs->io_threads;
+    if(!block_store_layout(snapshot, bs->num_blocks, bs->block_size)) {
+        free(snapshot);
+        return NULL;
+    }
+    //only the metadata blocks are copied now, the arena stays untouched until blocks get copied into it
+    snapshot->data = block_store_arena_create(snapshot->data_bytes);
+    if(snapshot->data != NULL) {
+        memcpy(snapshot->data, bs->data, bs->fbm_blocks * bs->block_size);
+    }
+    snapshot->copied = bitmap_create(bs->avail_blocks);
+    if(snapshot->data == NULL || snapshot->copied == NULL || !block_store_attach(snapshot)) {
+        block_store_free(snapshot);
+        return NULL;
+    }
+    snapshot->origin = bs;
+    snapshot->next_snapshot = bs->snapshots;
+    bs->snapshots = snapshot;
+    //a mutable borrower changes its block without telling anyone, so those are copied right away
+    bitmap_for_each(bs->borrowed_mut, block_store_snapshot_borrowed, snapshot);
+    return snapshot;
+}
+
+//Compressed images start with this magic where a plain one has BLOCK_STORE_MAGIC, see block_store_serialize_compressed
+#define BLOCK_STORE_PACKED_MAGIC 0x5A4B4C42u //"BLKZ"
+
+static block_store_t *block_store_unpack(const int fd, const block_store_header_t *const first, const size_t chunk);
+static bool block_store_write_sparse(const block_store_t *const bs, const int fd, size_t *const bytes);
+
+//Micah
+block_store_t *block_store_deserialize(const char *const filename)
+{
+    return block_store_deserialize_ex(filename, 1);
+}
+
+block_store_t *block_store_deserialize_ex(const char *const filename, const size_t threads)
+{
+    //checks if the filename is null
+    if(filename == NULL) return NULL;
+    if(threads == 0 || threads > BLOCK_IO_MAX_THREADS) return NULL;
+
+    //open the file 
+    int fd = open(filename, O_RDONLY);
+    //check if there was an error while opening the file
+    if(fd == -1) {
+        return NULL;
+    }
+
+    //the header in block 0 says how big the device is
+    struct stat st;
+    block_store_header_t header;
+    block_store_t geometry = {0};
+    if(fstat(fd, &st) == -1 || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        close(fd);
+        return NULL;
+    }
+    //a compressed image is read front to back like a stream, its header included
+    if(header.magic == BLOCK_STORE_PACKED_MAGIC) {
+        block_store_t *bs = lseek(fd, sizeof(header), SEEK_SET) == -1 ? NULL : block_store_unpack(fd, &header, BLOCK_STORE_STREAM_CHUNK);
+        close(fd);
+        if(bs != NULL) bs->io_threads = threads;
+        return bs;
+    }
+    if(!block_store_read_header(&geometry, &header, st.st_size)) {
+        close(fd);
+        return NULL;
+    }
+
+    //creates the block store
+    block_store_t* bs = block_store_create_flags(geometry.num_blocks, geometry.block_size, block_store_feature_options(&geometry));
+    //checks if the block store was successfully created
+    if(bs == NULL) {
+        close(fd);
+        return NULL;
+    }
+    //the copy gets serialized the same way it was read
+    bs->io_threads = threads;
+
+    //reads every block of the device, FBM blocks included, straight into the arena
+    if(!block_store_image_io(bs, fd, bs->io_depth, bs->io_threads, false)) {
+        close(fd);
+        block_store_destroy(bs);
+        return NULL;
+    }
+
+    if(!block_store_loaded(bs)) {
+        close(fd);
+        block_store_destroy(bs);
+        return NULL;
+    }
+
+    //close the file
+    close(fd);
+
+    return bs;
+}
+
+size_t block_store_serialize(const block_store_t *const bs, const char *const filename)
+{
+    //checks if the block store is null
+    if(bs == NULL) return 0;
+    //checks if the filename is null
+    if(filename == NULL) return 0;
+
+    //blocks parked in thread caches are free, the image has to say so
+    if(bs->flags & BS_THREAD_CACHE) block_store_magazine_drain_all(bs);
+
+    //open the file 
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+    //check if there was an error while opening the file
+    if(fd == -1) {
+
+        return 0;
+    }
+
+    //a deduplicating store's free slots are left as holes, the image only takes up what the slots in use do
+    //a snapshot's blocks may still be in its origin, they go out the same way, only what is allocated
+    if(bs->dedup != NULL || bs->origin != NULL) {
+        size_t bytes;
+        const bool ok = block_store_write_sparse(bs, fd, &bytes);
+        close(fd);
+        return ok ? bytes : 0;
+    }
+
+    //writes every block to the file, straight out of the arena, io_depth requests at a time
+    if(!block_store_image_io(bs, fd, bs->io_depth, bs->io_threads, true)) {
+        close(fd);
+        return 0;
+    }
+
+    //close the file
+    close(fd);
+
+
+    //return the total number of bytes written to files
+    return bs->data_bytes;
+}
+
+//A pipe holds 64 KiB to start with, which would cap every read and write at that
+static void block_store_grow_pipe(const int fd, const size_t chunk)
+{
+#ifdef F_SETPIPE_SZ
+    struct stat st;
+    if(fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode) && chunk <= INT32_MAX) {
+        //best effort, past /proc/sys/fs/pipe-max-size the pipe stays as it is
+        fcntl(fd, F_SETPIPE_SZ, (int)chunk);
+    }
+#else
+    UNUSED(fd);
+    UNUSED(chunk);
+#endif
+}
+
+//write that keeps going through short writes, chunk bytes at a time, pipes and sockets stop at any point
+static bool block_store_write_all(const int fd, const char *buf, size_t len, const size_t chunk)
+{
+    while(len > 0) {
+        ssize_t written = write(fd, buf, len < chunk ? len : chunk);
+        if(written <= 0) {
+            if(written == -1 && errno == EINTR) continue;
+            return false;
+        }
+        buf += written;
+        len -= written;
+    }
+    return true;
+}
+
+//read that keeps going until all len bytes are in, false on error or if the stream ends first
+static bool block_store_read_all(const int fd, char *buf, size_t len, const size_t chunk)
+{
+    while(len > 0) {
+        ssize_t got = read(fd, buf, len < chunk ? len : chunk);
+        if(got <= 0) {
+            if(got == -1 && errno == EINTR) continue;
+            return false;
+        }
+        buf += got;
+        len -= got;
+    }
+    return true;
+}
+
+block_store_t *block_store_deserialize_fd(const int fd, const size_t chunk)
+{
+    if(fd < 0) return NULL;
+    const size_t step = chunk == 0 ? BLOCK_STORE_STREAM_CHUNK : chunk;
+    block_store_grow_pipe(fd, step);
+
+    //a stream doesn't say how long it is, one that ends early fails the read of the blocks instead
+    block_store_header_t header;
+    block_store_t geometry = {0};
+    if(!block_store_read_all(fd, (char *)&header, sizeof(header), step)) {
+        return NULL;
+    }
+    if(header.magic == BLOCK_STORE_PACKED_MAGIC) {
+        return block_store_unpack(fd, &header, step);
+    }
+    if(!block_store_read_header(&geometry, &header, UINT64_MAX)) {
+        return NULL;
+    }
+
+    block_store_t *bs = block_store_create_flags(geometry.num_blocks, geometry.block_size, block_store_feature_options(&geometry));
+    if(bs == NULL) return NULL;
+    //the rest of the image lands straight in the arena behind the header
+    memcpy(bs->data, &header, sizeof(header));
+    if(!block_store_read_all(fd, bs->data + sizeof(header), bs->data_bytes - sizeof(header), step)
+        || !block_store_loaded(bs)) {
+        block_store_destroy(bs);
+        return NULL;
+    }
+    return bs;
+}
+
+//Streams a snapshot's image out, put together a chunk at a time from wherever its blocks are
+static bool block_store_stream_snapshot(const block_store_t *const bs, const int fd, const size_t step)
+{
+    const size_t per_chunk = step > bs->block_size ? step / bs->block_size : 1;
+    char *buffer = malloc(per_chunk * bs->block_size);
+    bool ok = buffer != NULL;
+    for(size_t block = 0; ok && block < bs->num_blocks; block += per_chunk) {
+        const size_t count = bs->num_blocks - block < per_chunk ? bs->num_blocks - block : per_chunk;
+        for(size_t i = 0; i < count; i++) {
+            block_store_copy_device_block(bs, block + i, buffer + i * bs->block_size);
+        }
+        ok = block_store_write_all(fd, buffer, count * bs->block_size, step);
+    }
+    free(buffer);
+    return ok;
+}
+
+size_t block_store_serialize_fd(const block_store_t *const bs, const int fd, const size_t chunk)
+{
+    if(bs == NULL || fd < 0) return 0;
+    const size_t step = chunk == 0 ? BLOCK_STORE_STREAM_CHUNK : chunk;
+    if(bs->flags & BS_THREAD_CACHE) block_store_magazine_drain_all(bs);
+    block_store_grow_pipe(fd, step);
+    if(bs->origin != NULL) return block_store_stream_snapshot(bs, fd, step) ? bs->data_bytes : 0;
+
+    size_t sent = 0;
+    //a mapped store's file is the image already (the mapping is shared, so it has every write),
+    //the kernel can hand it over without the bytes coming through here
+    if(bs->flags & BS_MAPPED) {
+        off_t offset = 0;
+        while(sent < bs->data_bytes) {
+            const size_t left = bs->data_bytes - sent;
+            ssize_t n = sendfile(fd, bs->fd, &offset, left < step ? left : step);
+            if(n <= 0) {
+                if(n == -1 && errno == EINTR) continue;
+                break; //the rest goes out with write, which says whether it was the fd or sendfile
+            }
+            sent += n;
+        }
+    }
+    if(!block_store_write_all(fd, bs->data + sent, bs->data_bytes - sent, step)) return 0;
+    return bs->data_bytes;
+}
+
+//pwrite that keeps going through short writes
+static bool block_store_pwrite_all(const int fd, const char *buf, size_t len, off_t offset)
+{
+    while(len > 0) {
+        ssize_t written = pwrite(fd, buf, len, offset);
+        if(written <= 0) {
+            if(written == -1 && errno == EINTR) continue;
+            return false;
+        }
+        buf += written;
+        len -= written;
+        offset += written;
+    }
+    return true;
+}
+
+//Writes len zeroes at offset, a chunk at a time
+static bool block_store_pwrite_zeroes(const int fd, size_t len, off_t offset)
+{
+    const size_t chunk = len < BLOCK_STORE_IO_CHUNK ? len : BLOCK_STORE_IO_CHUNK;
+    char *zeroes = calloc(1, chunk);
+    bool ok = zeroes != NULL;
+    while(ok && len > 0) {
+        const size_t bytes = len < chunk ? len : chunk;
+        ok = block_store_pwrite_all(fd, zeroes, bytes, offset);
+        len -= bytes;
+        offset += bytes;
+    }
+    free(zeroes);
+    return ok;
+}
+
+//Context for coalescing dirty blocks into pwrite and hole punching calls
+typedef struct checkpoint_run{
+    const block_store_t *bs;
+    int fd;
+    size_t first, end; //current run of blocks [first, end)
+    bool punch;        //the run is free blocks, punch a hole instead of writing it
+    size_t bytes;      //bytes written so far
+    bool ok;
+    char *scratch;     //snapshots only, scratch_blocks blocks on their way out
+    size_t scratch_blocks;
+    char *meta;        //checksummed stores only, a metadata block on its way out
+} checkpoint_run_t;
+
+static void block_store_checkpoint_run(checkpoint_run_t *const run)
+{
+    const size_t block_size = run->bs->block_size;
+    const char *start = run->bs->data + run->first * block_size;
+    const size_t len = (run->end - run->first) * block_size;
+    const off_t offset = (off_t)run->first * block_size;
+    //metadata blocks, with the checksums of free blocks put right
+    if(run->meta != NULL && run->first < run->bs->fbm_blocks) {
+        for(size_t block = run->first; block < run->end; block++) {
+            block_store_image_meta(run->bs, block, run->meta);
+            if(!block_store_pwrite_all(run->fd, run->meta, block_size, (off_t)block * block_size)) {
+                run->ok = false;
+                return;
+            }
+        }
+        run->bytes += len;
+        return;
+    }
+    //free blocks turn into holes, they read back as zeroes and take no space
+    if(run->punch) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+        if(fallocate(run->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) {
+            return;
+        }
+#endif
+        //or they are written out zeroed where the filesystem can't punch holes
+        if(!block_store_pwrite_zeroes(run->fd, len, offset)) {
+            run->ok = false;
+        } else {
+            run->bytes += len;
+        }
+        return;
+    }
+    //a snapshot's blocks are gathered from wherever they are first
+    if(run->scratch != NULL) {
+        for(size_t block = run->first; block < run->end; block += run->scratch_blocks) {
+            const size_t count = run->end - block < run->scratch_blocks ? run->end - block : run->scratch_blocks;
+            for(size_t i = 0; i < count; i++) {
+                block_store_copy_device_block(run->bs, block + i, run->scratch + i * block_size);
+            }
+            if(!block_store_pwrite_all(run->fd, run->scratch, count * block_size, (off_t)block * block_size)) {
+                run->ok = false;
+                return;
+            }
+        }
+        run->bytes += len;
+        return;
+    }
+    //allocated blocks
+    if(!block_store_pwrite_all(run->fd, start, len, offset)) {
+        run->ok = false;
+        return;
+    }
+    run->bytes += len;
+}
+
+static void block_store_checkpoint_block(size_t block, void *arg)
 {
-    int errornum;
+    checkpoint_run_t *run = arg;
+    const block_store_t *bs = run->bs;
+    bool punch = block >= bs->fbm_blocks && !bitmap_test(block_store_in_use(bs), block - bs->fbm_blocks);
+    if(run->end != block || run->punch != punch || block == bs->fbm_blocks) {
+        if(run->end != run->first) {
+            block_store_checkpoint_run(run);
+        }
+        run->first = block;
+        run->punch = punch;
+    }
+    run->end = block + 1;
+}
 
-    //Allocate memory for the block that is being created
-    block_store_t *block = malloc(sizeof(block_store_t));
-    if(block == NULL){
-        //errno number stuff
-        errornum = errno;
-        fprintf(stderr, "Value of errno: %d\n", errno);
-        perror("Error printed by perror");
-        fprintf(stderr, "Error Null Check: %s\n", strerror( errornum ));
-        return NULL;
+//Marks every block that has to be in a fresh image: the FBM blocks and every allocated block (or slot in use)
+static void block_store_mark_used(size_t block_id, void *arg)
+{
+    block_store_t *bs = arg;
+    bitmap_set(bs->dirty, bs->fbm_blocks + block_id);
+}
+
+static void block_store_checkpoint_slot(size_t slot, void *arg)
+{
+    checkpoint_run_t *run = arg;
+    block_store_checkpoint_block(run->bs->fbm_blocks + slot, run);
+}
+
+//Writes the metadata blocks and the user blocks (or slots) in use to a fresh image, the rest of it reads back as zeroes
+static bool block_store_write_sparse(const block_store_t *const bs, const int fd, size_t *const bytes)
+{
+    if(ftruncate(fd, bs->data_bytes) == -1) return false;
+    checkpoint_run_t run = {bs, fd, 0, 0, false, 0, true, NULL, 0, NULL};
+    if(bs->flags & BS_CHECKSUM) {
+        run.meta = malloc(bs->block_size);
+        if(run.meta == NULL) return false;
     }
-    //Create a bitmap with 256 - 1 as the available space
-    block->bitmap = bitmap_create(BLOCK_STORE_AVAIL_BLOCKS);
-    return block;
+    if(bs->origin != NULL) {
+        run.scratch_blocks = bs->block_size < BLOCK_STORE_IO_CHUNK ? BLOCK_STORE_IO_CHUNK / bs->block_size : 1;
+        run.scratch = malloc(run.scratch_blocks * bs->block_size);
+        if(run.scratch == NULL) {
+            free(run.meta);
+            return false;
+        }
+    }
+    for(size_t block = 0; block < bs->fbm_blocks; block++) {
+        block_store_checkpoint_block(block, &run);
+    }
+    bitmap_for_each(block_store_in_use(bs), block_store_checkpoint_slot, &run);
+    if(run.end != run.first) {
+        block_store_checkpoint_run(&run);
+    }
+    free(run.scratch);
+    free(run.meta);
+    *bytes = run.bytes;
+    return run.ok;
 }
 
-//Yuto Wada
-void block_store_destroy(block_store_t *const bs)
+size_t block_store_serialize_incremental(block_store_t *const bs, const char *const filename)
 {
-    int errornum;
+    if(bs == NULL || filename == NULL) return 0;
+    if(bs->flags & BS_READONLY) return 0;
+    if(bs->flags & BS_THREAD_CACHE) block_store_magazine_drain_all(bs);
 
-    if (bs == NULL){
-        errornum = errno;
-        fprintf(stderr, "Value of errno: %d\n", errno);
-        perror("Error printed by perror");
-        fprintf(stderr, "Error Null Check: %s\n", strerror( errornum )); 
-        return;
+    int fd = open(filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if(fd == -1) return 0;
+
+    //the image only needs the dirty blocks if it is this store as of the last checkpoint
+    block_store_header_t *header = (block_store_header_t *)bs->data;
+    block_store_header_t image;
+    block_store_t geometry = {0};
+    struct stat st;
+    bool incremental = fstat(fd, &st) == 0
+        && pread(fd, &image, sizeof(image), 0) == (ssize_t)sizeof(image)
+        && block_store_read_header(&geometry, &image, st.st_size)
+        && image.store_id == header->store_id && image.generation == header->generation
+        && geometry.num_blocks == bs->num_blocks && geometry.block_size == bs->block_size;
+
+    if(!incremental) {
+        //start over with an empty, sparse file, and write everything that is in use
+        if(ftruncate(fd, 0) == -1 || ftruncate(fd, bs->data_bytes) == -1) {
+            close(fd);
+            return 0;
+        }
+        for(size_t i = 0; i < bs->fbm_blocks; i++) {
+            bitmap_set(bs->dirty, i);
+        }
+        bitmap_for_each(block_store_in_use(bs), block_store_mark_used, bs);
     }
 
-    //If the parameter is not null, destroy the bitmap that is allocated and free the memory
-    bitmap_destroy(bs->bitmap);
-    free(bs);
-    return; 
+    header->generation++;
+    bitmap_set(bs->dirty, 0);
+
+    checkpoint_run_t run = {bs, fd, 0, 0, false, 0, true, NULL, 0, NULL};
+    if(bs->flags & BS_CHECKSUM) {
+        run.meta = malloc(bs->block_size);
+        run.ok = run.meta != NULL;
+    }
+    if(run.ok) {
+        bitmap_for_each(bs->dirty, block_store_checkpoint_block, &run);
+    }
+    if(run.ok && run.end != run.first) {
+        block_store_checkpoint_run(&run);
+    }
+    free(run.meta);
+    close(fd);
+
+    //a mapped store's own file has to get the changes too before the dirty bits go
+    if(run.ok && (bs->flags & BS_MAPPED) && !block_store_sync_dirty(bs)) {
+        run.ok = false;
+    }
+    if(!run.ok) {
+        //the image is somewhere between generations, make sure the next call rewrites it
+        header->generation++;
+        return 0;
+    }
+    bitmap_format(bs->dirty, 0x00);
+    return run.bytes;
 }
 
-//Yuto Wada
-size_t block_store_allocate(block_store_t *const bs)
+//Journal transactions start with this record, the block numbers follow it and then the blocks themselves
+#define BLOCK_STORE_JOURNAL_MAGIC 0x4C4E524Au //"JRNL"
+typedef struct journal_record{
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t generation; //the checkpoint generation it was written in
+    uint64_t count;      //device blocks in it
+    uint64_t bytes;      //the whole transaction, record included
+    uint64_t checksum;   //of the whole transaction, taken with this field 0
+} journal_record_t;
+
+//FNV-1a a word at a time, enough to tell a whole transaction from a torn or stale one
+//Transactions are always a whole number of words
+static uint64_t block_store_journal_sum(const char *buf, size_t len)
 {
-    //If bs is NULL, return SIZE_MAX (Stated in the test cases)
-    if (bs == NULL){
-        return SIZE_MAX;
+    uint64_t sum = 0xCBF29CE484222325ull;
+    for(; len >= 8; len -= 8, buf += 8) {
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        sum = (sum ^ word) * 0x100000001B3ull;
     }
+    return sum;
+}
 
-    //Find where the first zero occurs
-    size_t adressZero = bitmap_ffz(bs->bitmap);
+static size_t block_store_journal_bytes(const block_store_t *const bs, const size_t count)
+{
+    return sizeof(journal_record_t) + count * (sizeof(uint64_t) + bs->block_size);
+}
 
+//Context for collecting the pending blocks of a transaction
+typedef struct journal_take{
+    block_store_journal_t *journal;
+    size_t count;
+} journal_take_t;
 
-    if (adressZero == SIZE_MAX || adressZero == BLOCK_STORE_AVAIL_BLOCKS) {
-        return SIZE_MAX;
+//A block changed again after its bit is taken gets its bit back, and goes into the next transaction
+static void block_store_journal_take(size_t block, void *arg)
+{
+    journal_take_t *take = arg;
+    if(bitmap_test_and_reset(take->journal->pending, block)) {
+        take->journal->ids[take->count++] = block;
     }
-
-    //Set the bs to where the first zero is.
-    bitmap_set(bs->bitmap, adressZero);
-    return adressZero;
 }
 
-//Yuto Wada
-bool block_store_request(block_store_t *const bs, const size_t block_id)
+//Logs every pending block as one transaction and syncs it, only the leader of a commit runs this
+static bool block_store_journal_append(block_store_t *const bs, size_t *const logged)
 {
-    if(bs == NULL || (block_id > BLOCK_STORE_AVAIL_BLOCKS)) {
-        return 0;
+    block_store_journal_t *journal = bs->journal;
+    journal_take_t take = {journal, 0};
+    bitmap_for_each(journal->pending, block_store_journal_take, &take);
+    *logged = take.count;
+    if(take.count == 0) return true;
+
+    const size_t bytes = block_store_journal_bytes(bs, take.count);
+    if(bytes > journal->buffer_bytes) {
+        char *buffer = realloc(journal->buffer, bytes);
+        if(buffer == NULL) return false;
+        journal->buffer = buffer;
+        journal->buffer_bytes = bytes;
     }
+    journal_record_t *record = (journal_record_t *)journal->buffer;
+    uint64_t *ids = (uint64_t *)(record + 1);
+    char *blocks = (char *)(ids + take.count);
+    memcpy(ids, journal->ids, take.count * sizeof(uint64_t));
+    for(size_t i = 0; i < take.count; i++) {
+        block_store_copy_device_block(bs, ids[i], blocks + i * bs->block_size);
+    }
+    record->magic = BLOCK_STORE_JOURNAL_MAGIC;
+    record->reserved = 0;
+    record->generation = journal->generation;
+    record->count = take.count;
+    record->bytes = bytes;
+    record->checksum = 0;
+    record->checksum = block_store_journal_sum(journal->buffer, bytes);
 
-    //If the bit is already set, exit
-    if(bitmap_test(bs->bitmap, block_id) == 1) {
-        return 0; 
+    //one sequential append and one sync, however many writers this covers
+    if(!block_store_pwrite_all(journal->fd, journal->buffer, bytes, journal->tail) || fdatasync(journal->fd) == -1) {
+        return false;
     }
+    journal->tail += bytes;
+    for(size_t i = 0; i < take.count; i++) {
+        bitmap_set(journal->logged, ids[i]);
+    }
+    return true;
+}
 
-    //Set the bit to be the requested block
-    bitmap_set(bs->bitmap, block_id);
+//Returns once every change made before the call is in the journal
+static bool block_store_journal_commit(block_store_t *const bs)
+{
+    block_store_journal_t *journal = bs->journal;
+    pthread_mutex_lock(&journal->lock);
+    const uint64_t ticket = ++journal->requested;
+    journal->stats.commits++;
+    while(journal->durable < ticket && !journal->failed) {
+        if(journal->committing) {
+            pthread_cond_wait(&journal->done, &journal->lock);
+            continue;
+        }
+        //nobody is leading, lead a commit for every ticket handed out so far
+        const uint64_t covered = journal->requested;
+        journal->committing = true;
+        pthread_mutex_unlock(&journal->lock);
 
-    //If the bit is not used or set, something went wrong
-    if(bitmap_test(bs->bitmap, block_id) == 0) {
-        return 0; 
+        size_t logged = 0;
+        const bool ok = block_store_journal_append(bs, &logged);
+
+        pthread_mutex_lock(&journal->lock);
+        journal->committing = false;
+        if(ok) {
+            journal->durable = covered;
+            journal->stats.syncs += logged > 0;
+            journal->stats.blocks += logged;
+        } else {
+            //the blocks taken for the failed transaction are lost to the journal, so is every later promise
+            journal->failed = true;
+        }
+        if(!journal->wanted && (size_t)(journal->tail - journal->start) >= journal->limit) {
+            journal->wanted = true;
+            pthread_cond_signal(&journal->wake);
+        }
+        pthread_cond_broadcast(&journal->done);
     }
+    const bool durable = journal->durable >= ticket;
+    pthread_mutex_unlock(&journal->lock);
+    return durable;
+}
 
-    return 1;
+//Context for writing logged blocks back to the image
+typedef struct journal_fold{
+    block_store_t *bs;
+    bool ok;
+} journal_fold_t;
+
+static void block_store_journal_fold_block(size_t block, void *arg)
+{
+    journal_fold_t *fold = arg;
+    block_store_t *bs = fold->bs;
+    if(!fold->ok) return;
+    block_store_copy_device_block(bs, block, bs->journal->scratch);
+    fold->ok = block_store_pwrite_all(bs->journal->image_fd, bs->journal->scratch, bs->block_size, (off_t)block * bs->block_size);
 }
 
-//Yuto Wada
-void block_store_release(block_store_t *const bs, const size_t block_id)
+static void block_store_journal_relog(size_t block, void *arg)
 {
-    //checks if the block store is null
-    if(bs != NULL){
-        //resets the bit representing the selected block
-        bitmap_reset(bs->bitmap, block_id);
-    }
-    return;
+    bitmap_set(arg, block);
 }
 
-size_t block_store_get_used_blocks(const block_store_t *const bs)
+//Folds everything logged so far into the image
+//Between two commits the generation moves on, transactions from there on are for the next checkpoint.
+//The logged blocks go to the image, then block 0 with a header saying where replay starts now,
+//and the journal before that point is let go. A crash at any step replays from the old start.
+static bool block_store_journal_fold(block_store_t *const bs)
 {
-    //checks if the block store is null
-    if(bs != NULL) {
-        //returns the total number of set bits the the block store's bitmap
-        return bitmap_total_set(bs->bitmap);
+    block_store_journal_t *journal = bs->journal;
+    block_store_header_t *header = (block_store_header_t *)bs->data;
+
+    pthread_mutex_lock(&journal->checkpoint_lock);
+    pthread_mutex_lock(&journal->lock);
+    while(journal->committing) {
+        pthread_cond_wait(&journal->done, &journal->lock);
     }
-    //returns zero if the block store is null
-    return SIZE_MAX;
+    //the leader owns logged, it is only swapped out while nobody leads
+    bitmap_t *folding = journal->logged;
+    journal->logged = journal->folding;
+    journal->folding = folding;
+    const off_t from = journal->start, to = journal->tail;
+    journal->generation++;
+    __atomic_store_n(&header->journal_generation, journal->generation, __ATOMIC_RELAXED);
+    __atomic_store_n(&header->journal_start, (uint64_t)to, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&journal->lock);
+
+    //block 0 holds the header, it goes last
+    bitmap_reset(folding, 0);
+    journal_fold_t fold = {bs, true};
+    bitmap_for_each(folding, block_store_journal_fold_block, &fold);
+    bool ok = fold.ok && fdatasync(journal->image_fd) == 0;
+    if(ok) {
+        block_store_copy_device_block(bs, 0, journal->scratch);
+        ok = block_store_pwrite_all(journal->image_fd, journal->scratch, bs->block_size, 0) && fdatasync(journal->image_fd) == 0;
+    }
+#ifdef FALLOC_FL_PUNCH_HOLE
+    //best effort, a filesystem without holes just keeps the dead transactions
+    if(ok && to > from) {
+        fallocate(journal->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, to - from);
+    }
+#endif
+
+    pthread_mutex_lock(&journal->lock);
+    if(ok) {
+        journal->start = to;
+        journal->stats.checkpoints++;
+    } else {
+        //the next checkpoint has another go at these
+        while(journal->committing) {
+            pthread_cond_wait(&journal->done, &journal->lock);
+        }
+        bitmap_for_each(folding, block_store_journal_relog, journal->logged);
+    }
+    bitmap_format(folding, 0x00);
+    pthread_mutex_unlock(&journal->lock);
+    pthread_mutex_unlock(&journal->checkpoint_lock);
+    return ok;
 }
 
-size_t block_store_get_free_blocks(const block_store_t *const bs)
+//The background checkpoint, woken by a commit that takes the journal past its limit
+static void *block_store_checkpointer(void *arg)
 {
-    //checks if the block store is null
-    if(bs != NULL) {
-        //returns the number of unset bits in the block store's bitmap by subtracting the set bits from the total bits
-        return BLOCK_STORE_AVAIL_BLOCKS - bitmap_total_set(bs->bitmap);
+    block_store_t *bs = arg;
+    block_store_journal_t *journal = bs->journal;
+    pthread_mutex_lock(&journal->lock);
+    while(!journal->stop) {
+        if(!journal->wanted) {
+            pthread_cond_wait(&journal->wake, &journal->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&journal->lock);
+        block_store_journal_fold(bs);
+        pthread_mutex_lock(&journal->lock);
+        journal->wanted = false;
     }
-    //returns zero if the block store is null
-    return SIZE_MAX; 
+    pthread_mutex_unlock(&journal->lock);
+    return NULL;
 }
 
-//Yuto Wada
-size_t block_store_get_total_blocks()
+static bool block_store_journal_start(block_store_t *const bs)
 {
-    //returns the constant that represents the total blocks in the block store
-    return BLOCK_STORE_AVAIL_BLOCKS;
+    block_store_journal_t *journal = bs->journal;
+    journal->running = pthread_create(&journal->checkpointer, NULL, block_store_checkpointer, bs) == 0;
+    return journal->running;
 }
 
-//Micah 
-size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer)
+static void block_store_journal_stop(block_store_journal_t *const journal)
 {
+    if(!journal->running) return;
+    pthread_mutex_lock(&journal->lock);
+    journal->stop = true;
+    pthread_cond_signal(&journal->wake);
+    pthread_mutex_unlock(&journal->lock);
+    pthread_join(journal->checkpointer, NULL);
+    journal->running = false;
+}
 
-    //https://www.digitalocean.com/community/tutorials/two-dimensional-array-in-c-plus-plus
-    //error checking
-    if(bs == NULL) return 0;
-    if(block_id > BLOCK_STORE_NUM_BLOCKS) return 0; // double check this
-    if(buffer == NULL) return 0;
-    
+//Folds everything into the image and starts the journal over, only for open and destroy
+static bool block_store_journal_reset(block_store_t *const bs)
+{
+    block_store_journal_t *journal = bs->journal;
+    block_store_journal_stop(journal);
+    //whatever is in the journal now is older than the fold, replay would stop at the first of it
+    journal->tail = 0;
+    return block_store_journal_fold(bs) && ftruncate(journal->fd, 0) == 0;
+}
+
+static void block_store_journal_close(block_store_t *const bs)
+{
+    block_store_journal_t *journal = bs->journal;
+    block_store_journal_stop(journal);
+    if(journal->fd != -1) close(journal->fd);
+    close(journal->image_fd);
+    bitmap_destroy(journal->pending);
+    bitmap_destroy(journal->logged);
+    bitmap_destroy(journal->folding);
+    free(journal->ids);
+    free(journal->buffer);
+    free(journal->scratch);
+    pthread_cond_destroy(&journal->wake);
+    pthread_cond_destroy(&journal->done);
+    pthread_mutex_destroy(&journal->checkpoint_lock);
+    pthread_mutex_destroy(&journal->lock);
+    free(journal);
+    bs->journal = NULL;
+}
 
-    // // read data from block_store into buffer   
-    // // size_t i = 0;
-    // // while ( i < BLOCK_SIZE_BYTES )
-    // // {
-    // //     strncpy( buffer+i, (bs->data)[block_id][i], (size_t)1 );
-	// // i++;
-    // // }
+//Gives a store the journal <path>.wal next to its image, the store owns image_fd from here on
+static bool block_store_journal_open(block_store_t *const bs, const char *const path, const int image_fd, const bool truncate)
+{
+    block_store_journal_t *journal = calloc(1, sizeof(block_store_journal_t));
+    if(journal == NULL) {
+        close(image_fd);
+        return false;
+    }
+    journal->fd = -1;
+    journal->image_fd = image_fd;
+    journal->limit = BLOCK_STORE_JOURNAL_LIMIT;
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_mutex_init(&journal->checkpoint_lock, NULL);
+    pthread_cond_init(&journal->done, NULL);
+    pthread_cond_init(&journal->wake, NULL);
+    bs->journal = journal;
 
-    // memcpy(buffer, (bs->data)[block_id], BLOCK_STORE_NUM_BLOCKS);
+    char *name = malloc(strlen(path) + sizeof(".wal"));
+    if(name == NULL) return false;
+    strcpy(name, path);
+    strcat(name, ".wal");
+    journal->fd = open(name, O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), S_IRUSR | S_IWUSR);
+    free(name);
 
-    // return BLOCK_STORE_NUM_BLOCKS;
+    journal->pending = bitmap_create(bs->num_blocks);
+    journal->logged = bitmap_create(bs->num_blocks);
+    journal->folding = bitmap_create(bs->num_blocks);
+    journal->ids = calloc(bs->num_blocks, sizeof(uint64_t));
+    journal->scratch = malloc(bs->block_size);
+    return journal->fd != -1 && journal->pending != NULL && journal->logged != NULL && journal->folding != NULL
+        && journal->ids != NULL && journal->scratch != NULL;
+}
 
-    //2D array looks like
+//Applies the transactions a crash left in the journal, from where the image's header says to start
+//Replay ends at the first transaction that is torn, garbage, or older than the one before it
+static bool block_store_journal_replay(block_store_t *const bs, off_t offset, uint64_t generation)
+{
+    block_store_journal_t *journal = bs->journal;
+    journal_record_t record;
+    while(pread(journal->fd, &record, sizeof(record), offset) == (ssize_t)sizeof(record)) {
+        if(record.magic != BLOCK_STORE_JOURNAL_MAGIC || record.generation < generation
+            || record.count == 0 || record.count > bs->num_blocks
+            || record.bytes != block_store_journal_bytes(bs, record.count)) {
+            break;
+        }
+        if(record.bytes > journal->buffer_bytes) {
+            char *buffer = realloc(journal->buffer, record.bytes);
+            if(buffer == NULL) return false;
+            journal->buffer = buffer;
+            journal->buffer_bytes = record.bytes;
+        }
+        if(pread(journal->fd, journal->buffer, record.bytes, offset) != (ssize_t)record.bytes) break;
+        ((journal_record_t *)journal->buffer)->checksum = 0;
+        if(block_store_journal_sum(journal->buffer, record.bytes) != record.checksum) break;
 
+        const uint64_t *ids = (const uint64_t *)(journal->buffer + sizeof(record));
+        const char *blocks = (const char *)(ids + record.count);
+        bool valid = true;
+        for(size_t i = 0; i < record.count; i++) {
+            valid = valid && ids[i] < bs->num_blocks;
+        }
+        if(!valid) break;
+        //nothing else is running yet, and the reset fold writes all of these to the image
+        for(size_t i = 0; i < record.count; i++) {
+            memcpy(bs->data + ids[i] * bs->block_size, blocks + i * bs->block_size, bs->block_size);
+            bitmap_set(journal->logged, ids[i]);
+        }
+        generation = record.generation;
+        offset += record.bytes;
+    }
+    journal->generation = generation;
+    return true;
+}
 
-    // {   A[0]{0, 1, 2, 3},
-    //     A[1]{3, 2, 1, 0},
-    //     A[2]{3, 5, 6, 1},
-    //     A[3]{3, 8, 3, 4}  };
+block_store_t *block_store_create_wal(const char *const path, const size_t num_blocks, const size_t block_size)
+{
+    if(path == NULL) return NULL;
 
-    memcpy(buffer, bs->data[block_id], BLOCK_SIZE_BYTES);
-    return BLOCK_SIZE_BYTES;
+    //the checkpointer copies blocks out while the store is in use, that takes the seqlocks
+    block_store_t *bs = block_store_create_flags(num_blocks, block_size, BLOCK_STORE_THREAD_SAFE);
+    if(bs == NULL) return NULL;
+    //the image starts out sparse, the reset below writes block 0
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if(fd == -1 || ftruncate(fd, bs->data_bytes) == -1) {
+        if(fd != -1) close(fd);
+        block_store_free(bs);
+        return NULL;
+    }
+    if(!block_store_journal_open(bs, path, fd, true) || !block_store_journal_reset(bs) || !block_store_journal_start(bs)) {
+        block_store_free(bs);
+        return NULL;
+    }
+    return bs;
 }
 
+block_store_t *block_store_open_wal(const char *const path)
+{
+    if(path == NULL) return NULL;
 
-//Micah
-size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer)
-{    
-    // error checking
-    if(bs == NULL) return 0;
-    if(block_id > BLOCK_STORE_NUM_BLOCKS) return 0;
-    if(buffer == NULL) return 0;
-  
-    // read data from block_store into buffer 
+    int fd = open(path, O_RDWR);
+    if(fd == -1) return NULL;
+    struct stat st;
+    block_store_header_t header;
+    block_store_t geometry = {0};
+    if(fstat(fd, &st) == -1 || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+        || !block_store_read_header(&geometry, &header, st.st_size)
+        //checkpoints copy blocks and the metadata out at different moments, so block checksums
+        //wouldn't survive a crash in the middle of one, the journal's own checksums cover a journaled store
+        //journaled stores are thread-safe, which a deduplicating one can't be
+        || (geometry.flags & (BS_CHECKSUM | BS_DEDUP))) {
+        close(fd);
+        return NULL;
+    }
+    block_store_t *bs = block_store_create_flags(geometry.num_blocks, geometry.block_size, BLOCK_STORE_THREAD_SAFE);
+    if(bs == NULL) {
+        close(fd);
+        return NULL;
+    }
+    if(!block_store_image_io(bs, fd, bs->io_depth, bs->io_threads, false)) {
+        close(fd);
+        block_store_free(bs);
+        return NULL;
+    }
+    //the image as of its last checkpoint, plus whatever made it into the journal since
+    if(!block_store_journal_open(bs, path, fd, false)
+        || !block_store_journal_replay(bs, (off_t)header.journal_start, header.journal_generation)
+        || !block_store_loaded(bs) || !block_store_journal_reset(bs) || !block_store_journal_start(bs)) {
+        block_store_free(bs);
+        return NULL;
+    }
+    return bs;
+}
 
-    // size_t i = 0;
-    // while ( i < BLOCK_SIZE_BYTES )
-    // {
-    //     (bs->data)[block_id][i] = calloc(1, sizeof(char));
-	// strncpy( (bs->data)[block_id][i], buffer+i, (size_t)1 );	
-	// i++;
-    // }
-    memcpy(bs->data[block_id], buffer, BLOCK_SIZE_BYTES); 
+bool block_store_checkpoint(block_store_t *const bs)
+{
+    if(bs == NULL || bs->journal == NULL) return false;
+    //what changed goes into the journal first, so the image ends up with all of it
+    return block_store_journal_commit(bs) && block_store_journal_fold(bs);
+}
 
+bool block_store_set_journal_limit(block_store_t *const bs, const size_t bytes)
+{
+    if(bs == NULL || bs->journal == NULL || bytes == 0) return false;
+    pthread_mutex_lock(&bs->journal->lock);
+    bs->journal->limit = bytes;
+    pthread_mutex_unlock(&bs->journal->lock);
+    return true;
+}
 
-    return BLOCK_SIZE_BYTES;
+bool block_store_get_journal_stats(block_store_t *const bs, block_store_journal_stats_t *const stats)
+{
+    if(bs == NULL || bs->journal == NULL || stats == NULL) return false;
+    pthread_mutex_lock(&bs->journal->lock);
+    *stats = bs->journal->stats;
+    pthread_mutex_unlock(&bs->journal->lock);
+    return true;
 }
 
-//Micah
-block_store_t *block_store_deserialize(const char *const filename)
+//Compressed images: a header, an index with an entry per device block, then the stored blocks back to back in order
+//Every block is compressed on its own, so any one of them can be read without the others
+#define BLOCK_STORE_PACKED_VERSION 1
+typedef struct block_store_packed_header{
+    uint32_t magic;       //BLOCK_STORE_PACKED_MAGIC
+    uint16_t version;
+    uint16_t features;    //the store's, the same bits as in block_store_header_t
+    uint64_t num_blocks;
+    uint64_t block_size;
+    uint64_t fbm_blocks;
+    uint64_t data_offset; //the first stored block, right after the index
+    uint64_t data_bytes;  //everything stored from there on
+    uint64_t reserved[2];
+} block_store_packed_header_t; //the size of block_store_header_t, so either one can be read first
+
+//How a block is stored
+#define BLOCK_STORE_PACKED_ZERO 0 //not at all, a free or all-zero block
+#define BLOCK_STORE_PACKED_RAW 1  //as it is, it didn't get any smaller
+#define BLOCK_STORE_PACKED_LZ 2   //through lz_compress
+typedef struct block_store_packed_entry{
+    uint64_t offset; //from the start of the file
+    uint32_t bytes;  //stored bytes
+    uint32_t codec;
+} block_store_packed_entry_t;
+
+//A compressed or plain image open for reading single blocks
+struct block_store_image{
+    int fd;
+    size_t num_blocks;
+    size_t block_size;
+    size_t fbm_blocks;
+    size_t avail_blocks;
+    block_store_packed_entry_t *index; //compressed images only
+    char *meta;          //the metadata blocks, unpacked: header, FBM and checksums
+    bitmap_t *fbm;       //overlay on meta
+    const uint32_t *crc; //images with checksums only, in meta
+    const uint32_t *map; //deduplicated images only, in meta
+};
+
+//pread that keeps going through short reads, false on error or if the file ends first
+static bool block_store_pread_all(const int fd, char *buf, size_t len, off_t offset)
 {
-    //checks if the filename is null
-    if(filename == NULL) return NULL;
+    while(len > 0) {
+        ssize_t got = pread(fd, buf, len, offset);
+        if(got <= 0) {
+            if(got == -1 && errno == EINTR) continue;
+            return false;
+        }
+        buf += got;
+        len -= got;
+        offset += got;
+    }
+    return true;
+}
 
-    //open the file 
-    int fd = open(filename, O_RDONLY);
-    //check if there was an error while opening the file
-    if(fd == -1) {
-        return NULL;
+//Checks a compressed image's header and lays bs out to match it
+static bool block_store_packed_layout(block_store_t *const bs, const block_store_packed_header_t *const packed)
+{
+    if(packed->magic != BLOCK_STORE_PACKED_MAGIC || packed->version != BLOCK_STORE_PACKED_VERSION
+        || (packed->features & ~BLOCK_STORE_FEATURES) != 0) {
+        return false;
     }
+    block_store_take_features(bs, packed->features);
+    //entries keep stored sizes in 32 bits
+    return packed->num_blocks <= SIZE_MAX && packed->block_size <= UINT32_MAX
+        && block_store_layout(bs, packed->num_blocks, packed->block_size) && packed->fbm_blocks == bs->fbm_blocks
+        && packed->data_offset == sizeof(*packed) + bs->num_blocks * sizeof(block_store_packed_entry_t);
+}
 
-    //creates the block store
-    block_store_t* bs = block_store_create();
-    //checks if the block store was successfully created
-    if(bs == NULL) return NULL;
+//Checks the header in an unpacked block 0 against the layout the image said it has
+static bool block_store_packed_agrees(const block_store_t *const bs, const char *const block)
+{
+    block_store_t check = {0};
+    return block_store_read_header(&check, (const block_store_header_t *)block, UINT64_MAX)
+        && check.num_blocks == bs->num_blocks && check.block_size == bs->block_size
+        && (check.flags & (BS_CHECKSUM | BS_DEDUP)) == (bs->flags & (BS_CHECKSUM | BS_DEDUP));
+}
 
-    //initialze buffer
-    void* buf[BLOCK_STORE_NUM_BLOCKS];
-    
-    //reads through the array of ints in the file
-    for(size_t i = 0; i < BLOCK_STORE_NUM_BLOCKS; i++) {
-        //read the current block and reads it into the buffer
-        size_t bytes_read = read(fd, buf, BLOCK_STORE_NUM_BLOCKS); 
-        //check if the read was successful
-        if(bytes_read == 0) {
-            return NULL;
+//Turns one stored block back into block_size bytes at dst, false if it is damaged
+//A zero block leaves dst alone, it is up to the caller to have it zeroed
+static bool block_store_unpack_block(const size_t block_size, const block_store_packed_entry_t *const entry, const char *const stored, char *const dst)
+{
+    if(stored == NULL) return false;
+    switch(entry->codec) {
+    case BLOCK_STORE_PACKED_ZERO:
+        return entry->bytes == 0;
+    case BLOCK_STORE_PACKED_RAW:
+        if(entry->bytes != block_size) return false;
+        if(stored != dst) memcpy(dst, stored, block_size);
+        return true;
+    case BLOCK_STORE_PACKED_LZ:
+        return entry->bytes < block_size && lz_decompress(stored, entry->bytes, dst, block_size) == block_size;
+    default:
+        return false;
+    }
+}
+
+size_t block_store_serialize_compressed(const block_store_t *const bs, const char *const filename)
+{
+    if(bs == NULL || filename == NULL) return 0;
+    if(bs->block_size > UINT32_MAX) return 0;
+    //blocks parked in thread caches are free, the image has to say so
+    if(bs->flags & BS_THREAD_CACHE) block_store_magazine_drain_all(bs);
+
+    const size_t index_bytes = bs->num_blocks * sizeof(block_store_packed_entry_t);
+    const size_t chunk = bs->block_size < BLOCK_STORE_IO_CHUNK ? BLOCK_STORE_IO_CHUNK : bs->block_size;
+    block_store_packed_entry_t *index = calloc(bs->num_blocks, sizeof(block_store_packed_entry_t));
+    char *block = malloc(bs->block_size);
+    //stored blocks pile up here until there is a chunk of them, one more block always fits
+    char *buffer = malloc(chunk + bs->block_size);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    bool ok = index != NULL && block != NULL && buffer != NULL && fd != -1;
+
+    const off_t data_offset = sizeof(block_store_packed_header_t) + index_bytes;
+    off_t offset = data_offset; //where buffer goes in the file
+    size_t used = 0;
+    for(size_t b = 0; ok && b < bs->num_blocks; b++) {
+        block_store_packed_entry_t *entry = &index[b];
+        entry->offset = offset + used;
+        //a free block's contents don't matter, it comes back zeroed
+        if(b >= bs->fbm_blocks && !bitmap_test(block_store_in_use(bs), b - bs->fbm_blocks)) continue;
+        if(b < bs->fbm_blocks) {
+            block_store_image_meta(bs, b, block);
+        } else {
+            block_store_copy_device_block(bs, b, block);
         }
-        //writes the buffer for the block into the block store
-        size_t num_bytes = block_store_write(bs, i, buf);
-        //checks if the block store is correctly written to
-        if(num_bytes == 0) {
-            return NULL;
+        if(block_store_zeroed(block, bs->block_size)) continue;
+
+        //only worth it if it comes out smaller, otherwise the block is stored as it is
+        size_t bytes = lz_compress(block, bs->block_size, buffer + used, bs->block_size - 1);
+        if(bytes == 0) {
+            memcpy(buffer + used, block, bs->block_size);
+            bytes = bs->block_size;
+            entry->codec = BLOCK_STORE_PACKED_RAW;
+        } else {
+            entry->codec = BLOCK_STORE_PACKED_LZ;
+        }
+        entry->bytes = (uint32_t)bytes;
+        used += bytes;
+        if(used >= chunk) {
+            ok = block_store_pwrite_all(fd, buffer, used, offset);
+            offset += used;
+            used = 0;
         }
-    } 
+    }
+    ok = ok && block_store_pwrite_all(fd, buffer, used, offset);
+    offset += used;
 
-    //close the file
-    close(fd);
+    //the header goes last, an image cut short has no magic
+    block_store_packed_header_t packed = {BLOCK_STORE_PACKED_MAGIC, BLOCK_STORE_PACKED_VERSION,
+        block_store_features(bs), bs->num_blocks, bs->block_size, bs->fbm_blocks,
+        (uint64_t)data_offset, (uint64_t)(offset - data_offset), {0, 0}};
+    ok = ok && block_store_pwrite_all(fd, (const char *)index, index_bytes, sizeof(packed))
+        && block_store_pwrite_all(fd, (const char *)&packed, sizeof(packed), 0);
 
-    return bs;
+    if(fd != -1) close(fd);
+    free(buffer);
+    free(block);
+    free(index);
+    return ok ? (size_t)offset : 0;
 }
 
-size_t block_store_serialize(const block_store_t *const bs, const char *const filename)
+//Hands out the stored blocks of a compressed image front to back, reading a chunk at a time
+//but never past the image, so a stream can carry something else after it
+typedef struct packed_reader{
+    int fd;
+    char *buffer;
+    size_t size;       //a chunk plus a block, whatever is left over always has room to grow by a chunk
+    size_t start, end; //bytes read but not handed out
+    uint64_t left;     //bytes of the image not read yet
+    size_t chunk;
+} packed_reader_t;
+
+//The next len bytes, NULL if the image ends first or a read fails
+static const char *block_store_packed_next(packed_reader_t *const reader, const size_t len)
 {
-    //checks if the block store is null
-    if(bs == NULL) return 0;
-    //checks if the filename is null
-    if(filename == NULL) return 0;
+    if(reader->end - reader->start < len) {
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+        size_t want = reader->size - reader->end;
+        if(want > reader->left) want = reader->left;
+        if(!block_store_read_all(reader->fd, reader->buffer + reader->end, want, reader->chunk)) return NULL;
+        reader->end += want;
+        reader->left -= want;
+        if(reader->end < len) return NULL;
+    }
+    const char *bytes = reader->buffer + reader->start;
+    reader->start += len;
+    return bytes;
+}
 
-    //open the file 
-    int fd = open(filename, O_WRONLY | O_CREAT, S_IRWXU);
-    //check if there was an error while opening the file
-    if(fd == -1) {
+//Reads the rest of a compressed image from fd, first is its header, already read
+static block_store_t *block_store_unpack(const int fd, const block_store_header_t *const first, const size_t chunk)
+{
+    block_store_packed_header_t packed;
+    memcpy(&packed, first, sizeof(packed));
+    block_store_t geometry = {0};
+    if(!block_store_packed_layout(&geometry, &packed)) return NULL;
 
-        return 0;
+    const size_t index_bytes = geometry.num_blocks * sizeof(block_store_packed_entry_t);
+    block_store_packed_entry_t *index = malloc(index_bytes);
+    packed_reader_t reader = {fd, NULL, chunk + geometry.block_size, 0, 0, packed.data_bytes, chunk};
+    reader.buffer = malloc(reader.size);
+    block_store_t *bs = NULL;
+    bool ok = index != NULL && reader.buffer != NULL && block_store_read_all(fd, (char *)index, index_bytes, chunk);
+    if(ok) {
+        bs = block_store_create_flags(geometry.num_blocks, geometry.block_size, block_store_feature_options(&geometry));
+        ok = bs != NULL;
     }
+    uint64_t offset = packed.data_offset;
+    for(size_t b = 0; ok && b < geometry.num_blocks; b++) {
+        //the blocks are back to back in order, that is what lets a stream be read without seeking
+        //zero blocks are left alone, the arena is zeroed already and its pages stay untouched
+        const block_store_packed_entry_t *entry = &index[b];
+        ok = entry->offset == offset
+            && block_store_unpack_block(bs->block_size, entry, block_store_packed_next(&reader, entry->bytes), bs->data + b * bs->block_size);
+        offset += entry->bytes;
+    }
+    //every stored byte accounted for, and a header in block 0 that agrees with the one in front
+    ok = ok && offset == packed.data_offset + packed.data_bytes && block_store_packed_agrees(bs, bs->data) && block_store_loaded(bs);
+    free(reader.buffer);
+    free(index);
+    if(!ok && bs != NULL) {
+        block_store_free(bs);
+        return NULL;
+    }
+    return bs;
+}
 
-    //set the buffer
-    void* buf[BLOCK_STORE_NUM_BLOCKS];
-
-    size_t total_bytes = 0; //initialize total bytes written to zero
+//Reads one device block of an image into dst, scratch holds a compressed block on its way through
+static bool block_store_image_block(const block_store_image_t *const image, const size_t block, char *const dst, char *const scratch)
+{
+    const size_t block_size = image->block_size;
+    if(image->index == NULL) {
+        return block_store_pread_all(image->fd, dst, block_size, (off_t)(block * block_size));
+    }
+    const block_store_packed_entry_t *entry = &image->index[block];
+    if(entry->bytes > block_size) return false;
+    if(entry->codec == BLOCK_STORE_PACKED_ZERO) memset(dst, 0, block_size);
+    //a raw block can go straight where it belongs
+    char *stored = entry->codec == BLOCK_STORE_PACKED_RAW ? dst : scratch;
+    if(entry->bytes > 0 && !block_store_pread_all(image->fd, stored, entry->bytes, (off_t)entry->offset)) return false;
+    return block_store_unpack_block(block_size, entry, stored, dst);
+}
 
-    //writes each block to the file
-    for(size_t i = 0; i < BLOCK_STORE_NUM_BLOCKS; i++) {
-        //read block into buffer
-        size_t num_bytes = block_store_read(bs, i, buf);
+block_store_image_t *block_store_image_open(const char *const filename)
+{
+    if(filename == NULL) return NULL;
+    block_store_image_t *image = calloc(1, sizeof(block_store_image_t));
+    if(image == NULL) return NULL;
+    image->fd = open(filename, O_RDONLY);
 
-        //check if buffer was correctly written to
-        if(num_bytes == 0) {
+    //the same two kinds of image block_store_deserialize takes
+    struct stat st;
+    block_store_header_t header;
+    block_store_t geometry = {0};
+    bool ok = image->fd != -1 && fstat(image->fd, &st) == 0
+        && pread(image->fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+    if(ok && header.magic == BLOCK_STORE_PACKED_MAGIC) {
+        block_store_packed_header_t packed;
+        memcpy(&packed, &header, sizeof(packed));
+        ok = block_store_packed_layout(&geometry, &packed) && (uint64_t)st.st_size >= packed.data_offset
+            && (uint64_t)st.st_size - packed.data_offset >= packed.data_bytes;
+        const size_t index_bytes = geometry.num_blocks * sizeof(block_store_packed_entry_t);
+        image->index = ok ? malloc(index_bytes) : NULL;
+        ok = image->index != NULL && block_store_pread_all(image->fd, (char *)image->index, index_bytes, sizeof(packed));
+    } else {
+        ok = ok && block_store_read_header(&geometry, &header, st.st_size);
+    }
 
-            return 0;
+    //the metadata blocks are all a read needs besides the block itself, they stay in memory
+    if(ok) {
+        image->num_blocks = geometry.num_blocks;
+        image->block_size = geometry.block_size;
+        image->fbm_blocks = geometry.fbm_blocks;
+        image->avail_blocks = geometry.avail_blocks;
+        image->meta = malloc(image->fbm_blocks * image->block_size);
+        char *scratch = malloc(image->block_size);
+        ok = image->meta != NULL && scratch != NULL;
+        for(size_t b = 0; ok && b < image->fbm_blocks; b++) {
+            ok = block_store_image_block(image, b, image->meta + b * image->block_size, scratch);
         }
-        //write buffer of block to file
-        size_t bytes_written = write(fd, buf, BLOCK_STORE_NUM_BLOCKS);
+        free(scratch);
+        ok = ok && block_store_packed_agrees(&geometry, image->meta);
+    }
+    if(ok) {
+        image->fbm = bitmap_overlay(image->avail_blocks, image->meta + sizeof(block_store_header_t));
+        ok = image->fbm != NULL;
+        if(geometry.flags & BS_CHECKSUM) {
+            image->crc = (const uint32_t *)(image->meta + CRC_OFFSET(&geometry));
+        }
+        if(geometry.flags & BS_DEDUP) {
+            image->map = (const uint32_t *)(image->meta + MAP_OFFSET(&geometry));
+        }
+    }
+    if(!ok) {
+        block_store_image_close(image);
+        return NULL;
+    }
+    return image;
+}
 
-        //check if the file was correctly written to
-        if(bytes_written == 0) {
+size_t block_store_image_read(const block_store_image_t *const image, const size_t block_id, void *buffer)
+{
+    if(image == NULL || buffer == NULL) return 0;
+    if(block_id >= image->avail_blocks) return 0;
 
-            return 0;
-        }
-        //add the bytes written for the block to the total bytes written
-        total_bytes += bytes_written;
+    //every call has its own scratch, so reads from several threads don't get in each other's way
+    char *scratch = image->index != NULL ? malloc(image->block_size) : NULL;
+    if(image->index != NULL && scratch == NULL) return 0;
+    //a deduplicated block is in the slot its map entry names, or nowhere if it is zeroed
+    size_t block = image->fbm_blocks + block_id;
+    bool ok = true;
+    if(image->map != NULL) {
+        const uint32_t slot = image->map[block_id];
+        ok = slot <= image->avail_blocks;
+        block = slot != 0 ? image->fbm_blocks + slot - 1 : SIZE_MAX;
+        if(slot == 0) memset(buffer, 0, image->block_size);
     }
+    ok = ok && (block == SIZE_MAX || block_store_image_block(image, block, buffer, scratch));
+    free(scratch);
+    //the same rule as block_store_read, allocated blocks have to match their checksums
+    if(ok && image->crc != NULL && bitmap_test(image->fbm, block_id)) {
+        ok = crc32c(0, buffer, image->block_size) == image->crc[block_id];
+    }
+    return ok ? image->block_size : 0;
+}
 
-    //close the file
-    close(fd);
+size_t block_store_image_get_avail_blocks(const block_store_image_t *const image)
+{
+    if(image == NULL) return SIZE_MAX;
+    return image->avail_blocks;
+}
 
+size_t block_store_image_get_block_size(const block_store_image_t *const image)
+{
+    if(image == NULL) return SIZE_MAX;
+    return image->block_size;
+}
 
-    //return the total number of bytes written to files
-    return total_bytes;
+void block_store_image_close(block_store_image_t *const image)
+{
+    if(image == NULL) return;
+    bitmap_destroy(image->fbm);
+    free(image->meta);
+    free(image->index);
+    if(image->fd != -1) close(image->fd);
+    free(image);
 }
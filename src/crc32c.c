@@ -0,0 +1,136 @@
+#define _GNU_SOURCE //getauxval
+#include <stdint.h>
+#include "crc32c.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32C_ARM
+#endif
+
+//CRC-32C polynomial, bit-reversed
+#define CRC32C_POLY 0x82F63B78u
+
+//table[0] is the usual byte at a time table, table[k] runs a byte through k more zero bytes,
+//so eight lookups cover eight bytes at once
+static uint32_t crc32c_table[8][256];
+
+typedef uint32_t (*crc32c_fn_t)(uint32_t crc, const unsigned char *buf, size_t len);
+static crc32c_fn_t crc32c_impl;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+//The CRC here is the inverted one, crc32c() does the inverting on the way in and out
+static uint32_t crc32c_slice8(uint32_t crc, const unsigned char *buf, size_t len)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for(; len >= 8; len -= 8, buf += 8) {
+        uint32_t one, two;
+        memcpy(&one, buf, 4);
+        memcpy(&two, buf + 4, 4);
+        one ^= crc;
+        crc = crc32c_table[7][one & 0xff] ^ crc32c_table[6][(one >> 8) & 0xff]
+            ^ crc32c_table[5][(one >> 16) & 0xff] ^ crc32c_table[4][one >> 24]
+            ^ crc32c_table[3][two & 0xff] ^ crc32c_table[2][(two >> 8) & 0xff]
+            ^ crc32c_table[1][(two >> 16) & 0xff] ^ crc32c_table[0][two >> 24];
+    }
+#endif
+    for(; len > 0; len--) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xff];
+    }
+    return crc;
+}
+
+#ifdef CRC32C_X86
+//One crc32 instruction per eight bytes
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *buf, size_t len)
+{
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for(; len >= 8; len -= 8, buf += 8) {
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+#endif
+    for(; len >= 4; len -= 4, buf += 4) {
+        uint32_t word;
+        memcpy(&word, buf, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+    for(; len > 0; len--) {
+        crc = _mm_crc32_u8(crc, *buf++);
+    }
+    return crc;
+}
+#endif
+
+#ifdef CRC32C_ARM
+__attribute__((target("+crc")))
+static uint32_t crc32c_armv8(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    for(; len >= 8; len -= 8, buf += 8) {
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        crc = __crc32cd(crc, word);
+    }
+    for(; len > 0; len--) {
+        crc = __crc32cb(crc, *buf++);
+    }
+    return crc;
+}
+#endif
+
+//Builds the tables (the software path is always there for crc32c_sw) and picks what crc32c runs on
+static void crc32c_init(void)
+{
+    for(unsigned i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for(int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for(unsigned i = 0; i < 256; i++) {
+        for(int k = 1; k < 8; k++) {
+            const uint32_t prev = crc32c_table[k - 1][i];
+            crc32c_table[k][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+        }
+    }
+
+    crc32c_impl = crc32c_slice8;
+#if defined(CRC32C_X86)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")) crc32c_impl = crc32c_sse42;
+#elif defined(CRC32C_ARM)
+    if(getauxval(AT_HWCAP) & HWCAP_CRC32) crc32c_impl = crc32c_armv8;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *const buf, const size_t len)
+{
+    if(buf == NULL) return crc;
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_impl(~crc, buf, len);
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *const buf, const size_t len)
+{
+    if(buf == NULL) return crc;
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_slice8(~crc, buf, len);
+}
+
+bool crc32c_hw(void)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_impl != crc32c_slice8;
+}
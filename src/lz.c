@@ -0,0 +1,171 @@
+#include <stdint.h>
+#include "lz.h"
+
+#include <string.h>
+#include <stdbool.h>
+
+//Positions of recent 4-byte sequences, keyed by a multiplicative hash
+#define LZ_HASH_BITS 12
+
+//After this many misses in a row the search starts skipping ahead, so incompressible data goes by quickly
+#define LZ_SKIP_TRIGGER 6
+
+static uint32_t lz_read32(const uint8_t *const p)
+{
+    uint32_t word;
+    memcpy(&word, p, 4);
+    return word;
+}
+
+static uint32_t lz_hash(const uint32_t word)
+{
+    return (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+//How far two spans starting at a and b agree, stopping at end (a runs ahead of b)
+static size_t lz_match_length(const uint8_t *a, const uint8_t *b, const uint8_t *const end)
+{
+    const uint8_t *const start = a;
+    while(end - a >= 8) {
+        uint64_t x, y;
+        memcpy(&x, a, 8);
+        memcpy(&y, b, 8);
+        if(x != y) {
+            return a - start + (size_t)__builtin_ctzll(x ^ y) / 8;
+        }
+        a += 8;
+        b += 8;
+    }
+    while(a < end && *a == *b) {
+        a++;
+        b++;
+    }
+    return a - start;
+}
+
+//The 255-at-a-time tail of a length that didn't fit its nibble
+static uint8_t *lz_put_length(uint8_t *out, size_t len)
+{
+    for(; len >= 255; len -= 255) {
+        *out++ = 255;
+    }
+    *out++ = (uint8_t)len;
+    return out;
+}
+
+//Writes one sequence, literals then (unless it is the last one) a match, NULL if dst runs out
+static uint8_t *lz_put_sequence(uint8_t *out, uint8_t *const out_end, const uint8_t *const literals, const size_t literal_len,
+                                const size_t distance, const size_t match_len)
+{
+    //token, both length tails, literals and distance, worked out before anything is written
+    const size_t need = 1 + literal_len / 255 + 1 + literal_len + 2 + match_len / 255 + 1;
+    if((size_t)(out_end - out) < need) return NULL;
+
+    const size_t match_code = match_len == 0 ? 0 : match_len - LZ_MIN_MATCH;
+    uint8_t *token = out++;
+    *token = (uint8_t)(((literal_len < 15 ? literal_len : 15) << 4) | (match_code < 15 ? match_code : 15));
+    if(literal_len >= 15) out = lz_put_length(out, literal_len - 15);
+    //an empty input has no literals to point at
+    if(literal_len > 0) memcpy(out, literals, literal_len);
+    out += literal_len;
+    if(match_len == 0) return out;
+
+    *out++ = (uint8_t)distance;
+    *out++ = (uint8_t)(distance >> 8);
+    if(match_code >= 15) out = lz_put_length(out, match_code - 15);
+    return out;
+}
+
+size_t lz_compress(const void *const src, const size_t len, void *const dst, const size_t cap)
+{
+    //positions go in the hash table as 32 bits
+    if((src == NULL && len > 0) || dst == NULL || len > UINT32_MAX) return 0;
+    const uint8_t *const in = src, *const end = in + len;
+    uint8_t *out = dst, *const out_end = out + cap;
+
+    //0 for an empty slot is fine, every candidate gets its bytes compared
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    const uint8_t *anchor = in; //first byte not covered by a sequence yet
+    const uint8_t *p = in;
+    size_t misses = 0;
+    //a match needs four bytes to hash, the last few bytes always go out as literals
+    while(len > LZ_MIN_MATCH && p < end - LZ_MIN_MATCH) {
+        const uint32_t word = lz_read32(p);
+        const uint32_t h = lz_hash(word);
+        const uint8_t *candidate = in + table[h];
+        table[h] = (uint32_t)(p - in);
+        if(candidate >= p || p - candidate > LZ_MAX_DISTANCE || lz_read32(candidate) != word) {
+            const size_t step = 1 + (misses++ >> LZ_SKIP_TRIGGER);
+            p = (size_t)(end - p) > step ? p + step : end;
+            continue;
+        }
+        misses = 0;
+        //stretch the match back over literals that happen to agree too
+        while(p > anchor && candidate > in && p[-1] == candidate[-1]) {
+            p--;
+            candidate--;
+        }
+        const size_t match_len = LZ_MIN_MATCH + lz_match_length(p + LZ_MIN_MATCH, candidate + LZ_MIN_MATCH, end);
+        out = lz_put_sequence(out, out_end, anchor, p - anchor, p - candidate, match_len);
+        if(out == NULL) return 0;
+        p += match_len;
+        anchor = p;
+        //one position inside the match, so the next search has something close by
+        if(p < end - LZ_MIN_MATCH) table[lz_hash(lz_read32(p - 2))] = (uint32_t)(p - 2 - in);
+    }
+    out = lz_put_sequence(out, out_end, anchor, end - anchor, 0, 0);
+    return out == NULL ? 0 : (size_t)(out - (uint8_t *)dst);
+}
+
+//Reads the tail of a length, false if the input ends first
+static bool lz_get_length(const uint8_t **const in, const uint8_t *const in_end, size_t *const len)
+{
+    uint8_t byte;
+    do {
+        if(*in >= in_end) return false;
+        byte = *(*in)++;
+        *len += byte;
+    } while(byte == 255);
+    return true;
+}
+
+size_t lz_decompress(const void *const src, const size_t len, void *const dst, const size_t cap)
+{
+    if(src == NULL || (dst == NULL && cap > 0)) return SIZE_MAX;
+    const uint8_t *in = src, *const in_end = in + len;
+    uint8_t *out = dst, *const out_end = out + cap;
+
+    for(;;) {
+        if(in >= in_end) return SIZE_MAX;
+        const uint8_t token = *in++;
+        size_t literal_len = token >> 4;
+        if(literal_len == 15 && !lz_get_length(&in, in_end, &literal_len)) return SIZE_MAX;
+        if(literal_len > (size_t)(in_end - in) || literal_len > (size_t)(out_end - out)) return SIZE_MAX;
+        memcpy(out, in, literal_len);
+        in += literal_len;
+        out += literal_len;
+        //the last sequence ends with its literals
+        if(in == in_end) return out - (uint8_t *)dst;
+
+        if(in_end - in < 2) return SIZE_MAX;
+        const size_t distance = in[0] | (size_t)in[1] << 8;
+        in += 2;
+        size_t match_len = token & 15;
+        if(match_len == 15 && !lz_get_length(&in, in_end, &match_len)) return SIZE_MAX;
+        match_len += LZ_MIN_MATCH;
+        if(distance == 0 || distance > (size_t)(out - (uint8_t *)dst) || match_len > (size_t)(out_end - out)) return SIZE_MAX;
+
+        const uint8_t *from = out - distance;
+        if(distance >= match_len) {
+            memcpy(out, from, match_len);
+            out += match_len;
+        } else {
+            //the match runs into itself, a run of a short pattern
+            for(size_t i = 0; i < match_len; i++) {
+                *out++ = from[i];
+            }
+        }
+    }
+}
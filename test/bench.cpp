@@ -0,0 +1,882 @@
+/*
+ * Benchmarks for the bitmap and block store.
+ *  ./hw3_bench            runs everything
+ *  ./hw3_bench ffz ...    runs only the named benchmarks
+ * Configure with -DCMAKE_BUILD_TYPE=Release, the default build is unoptimized.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bitmap.h"
+#include "block_store.h"
+#include "crc32c.h"
+
+typedef void (*bench_func)();
+
+struct bench_entry {
+    const char *name;
+    bench_func func;
+};
+
+static double seconds_since(const std::chrono::steady_clock::time_point &start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Keeps the optimizer from throwing away results we never look at
+static volatile size_t sink;
+
+// What bitmap_ffz used to be: one bitmap_test call per bit
+static size_t ffz_per_bit(const bitmap_t *bitmap) {
+    const size_t bits = bitmap_get_bits(bitmap);
+    size_t result = 0;
+    for (; result < bits && bitmap_test(bitmap, result); ++result) {
+    }
+    return result == bits ? SIZE_MAX : result;
+}
+
+static size_t total_set_per_bit(const bitmap_t *bitmap) {
+    const size_t bits = bitmap_get_bits(bitmap);
+    size_t total = 0;
+    for (size_t i = 0; i < bits; ++i) {
+        total += bitmap_test(bitmap, i);
+    }
+    return total;
+}
+
+// First-fit leaves the low end of the map full, so fill a prefix of the bitmap
+// and time how long it takes to find the first hole past it.
+static void bench_ffz() {
+    const size_t bits = 1 << 20;
+    const double fills[] = {0.0, 0.25, 0.5, 0.9, 0.99, 1.0};
+
+    std::printf("%8s %14s %14s %9s\n", "fill", "per-bit ns", "word ns", "speedup");
+    for (double fill : fills) {
+        bitmap_t *bitmap = bitmap_create(bits);
+        const size_t used = (size_t)(bits * fill);
+        for (size_t i = 0; i < used; ++i) {
+            bitmap_set(bitmap, i);
+        }
+
+        const int reps = 20;
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < reps; ++r) {
+            sink = ffz_per_bit(bitmap);
+        }
+        const double slow = seconds_since(start) / reps;
+
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < reps; ++r) {
+            sink = bitmap_ffz(bitmap);
+        }
+        const double fast = seconds_since(start) / reps;
+
+        std::printf("%7.0f%% %14.0f %14.0f %8.1fx\n", fill * 100, slow * 1e9, fast * 1e9,
+                    fast > 0 ? slow / fast : 0.0);
+        bitmap_destroy(bitmap);
+    }
+}
+
+static void bench_total_set() {
+    const size_t bits = 1 << 20;
+    bitmap_t *bitmap = bitmap_create(bits);
+    for (size_t i = 0; i < bits; i += 3) {
+        bitmap_set(bitmap, i);
+    }
+
+    const int reps = 20;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < reps; ++r) {
+        sink = total_set_per_bit(bitmap);
+    }
+    const double slow = seconds_since(start) / reps;
+
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < reps; ++r) {
+        sink = bitmap_total_set(bitmap);
+    }
+    const double fast = seconds_since(start) / reps;
+
+    std::printf("total_set over %zu bits: per-bit %.0f ns, popcount %.0f ns (%.1fx)\n", bits, slow * 1e9,
+                fast * 1e9, fast > 0 ? slow / fast : 0.0);
+    bitmap_destroy(bitmap);
+}
+
+// Flat vs hierarchical ffz on a map that is full except for its last bit,
+// which is the worst case for the linear scan
+static void bench_ffz_hierarchical() {
+    std::printf("%12s %12s %12s %14s %14s\n", "bits", "flat ns", "tree ns", "flat set ns", "tree set ns");
+    for (size_t bits = 1 << 10; bits <= (size_t) 1 << 26; bits <<= 4) {
+        bitmap_t *flat = bitmap_create(bits);
+        bitmap_t *tree = bitmap_create_hierarchical(bits);
+        bitmap_format(flat, 0xFF);
+        bitmap_format(tree, 0xFF);
+        bitmap_reset(flat, bits - 1);
+        bitmap_reset(tree, bits - 1);
+
+        const int reps = 200;
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < reps; ++r) {
+            sink = bitmap_ffz(flat);
+        }
+        const double flat_ffz = seconds_since(start) / reps;
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < reps; ++r) {
+            sink = bitmap_ffz(tree);
+        }
+        const double tree_ffz = seconds_since(start) / reps;
+
+        // set/reset pairs that flip a word between full and not full, so the summary has to move
+        const int flips = 1 << 20;
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < flips; ++r) {
+            bitmap_set(flat, bits - 1);
+            bitmap_reset(flat, bits - 1);
+        }
+        const double flat_set = seconds_since(start) / flips;
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < flips; ++r) {
+            bitmap_set(tree, bits - 1);
+            bitmap_reset(tree, bits - 1);
+        }
+        const double tree_set = seconds_since(start) / flips;
+
+        std::printf("%12zu %12.1f %12.1f %14.1f %14.1f\n", bits, flat_ffz * 1e9, tree_ffz * 1e9, flat_set * 1e9,
+                    tree_set * 1e9);
+        bitmap_destroy(flat);
+        bitmap_destroy(tree);
+    }
+}
+
+// Opening a mapped store only reads the header, so it should not grow with the device
+static void bench_mmap_open() {
+    std::printf("%12s %14s %14s\n", "device MiB", "open us", "flush 1 blk us");
+    for (size_t blocks = 4096; blocks <= 262144; blocks <<= 2) {
+        block_store_t *bs = block_store_create_mmap("bench_mmap.bs", blocks, 4096);
+        if (!bs) {
+            std::printf("could not create bench_mmap.bs\n");
+            return;
+        }
+        block_store_destroy(bs);
+
+        auto start = std::chrono::steady_clock::now();
+        bs = block_store_open_mmap("bench_mmap.bs", 0);
+        const double open = seconds_since(start);
+
+        char buffer[4096] = {1};
+        size_t id = block_store_allocate(bs);
+        block_store_write(bs, id, buffer);
+        start = std::chrono::steady_clock::now();
+        block_store_flush(bs);
+        const double flush = seconds_since(start);
+
+        std::printf("%12zu %14.1f %14.1f\n", blocks * 4096 >> 20, open * 1e6, flush * 1e6);
+        block_store_destroy(bs);
+    }
+    std::remove("bench_mmap.bs");
+}
+
+// Parsing blocks in place vs copying them out first, the parse just sums the words of the block
+static void bench_borrow() {
+    const size_t blocks = 16384, block_size = 4096;
+    block_store_t *bs = block_store_create_ex(blocks, block_size);
+    const size_t avail = block_store_get_avail_blocks(bs);
+    std::vector<uint64_t> buffer(block_size / sizeof(uint64_t), 0x0101010101010101);
+    for (size_t i = 0; i < avail; ++i) {
+        block_store_write(bs, i, buffer.data());
+    }
+
+    const int reps = 10;
+    uint64_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < reps; ++r) {
+        for (size_t i = 0; i < avail; ++i) {
+            block_store_read(bs, i, buffer.data());
+            for (uint64_t word : buffer) {
+                sum += word;
+            }
+        }
+    }
+    const double copy = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < reps; ++r) {
+        for (size_t i = 0; i < avail; ++i) {
+            const uint64_t *words = static_cast<const uint64_t *>(block_store_borrow(bs, i));
+            for (size_t w = 0; w < block_size / sizeof(uint64_t); ++w) {
+                sum += words[w];
+            }
+            block_store_return(bs, i);
+        }
+    }
+    const double borrow = seconds_since(start);
+    sink = sum;
+
+    const double gib = (double) reps * avail * block_size / (1 << 30);
+    std::printf("copy then parse: %6.2f GiB/s\nparse in place:  %6.2f GiB/s\n", gib / copy, gib / borrow);
+    block_store_destroy(bs);
+}
+
+// Filling a store one allocate at a time rescans the full prefix every call, the batch walks the FBM once
+static void bench_batch() {
+    std::printf("%12s %14s %14s\n", "blocks", "one by one ms", "batch ms");
+    for (size_t blocks = 4096; blocks <= 262144; blocks <<= 2) {
+        block_store_t *bs = block_store_create_ex(blocks, 64);
+        const size_t avail = block_store_get_avail_blocks(bs);
+        std::vector<size_t> ids(avail);
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < avail; ++i) {
+            ids[i] = block_store_allocate(bs);
+        }
+        const double single = seconds_since(start);
+        block_store_release_batch(bs, ids.data(), avail);
+
+        start = std::chrono::steady_clock::now();
+        sink = block_store_allocate_batch(bs, avail, ids.data());
+        const double batch = seconds_since(start);
+
+        std::printf("%12zu %14.2f %14.2f\n", blocks, single * 1e3, batch * 1e3);
+        block_store_destroy(bs);
+    }
+}
+
+// One step of an allocation trace: allocate size blocks for object id, or free object id (size 0)
+struct trace_op {
+    size_t id;
+    size_t size;
+};
+
+// A churning mix of mostly small objects and the odd large one, frees pick a random live object.
+// Generated once with a fixed seed so every policy replays the same trace.
+static std::vector<trace_op> make_trace(const size_t capacity, const size_t ops) {
+    std::vector<trace_op> trace;
+    std::vector<size_t> live, sizes;
+    size_t in_use = 0;
+    uint64_t seed = 42;
+    auto next = [&seed]() {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (size_t) (seed >> 33);
+    };
+    for (size_t i = 0; i < ops; ++i) {
+        // Hover around 80% full
+        if (live.empty() || (in_use < capacity * 8 / 10 && next() % 4 != 0)) {
+            const size_t size = next() % 16 == 0 ? 16 + next() % 112 : 1 + next() % 8;
+            trace.push_back({sizes.size(), size});
+            live.push_back(sizes.size());
+            sizes.push_back(size);
+            in_use += size;
+        } else {
+            const size_t pick = next() % live.size();
+            trace.push_back({live[pick], 0});
+            in_use -= sizes[live[pick]];
+            live[pick] = live.back();
+            live.pop_back();
+        }
+    }
+    return trace;
+}
+
+// Fragmentation as 1 - largest free run / free blocks, 0 when all the free space is one run
+static double fragmentation(const std::vector<bool> &used) {
+    size_t free_blocks = 0, run = 0, largest = 0;
+    for (bool bit : used) {
+        run = bit ? 0 : run + 1;
+        free_blocks += !bit;
+        largest = run > largest ? run : largest;
+    }
+    return free_blocks ? 1.0 - (double) largest / free_blocks : 0.0;
+}
+
+static void bench_policies() {
+    const size_t blocks = 65536;
+    const char *names[] = {"first-fit", "next-fit", "best-fit"};
+    const block_store_policy_t policies[] = {BLOCK_STORE_FIRST_FIT, BLOCK_STORE_NEXT_FIT, BLOCK_STORE_BEST_FIT};
+
+    std::printf("%10s %12s %10s %14s\n", "policy", "Mops/s", "failed", "fragmentation");
+    for (size_t p = 0; p < 3; ++p) {
+        block_store_t *bs = block_store_create_ex(blocks, 64);
+        block_store_set_policy(bs, policies[p]);
+        const size_t avail = block_store_get_avail_blocks(bs);
+        const std::vector<trace_op> trace = make_trace(avail, 1 << 18);
+        std::vector<size_t> placed(trace.size(), SIZE_MAX), sizes(trace.size(), 0);
+        size_t failed = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        for (const trace_op &op : trace) {
+            if (op.size) {
+                sizes[op.id] = op.size;
+                failed += !block_store_allocate_extent(bs, op.size, &placed[op.id]);
+            } else if (placed[op.id] != SIZE_MAX) {
+                block_store_release_extent(bs, placed[op.id], sizes[op.id]);
+                placed[op.id] = SIZE_MAX;
+            }
+        }
+        const double elapsed = seconds_since(start);
+
+        // Rebuild the map from what is still placed
+        std::vector<bool> used(avail, false);
+        for (size_t id = 0; id < trace.size(); ++id) {
+            if (placed[id] != SIZE_MAX) {
+                std::fill(used.begin() + placed[id], used.begin() + placed[id] + sizes[id], true);
+            }
+        }
+        std::printf("%10s %12.2f %10zu %14.3f\n", names[p], trace.size() / elapsed / 1e6, failed, fragmentation(used));
+        block_store_destroy(bs);
+    }
+}
+
+// Allocate/write/release churn from several threads: a plain store behind one global mutex
+// (what callers had to do before) against BLOCK_STORE_THREAD_SAFE and BLOCK_STORE_THREAD_CACHE stores
+static double churn(block_store_t *bs, const unsigned threads, std::mutex *global) {
+    const size_t ops = 1 << 18;
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([=]() {
+            char buffer[64] = {0};
+            size_t held[16];
+            for (size_t i = 0; i < ops / threads; i += 16) {
+                for (size_t &id : held) {
+                    if (global) {
+                        std::lock_guard<std::mutex> lock(*global);
+                        id = block_store_allocate(bs);
+                        block_store_write(bs, id, buffer);
+                    } else {
+                        id = block_store_allocate(bs);
+                        block_store_write(bs, id, buffer);
+                    }
+                }
+                for (size_t id : held) {
+                    if (global) {
+                        std::lock_guard<std::mutex> lock(*global);
+                        block_store_release(bs, id);
+                    } else {
+                        block_store_release(bs, id);
+                    }
+                }
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    return ops / seconds_since(start) / 1e6;
+}
+
+static void bench_threads() {
+    std::printf("%8s %16s %20s %16s %10s\n", "threads", "global Mops/s", "thread-safe Mops/s", "cached Mops/s",
+                "hit rate");
+    for (unsigned threads = 1; threads <= 2 * std::thread::hardware_concurrency() && threads <= 32; threads <<= 1) {
+        std::mutex global;
+        block_store_t *plain = block_store_create_ex(1 << 16, 64);
+        block_store_t *sharded = block_store_create_flags(1 << 16, 64, BLOCK_STORE_THREAD_SAFE);
+        block_store_t *cached = block_store_create_flags(1 << 16, 64, BLOCK_STORE_THREAD_CACHE);
+        const double locked = churn(plain, threads, &global);
+        const double parallel = churn(sharded, threads, nullptr);
+        const double magazines = churn(cached, threads, nullptr);
+        block_store_cache_stats_t stats;
+        block_store_get_cache_stats(cached, &stats);
+        std::printf("%8u %16.2f %20.2f %16.2f %9.1f%%\n", threads, locked, parallel, magazines,
+                    100.0 * stats.hits / (stats.hits + stats.misses));
+        block_store_destroy(plain);
+        block_store_destroy(sharded);
+        block_store_destroy(cached);
+    }
+}
+
+// Readers hammering one hot block while a writer rewrites it now and then: a plain store behind
+// a global mutex against the per-block seqlocks of a thread-safe store
+static double hot_reads(block_store_t *bs, const unsigned threads, std::mutex *global) {
+    const size_t reads = 1 << 18;
+    std::atomic<bool> stop(false);
+    std::thread writer([&]() {
+        std::vector<char> block(4096, 1);
+        while (!stop) {
+            if (global) {
+                std::lock_guard<std::mutex> lock(*global);
+                block_store_write(bs, 0, block.data());
+            } else {
+                block_store_write(bs, 0, block.data());
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    });
+    std::vector<std::thread> readers;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned t = 0; t < threads; ++t) {
+        readers.emplace_back([=]() {
+            std::vector<char> block(4096);
+            for (size_t i = 0; i < reads / threads; ++i) {
+                if (global) {
+                    std::lock_guard<std::mutex> lock(*global);
+                    block_store_read(bs, 0, block.data());
+                } else {
+                    block_store_read(bs, 0, block.data());
+                }
+            }
+        });
+    }
+    for (std::thread &reader : readers) {
+        reader.join();
+    }
+    const double elapsed = seconds_since(start);
+    stop = true;
+    writer.join();
+    return reads / elapsed / 1e6;
+}
+
+static void bench_hot_reads() {
+    std::printf("%8s %16s %16s\n", "readers", "global Mreads/s", "seqlock Mreads/s");
+    for (unsigned threads = 1; threads <= 2 * std::thread::hardware_concurrency() && threads <= 32; threads <<= 1) {
+        std::mutex global;
+        block_store_t *plain = block_store_create_ex(64, 4096);
+        block_store_t *seqlocked = block_store_create_flags(64, 4096, BLOCK_STORE_THREAD_SAFE);
+        const double locked = hot_reads(plain, threads, &global);
+        const double optimistic = hot_reads(seqlocked, threads, nullptr);
+        std::printf("%8u %16.2f %16.2f\n", threads, locked, optimistic);
+        block_store_destroy(plain);
+        block_store_destroy(seqlocked);
+    }
+}
+
+// Drops a file's clean pages from the page cache, so the next reads have to go to the disk
+static void drop_cache(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd != -1) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static void count_read(void *arg, ssize_t result) {
+    *static_cast<size_t *>(arg) += result > 0;
+}
+
+// Serialize/deserialize of a 256 MiB store, and random reads of cold blocks from a mapped store:
+// one page fault at a time through block_store_read, or io depth reads at once through block_store_read_async
+static void bench_io_depth() {
+    const size_t blocks = 65536, block_size = 4096, reads = 4096;
+    block_store_t *bs = block_store_create_ex(blocks, block_size);
+    std::vector<char> buffer(block_size, 'x');
+    for (size_t i = 0; i < blocks - 1; ++i) {
+        block_store_request(bs, i);
+        block_store_write(bs, i, buffer.data());
+    }
+    std::vector<size_t> ids(reads);
+    for (size_t i = 0; i < reads; ++i) {
+        ids[i] = (i * 2654435761u) % (blocks - 1);
+    }
+    std::vector<char> out(reads * block_size);
+
+    block_store_serialize(bs, "bench_io.bs");
+    block_store_t *mapped = block_store_open_mmap("bench_io.bs", 0);
+    block_store_flush(mapped);
+    block_store_destroy(mapped);
+    drop_cache("bench_io.bs");
+    mapped = block_store_open_mmap("bench_io.bs", 0);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < reads; ++i) {
+        block_store_read(mapped, ids[i], &out[i * block_size]);
+    }
+    std::printf("cold block_store_read: %.1f us/block\n", seconds_since(start) * 1e6 / reads);
+    block_store_destroy(mapped);
+
+    std::printf("%6s %14s %14s %18s\n", "depth", "serialize MB/s", "deserial. MB/s", "cold async us/blk");
+    for (size_t depth = 1; depth <= 128; depth <<= 2) {
+        block_store_set_io_depth(bs, depth);
+        std::remove("bench_io.bs");
+        start = std::chrono::steady_clock::now();
+        block_store_serialize(bs, "bench_io.bs");
+        const double serialize = seconds_since(start);
+
+        drop_cache("bench_io.bs");
+        start = std::chrono::steady_clock::now();
+        block_store_t *copy = block_store_deserialize("bench_io.bs");
+        const double deserialize = seconds_since(start);
+        block_store_destroy(copy);
+
+        drop_cache("bench_io.bs");
+        mapped = block_store_open_mmap("bench_io.bs", 0);
+        block_store_set_io_depth(mapped, depth);
+        size_t done = 0;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < reads; ++i) {
+            block_store_read_async(mapped, ids[i], &out[i * block_size], count_read, &done);
+        }
+        block_store_wait(mapped);
+        const double async = seconds_since(start);
+        block_store_destroy(mapped);
+
+        const double mb = blocks * block_size / 1e6;
+        std::printf("%6zu %14.0f %14.0f %18.1f\n", depth, mb / serialize, mb / deserialize, async * 1e6 / done);
+    }
+    block_store_destroy(bs);
+    std::remove("bench_io.bs");
+}
+
+// Serialize/deserialize of a 256 MiB store split between more and more threads, page cache warm
+static void bench_serialize_threads() {
+    const size_t blocks = 65536, block_size = 4096;
+    block_store_t *bs = block_store_create_ex(blocks, block_size);
+    std::vector<char> buffer(block_size, 'x');
+    for (size_t i = 0; i < blocks - 1; ++i) {
+        block_store_request(bs, i);
+        block_store_write(bs, i, buffer.data());
+    }
+    std::printf("%8s %14s %16s\n", "threads", "serialize MB/s", "deserialize MB/s");
+    const double mb = blocks * block_size / 1e6;
+    for (size_t threads = 1; threads <= 16; threads <<= 1) {
+        block_store_set_io_threads(bs, threads);
+        // the file is rewritten in place, so this times the copy and not the filesystem growing it
+        block_store_serialize(bs, "bench_io.bs");
+        auto start = std::chrono::steady_clock::now();
+        block_store_serialize(bs, "bench_io.bs");
+        const double serialize = seconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        block_store_t *copy = block_store_deserialize_ex("bench_io.bs", threads);
+        const double deserialize = seconds_since(start);
+        block_store_destroy(copy);
+        std::printf("%8zu %14.0f %16.0f\n", threads, mb / serialize, mb / deserialize);
+    }
+    block_store_destroy(bs);
+    std::remove("bench_io.bs");
+}
+
+// serialize_fd of a 256 MiB store into a pipe drained by another thread, the syscall count goes with the chunk size,
+// then a mapped store sendfile-ing its own file vs an anonymous one writing its memory, into a file
+static void bench_stream() {
+    const size_t blocks = 65536, block_size = 4096;
+    block_store_t *bs = block_store_create_ex(blocks, block_size);
+    std::vector<char> buffer(block_size, 'x');
+    for (size_t i = 0; i < blocks - 1; ++i) {
+        block_store_request(bs, i);
+        block_store_write(bs, i, buffer.data());
+    }
+    const double mb = blocks * block_size / 1e6;
+    std::printf("%10s %12s\n", "chunk KiB", "pipe MB/s");
+    for (size_t chunk = 64 * 1024; chunk <= 4 * 1024 * 1024; chunk <<= 2) {
+        int fds[2];
+        if (pipe(fds) != 0) return;
+        std::thread drain([&]() {
+            std::vector<char> sink_buffer(chunk);
+            while (read(fds[0], sink_buffer.data(), chunk) > 0) {
+            }
+        });
+        auto start = std::chrono::steady_clock::now();
+        block_store_serialize_fd(bs, fds[1], chunk);
+        close(fds[1]);
+        drain.join();
+        const double elapsed = seconds_since(start);
+        close(fds[0]);
+        std::printf("%10zu %12.0f\n", chunk >> 10, mb / elapsed);
+    }
+
+    block_store_serialize(bs, "bench_io.bs");
+    block_store_t *mapped = block_store_open_mmap("bench_io.bs", 0);
+    for (block_store_t *store : {bs, mapped}) {
+        int fd = open("bench_stream.bs", O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        block_store_serialize_fd(store, fd, 0);
+        lseek(fd, 0, SEEK_SET);
+        auto start = std::chrono::steady_clock::now();
+        block_store_serialize_fd(store, fd, 0);
+        const double elapsed = seconds_since(start);
+        close(fd);
+        std::printf("%-12s %8.0f MB/s into a file\n", store == bs ? "write" : "sendfile", mb / elapsed);
+    }
+    block_store_destroy(mapped);
+    block_store_destroy(bs);
+    std::remove("bench_io.bs");
+    std::remove("bench_stream.bs");
+}
+
+// Durable writes to a journaled 64 MiB store from more and more threads: every write returns once it is synced,
+// group commit shares the syncs. A full serialize + fsync of the image is what each durable write cost before
+static void bench_wal() {
+    const size_t blocks = 16384, block_size = 4096, writes = 2000;
+    block_store_t *bs = block_store_create_wal("bench_wal.bs", blocks, block_size);
+    if (!bs) {
+        std::printf("could not create bench_wal.bs\n");
+        return;
+    }
+    std::printf("%8s %14s %14s %16s\n", "threads", "durable w/s", "us/write", "commits/sync");
+    for (unsigned threads = 1; threads <= 16; threads <<= 1) {
+        block_store_journal_stats_t before, after;
+        block_store_get_journal_stats(bs, &before);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> writers;
+        for (unsigned t = 0; t < threads; ++t) {
+            writers.emplace_back([bs, t, threads, writes]() {
+                std::vector<char> block(4096, (char) t);
+                for (size_t i = t; i < writes; i += threads) {
+                    block_store_write(bs, i % (blocks - 1), block.data());
+                }
+            });
+        }
+        for (std::thread &writer : writers) {
+            writer.join();
+        }
+        const double elapsed = seconds_since(start);
+        block_store_get_journal_stats(bs, &after);
+        std::printf("%8u %14.0f %14.1f %16.2f\n", threads, writes / elapsed, elapsed * 1e6 * threads / writes,
+                    (double) (after.commits - before.commits) / (after.syncs - before.syncs));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    block_store_serialize(bs, "bench_io.bs");
+    int fd = open("bench_io.bs", O_RDONLY);
+    fsync(fd);
+    close(fd);
+    std::printf("full image rewrite + fsync: %.0f us\n", seconds_since(start) * 1e6);
+    block_store_destroy(bs);
+    std::remove("bench_io.bs");
+    std::remove("bench_wal.bs");
+    std::remove("bench_wal.bs.wal");
+}
+
+// CRC-32C speed with and without the CPU instructions, then what BLOCK_STORE_CHECKSUMS adds to writing,
+// reading and deserializing every block of a 256 MiB store, as time per GB moved
+static void bench_checksum() {
+    std::vector<char> bytes(64 << 20);
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        bytes[i] = (char) (i * 2654435761u >> 24);
+    }
+    std::printf("crc32c uses %s\n", crc32c_hw() ? "CPU instructions" : "slicing-by-8 tables");
+    for (bool hw : {true, false}) {
+        auto start = std::chrono::steady_clock::now();
+        sink = hw ? crc32c(0, bytes.data(), bytes.size()) : crc32c_sw(0, bytes.data(), bytes.size());
+        std::printf("%-14s %8.2f GB/s\n", hw ? "crc32c" : "crc32c_sw", bytes.size() / seconds_since(start) / 1e9);
+    }
+
+    const size_t blocks = 65536, block_size = 4096;
+    const double gb = (blocks - 1) * block_size / 1e9;
+    double base[3] = {0, 0, 0};
+    std::printf("%10s %14s %14s %18s\n", "checksums", "write ms/GB", "read ms/GB", "deserialize ms/GB");
+    for (int flags : {0, BLOCK_STORE_CHECKSUMS}) {
+        block_store_t *bs = block_store_create_flags(blocks, block_size, flags);
+        std::vector<char> block(block_size);
+        const size_t avail = block_store_get_avail_blocks(bs);
+        for (size_t i = 0; i < avail; ++i) {
+            block_store_request(bs, i);
+        }
+        double ms[3];
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < avail; ++i) {
+            std::memcpy(block.data(), bytes.data() + (i * block_size) % bytes.size(), block_size);
+            block_store_write(bs, i, block.data());
+        }
+        ms[0] = seconds_since(start) * 1e3 / gb;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < avail; ++i) {
+            sink = block_store_read(bs, i, block.data());
+        }
+        ms[1] = seconds_since(start) * 1e3 / gb;
+        block_store_serialize(bs, "bench_io.bs");
+        block_store_destroy(bs);
+        start = std::chrono::steady_clock::now();
+        bs = block_store_deserialize("bench_io.bs");
+        ms[2] = seconds_since(start) * 1e3 / gb;
+        block_store_destroy(bs);
+        std::printf("%10s %14.1f %14.1f %18.1f\n", flags ? "on" : "off", ms[0], ms[1], ms[2]);
+        if (flags) {
+            std::printf("%10s %+14.1f %+14.1f %+18.1f\n", "overhead", ms[0] - base[0], ms[1] - base[1], ms[2] - base[2]);
+        } else {
+            std::copy(ms, ms + 3, base);
+        }
+    }
+    std::remove("bench_io.bs");
+}
+
+// A 256 MiB store of log-like records: image size and time for a plain vs a compressed image,
+// and what reading single blocks out of each image costs
+static void bench_compressed() {
+    const size_t blocks = 65536, block_size = 4096;
+    block_store_t *bs = block_store_create_ex(blocks, block_size);
+    std::vector<char> block(block_size);
+    uint32_t x = 1;
+    for (size_t i = 0; i < blocks - 1; ++i) {
+        // records with a counter, a few random bytes and padding, roughly what compresses 3-5x
+        for (size_t at = 0; at + 64 <= block_size; at += 64) {
+            x = x * 1103515245 + 12345;
+            std::snprintf(block.data() + at, 64, "%08zu|user=%05u|op=write|status=ok|............", i * 64 + at, x >> 17);
+        }
+        block_store_request(bs, i);
+        block_store_write(bs, i, block.data());
+    }
+    const double mb = blocks * block_size / 1e6;
+    std::printf("%-11s %10s %14s %16s %14s\n", "image", "MB", "serialize MB/s", "deserialize MB/s", "block read us");
+    for (bool packed : {false, true}) {
+        const char *name = packed ? "bench_packed.bs" : "bench_io.bs";
+        auto start = std::chrono::steady_clock::now();
+        const size_t bytes = packed ? block_store_serialize_compressed(bs, name) : block_store_serialize(bs, name);
+        const double serialize = seconds_since(start);
+        start = std::chrono::steady_clock::now();
+        block_store_t *copy = block_store_deserialize(name);
+        const double deserialize = seconds_since(start);
+        block_store_destroy(copy);
+
+        block_store_image_t *image = block_store_image_open(name);
+        const size_t reads = 20000;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < reads; ++i) {
+            sink = block_store_image_read(image, (i * 7919) % (blocks - 1), block.data());
+        }
+        const double read = seconds_since(start);
+        block_store_image_close(image);
+        std::printf("%-11s %10.1f %14.0f %16.0f %14.2f\n", packed ? "compressed" : "plain", bytes / 1e6,
+                    mb / serialize, mb / deserialize, read * 1e6 / reads);
+        std::remove(name);
+    }
+    block_store_destroy(bs);
+}
+
+static void bench_dedup() {
+    const size_t blocks = 65536, block_size = 4096;
+    // a quarter zeroed pages, most of the rest one of 64 records, one block in eight unique
+    std::vector<std::vector<char>> contents(blocks - 1, std::vector<char>(block_size));
+    uint32_t x = 7;
+    for (size_t i = 0; i < blocks - 1; ++i) {
+        x = x * 1103515245 + 12345;
+        const unsigned pick = (x >> 16) % 8;
+        if (pick < 2) continue;
+        const size_t record = pick == 7 ? i : (x >> 8) % 64;
+        for (size_t at = 0; at + 64 <= block_size; at += 64) {
+            std::snprintf(contents[i].data() + at, 64, "%08zu|record=%06zu|padding.....................", at, record);
+        }
+    }
+    const double mb = (blocks - 1) * block_size / 1e6;
+    std::printf("%-6s %12s %10s %14s %12s\n", "store", "write MB/s", "read MB/s", "stored blocks", "image MB");
+    for (int flags : {0, BLOCK_STORE_DEDUP}) {
+        block_store_t *bs = block_store_create_flags(blocks, block_size, flags);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < blocks - 1; ++i) {
+            block_store_request(bs, i);
+            block_store_write(bs, i, contents[i].data());
+        }
+        const double write = seconds_since(start);
+        std::vector<char> block(block_size);
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < blocks - 1; ++i) {
+            sink = block_store_read(bs, i, block.data());
+        }
+        const double read = seconds_since(start);
+        block_store_serialize(bs, "bench_dedup.bs");
+        struct stat st;
+        stat("bench_dedup.bs", &st);
+        std::printf("%-6s %12.0f %10.0f %14zu %12.1f\n", flags ? "dedup" : "plain", mb / write, mb / read,
+                    block_store_get_stored_blocks(bs), st.st_blocks * 512 / 1e6);
+        std::remove("bench_dedup.bs");
+        block_store_destroy(bs);
+    }
+}
+
+// Resident memory of the whole process, in MB
+static double resident_mb() {
+    long pages = 0, resident = 0;
+    FILE *statm = std::fopen("/proc/self/statm", "r");
+    if (statm != nullptr) {
+        if (std::fscanf(statm, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        std::fclose(statm);
+    }
+    return resident * sysconf(_SC_PAGESIZE) / 1e6;
+}
+
+// A full 256 MiB thread-safe store: what taking a snapshot costs, how the snapshot's memory grows
+// as the device writes over more of it, and writing the snapshot out while writers keep going
+static void bench_snapshot() {
+    const size_t blocks = 65536, block_size = 4096;
+    block_store_t *bs = block_store_create_flags(blocks, block_size, BLOCK_STORE_THREAD_SAFE);
+    std::vector<char> block(block_size, 'a');
+    for (size_t i = 0; i < blocks - 1; ++i) {
+        block_store_request(bs, i);
+        block_store_write(bs, i, block.data());
+    }
+    std::printf("%-10s %12s %14s\n", "rewritten", "snapshot us", "snapshot MB");
+    std::fill(block.begin(), block.end(), 'b');
+    for (size_t percent : {0, 1, 10, 50, 100}) {
+        const double before = resident_mb();
+        auto start = std::chrono::steady_clock::now();
+        block_store_t *snapshot = block_store_snapshot(bs);
+        const double taken = seconds_since(start);
+        for (size_t i = 0; i < (blocks - 1) * percent / 100; ++i) {
+            block_store_write(bs, i, block.data());
+        }
+        std::printf("%9zu%% %12.1f %14.1f\n", percent, taken * 1e6, resident_mb() - before);
+        block_store_destroy(snapshot);
+    }
+
+    const double mb = blocks * block_size / 1e6;
+    std::printf("%-8s %14s %16s\n", "writers", "serialize MB/s", "writer MB/s");
+    for (unsigned writers : {0u, 1u, 2u}) {
+        block_store_t *snapshot = block_store_snapshot(bs);
+        std::atomic<bool> stop(false);
+        std::atomic<size_t> written(0);
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < writers; ++t) {
+            threads.emplace_back([&, t]() {
+                std::vector<char> mine(block_size, (char) ('c' + t));
+                size_t n = 0;
+                for (size_t i = t; !stop.load(std::memory_order_relaxed); i += writers) {
+                    block_store_write(bs, i % (blocks - 1), mine.data());
+                    ++n;
+                }
+                written += n;
+            });
+        }
+        auto start = std::chrono::steady_clock::now();
+        block_store_serialize(snapshot, "bench_snapshot.bs");
+        const double took = seconds_since(start);
+        stop = true;
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        std::printf("%8u %14.0f %16.0f\n", writers, mb / took, written * block_size / 1e6 / took);
+        block_store_destroy(snapshot);
+        std::remove("bench_snapshot.bs");
+    }
+    block_store_destroy(bs);
+}
+
+static const bench_entry benches[] = {
+    {"ffz", bench_ffz},
+    {"total_set", bench_total_set},
+    {"ffz_hierarchical", bench_ffz_hierarchical},
+    {"mmap_open", bench_mmap_open},
+    {"borrow", bench_borrow},
+    {"batch", bench_batch},
+    {"policies", bench_policies},
+    {"threads", bench_threads},
+    {"hot_reads", bench_hot_reads},
+    {"io_depth", bench_io_depth},
+    {"serialize_threads", bench_serialize_threads},
+    {"stream", bench_stream},
+    {"wal", bench_wal},
+    {"checksum", bench_checksum},
+    {"compressed", bench_compressed},
+    {"dedup", bench_dedup},
+    {"snapshot", bench_snapshot},
+};
+
+int main(int argc, char **argv) {
+    for (const bench_entry &bench : benches) {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; ++i) {
+            selected = selected || std::strcmp(argv[i], bench.name) == 0;
+        }
+        if (selected) {
+            std::printf("== %s ==\n", bench.name);
+            bench.func();
+        }
+    }
+    return 0;
+}
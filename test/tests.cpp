@@ -3,7 +3,20 @@
 
 #include <gtest/gtest.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include "block_store.h"
+#include "bitmap.h"
+#include "block_io.h"
+#include "crc32c.h"
+#include "lz.h"
 
 // The object is opaque, so we can't really test things directly....
 
@@ -190,6 +203,146 @@ TEST(block_store, count_free_and_used) {
     score += 5;
 }
 
+TEST(block_store_alloc_free_req, extent)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+
+    // Holes too small for the extent at the front
+    ASSERT_TRUE(block_store_request(bs, 1));
+    ASSERT_TRUE(block_store_request(bs, 5));
+    size_t first = SIZE_MAX;
+    ASSERT_TRUE(block_store_allocate_extent(bs, 10, &first));
+    ASSERT_EQ(6, first);
+    ASSERT_EQ(12, block_store_get_used_blocks(bs));
+    ASSERT_EQ(0, block_store_allocate(bs));
+    ASSERT_EQ(2, block_store_allocate(bs));
+
+    // Spanning word boundaries
+    ASSERT_TRUE(block_store_allocate_extent(bs, 100, &first));
+    ASSERT_EQ(16, first);
+    ASSERT_TRUE(block_store_allocate_extent(bs, 3, &first));
+    ASSERT_EQ(116, first);
+
+    block_store_release_extent(bs, 16, 100);
+    ASSERT_TRUE(block_store_allocate_extent(bs, 100, &first));
+    ASSERT_EQ(16, first);
+
+    // Pinned blocks are left alone by release_extent
+    ASSERT_NE(nullptr, block_store_borrow(bs, 50));
+    block_store_release_extent(bs, 16, 100);
+    ASSERT_FALSE(block_store_request(bs, 50));
+    ASSERT_TRUE(block_store_request(bs, 49));
+    ASSERT_TRUE(block_store_request(bs, 51));
+    block_store_return(bs, 50);
+
+    // Too long, right up to the end, and bad arguments
+    ASSERT_FALSE(block_store_allocate_extent(bs, BLOCK_STORE_AVAIL_BLOCKS, &first));
+    ASSERT_TRUE(block_store_allocate_extent(bs, BLOCK_STORE_AVAIL_BLOCKS - 119, &first));
+    ASSERT_EQ(119, first);
+    ASSERT_FALSE(block_store_allocate_extent(bs, 0, &first));
+    ASSERT_FALSE(block_store_allocate_extent(bs, 1, NULL));
+    ASSERT_FALSE(block_store_allocate_extent(NULL, 1, &first));
+    block_store_release_extent(bs, 200, 100);
+    ASSERT_FALSE(block_store_request(bs, 200));
+
+    block_store_destroy(bs);
+}
+
+TEST(block_store_alloc_free_req, batch)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_request(bs, 2));
+    ASSERT_TRUE(block_store_request(bs, 70));
+
+    std::vector<size_t> ids(BLOCK_STORE_AVAIL_BLOCKS);
+    ASSERT_EQ(100, block_store_allocate_batch(bs, 100, ids.data()));
+    ASSERT_EQ(0, ids[0]);
+    ASSERT_EQ(1, ids[1]);
+    ASSERT_EQ(3, ids[2]);
+    ASSERT_EQ(71, ids[69]);
+    ASSERT_EQ(101, ids[99]);
+    ASSERT_EQ(102, block_store_get_used_blocks(bs));
+    ASSERT_EQ(102, block_store_allocate(bs));
+
+    // Give back every other block, plus one already free and one out of range
+    std::vector<size_t> odd;
+    for (size_t i = 1; i < 100; i += 2) {
+        odd.push_back(ids[i]);
+    }
+    odd.push_back(200);
+    odd.push_back(BLOCK_STORE_AVAIL_BLOCKS);
+    block_store_release_batch(bs, odd.data(), odd.size());
+    ASSERT_EQ(53, block_store_get_used_blocks(bs));
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS - 53, block_store_get_free_blocks(bs));
+    ASSERT_EQ(1, block_store_allocate(bs));
+
+    // Runs out part way through
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS - 54, block_store_allocate_batch(bs, BLOCK_STORE_AVAIL_BLOCKS, ids.data()));
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS, block_store_get_used_blocks(bs));
+    ASSERT_EQ(0, block_store_get_free_blocks(bs));
+    ASSERT_EQ(0, block_store_allocate_batch(bs, 1, ids.data()));
+    ASSERT_EQ(0, block_store_allocate_batch(NULL, 1, ids.data()));
+    ASSERT_EQ(0, block_store_allocate_batch(bs, 1, NULL));
+
+    block_store_destroy(bs);
+}
+
+TEST(block_store_alloc_free_req, policies)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_set_policy(NULL, BLOCK_STORE_NEXT_FIT));
+    ASSERT_FALSE(block_store_set_policy(bs, (block_store_policy_t) 42));
+
+    // Holes of 2 at 10, 5 at 20 and 3 at 30, everything else below 40 taken
+    size_t first = 0;
+    ASSERT_TRUE(block_store_allocate_extent(bs, 40, &first));
+    block_store_release_extent(bs, 10, 2);
+    block_store_release_extent(bs, 20, 5);
+    block_store_release_extent(bs, 30, 3);
+
+    ASSERT_TRUE(block_store_set_policy(bs, BLOCK_STORE_BEST_FIT));
+    ASSERT_TRUE(block_store_allocate_extent(bs, 3, &first));
+    ASSERT_EQ(30, first);
+    ASSERT_TRUE(block_store_allocate_extent(bs, 2, &first));
+    ASSERT_EQ(10, first);
+    ASSERT_TRUE(block_store_allocate_extent(bs, 2, &first));
+    ASSERT_EQ(20, first);
+    block_store_release_extent(bs, 30, 1);
+    ASSERT_EQ(30, block_store_allocate(bs));
+
+    // Next-fit keeps going from the last allocation and wraps around when it runs off the end
+    // (22 to 24 are still free, but the last allocation was 30)
+    ASSERT_TRUE(block_store_set_policy(bs, BLOCK_STORE_NEXT_FIT));
+    ASSERT_EQ(40, block_store_allocate(bs));
+    ASSERT_EQ(41, block_store_allocate(bs));
+    ASSERT_TRUE(block_store_request(bs, BLOCK_STORE_AVAIL_BLOCKS - 1));
+    ASSERT_TRUE(block_store_allocate_extent(bs, BLOCK_STORE_AVAIL_BLOCKS - 43, &first));
+    ASSERT_EQ(42, first);
+    ASSERT_EQ(22, block_store_allocate(bs));
+    block_store_release(bs, 5);
+    ASSERT_EQ(23, block_store_allocate(bs));
+    ASSERT_EQ(24, block_store_allocate(bs));
+    ASSERT_EQ(5, block_store_allocate(bs));
+
+    // First-fit goes back to the bottom
+    block_store_release(bs, 3);
+    block_store_release(bs, 100);
+    ASSERT_TRUE(block_store_set_policy(bs, BLOCK_STORE_FIRST_FIT));
+    ASSERT_EQ(3, block_store_allocate(bs));
+
+    // Near looks forward from the hint and wraps
+    ASSERT_EQ(100, block_store_allocate_near(bs, 60));
+    block_store_release(bs, 7);
+    ASSERT_EQ(7, block_store_allocate_near(bs, 200));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_near(bs, 0));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_near(NULL, 0));
+
+    block_store_destroy(bs);
+}
+
 TEST(block_store, count_free_and_used_null) {
     ASSERT_EQ(SIZE_MAX, block_store_get_used_blocks(NULL));
 
@@ -224,7 +377,7 @@ TEST(block_store_write_read, valid_write) {
 TEST(block_store_write_read, null_bs_write) {
     size_t bytesWritten;
     // Want to give buffer a valid value since we are testing bs.
-    int buffer;
+    int buffer = 0;
     bytesWritten = block_store_write(NULL, 0, &buffer);
     ASSERT_EQ(bytesWritten, 0);
 
@@ -252,7 +405,7 @@ TEST(block_store_write_read, null_buffer_write) {
 TEST(block_store_write_read, null_bs_read) {
     size_t bytesWritten;
     // Want to give buffer a valid value since we are testing bs.
-    int buffer;
+    int buffer = 0;
     bytesWritten = block_store_read(NULL, 0, &buffer);
     ASSERT_EQ(bytesWritten, 0);
     score += 2;
@@ -486,3 +639,2344 @@ TEST(block_store_deserialize, null_filename)
     score += 2;
 }
 
+
+TEST(block_store_deserialize, restores_geometry_and_fbm)
+{
+    // Big enough for the hierarchical FBM, whose summary has to come back too
+    block_store_t *bs = block_store_create_ex(8192, 512);
+    ASSERT_NE(nullptr, bs);
+    for (size_t i = 0; i < 5000; ++i) {
+        ASSERT_EQ(i, block_store_allocate(bs));
+    }
+    block_store_release(bs, 1234);
+    std::vector<uint8_t> write_buffer(512, 'D'), read_buffer(512);
+    ASSERT_EQ(512, block_store_write(bs, 4999, write_buffer.data()));
+    ASSERT_EQ(8192 * 512, block_store_serialize(bs, "test_ex.bs"));
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_ex.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(8192, block_store_get_num_blocks(bs));
+    ASSERT_EQ(512, block_store_get_block_size(bs));
+    ASSERT_EQ(4999, block_store_get_used_blocks(bs));
+    ASSERT_EQ(1234, block_store_allocate(bs));
+    ASSERT_EQ(5000, block_store_allocate(bs));
+    ASSERT_EQ(512, block_store_read(bs, 4999, read_buffer.data()));
+    ASSERT_EQ(write_buffer, read_buffer);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_deserialize, rejects_bad_header)
+{
+    // Right size for the default device, but no header
+    std::vector<uint8_t> junk(BLOCK_STORE_NUM_BYTES, 0x5A);
+    FILE *file = fopen("test_junk.bs", "w");
+    ASSERT_NE(nullptr, file);
+    ASSERT_EQ(junk.size(), fwrite(junk.data(), 1, junk.size(), file));
+    fclose(file);
+    ASSERT_EQ(nullptr, block_store_deserialize("test_junk.bs"));
+
+    // A good header on a truncated image
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_junk.bs"));
+    block_store_destroy(bs);
+    ASSERT_EQ(0, truncate("test_junk.bs", BLOCK_STORE_NUM_BYTES / 2));
+    ASSERT_EQ(nullptr, block_store_deserialize("test_junk.bs"));
+}
+
+TEST(block_store_serialize, truncates_old_image)
+{
+    block_store_t *big = block_store_create_ex(1024, 4096);
+    ASSERT_NE(nullptr, big);
+    ASSERT_EQ(1024 * 4096, block_store_serialize(big, "test_junk.bs"));
+    block_store_destroy(big);
+
+    // Nothing of the bigger image may be left behind the new one
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_junk.bs"));
+    block_store_destroy(bs);
+    struct stat st;
+    ASSERT_EQ(0, stat("test_junk.bs", &st));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, st.st_size);
+    std::remove("test_junk.bs");
+}
+
+TEST(block_store_stream, pipe_round_trip)
+{
+    block_store_t *bs = block_store_create_ex(2048, 1024);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> block(1024);
+    for (size_t i = 0; i < 2047; i += 5) {
+        std::fill(block.begin(), block.end(), (uint8_t) i);
+        ASSERT_TRUE(block_store_request(bs, i));
+        ASSERT_EQ(1024, block_store_write(bs, i, block.data()));
+    }
+
+    // Two images back to back through one pipe, odd chunk sizes, the reader has to stop at the end of each
+    for (size_t chunk : {0, 4000}) {
+        int fds[2];
+        ASSERT_EQ(0, pipe(fds));
+        size_t written = 0;
+        std::thread writer([&]() {
+            written = block_store_serialize_fd(bs, fds[1], chunk);
+            written += block_store_serialize_fd(bs, fds[1], chunk);
+            close(fds[1]);
+        });
+        block_store_t *first = block_store_deserialize_fd(fds[0], chunk);
+        block_store_t *second = block_store_deserialize_fd(fds[0], chunk);
+        // The stream is over, a third image is not there
+        block_store_t *third = block_store_deserialize_fd(fds[0], chunk);
+        writer.join();
+        close(fds[0]);
+        ASSERT_EQ(2 * 2048 * 1024, written);
+        ASSERT_EQ(nullptr, third);
+        for (block_store_t *copy : {first, second}) {
+            ASSERT_NE(nullptr, copy);
+            ASSERT_EQ(block_store_get_used_blocks(bs), block_store_get_used_blocks(copy));
+            for (size_t i = 0; i < 2047; i += 5) {
+                ASSERT_EQ(1024, block_store_read(copy, i, block.data()));
+                ASSERT_EQ(1024, std::count(block.begin(), block.end(), (uint8_t) i));
+            }
+            block_store_destroy(copy);
+        }
+    }
+
+    ASSERT_EQ(0, block_store_serialize_fd(nullptr, 1, 0));
+    ASSERT_EQ(0, block_store_serialize_fd(bs, -1, 0));
+    ASSERT_EQ(nullptr, block_store_deserialize_fd(-1, 0));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_stream, mapped_store_to_file)
+{
+    block_store_t *bs = block_store_create_mmap("test_mmap.bs", 512, 4096);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> block(4096, 'S');
+    ASSERT_TRUE(block_store_request(bs, 300));
+    ASSERT_EQ(4096, block_store_write(bs, 300, block.data()));
+
+    // Not flushed, the image still has the write
+    int fd = open("test_stream.bs", O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    ASSERT_NE(-1, fd);
+    ASSERT_EQ(5, write(fd, "hello", 5));
+    ASSERT_EQ(512 * 4096, block_store_serialize_fd(bs, fd, 0));
+    block_store_destroy(bs);
+
+    ASSERT_EQ(5, lseek(fd, 5, SEEK_SET));
+    block_store_t *copy = block_store_deserialize_fd(fd, 64 * 1024);
+    close(fd);
+    ASSERT_NE(nullptr, copy);
+    ASSERT_EQ(1, block_store_get_used_blocks(copy));
+    std::vector<uint8_t> back(4096);
+    ASSERT_EQ(4096, block_store_read(copy, 300, back.data()));
+    ASSERT_EQ(block, back);
+    block_store_destroy(copy);
+    std::remove("test_stream.bs");
+}
+
+TEST(block_store_serialize, incremental)
+{
+    block_store_t *bs = block_store_create_ex(1024, 4096);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> buffer(4096);
+    for (size_t i = 0; i < 100; ++i) {
+        ASSERT_EQ(i, block_store_allocate(bs));
+        memset(buffer.data(), (int) i, buffer.size());
+        ASSERT_EQ(4096, block_store_write(bs, i, buffer.data()));
+    }
+
+    // No image yet: a fresh one with the FBM block and the 100 allocated blocks
+    unlink("test_incr.bs");
+    ASSERT_EQ(101 * 4096, block_store_serialize_incremental(bs, "test_incr.bs"));
+    struct stat st;
+    ASSERT_EQ(0, stat("test_incr.bs", &st));
+    ASSERT_EQ(1024 * 4096, st.st_size);
+
+    // Nothing changed, only the header block goes out
+    ASSERT_EQ(4096, block_store_serialize_incremental(bs, "test_incr.bs"));
+
+    // One block rewritten and one released: the header/FBM block plus the rewrite
+    memset(buffer.data(), 0xEE, buffer.size());
+    ASSERT_EQ(4096, block_store_write(bs, 50, buffer.data()));
+    block_store_release(bs, 60);
+    ASSERT_EQ(2 * 4096, block_store_serialize_incremental(bs, "test_incr.bs"));
+
+    block_store_t *copy = block_store_deserialize("test_incr.bs");
+    ASSERT_NE(nullptr, copy);
+    ASSERT_EQ(99, block_store_get_used_blocks(copy));
+    ASSERT_TRUE(block_store_request(copy, 60));
+    std::vector<uint8_t> read_buffer(4096);
+    ASSERT_EQ(4096, block_store_read(copy, 50, read_buffer.data()));
+    ASSERT_EQ(buffer, read_buffer);
+    ASSERT_EQ(4096, block_store_read(copy, 99, read_buffer.data()));
+    ASSERT_EQ(99, read_buffer[0]);
+    // The released block was punched out
+    ASSERT_EQ(4096, block_store_read(copy, 60, read_buffer.data()));
+    ASSERT_EQ(std::vector<uint8_t>(4096, 0), read_buffer);
+    block_store_destroy(copy);
+
+    // A different store writing to the image forces a full rewrite
+    block_store_t *other = block_store_create_ex(1024, 4096);
+    ASSERT_NE(nullptr, other);
+    ASSERT_EQ(4096, block_store_serialize_incremental(other, "test_incr.bs"));
+    block_store_destroy(other);
+    ASSERT_EQ(100 * 4096, block_store_serialize_incremental(bs, "test_incr.bs"));
+
+    block_store_destroy(bs);
+    ASSERT_EQ(0, block_store_serialize_incremental(NULL, "test_incr.bs"));
+}
+
+TEST(block_store_write_read, partial)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+
+    std::vector<uint8_t> block(BLOCK_SIZE_BYTES, '.');
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 20, block.data()));
+
+    uint64_t field = 0x0123456789ABCDEF;
+    ASSERT_EQ(sizeof(field), block_store_pwrite(bs, 20, 100, sizeof(field), &field));
+    ASSERT_EQ(1, block_store_pwrite(bs, 20, BLOCK_SIZE_BYTES - 1, 1, "!"));
+
+    uint64_t read_field = 0;
+    ASSERT_EQ(sizeof(read_field), block_store_pread(bs, 20, 100, sizeof(read_field), &read_field));
+    ASSERT_EQ(field, read_field);
+
+    // Everything around the field is untouched
+    memcpy(block.data() + 100, &field, sizeof(field));
+    block[BLOCK_SIZE_BYTES - 1] = '!';
+    std::vector<uint8_t> read_buffer(BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 20, read_buffer.data()));
+    ASSERT_EQ(block, read_buffer);
+
+    // Spans that leave the block, empty spans, bad blocks and NULLs
+    ASSERT_EQ(0, block_store_pread(bs, 20, BLOCK_SIZE_BYTES - 4, 8, &read_field));
+    ASSERT_EQ(0, block_store_pwrite(bs, 20, BLOCK_SIZE_BYTES, 1, &field));
+    ASSERT_EQ(0, block_store_pwrite(bs, 20, 8, SIZE_MAX, &field));
+    ASSERT_EQ(0, block_store_pread(bs, 20, 0, 0, &read_field));
+    ASSERT_EQ(0, block_store_pread(bs, BLOCK_STORE_AVAIL_BLOCKS, 0, 8, &read_field));
+    ASSERT_EQ(0, block_store_pread(bs, 20, 0, 8, NULL));
+    ASSERT_EQ(0, block_store_pwrite(NULL, 20, 0, 8, &field));
+
+    block_store_destroy(bs);
+}
+
+TEST(block_store_borrow, read_and_modify_in_place)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_request(bs, 42));
+
+    std::vector<uint8_t> block(BLOCK_SIZE_BYTES, 'q');
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 42, block.data()));
+
+    const uint8_t *view = static_cast<const uint8_t *>(block_store_borrow(bs, 42));
+    ASSERT_NE(nullptr, view);
+    ASSERT_EQ(0, memcmp(view, block.data(), BLOCK_SIZE_BYTES));
+    // Blocks start on cache lines
+    ASSERT_EQ(0, reinterpret_cast<uintptr_t>(view) % 64);
+
+    uint8_t *edit = static_cast<uint8_t *>(block_store_borrow_mut(bs, 42));
+    ASSERT_EQ(view, edit);
+    edit[7] = '!';
+    ASSERT_EQ('!', view[7]);
+
+    // Pinned twice, so the block survives release until both borrows are back
+    block_store_release(bs, 42);
+    ASSERT_FALSE(block_store_request(bs, 42));
+    ASSERT_TRUE(block_store_return(bs, 42));
+    block_store_release(bs, 42);
+    ASSERT_FALSE(block_store_request(bs, 42));
+    ASSERT_TRUE(block_store_return(bs, 42));
+    block_store_release(bs, 42);
+    ASSERT_TRUE(block_store_request(bs, 42));
+
+    // Extra returns are harmless, just turned away
+    ASSERT_FALSE(block_store_return(bs, 42));
+    ASSERT_FALSE(block_store_return(NULL, 42));
+
+    std::vector<uint8_t> read_buffer(BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 42, read_buffer.data()));
+    ASSERT_EQ('!', read_buffer[7]);
+
+    ASSERT_EQ(nullptr, block_store_borrow(bs, BLOCK_STORE_AVAIL_BLOCKS));
+    ASSERT_EQ(nullptr, block_store_borrow_mut(NULL, 0));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_borrow, page_aligned_blocks)
+{
+    block_store_t *bs = block_store_create_ex(64, 4096);
+    ASSERT_NE(nullptr, bs);
+    for (size_t i = 0; i < block_store_get_avail_blocks(bs); ++i) {
+        const void *block = block_store_borrow(bs, i);
+        ASSERT_EQ(0, reinterpret_cast<uintptr_t>(block) % 4096);
+        block_store_return(bs, i);
+    }
+    block_store_destroy(bs);
+}
+
+TEST(block_store_borrow, mutable_borrow_is_checkpointed)
+{
+    block_store_t *bs = block_store_create_ex(64, 4096);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_request(bs, 3));
+    unlink("test_borrow.bs");
+    ASSERT_NE(0, block_store_serialize_incremental(bs, "test_borrow.bs"));
+
+    // Changed after the checkpoint but while still borrowed: the return has to catch it
+    uint8_t *edit = static_cast<uint8_t *>(block_store_borrow_mut(bs, 3));
+    ASSERT_NE(nullptr, edit);
+    ASSERT_NE(0, block_store_serialize_incremental(bs, "test_borrow.bs"));
+    edit[0] = 'Z';
+    block_store_return(bs, 3);
+    ASSERT_EQ(2 * 4096, block_store_serialize_incremental(bs, "test_borrow.bs"));
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_borrow.bs");
+    ASSERT_NE(nullptr, bs);
+    uint8_t first = 0;
+    ASSERT_EQ(1, block_store_pread(bs, 3, 0, 1, &first));
+    ASSERT_EQ('Z', first);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_write_read, vectored)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+
+    // Blocks 3, 4, 5 from one contiguous buffer, plus a stray block 9
+    std::vector<uint8_t> chunk(3 * BLOCK_SIZE_BYTES), stray(BLOCK_SIZE_BYTES, 'z');
+    for (size_t i = 0; i < chunk.size(); ++i) {
+        chunk[i] = (uint8_t) (i / BLOCK_SIZE_BYTES + 'a');
+    }
+    size_t ids[] = {3, 4, 5, 9};
+    struct iovec iov[] = {
+        {chunk.data(), BLOCK_SIZE_BYTES},
+        {chunk.data() + BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES},
+        {chunk.data() + 2 * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES},
+        {stray.data(), BLOCK_SIZE_BYTES},
+    };
+    ASSERT_EQ(4 * BLOCK_SIZE_BYTES, block_store_writev(bs, ids, iov, 4));
+
+    std::vector<uint8_t> read_buffer(BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 4, read_buffer.data()));
+    ASSERT_EQ('b', read_buffer[0]);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 9, read_buffer.data()));
+    ASSERT_EQ(stray, read_buffer);
+
+    // Read them back in a different order
+    std::vector<uint8_t> a(BLOCK_SIZE_BYTES), b(BLOCK_SIZE_BYTES);
+    size_t read_ids[] = {9, 3};
+    struct iovec read_iov[] = {{a.data(), BLOCK_SIZE_BYTES}, {b.data(), BLOCK_SIZE_BYTES}};
+    ASSERT_EQ(2 * BLOCK_SIZE_BYTES, block_store_readv(bs, read_ids, read_iov, 2));
+    ASSERT_EQ(stray, a);
+    ASSERT_EQ('a', b[BLOCK_SIZE_BYTES - 1]);
+
+    // One bad id spoils the whole batch
+    size_t bad_ids[] = {3, BLOCK_STORE_AVAIL_BLOCKS};
+    ASSERT_EQ(0, block_store_writev(bs, bad_ids, iov, 2));
+    ASSERT_EQ(0, block_store_readv(bs, bad_ids, read_iov, 2));
+    struct iovec short_iov[] = {{a.data(), BLOCK_SIZE_BYTES - 1}};
+    ASSERT_EQ(0, block_store_readv(bs, ids, short_iov, 1));
+    ASSERT_EQ(0, block_store_readv(NULL, ids, read_iov, 1));
+
+    block_store_destroy(bs);
+}
+
+TEST(block_store_write_read, range)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+
+    std::vector<uint8_t> write_buffer(10 * BLOCK_SIZE_BYTES), read_buffer(10 * BLOCK_SIZE_BYTES);
+    for (size_t i = 0; i < write_buffer.size(); ++i) {
+        write_buffer[i] = (uint8_t) i;
+    }
+    ASSERT_EQ(write_buffer.size(), block_store_write_range(bs, BLOCK_STORE_AVAIL_BLOCKS - 10, 10, write_buffer.data()));
+    ASSERT_EQ(read_buffer.size(), block_store_read_range(bs, BLOCK_STORE_AVAIL_BLOCKS - 10, 10, read_buffer.data()));
+    ASSERT_EQ(write_buffer, read_buffer);
+
+    std::vector<uint8_t> one(BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, BLOCK_STORE_AVAIL_BLOCKS - 9, one.data()));
+    ASSERT_TRUE(std::equal(one.begin(), one.end(), write_buffer.begin() + BLOCK_SIZE_BYTES));
+
+    // Past the end, empty, or missing buffer
+    ASSERT_EQ(0, block_store_read_range(bs, BLOCK_STORE_AVAIL_BLOCKS - 9, 10, read_buffer.data()));
+    ASSERT_EQ(0, block_store_write_range(bs, BLOCK_STORE_AVAIL_BLOCKS, 1, write_buffer.data()));
+    ASSERT_EQ(0, block_store_read_range(bs, 0, 0, read_buffer.data()));
+    ASSERT_EQ(0, block_store_write_range(bs, 0, 1, NULL));
+    ASSERT_EQ(0, block_store_read_range(bs, 0, SIZE_MAX, read_buffer.data()));
+
+    block_store_destroy(bs);
+}
+
+TEST(block_store_create_ex, default_geometry)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS, block_store_get_num_blocks(bs));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_get_block_size(bs));
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS, block_store_get_avail_blocks(bs));
+    block_store_destroy(bs);
+
+    ASSERT_EQ(SIZE_MAX, block_store_get_num_blocks(NULL));
+    ASSERT_EQ(SIZE_MAX, block_store_get_block_size(NULL));
+    ASSERT_EQ(SIZE_MAX, block_store_get_avail_blocks(NULL));
+}
+
+TEST(block_store_create_ex, bad_geometry)
+{
+    ASSERT_EQ(nullptr, block_store_create_ex(0, 4096));
+    ASSERT_EQ(nullptr, block_store_create_ex(256, 0));
+    ASSERT_EQ(nullptr, block_store_create_ex(256, 1000));
+    ASSERT_EQ(nullptr, block_store_create_ex(256, BLOCK_STORE_MIN_BLOCK_SIZE / 2));
+    ASSERT_EQ(nullptr, block_store_create_ex(SIZE_MAX / 2, 4096));
+    // Nothing left over once the FBM has its block
+    ASSERT_EQ(nullptr, block_store_create_ex(1, 4096));
+}
+
+TEST(block_store_create_ex, large_store)
+{
+    // 64 MiB of 4 KiB blocks, 16384 blocks need a 2 KiB FBM which still fits in block 0
+    block_store_t *bs = block_store_create_ex(16384, 4096);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(16383, block_store_get_avail_blocks(bs));
+    ASSERT_EQ(4096, block_store_get_block_size(bs));
+
+    for (size_t i = 0; i < 16383; ++i) {
+        ASSERT_EQ(i, block_store_allocate(bs));
+    }
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+    ASSERT_EQ(0, block_store_get_free_blocks(bs));
+    ASSERT_FALSE(block_store_request(bs, 16383));
+
+    std::vector<uint8_t> write_buffer(4096, 'x'), read_buffer(4096);
+    write_buffer[4095] = 'y';
+    ASSERT_EQ(4096, block_store_write(bs, 16382, write_buffer.data()));
+    ASSERT_EQ(0, block_store_write(bs, 16383, write_buffer.data()));
+    ASSERT_EQ(4096, block_store_read(bs, 16382, read_buffer.data()));
+    ASSERT_EQ(write_buffer, read_buffer);
+
+    block_store_release(bs, 9000);
+    ASSERT_EQ(9000, block_store_allocate(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_create_ex, multi_block_fbm)
+{
+    // 1M blocks of 64 bytes need 128 KiB of FBM plus the 64 byte header, 2049 blocks of it
+    block_store_t *bs = block_store_create_ex(1 << 20, 64);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ((1 << 20) - 2049, block_store_get_avail_blocks(bs));
+    ASSERT_EQ((1 << 20) - 2049, block_store_get_free_blocks(bs));
+    block_store_destroy(bs);
+}
+
+// Resident set size in bytes, straight from the kernel
+static size_t resident_bytes() {
+    size_t pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%zu %zu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+TEST(block_store_footprint, arena_is_lazy)
+{
+    // A 1 GiB device should only cost memory for the blocks that get touched
+    const size_t before = resident_bytes();
+    block_store_t *bs = block_store_create_ex(262144, 4096);
+    ASSERT_NE(nullptr, bs);
+    const size_t created = resident_bytes();
+
+    std::vector<uint8_t> buffer(4096, 0xAB);
+    for (size_t i = 0; i < 256; ++i) {
+        size_t id = block_store_allocate(bs);
+        ASSERT_EQ(4096, block_store_write(bs, id, buffer.data()));
+    }
+    const size_t written = resident_bytes();
+
+    std::cout << "1 GiB device: " << (created - before) / 1024 << " KiB resident after create, "
+              << (written - before) / 1024 << " KiB after writing 1 MiB" << std::endl;
+    ::testing::Test::RecordProperty("footprint_create_kib", (created - before) / 1024);
+    ::testing::Test::RecordProperty("footprint_written_kib", (written - before) / 1024);
+    ASSERT_LT(created - before, (size_t) 4 << 20);
+    ASSERT_LT(written - before, (size_t) 8 << 20);
+
+    block_store_destroy(bs);
+}
+
+TEST(block_store_mmap, create_and_reopen)
+{
+    block_store_t *bs = block_store_create_mmap("test_mmap.bs", 1024, 4096);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(1023, block_store_get_avail_blocks(bs));
+
+    std::vector<uint8_t> write_buffer(4096, 'M'), read_buffer(4096);
+    ASSERT_EQ(0, block_store_allocate(bs));
+    ASSERT_EQ(1, block_store_allocate(bs));
+    ASSERT_TRUE(block_store_request(bs, 700));
+    ASSERT_EQ(4096, block_store_write(bs, 700, write_buffer.data()));
+    ASSERT_TRUE(block_store_flush(bs));
+    block_store_release(bs, 1);
+    block_store_destroy(bs);
+
+    struct stat st;
+    ASSERT_EQ(0, stat("test_mmap.bs", &st));
+    ASSERT_EQ(1024 * 4096, st.st_size);
+
+    // The FBM came back with the blocks, no rebuild needed
+    bs = block_store_open_mmap("test_mmap.bs", 0);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(1024, block_store_get_num_blocks(bs));
+    ASSERT_EQ(4096, block_store_get_block_size(bs));
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+    ASSERT_FALSE(block_store_request(bs, 700));
+    ASSERT_EQ(1, block_store_allocate(bs));
+    ASSERT_EQ(4096, block_store_read(bs, 700, read_buffer.data()));
+    ASSERT_EQ(write_buffer, read_buffer);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_mmap, readonly)
+{
+    block_store_t *bs = block_store_create_mmap("test_mmap.bs", 64, 256);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_request(bs, 5));
+    block_store_destroy(bs);
+
+    bs = block_store_open_mmap("test_mmap.bs", BLOCK_STORE_MMAP_READONLY);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> buffer(256);
+    ASSERT_EQ(256, block_store_read(bs, 5, buffer.data()));
+    ASSERT_EQ(0, block_store_write(bs, 5, buffer.data()));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+    ASSERT_FALSE(block_store_request(bs, 6));
+    block_store_release(bs, 5);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_mmap, open_create_and_bad_files)
+{
+    unlink("test_mmap_new.bs");
+    ASSERT_EQ(nullptr, block_store_open_mmap("test_mmap_new.bs", 0));
+    block_store_t *bs = block_store_open_mmap("test_mmap_new.bs", BLOCK_STORE_MMAP_CREATE);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS, block_store_get_avail_blocks(bs));
+    block_store_destroy(bs);
+
+    // Not a block store image
+    FILE *junk = fopen("test_mmap_new.bs", "w");
+    ASSERT_NE(nullptr, junk);
+    fputs("definitely not a block store", junk);
+    fclose(junk);
+    ASSERT_EQ(nullptr, block_store_open_mmap("test_mmap_new.bs", 0));
+
+    ASSERT_EQ(nullptr, block_store_open_mmap(NULL, 0));
+    ASSERT_EQ(nullptr, block_store_create_mmap(NULL, 64, 256));
+    ASSERT_FALSE(block_store_flush(NULL));
+}
+
+TEST(block_store_thread_safe, concurrent_allocate_release)
+{
+    block_store_t *bs = block_store_create_flags(1 << 16, 64, BLOCK_STORE_THREAD_SAFE);
+    ASSERT_NE(nullptr, bs);
+    const size_t avail = block_store_get_avail_blocks(bs);
+    const unsigned threads = 8;
+
+    // Every thread allocates until the device is full, stamping each block it gets with its own id
+    std::vector<std::vector<size_t>> owned(threads);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            std::vector<uint8_t> stamp(64, (uint8_t) t);
+            for (size_t id; (id = block_store_allocate(bs)) != SIZE_MAX;) {
+                owned[t].push_back(id);
+                block_store_write(bs, id, stamp.data());
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+
+    // No block handed out twice, none lost, and nobody scribbled on someone else's block
+    std::vector<size_t> all;
+    std::vector<uint8_t> buffer(64);
+    for (unsigned t = 0; t < threads; ++t) {
+        for (size_t id : owned[t]) {
+            all.push_back(id);
+            ASSERT_EQ(64, block_store_read(bs, id, buffer.data()));
+            ASSERT_EQ(std::vector<uint8_t>(64, (uint8_t) t), buffer);
+        }
+    }
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(avail, all.size());
+    ASSERT_TRUE(std::adjacent_find(all.begin(), all.end()) == all.end());
+    ASSERT_EQ(avail, block_store_get_used_blocks(bs));
+
+    // Churn: give blocks back and take new ones while the others do the same
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            for (int round = 0; round < 4; ++round) {
+                block_store_release_batch(bs, owned[t].data(), owned[t].size());
+                const size_t want = owned[t].size();
+                owned[t].clear();
+                for (size_t id; owned[t].size() < want && (id = block_store_allocate(bs)) != SIZE_MAX;) {
+                    owned[t].push_back(id);
+                }
+            }
+            for (size_t id : owned[t]) {
+                block_store_release(bs, id);
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    ASSERT_EQ(avail, block_store_get_free_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_thread_safe, extents_and_requests)
+{
+    block_store_t *bs = block_store_create_flags(4096, 64, BLOCK_STORE_THREAD_SAFE);
+    ASSERT_NE(nullptr, bs);
+    const unsigned threads = 4;
+    std::vector<size_t> extents[threads], requested(threads, 0);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            for (int i = 0; i < 50; ++i) {
+                size_t first;
+                if (block_store_allocate_extent(bs, 7, &first)) {
+                    extents[t].push_back(first);
+                }
+            }
+            // Every thread goes after the same blocks, each one can only be won once
+            for (size_t id = 3500; id < 3600; ++id) {
+                requested[t] += block_store_request(bs, id);
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+
+    std::vector<bool> used(block_store_get_avail_blocks(bs), false);
+    for (unsigned t = 0; t < threads; ++t) {
+        for (size_t first : extents[t]) {
+            for (size_t id = first; id < first + 7; ++id) {
+                ASSERT_FALSE(used[id]);
+                used[id] = true;
+            }
+        }
+    }
+    size_t won = 0;
+    for (size_t count : requested) {
+        won += count;
+    }
+    ASSERT_EQ(100, won);
+    ASSERT_EQ(threads * 50 * 7 + 100, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_thread_safe, thread_cache)
+{
+    block_store_t *bs = block_store_create_flags(1 << 14, 64, BLOCK_STORE_THREAD_CACHE);
+    ASSERT_NE(nullptr, bs);
+    const size_t avail = block_store_get_avail_blocks(bs);
+    block_store_cache_stats_t stats;
+    ASSERT_TRUE(block_store_get_cache_stats(bs, &stats));
+    ASSERT_EQ(0, stats.hits + stats.misses);
+
+    // Single thread: the first allocate refills, the rest come out of the cache in order
+    size_t first = block_store_allocate(bs);
+    ASSERT_EQ(first + 1, block_store_allocate(bs));
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+    block_store_release(bs, first);
+    block_store_release(bs, first);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    ASSERT_EQ(avail - 1, block_store_get_free_blocks(bs));
+    ASSERT_FALSE(block_store_request(bs, first));
+    ASSERT_EQ(first, block_store_allocate(bs));
+    ASSERT_TRUE(block_store_get_cache_stats(bs, &stats));
+    ASSERT_EQ(1, stats.misses);
+    ASSERT_EQ(3, stats.hits);
+    ASSERT_EQ(1, stats.refills);
+    ASSERT_EQ(30, stats.cached);
+
+    // Threads churning through their caches never share a block
+    const unsigned threads = 8;
+    std::vector<std::vector<size_t>> held(threads);
+    std::vector<std::thread> workers;
+    std::vector<uint8_t> clash(threads, 0);
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            std::vector<uint8_t> stamp(64, (uint8_t) t), check(64);
+            for (int round = 0; round < 200; ++round) {
+                for (int i = 0; i < 40; ++i) {
+                    size_t id = block_store_allocate(bs);
+                    if (id != SIZE_MAX) {
+                        block_store_write(bs, id, stamp.data());
+                        held[t].push_back(id);
+                    }
+                }
+                for (size_t id : held[t]) {
+                    block_store_read(bs, id, check.data());
+                    clash[t] |= check != stamp;
+                    block_store_release(bs, id);
+                }
+                held[t].clear();
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    for (uint8_t c : clash) {
+        ASSERT_EQ(0, c);
+    }
+
+    // The workers' caches went back when they exited, the main thread's goes back with the image
+    ASSERT_TRUE(block_store_get_cache_stats(bs, &stats));
+    ASSERT_EQ(30, stats.cached);
+    ASSERT_GT(stats.hits, 10 * stats.misses);
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+    ASSERT_NE(0, block_store_serialize(bs, "thread_cache.bs"));
+    ASSERT_TRUE(block_store_get_cache_stats(bs, &stats));
+    ASSERT_EQ(0, stats.cached);
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("thread_cache.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+    ASSERT_FALSE(block_store_get_cache_stats(bs, &stats));
+    block_store_destroy(bs);
+    remove("thread_cache.bs");
+}
+
+TEST(block_store_thread_safe, thread_cache_release_extent)
+{
+    block_store_t *bs = block_store_create_flags(1 << 14, 64, BLOCK_STORE_THREAD_CACHE);
+    ASSERT_NE(nullptr, bs);
+    // The refill parks the next 31 blocks in this thread's magazine, releasing them leaves them there
+    size_t first = block_store_allocate(bs);
+    ASSERT_NE(SIZE_MAX, first);
+    block_store_release_extent(bs, first, 32);
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    block_store_cache_stats_t stats;
+    ASSERT_TRUE(block_store_get_cache_stats(bs, &stats));
+    ASSERT_EQ(31, stats.cached);
+
+    // Nothing gets handed out twice, from the magazine and from a refill
+    std::vector<uint8_t> seen(block_store_get_avail_blocks(bs), 0);
+    for (int i = 0; i < 100; ++i) {
+        size_t id = block_store_allocate(bs);
+        ASSERT_NE(SIZE_MAX, id);
+        ASSERT_EQ(0, seen[id]) << "block " << id;
+        seen[id] = 1;
+    }
+    ASSERT_EQ(100, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_thread_safe, no_torn_reads)
+{
+    const size_t block_size = 4096;
+    block_store_t *bs = block_store_create_flags(64, block_size, BLOCK_STORE_THREAD_SAFE);
+    ASSERT_NE(nullptr, bs);
+
+    // Writers keep filling two hot blocks with one byte value each time, whole or with pwrite,
+    // readers must only ever see a block that is all one value
+    std::vector<uint8_t> zero(block_size, 0);
+    ASSERT_EQ(block_size, block_store_write(bs, 0, zero.data()));
+    ASSERT_EQ(block_size, block_store_write(bs, 1, zero.data()));
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> workers;
+    for (unsigned w = 0; w < 2; ++w) {
+        workers.emplace_back([&, w]() {
+            std::vector<uint8_t> fill(block_size);
+            for (unsigned round = 1; !stop; ++round) {
+                std::fill(fill.begin(), fill.end(), (uint8_t) (round * 2 + w));
+                if (round % 2) {
+                    block_store_write(bs, round % 4 / 2, fill.data());
+                } else {
+                    block_store_pwrite(bs, round % 4 / 2, 0, block_size, fill.data());
+                }
+            }
+        });
+    }
+    std::vector<size_t> torn(4, 0);
+    std::vector<std::thread> readers;
+    for (unsigned r = 0; r < 4; ++r) {
+        readers.emplace_back([&, r]() {
+            std::vector<uint8_t> block(block_size * 2), part(100);
+            for (int i = 0; i < 500; ++i) {
+                block_store_read_range(bs, 0, 2, block.data());
+                torn[r] += std::count(block.begin(), block.begin() + block_size, block[0]) != (long) block_size;
+                torn[r] += std::count(block.begin() + block_size, block.end(), block[block_size]) != (long) block_size;
+                block_store_pread(bs, 1, 3001, part.size(), part.data());
+                torn[r] += std::count(part.begin(), part.end(), part[0]) != (long) part.size();
+            }
+        });
+    }
+    for (std::thread &reader : readers) {
+        reader.join();
+    }
+    stop = true;
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    for (size_t count : torn) {
+        ASSERT_EQ(0, count);
+    }
+    block_store_destroy(bs);
+}
+
+static void count_result(void *arg, ssize_t result)
+{
+    std::vector<ssize_t> *results = static_cast<std::vector<ssize_t> *>(arg);
+    results->push_back(result);
+}
+
+TEST(block_io, both_backends)
+{
+    for (int flags : {0, BLOCK_IO_POOL}) {
+        block_io_t *io = block_io_create(4, flags);
+        ASSERT_NE(nullptr, io);
+        if (flags) {
+            ASSERT_FALSE(block_io_uses_uring(io));
+        }
+        int fd = open("test_io.bs", O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        ASSERT_NE(-1, fd);
+
+        // Twice the depth worth of writes, the later ones have to wait for room
+        std::vector<std::vector<uint8_t>> blocks(8, std::vector<uint8_t>(512));
+        std::vector<ssize_t> results;
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            std::fill(blocks[i].begin(), blocks[i].end(), (uint8_t) (i + 1));
+            ASSERT_TRUE(block_io_write(io, fd, blocks[i].data(), 512, i * 512, count_result, &results));
+            ASSERT_LE(block_io_pending(io), 4);
+        }
+        block_io_wait(io);
+        ASSERT_EQ(0, block_io_pending(io));
+        ASSERT_EQ(8, results.size());
+        for (ssize_t result : results) {
+            ASSERT_EQ(512, result);
+        }
+
+        // Backwards, and one already finished in the middle
+        results.clear();
+        std::vector<std::vector<uint8_t>> back(8, std::vector<uint8_t>(512));
+        for (size_t i = 8; i-- > 0;) {
+            ASSERT_TRUE(block_io_read(io, fd, back[i].data(), 512, i * 512, count_result, &results));
+        }
+        ASSERT_TRUE(block_io_complete(io, 7, count_result, &results));
+        // Past the end of the file is a short read, a bad fd an error
+        std::vector<uint8_t> tail(512);
+        ASSERT_TRUE(block_io_read(io, fd, tail.data(), 512, 8 * 512 - 100, count_result, &results));
+        ASSERT_TRUE(block_io_read(io, 1000, tail.data(), 512, 0, count_result, &results));
+        block_io_wait(io);
+        ASSERT_EQ(blocks, back);
+        ASSERT_EQ(11, results.size());
+        ASSERT_EQ(1, std::count(results.begin(), results.end(), 7));
+        ASSERT_EQ(1, std::count(results.begin(), results.end(), 100));
+        ASSERT_EQ(1, std::count(results.begin(), results.end(), -EBADF));
+        ASSERT_EQ(0, block_io_poll(io));
+
+        close(fd);
+        block_io_destroy(io);
+    }
+    ASSERT_EQ(nullptr, block_io_create(0, 0));
+    ASSERT_EQ(nullptr, block_io_create(BLOCK_IO_MAX_DEPTH + 1, 0));
+    ASSERT_FALSE(block_io_read(nullptr, 0, nullptr, 0, 0, nullptr, nullptr));
+    block_io_destroy(nullptr);
+    std::remove("test_io.bs");
+}
+
+TEST(block_store_async, read_async)
+{
+    block_store_t *mapped = block_store_create_mmap("test_async.bs", 256, 4096);
+    block_store_t *plain = block_store_create_ex(256, 4096);
+    ASSERT_NE(nullptr, mapped);
+    ASSERT_NE(nullptr, plain);
+    ASSERT_FALSE(block_store_set_io_depth(mapped, 0));
+    ASSERT_TRUE(block_store_set_io_depth(mapped, 2));
+
+    for (block_store_t *bs : {mapped, plain}) {
+        std::vector<uint8_t> block(4096);
+        for (size_t i = 0; i < 16; ++i) {
+            std::fill(block.begin(), block.end(), (uint8_t) (i * 3 + 1));
+            ASSERT_EQ(4096, block_store_write(bs, i * 10, block.data()));
+        }
+        std::vector<std::vector<uint8_t>> reads(16, std::vector<uint8_t>(4096));
+        std::vector<ssize_t> results;
+        for (size_t i = 0; i < 16; ++i) {
+            ASSERT_TRUE(block_store_read_async(bs, i * 10, reads[i].data(), count_result, &results));
+        }
+        ASSERT_FALSE(block_store_read_async(bs, 255, reads[0].data(), count_result, &results));
+        ASSERT_FALSE(block_store_read_async(bs, 0, nullptr, count_result, &results));
+        block_store_poll(bs);
+        block_store_wait(bs);
+        ASSERT_EQ(16, results.size());
+        for (size_t i = 0; i < 16; ++i) {
+            ASSERT_EQ(4096, results[i]);
+            ASSERT_EQ(4096, std::count(reads[i].begin(), reads[i].end(), (uint8_t) (i * 3 + 1)));
+        }
+
+        // Destroy waits for reads still out
+        results.clear();
+        ASSERT_TRUE(block_store_read_async(bs, 0, reads[0].data(), count_result, &results));
+        block_store_destroy(bs);
+        ASSERT_EQ(1, results.size());
+    }
+    ASSERT_FALSE(block_store_read_async(nullptr, 0, nullptr, nullptr, nullptr));
+    ASSERT_EQ(0, block_store_wait(nullptr));
+    std::remove("test_async.bs");
+}
+
+TEST(block_store_async, serialize_depths_and_threads)
+{
+    block_store_t *bs = block_store_create_ex(1024, 4096);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> block(4096);
+    for (size_t i = 0; i < 1023; i += 7) {
+        std::fill(block.begin(), block.end(), (uint8_t) i);
+        ASSERT_TRUE(block_store_request(bs, i));
+        ASSERT_EQ(4096, block_store_write(bs, i, block.data()));
+    }
+    for (size_t depth : {1, 3, 64}) {
+        ASSERT_TRUE(block_store_set_io_depth(bs, depth));
+        std::remove("test_async.bs");
+        ASSERT_EQ(1024 * 4096, block_store_serialize(bs, "test_async.bs"));
+        block_store_t *copy = block_store_deserialize("test_async.bs");
+        ASSERT_NE(nullptr, copy);
+        ASSERT_EQ(block_store_get_used_blocks(bs), block_store_get_used_blocks(copy));
+        std::vector<uint8_t> back(4096);
+        for (size_t i = 0; i < 1023; i += 7) {
+            ASSERT_EQ(4096, block_store_read(copy, i, back.data()));
+            ASSERT_EQ(4096, std::count(back.begin(), back.end(), (uint8_t) i));
+        }
+        block_store_destroy(copy);
+    }
+
+    // Split between threads, every thread count gives the same image
+    ASSERT_FALSE(block_store_set_io_threads(bs, 0));
+    ASSERT_FALSE(block_store_set_io_threads(bs, BLOCK_IO_MAX_THREADS + 1));
+    for (size_t threads : {2, 3, 8}) {
+        ASSERT_TRUE(block_store_set_io_threads(bs, threads));
+        std::remove("test_async.bs");
+        ASSERT_EQ(1024 * 4096, block_store_serialize(bs, "test_async.bs"));
+        block_store_t *copy = block_store_deserialize_ex("test_async.bs", 5);
+        ASSERT_NE(nullptr, copy);
+        std::vector<uint8_t> back(4096);
+        for (size_t i = 0; i < 1023; i += 7) {
+            ASSERT_EQ(4096, block_store_read(copy, i, back.data()));
+            ASSERT_EQ(4096, std::count(back.begin(), back.end(), (uint8_t) i));
+        }
+        block_store_destroy(copy);
+    }
+    ASSERT_EQ(nullptr, block_store_deserialize_ex("test_async.bs", 0));
+
+    // A truncated image comes up short
+    ASSERT_EQ(0, truncate("test_async.bs", 1000 * 4096));
+    ASSERT_EQ(nullptr, block_store_deserialize("test_async.bs"));
+    ASSERT_EQ(nullptr, block_store_deserialize_ex("test_async.bs", 4));
+    block_store_destroy(bs);
+    std::remove("test_async.bs");
+}
+
+TEST(block_store_wal, clean_shutdown)
+{
+    block_store_t *bs = block_store_create_wal("test_wal.bs", 512, 1024);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(511, block_store_get_avail_blocks(bs));
+    std::vector<uint8_t> block(1024, 'W'), back(1024);
+    ASSERT_EQ(0, block_store_allocate(bs));
+    ASSERT_EQ(1024, block_store_write(bs, 0, block.data()));
+    ASSERT_TRUE(block_store_request(bs, 400));
+    ASSERT_EQ(10, block_store_pwrite(bs, 400, 5, 10, block.data()));
+    ASSERT_TRUE(block_store_flush(bs));
+    block_store_journal_stats_t stats;
+    ASSERT_TRUE(block_store_get_journal_stats(bs, &stats));
+    ASSERT_EQ(3, stats.commits);
+    ASSERT_EQ(2, stats.syncs);
+    block_store_destroy(bs);
+
+    // Everything went into the image, the journal is empty
+    struct stat st;
+    ASSERT_EQ(0, stat("test_wal.bs.wal", &st));
+    ASSERT_EQ(0, st.st_size);
+    bs = block_store_open_wal("test_wal.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+    ASSERT_EQ(1024, block_store_read(bs, 0, back.data()));
+    ASSERT_EQ(block, back);
+    ASSERT_EQ(1024, block_store_read(bs, 400, back.data()));
+    ASSERT_EQ(10, std::count(back.begin(), back.end(), 'W'));
+    block_store_destroy(bs);
+
+    // Plain stores have no journal
+    bs = block_store_create();
+    ASSERT_FALSE(block_store_checkpoint(bs));
+    ASSERT_FALSE(block_store_set_journal_limit(bs, 4096));
+    ASSERT_FALSE(block_store_get_journal_stats(bs, &stats));
+    block_store_destroy(bs);
+    ASSERT_EQ(nullptr, block_store_open_wal("test_wal_missing.bs"));
+    ASSERT_EQ(nullptr, block_store_create_wal(nullptr, 512, 1024));
+    std::remove("test_wal.bs");
+    std::remove("test_wal.bs.wal");
+}
+
+// Fills a block with a value only it and its round have
+static void wal_fill(std::vector<uint8_t> &block, const size_t id, const unsigned round)
+{
+    std::fill(block.begin(), block.end(), (uint8_t) (id * 7 + round));
+}
+
+TEST(block_store_wal, crash_recovery)
+{
+    // The child writes from several threads, checkpointing in the background, and dies without a destroy
+    pid_t child = fork();
+    ASSERT_NE(-1, child);
+    if (child == 0) {
+        block_store_t *bs = block_store_create_wal("test_wal.bs", 1024, 512);
+        if (!bs || !block_store_set_journal_limit(bs, 32 * 1024)) _exit(1);
+        std::vector<std::thread> writers;
+        for (unsigned w = 0; w < 4; ++w) {
+            writers.emplace_back([bs, w]() {
+                std::vector<uint8_t> block(512);
+                for (unsigned round = 0; round < 3; ++round) {
+                    for (size_t id = w; id < 200; id += 4) {
+                        block_store_request(bs, id);
+                        wal_fill(block, id, round);
+                        if (block_store_write(bs, id, block.data()) != 512) _exit(2);
+                    }
+                }
+            });
+        }
+        for (std::thread &writer : writers) {
+            writer.join();
+        }
+        // A release only gets in with the next commit
+        block_store_release(bs, 150);
+        if (!block_store_flush(bs)) _exit(3);
+        block_store_release(bs, 151);
+        block_store_journal_stats_t stats;
+        block_store_get_journal_stats(bs, &stats);
+        if (stats.commits != 601 || stats.syncs > stats.commits || stats.blocks < 200) _exit(4);
+        _exit(0);
+    }
+    int status;
+    ASSERT_EQ(child, waitpid(child, &status, 0));
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(0, WEXITSTATUS(status));
+
+    // A transaction torn halfway through the append
+    struct stat st;
+    ASSERT_EQ(0, stat("test_wal.bs.wal", &st));
+    ASSERT_LT(0, st.st_size);
+    int fd = open("test_wal.bs.wal", O_WRONLY | O_APPEND);
+    ASSERT_NE(-1, fd);
+    const char torn[] = "JRNL and then nothing";
+    ASSERT_EQ(sizeof(torn), write(fd, torn, sizeof(torn)));
+    close(fd);
+
+    block_store_t *bs = block_store_open_wal("test_wal.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(199, block_store_get_used_blocks(bs));
+    ASSERT_FALSE(block_store_request(bs, 151));
+    ASSERT_TRUE(block_store_request(bs, 150));
+    std::vector<uint8_t> block(512), back(512);
+    for (size_t id = 0; id < 200; ++id) {
+        if (id == 150) continue;
+        wal_fill(block, id, 2);
+        ASSERT_EQ(512, block_store_read(bs, id, back.data()));
+        ASSERT_EQ(block, back) << "block " << id;
+    }
+    // The replay is in the image now, the journal starts over
+    ASSERT_EQ(0, stat("test_wal.bs.wal", &st));
+    ASSERT_EQ(0, st.st_size);
+    ASSERT_TRUE(block_store_checkpoint(bs));
+    block_store_destroy(bs);
+    std::remove("test_wal.bs");
+    std::remove("test_wal.bs.wal");
+}
+
+TEST(block_store_wal, return_reports_journal_failure)
+{
+    // The child's file size limit stops the journal growing, so a mutable borrow can't be logged
+    pid_t child = fork();
+    ASSERT_NE(-1, child);
+    if (child == 0) {
+        block_store_t *bs = block_store_create_wal("test_wal.bs", 256, 512);
+        if (!bs || !block_store_request(bs, 9)) _exit(1);
+        uint8_t *edit = (uint8_t *) block_store_borrow_mut(bs, 9);
+        if (!edit) _exit(2);
+        edit[0] = 'J';
+        // Read-only borrows have nothing to log
+        if (!block_store_borrow(bs, 10) || !block_store_return(bs, 10)) _exit(3);
+        struct stat st;
+        if (stat("test_wal.bs.wal", &st) != 0) _exit(4);
+        struct rlimit limit = {(rlim_t) st.st_size, (rlim_t) st.st_size};
+        signal(SIGXFSZ, SIG_IGN);
+        if (setrlimit(RLIMIT_FSIZE, &limit) != 0) _exit(5);
+        if (block_store_return(bs, 9)) _exit(6);
+        // The borrow is back all the same
+        if (block_store_return(bs, 9)) _exit(7);
+        _exit(0);
+    }
+    int status;
+    ASSERT_EQ(child, waitpid(child, &status, 0));
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(0, WEXITSTATUS(status));
+    std::remove("test_wal.bs");
+    std::remove("test_wal.bs.wal");
+}
+
+TEST(crc32c, known_values)
+{
+    // The check value of CRC-32C
+    ASSERT_EQ(0xE3069283u, crc32c(0, "123456789", 9));
+    ASSERT_EQ(0xE3069283u, crc32c_sw(0, "123456789", 9));
+    ASSERT_EQ(0u, crc32c(0, "", 0));
+    // 32 zero bytes, from RFC 3720
+    std::vector<uint8_t> zeroes(32, 0);
+    ASSERT_EQ(0x8A9136AAu, crc32c(0, zeroes.data(), zeroes.size()));
+
+    // Every length and alignment gives the same answer with or without the CPU instructions,
+    // and a CRC can be carried on from one piece to the next
+    std::vector<uint8_t> bytes(300);
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        bytes[i] = (uint8_t) (i * 131 + 7);
+    }
+    for (size_t start = 0; start < 9; ++start) {
+        for (size_t len = 0; start + len <= bytes.size(); len += 13) {
+            uint32_t whole = crc32c(0, bytes.data() + start, len);
+            ASSERT_EQ(whole, crc32c_sw(0, bytes.data() + start, len));
+            ASSERT_EQ(whole, crc32c(crc32c(0, bytes.data() + start, len / 3), bytes.data() + start + len / 3, len - len / 3));
+        }
+    }
+}
+
+TEST(block_store_checksum, detects_corruption)
+{
+    block_store_t *bs = block_store_create_flags(1024, 512, BLOCK_STORE_CHECKSUMS);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_verify(bs));
+    std::vector<uint8_t> block(512), back(512);
+    for (size_t id = 0; id < 100; ++id) {
+        std::fill(block.begin(), block.end(), (uint8_t) id);
+        ASSERT_TRUE(block_store_request(bs, id));
+        ASSERT_EQ(512, block_store_write(bs, id, block.data()));
+    }
+    // Partial writes, mutable borrows and never-written blocks all keep their checksums right
+    ASSERT_EQ(3, block_store_pwrite(bs, 7, 100, 3, "abc"));
+    uint8_t *raw = (uint8_t *) block_store_borrow_mut(bs, 8);
+    ASSERT_NE(nullptr, raw);
+    raw[511] = 0xFF;
+    // Out on a mutable borrow, the block isn't checked yet
+    ASSERT_EQ(512, block_store_read(bs, 8, back.data()));
+    block_store_return(bs, 8);
+    ASSERT_TRUE(block_store_request(bs, 200));
+    ASSERT_EQ(0, block_store_verify(bs));
+    ASSERT_EQ(512, block_store_read(bs, 8, back.data()));
+    ASSERT_EQ(0xFF, back[511]);
+    ASSERT_EQ(512, block_store_read(bs, 200, back.data()));
+    ASSERT_EQ(3, block_store_pread(bs, 7, 100, 3, back.data()));
+    ASSERT_EQ(0, memcmp("abc", back.data(), 3));
+
+    ASSERT_EQ(1024 * 512, block_store_serialize(bs, "test_crc.bs"));
+
+    // A byte going bad behind the store's back, the read turns it away
+    uint8_t *bad = (uint8_t *) block_store_borrow(bs, 42);
+    bad[17] ^= 0x01;
+    block_store_return(bs, 42);
+    ASSERT_EQ(0, block_store_read(bs, 42, back.data()));
+    ASSERT_EQ(0, block_store_pread(bs, 42, 0, 1, back.data()));
+    ASSERT_EQ(1, block_store_verify(bs));
+    // Free blocks hold nothing to protect
+    ASSERT_EQ(512, block_store_read(bs, 500, back.data()));
+    bad[17] ^= 0x01;
+    ASSERT_EQ(512, block_store_read(bs, 42, back.data()));
+    block_store_destroy(bs);
+
+    // The image checks out as written, but not once an allocated block in it is damaged
+    bs = block_store_deserialize("test_crc.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_verify(bs));
+    ASSERT_EQ(512, block_store_read(bs, 99, back.data()));
+    ASSERT_EQ(512, std::count(back.begin(), back.end(), 99));
+    const size_t fbm_blocks = 1024 - block_store_get_avail_blocks(bs);
+    block_store_destroy(bs);
+
+    int fd = open("test_crc.bs", O_RDWR);
+    ASSERT_NE(-1, fd);
+    uint8_t byte = 0x5A;
+    ASSERT_EQ(1, pwrite(fd, &byte, 1, (fbm_blocks + 600) * 512 + 3));
+    close(fd);
+    bs = block_store_deserialize("test_crc.bs");
+    ASSERT_NE(nullptr, bs);
+    block_store_destroy(bs);
+    fd = open("test_crc.bs", O_RDWR);
+    ASSERT_EQ(1, pwrite(fd, &byte, 1, (fbm_blocks + 60) * 512 + 3));
+    close(fd);
+    ASSERT_EQ(nullptr, block_store_deserialize("test_crc.bs"));
+    std::remove("test_crc.bs");
+
+    // Stores without checksums have nothing to verify
+    bs = block_store_create();
+    ASSERT_EQ(SIZE_MAX, block_store_verify(bs));
+    block_store_destroy(bs);
+    ASSERT_EQ(SIZE_MAX, block_store_verify(nullptr));
+}
+
+TEST(block_store_checksum, thread_safe_and_mapped)
+{
+    block_store_t *bs = block_store_create_flags(2048, 256, BLOCK_STORE_THREAD_SAFE | BLOCK_STORE_CHECKSUMS);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> data(8 * 256);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (uint8_t) (i / 3);
+    }
+    size_t first;
+    ASSERT_TRUE(block_store_allocate_extent(bs, 8, &first));
+    ASSERT_EQ(8 * 256, block_store_write_range(bs, first, 8, data.data()));
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 4; ++t) {
+        threads.emplace_back([bs, t]() {
+            std::vector<uint8_t> block(256, (uint8_t) t), back(256);
+            size_t id = block_store_allocate(bs);
+            for (int i = 0; i < 200; ++i) {
+                block[i] = (uint8_t) i;
+                EXPECT_EQ(256, block_store_write(bs, id, block.data()));
+                EXPECT_EQ(256, block_store_read(bs, id, back.data()));
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    std::vector<uint8_t> back(data.size());
+    ASSERT_EQ(8 * 256, block_store_read_range(bs, first, 8, back.data()));
+    ASSERT_EQ(data, back);
+    ASSERT_EQ(0, block_store_verify(bs));
+    ASSERT_EQ(2048 * 256, block_store_serialize(bs, "test_crc_ts.bs"));
+    block_store_destroy(bs);
+
+    // A mapped store keeps an image's checksums up to date, and flush makes them durable
+    bs = block_store_open_mmap("test_crc_ts.bs", 0);
+    ASSERT_NE(nullptr, bs);
+    size_t ids[2] = {first + 1, first + 5};
+    struct iovec iov[2] = {{data.data(), 256}, {data.data() + 256, 256}};
+    ASSERT_EQ(512, block_store_writev(bs, ids, iov, 2));
+    ASSERT_TRUE(block_store_flush(bs));
+    block_store_destroy(bs);
+    bs = block_store_deserialize("test_crc_ts.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_verify(bs));
+    ASSERT_EQ(256, block_store_read(bs, first + 5, back.data()));
+    ASSERT_EQ(0, memcmp(data.data() + 256, back.data(), 256));
+    block_store_destroy(bs);
+
+    // Journaled stores have no block checksums, their images aren't opened as one
+    ASSERT_EQ(nullptr, block_store_open_wal("test_crc_ts.bs"));
+    std::remove("test_crc_ts.bs");
+}
+
+TEST(block_store_checksum, partial_reads_of_large_blocks)
+{
+    // Blocks bigger than the piece a checked pread sums at a time, spans on either side of and across the seams
+    for (unsigned flags : {0u, (unsigned) BLOCK_STORE_THREAD_SAFE}) {
+        block_store_t *bs = block_store_create_flags(64, 16384, flags | BLOCK_STORE_CHECKSUMS);
+        ASSERT_NE(nullptr, bs);
+        std::vector<uint8_t> block(16384), back(16384);
+        for (size_t i = 0; i < block.size(); ++i) {
+            block[i] = (uint8_t) (i * 7 + i / 251);
+        }
+        ASSERT_TRUE(block_store_request(bs, 5));
+        ASSERT_EQ(16384, block_store_write(bs, 5, block.data()));
+        const size_t spans[][2] = {{0, 1}, {4095, 2}, {4096, 4096}, {100, 10000}, {16383, 1}, {0, 16384}};
+        for (const auto &span : spans) {
+            std::fill(back.begin(), back.end(), 0);
+            ASSERT_EQ(span[1], block_store_pread(bs, 5, span[0], span[1], back.data()));
+            ASSERT_EQ(0, memcmp(block.data() + span[0], back.data(), span[1])) << span[0] << "+" << span[1];
+        }
+
+        // Damage in a piece the span doesn't touch still fails the read
+        uint8_t *bad = (uint8_t *) block_store_borrow(bs, 5);
+        bad[12000] ^= 0x10;
+        ASSERT_EQ(0, block_store_pread(bs, 5, 10, 20, back.data()));
+        bad[12000] ^= 0x10;
+        block_store_return(bs, 5);
+        ASSERT_EQ(20, block_store_pread(bs, 5, 10, 20, back.data()));
+        block_store_destroy(bs);
+    }
+
+    // Against a writer, every piece has to come from the same write or the sum would be off
+    block_store_t *bs = block_store_create_flags(64, 16384, BLOCK_STORE_THREAD_SAFE | BLOCK_STORE_CHECKSUMS);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_request(bs, 9));
+    std::atomic<bool> stop(false);
+    std::thread writer([bs, &stop]() {
+        std::vector<uint8_t> block(16384);
+        for (uint8_t round = 0; !stop.load(); ++round) {
+            std::fill(block.begin(), block.end(), round);
+            EXPECT_EQ(16384, block_store_write(bs, 9, block.data()));
+        }
+    });
+    std::vector<uint8_t> back(8);
+    for (int i = 0; i < 2000; ++i) {
+        ASSERT_EQ(8, block_store_pread(bs, 9, 4092, 8, back.data()));
+        ASSERT_EQ(8, std::count(back.begin(), back.end(), back[0]));
+    }
+    stop = true;
+    writer.join();
+    block_store_destroy(bs);
+}
+
+// A released block comes back zeroed from the images that leave free blocks out, and its checksum with it
+TEST(block_store_checksum, released_blocks_in_images)
+{
+    std::vector<uint8_t> block(256, 0x5a), back(256);
+    auto fill = [&](block_store_t *bs) {
+        ASSERT_TRUE(block_store_request(bs, 10));
+        ASSERT_TRUE(block_store_request(bs, 11));
+        ASSERT_EQ(256, block_store_write(bs, 10, block.data()));
+        ASSERT_EQ(256, block_store_write(bs, 11, block.data()));
+    };
+    auto check = [&](const char *name) {
+        block_store_t *copy = block_store_deserialize(name);
+        ASSERT_NE(nullptr, copy) << name;
+        ASSERT_EQ(1, block_store_get_used_blocks(copy)) << name;
+        ASSERT_TRUE(block_store_request(copy, 10)) << name;
+        ASSERT_EQ(256, block_store_read(copy, 10, back.data())) << name;
+        ASSERT_EQ(256, std::count(back.begin(), back.end(), 0)) << name;
+        ASSERT_EQ(256, block_store_read(copy, 11, back.data())) << name;
+        ASSERT_EQ(block, back) << name;
+        ASSERT_EQ(0, block_store_verify(copy)) << name;
+        block_store_destroy(copy);
+    };
+
+    block_store_t *bs = block_store_create_flags(1024, 256, BLOCK_STORE_CHECKSUMS);
+    ASSERT_NE(nullptr, bs);
+    fill(bs);
+    // The incremental image has block 10 before it is released and punches it out after
+    ASSERT_LT(0, block_store_serialize_incremental(bs, "test_crc_incr.bs"));
+    block_store_release(bs, 10);
+    ASSERT_LT(0, block_store_serialize_incremental(bs, "test_crc_incr.bs"));
+    ASSERT_LT(0, block_store_serialize_incremental(bs, "test_crc_fresh.bs"));
+    ASSERT_LT(0, block_store_serialize_compressed(bs, "test_crc_packed.bs"));
+    // The store itself still has the old bytes, and the checksum to go with them
+    ASSERT_TRUE(block_store_request(bs, 10));
+    ASSERT_EQ(256, block_store_read(bs, 10, back.data()));
+    ASSERT_EQ(block, back);
+    block_store_release(bs, 10);
+    block_store_t *snapshot = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snapshot);
+    ASSERT_LT(0, block_store_serialize(snapshot, "test_crc_sparse.bs"));
+    block_store_destroy(snapshot);
+    block_store_destroy(bs);
+    for (const char *name : {"test_crc_incr.bs", "test_crc_fresh.bs", "test_crc_packed.bs", "test_crc_sparse.bs"}) {
+        check(name);
+        std::remove(name);
+    }
+}
+
+TEST(block_store_checksum, batch_allocated_blocks_in_images)
+{
+    // Block 599's checksum is a few metadata blocks past the FBM, it has to be marked on its own
+    block_store_t *bs = block_store_create_flags(1024, 512, BLOCK_STORE_CHECKSUMS);
+    ASSERT_NE(nullptr, bs);
+    std::vector<size_t> ids(600);
+    ASSERT_EQ(600, block_store_allocate_batch(bs, 600, ids.data()));
+    std::vector<uint8_t> block(512, 0x3c), back(512);
+    ASSERT_EQ(512, block_store_write(bs, 599, block.data()));
+    unlink("test_crc_batch.bs");
+    ASSERT_LT(0, block_store_serialize_incremental(bs, "test_crc_batch.bs"));
+    block_store_release_extent(bs, 500, 100);
+    ASSERT_LT(0, block_store_serialize_incremental(bs, "test_crc_batch.bs"));
+    // Taken again with their old bytes, the image needs their old checksums back too
+    ASSERT_EQ(100, block_store_allocate_batch(bs, 100, ids.data()));
+    ASSERT_EQ(599, ids[99]);
+    ASSERT_LT(0, block_store_serialize_incremental(bs, "test_crc_batch.bs"));
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_crc_batch.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(600, block_store_get_used_blocks(bs));
+    ASSERT_EQ(0, block_store_verify(bs));
+    ASSERT_EQ(512, block_store_read(bs, 599, back.data()));
+    ASSERT_EQ(block, back);
+    block_store_destroy(bs);
+    std::remove("test_crc_batch.bs");
+}
+
+TEST(block_store_checksum, thread_cache_releases_in_images)
+{
+    // Released blocks sit in the thread's magazine until the checkpoint drains them into the FBM
+    block_store_t *bs = block_store_create_flags(1024, 512, BLOCK_STORE_THREAD_CACHE | BLOCK_STORE_CHECKSUMS);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> block(512, 0x77), back(512);
+    std::vector<size_t> ids;
+    for (size_t i = 0; i < 700; ++i) {
+        ids.push_back(block_store_allocate(bs));
+        ASSERT_NE(SIZE_MAX, ids.back());
+        ASSERT_EQ(512, block_store_write(bs, ids.back(), block.data()));
+    }
+    unlink("test_crc_cache.bs");
+    ASSERT_LT(0, block_store_serialize_incremental(bs, "test_crc_cache.bs"));
+    for (size_t id : ids) {
+        block_store_release(bs, id);
+    }
+    ASSERT_LT(0, block_store_serialize_incremental(bs, "test_crc_cache.bs"));
+    block_store_destroy(bs);
+
+    // The blocks are holes in the image, their checksums have to be a zeroed block's
+    bs = block_store_deserialize("test_crc_cache.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    for (size_t id : ids) {
+        ASSERT_TRUE(block_store_request(bs, id));
+        ASSERT_EQ(512, block_store_read(bs, id, back.data())) << id;
+        ASSERT_EQ(512, std::count(back.begin(), back.end(), 0)) << id;
+    }
+    ASSERT_EQ(0, block_store_verify(bs));
+    block_store_destroy(bs);
+    std::remove("test_crc_cache.bs");
+}
+
+TEST(lz, round_trip)
+{
+    std::vector<std::vector<uint8_t>> inputs;
+    inputs.push_back({});
+    inputs.push_back({'a', 'b', 'c'});
+    inputs.push_back(std::vector<uint8_t>(5000, 0));
+    std::vector<uint8_t> text;
+    for (int i = 0; i < 500; ++i) {
+        const char *word = i % 3 ? "record " : "entry #";
+        text.insert(text.end(), word, word + 7);
+        text.push_back((uint8_t) ('0' + i % 10));
+    }
+    inputs.push_back(text);
+    std::vector<uint8_t> noise(4096);
+    uint32_t x = 12345;
+    for (uint8_t &byte : noise) {
+        x = x * 1103515245 + 12345;
+        byte = (uint8_t) (x >> 24);
+    }
+    inputs.push_back(noise);
+    // A short pattern repeated, the matches overlap themselves
+    std::vector<uint8_t> pattern(3000);
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        pattern[i] = "xyz"[i % 3];
+    }
+    inputs.push_back(pattern);
+
+    for (const std::vector<uint8_t> &input : inputs) {
+        std::vector<uint8_t> packed(LZ_BOUND(input.size())), back(input.size() + 1);
+        size_t bytes = lz_compress(input.data(), input.size(), packed.data(), packed.size());
+        ASSERT_LT(0, bytes);
+        ASSERT_EQ(input.size(), lz_decompress(packed.data(), bytes, back.data(), back.size()));
+        ASSERT_TRUE(std::equal(input.begin(), input.end(), back.begin()));
+        if (input.size() >= 3000 && &input != &inputs[4]) {
+            ASSERT_GT(input.size() / 4, bytes);
+        }
+        // Too little room either way is an error, not an overrun
+        if (input.size() > 0) {
+            ASSERT_EQ(SIZE_MAX, lz_decompress(packed.data(), bytes, back.data(), input.size() - 1));
+        }
+        ASSERT_EQ(0, lz_compress(input.data(), input.size(), packed.data(), bytes - 1));
+        // Damaged input is turned away or decodes to something, never past the buffer
+        for (size_t i = 0; i < bytes; i += 7) {
+            std::vector<uint8_t> damaged(packed.begin(), packed.begin() + bytes);
+            damaged[i] ^= 0x5A;
+            size_t got = lz_decompress(damaged.data(), bytes, back.data(), input.size());
+            ASSERT_TRUE(got == SIZE_MAX || got <= input.size());
+        }
+    }
+}
+
+// Half the blocks hold repetitive records, a few are noise, some are zeroed and the rest are free
+static block_store_t *packed_store(int flags)
+{
+    block_store_t *bs = block_store_create_flags(4096, 1024, flags);
+    std::vector<uint8_t> block(1024);
+    uint32_t x = 99;
+    for (size_t id = 0; id < 3000; ++id) {
+        if (!block_store_request(bs, id)) return nullptr;
+        if (id % 10 == 9) continue;
+        for (size_t i = 0; i < block.size(); ++i) {
+            x = x * 1103515245 + 12345;
+            block[i] = id % 50 == 0 ? (uint8_t) (x >> 24) : (uint8_t) ("record:"[i % 7] + id % 5);
+        }
+        block_store_write(bs, id, block.data());
+    }
+    return bs;
+}
+
+TEST(block_store_compressed, round_trip)
+{
+    for (int flags : {0, BLOCK_STORE_CHECKSUMS, BLOCK_STORE_THREAD_SAFE}) {
+        block_store_t *bs = packed_store(flags);
+        ASSERT_NE(nullptr, bs);
+        size_t bytes = block_store_serialize_compressed(bs, "test_packed.bs");
+        ASSERT_LT(0, bytes);
+        // A plain image is 4 MiB, most of this compresses away
+        ASSERT_GT(4096 * 1024 / 8, bytes);
+        struct stat st;
+        ASSERT_EQ(0, stat("test_packed.bs", &st));
+        ASSERT_EQ(bytes, st.st_size);
+
+        block_store_t *copy = block_store_deserialize("test_packed.bs");
+        ASSERT_NE(nullptr, copy);
+        ASSERT_EQ(block_store_get_used_blocks(bs), block_store_get_used_blocks(copy));
+        std::vector<uint8_t> block(1024), back(1024);
+        for (size_t id = 0; id < 3000; ++id) {
+            ASSERT_EQ(1024, block_store_read(bs, id, block.data()));
+            ASSERT_EQ(1024, block_store_read(copy, id, back.data()));
+            ASSERT_EQ(block, back) << "block " << id;
+        }
+        ASSERT_FALSE(block_store_request(copy, 10));
+        ASSERT_TRUE(block_store_request(copy, 3000));
+        if (flags & BLOCK_STORE_CHECKSUMS) {
+            ASSERT_EQ(0, block_store_verify(copy));
+        }
+        block_store_destroy(copy);
+        block_store_destroy(bs);
+    }
+    std::remove("test_packed.bs");
+    ASSERT_EQ(0, block_store_serialize_compressed(nullptr, "test_packed.bs"));
+    block_store_t *bs = block_store_create();
+    ASSERT_EQ(0, block_store_serialize_compressed(bs, nullptr));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_compressed, damaged_image)
+{
+    block_store_t *bs = packed_store(0);
+    ASSERT_NE(nullptr, bs);
+    size_t bytes = block_store_serialize_compressed(bs, "test_packed.bs");
+    block_store_destroy(bs);
+    std::vector<uint8_t> image(bytes);
+    int fd = open("test_packed.bs", O_RDONLY);
+    ASSERT_EQ(bytes, read(fd, image.data(), bytes));
+    close(fd);
+
+    // Cut short anywhere, or with bytes flipped in the header and index, the image is refused
+    for (size_t cut : {(size_t) 10, (size_t) 64, (size_t) 1000, bytes / 2, bytes - 1}) {
+        fd = open("test_packed.bs", O_WRONLY | O_TRUNC);
+        ASSERT_EQ(cut, write(fd, image.data(), cut));
+        close(fd);
+        ASSERT_EQ(nullptr, block_store_deserialize("test_packed.bs"));
+    }
+    for (size_t at : {(size_t) 4, (size_t) 8, (size_t) 40, (size_t) 64 + 16 * 5, (size_t) 64 + 16 * 5 + 8}) {
+        std::vector<uint8_t> damaged = image;
+        damaged[at] ^= 0x10;
+        fd = open("test_packed.bs", O_WRONLY | O_TRUNC);
+        ASSERT_EQ(bytes, write(fd, damaged.data(), bytes));
+        close(fd);
+        ASSERT_EQ(nullptr, block_store_deserialize("test_packed.bs"));
+    }
+    std::remove("test_packed.bs");
+}
+
+TEST(block_store_compressed, stream_and_random_access)
+{
+    block_store_t *bs = packed_store(BLOCK_STORE_CHECKSUMS);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_LT(0, block_store_serialize_compressed(bs, "test_packed.bs"));
+    ASSERT_EQ(4096 * 1024, block_store_serialize(bs, "test_plain.bs"));
+
+    // A compressed image then a plain one through the same pipe, the first read stops where its image does
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    std::thread writer([&]() {
+        int fd = open("test_packed.bs", O_RDONLY);
+        std::vector<char> buffer(1 << 16);
+        ssize_t got;
+        while ((got = read(fd, buffer.data(), buffer.size())) > 0) {
+            EXPECT_EQ(got, write(fds[1], buffer.data(), got));
+        }
+        close(fd);
+        EXPECT_EQ(4096 * 1024, block_store_serialize_fd(bs, fds[1], 0));
+        close(fds[1]);
+    });
+    block_store_t *first = block_store_deserialize_fd(fds[0], 4000);
+    block_store_t *second = block_store_deserialize_fd(fds[0], 4000);
+    writer.join();
+    close(fds[0]);
+    ASSERT_NE(nullptr, first);
+    ASSERT_NE(nullptr, second);
+
+    std::vector<uint8_t> block(1024), back(1024);
+    for (const char *name : {"test_packed.bs", "test_plain.bs"}) {
+        block_store_image_t *image = block_store_image_open(name);
+        ASSERT_NE(nullptr, image);
+        ASSERT_EQ(block_store_get_avail_blocks(bs), block_store_image_get_avail_blocks(image));
+        ASSERT_EQ(1024, block_store_image_get_block_size(image));
+        for (size_t id : {0, 9, 50, 777, 2999, 3000, 4000}) {
+            ASSERT_EQ(1024, block_store_read(bs, id, block.data()));
+            ASSERT_EQ(1024, block_store_image_read(image, id, back.data()));
+            ASSERT_EQ(block, back) << name << " block " << id;
+            ASSERT_EQ(1024, block_store_read(first, id, back.data()));
+            ASSERT_EQ(block, back);
+            ASSERT_EQ(1024, block_store_read(second, id, back.data()));
+            ASSERT_EQ(block, back);
+        }
+        ASSERT_EQ(0, block_store_image_read(image, block_store_get_avail_blocks(bs), back.data()));
+        ASSERT_EQ(0, block_store_image_read(image, 0, nullptr));
+        block_store_image_close(image);
+    }
+
+    // A damaged block is caught by its checksum, the blocks around it still read
+    int fd = open("test_plain.bs", O_RDWR);
+    const size_t fbm_blocks = 4096 - block_store_get_avail_blocks(bs);
+    uint8_t byte = 0xEE;
+    ASSERT_EQ(1, pwrite(fd, &byte, 1, (fbm_blocks + 777) * 1024 + 5));
+    close(fd);
+    block_store_image_t *image = block_store_image_open("test_plain.bs");
+    ASSERT_NE(nullptr, image);
+    ASSERT_EQ(0, block_store_image_read(image, 777, back.data()));
+    ASSERT_EQ(1024, block_store_image_read(image, 776, back.data()));
+    block_store_image_close(image);
+
+    ASSERT_EQ(nullptr, block_store_image_open(nullptr));
+    ASSERT_EQ(nullptr, block_store_image_open("no_such_image.bs"));
+    block_store_image_close(nullptr);
+    block_store_destroy(first);
+    block_store_destroy(second);
+    block_store_destroy(bs);
+    std::remove("test_packed.bs");
+    std::remove("test_plain.bs");
+}
+
+// Four kinds of record and a run of zeroed blocks, over and over
+static void dedup_fill(std::vector<uint8_t> &block, const size_t id)
+{
+    const size_t kind = id % 5;
+    for (size_t i = 0; i < block.size(); ++i) {
+        block[i] = kind == 4 ? 0 : (uint8_t) ("record:"[i % 7] + kind);
+    }
+}
+
+TEST(block_store_dedup, shares_identical_blocks)
+{
+    ASSERT_EQ(nullptr, block_store_create_flags(1024, 512, BLOCK_STORE_DEDUP | BLOCK_STORE_THREAD_SAFE));
+    ASSERT_EQ(nullptr, block_store_create_flags(1024, 512, BLOCK_STORE_DEDUP | BLOCK_STORE_THREAD_CACHE));
+    block_store_t *bs = block_store_create_flags(1024, 512, BLOCK_STORE_DEDUP | BLOCK_STORE_CHECKSUMS);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> block(512), back(512);
+    for (size_t id = 0; id < 500; ++id) {
+        dedup_fill(block, id);
+        ASSERT_TRUE(block_store_request(bs, id));
+        ASSERT_EQ(512, block_store_write(bs, id, block.data()));
+    }
+    // 500 blocks written, four distinct ones stored, the zeroed ones take nothing
+    ASSERT_EQ(500, block_store_get_used_blocks(bs));
+    ASSERT_EQ(4, block_store_get_stored_blocks(bs));
+    for (size_t id = 0; id < 500; ++id) {
+        dedup_fill(block, id);
+        ASSERT_EQ(512, block_store_read(bs, id, back.data()));
+        ASSERT_EQ(block, back) << "block " << id;
+    }
+
+    // A shared block written over gets a copy of its own, the others sharing it don't change
+    ASSERT_EQ(3, block_store_pwrite(bs, 0, 10, 3, "xyz"));
+    ASSERT_EQ(5, block_store_get_stored_blocks(bs));
+    ASSERT_EQ(512, block_store_read(bs, 5, back.data()));
+    dedup_fill(block, 5);
+    ASSERT_EQ(block, back);
+    ASSERT_EQ(3, block_store_pread(bs, 0, 10, 3, back.data()));
+    ASSERT_EQ(0, memcmp("xyz", back.data(), 3));
+    // One nobody shares is written in place, and written back the way it was it joins the rest again
+    ASSERT_EQ(3, block_store_pwrite(bs, 0, 10, 3, "XYZ"));
+    ASSERT_EQ(5, block_store_get_stored_blocks(bs));
+    dedup_fill(block, 0);
+    ASSERT_EQ(512, block_store_write(bs, 0, block.data()));
+    ASSERT_EQ(4, block_store_get_stored_blocks(bs));
+
+    // A borrow gets a copy to itself, and gives it up on return if it matches another block
+    uint8_t *raw = (uint8_t *) block_store_borrow_mut(bs, 1);
+    ASSERT_NE(nullptr, raw);
+    ASSERT_EQ(5, block_store_get_stored_blocks(bs));
+    dedup_fill(block, 2);
+    memcpy(raw, block.data(), 512);
+    ASSERT_EQ(512, block_store_read(bs, 6, back.data()));
+    dedup_fill(block, 6);
+    ASSERT_EQ(block, back);
+    ASSERT_EQ(512, block_store_write(bs, 1, raw));
+    block_store_release(bs, 1);
+    ASSERT_EQ(500, block_store_get_used_blocks(bs));
+    block_store_return(bs, 1);
+    ASSERT_EQ(4, block_store_get_stored_blocks(bs));
+    ASSERT_EQ(512, block_store_read(bs, 1, back.data()));
+    dedup_fill(block, 2);
+    ASSERT_EQ(block, back);
+    const uint8_t *zeroed = (const uint8_t *) block_store_borrow(bs, 4);
+    ASSERT_EQ(512, std::count(zeroed, zeroed + 512, 0));
+    block_store_return(bs, 4);
+    ASSERT_EQ(4, block_store_get_stored_blocks(bs));
+
+    // The vectored calls and ranges go block by block through the map
+    std::vector<uint8_t> range(4 * 512), expect(4 * 512);
+    for (size_t i = 0; i < 4; ++i) {
+        dedup_fill(block, 20 + i);
+        std::copy(block.begin(), block.end(), expect.begin() + i * 512);
+    }
+    size_t first;
+    ASSERT_TRUE(block_store_allocate_extent(bs, 4, &first));
+    ASSERT_EQ(500, first);
+    ASSERT_TRUE(block_store_request(bs, 700));
+    ASSERT_TRUE(block_store_request(bs, 701));
+    ASSERT_EQ(4 * 512, block_store_write_range(bs, first, 4, expect.data()));
+    ASSERT_EQ(4 * 512, block_store_read_range(bs, first, 4, range.data()));
+    ASSERT_EQ(expect, range);
+    size_t ids[2] = {700, 701};
+    struct iovec iov[2] = {{expect.data(), 512}, {expect.data() + 512, 512}};
+    ASSERT_EQ(2 * 512, block_store_writev(bs, ids, iov, 2));
+    iov[0].iov_base = range.data();
+    iov[1].iov_base = range.data() + 512;
+    ASSERT_EQ(2 * 512, block_store_readv(bs, ids, iov, 2));
+    ASSERT_EQ(0, memcmp(expect.data(), range.data(), 2 * 512));
+    ASSERT_EQ(4, block_store_get_stored_blocks(bs));
+    ASSERT_EQ(0, block_store_verify(bs));
+
+    // Releasing drops references, a copy goes once nothing maps onto it, and the block reads back zeroed
+    for (size_t id = 0; id < 500; id += 5) {
+        block_store_release(bs, id + 3);
+    }
+    block_store_release_extent(bs, first, 4);
+    size_t batch[2] = {700, 701};
+    block_store_release_batch(bs, batch, 2);
+    ASSERT_EQ(3, block_store_get_stored_blocks(bs));
+    ASSERT_EQ(512, block_store_read(bs, 3, back.data()));
+    ASSERT_EQ(512, std::count(back.begin(), back.end(), 0));
+    ASSERT_EQ(0, block_store_verify(bs));
+    block_store_destroy(bs);
+    ASSERT_EQ(SIZE_MAX, block_store_get_stored_blocks(nullptr));
+}
+
+TEST(block_store_dedup, images)
+{
+    block_store_t *bs = block_store_create_flags(4096, 1024, BLOCK_STORE_DEDUP);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> block(1024), back(1024);
+    for (size_t id = 0; id < 3000; ++id) {
+        dedup_fill(block, id);
+        ASSERT_TRUE(block_store_request(bs, id));
+        ASSERT_EQ(1024, block_store_write(bs, id, block.data()));
+    }
+    ASSERT_EQ(4, block_store_get_stored_blocks(bs));
+
+    // The plain image only writes the metadata blocks and the four copies
+    const size_t fbm_blocks = 4096 - block_store_get_avail_blocks(bs);
+    ASSERT_EQ((fbm_blocks + 4) * 1024, block_store_serialize(bs, "test_dedup.bs"));
+    struct stat st;
+    ASSERT_EQ(0, stat("test_dedup.bs", &st));
+    ASSERT_EQ(4096 * 1024, st.st_size);
+    ASSERT_GT(4096 * 1024 / 8, st.st_blocks * 512);
+    size_t packed = block_store_serialize_compressed(bs, "test_dedup_packed.bs");
+    ASSERT_LT(0, packed);
+    // Most of that is the index
+    ASSERT_GT(4096 * 16 + 16 * 1024, packed);
+
+    for (const char *name : {"test_dedup.bs", "test_dedup_packed.bs"}) {
+        block_store_t *copy = block_store_deserialize(name);
+        ASSERT_NE(nullptr, copy);
+        ASSERT_EQ(3000, block_store_get_used_blocks(copy));
+        ASSERT_EQ(4, block_store_get_stored_blocks(copy));
+        block_store_image_t *image = block_store_image_open(name);
+        ASSERT_NE(nullptr, image);
+        for (size_t id : {0, 1, 4, 777, 2999, 3000}) {
+            dedup_fill(block, id < 3000 ? id : 4);
+            ASSERT_EQ(1024, block_store_read(copy, id, back.data()));
+            ASSERT_EQ(block, back) << name << " block " << id;
+            ASSERT_EQ(1024, block_store_image_read(image, id, back.data()));
+            ASSERT_EQ(block, back) << name << " block " << id;
+        }
+        block_store_image_close(image);
+        // The copy finds the same blocks again
+        dedup_fill(block, 7);
+        ASSERT_EQ(1024, block_store_write(copy, 3500, block.data()));
+        ASSERT_EQ(4, block_store_get_stored_blocks(copy));
+        block_store_destroy(copy);
+    }
+
+    // Mapped, changes go back to the file and the incremental image skips the unused slots
+    block_store_t *mapped = block_store_open_mmap("test_dedup.bs", 0);
+    ASSERT_NE(nullptr, mapped);
+    ASSERT_EQ(4, block_store_get_stored_blocks(mapped));
+    std::fill(block.begin(), block.end(), 0x42);
+    ASSERT_EQ(1024, block_store_write(mapped, 10, block.data()));
+    ASSERT_EQ(5, block_store_get_stored_blocks(mapped));
+    ASSERT_LT(0, block_store_serialize_incremental(mapped, "test_dedup_incr.bs"));
+    block_store_destroy(mapped);
+    for (const char *name : {"test_dedup.bs", "test_dedup_incr.bs"}) {
+        block_store_t *copy = block_store_deserialize(name);
+        ASSERT_NE(nullptr, copy);
+        ASSERT_EQ(5, block_store_get_stored_blocks(copy));
+        ASSERT_EQ(1024, block_store_read(copy, 10, back.data()));
+        ASSERT_EQ(block, back);
+        block_store_destroy(copy);
+    }
+
+    // A map entry pointing past the last slot is refused, and a journal can't be opened on the image
+    int fd = open("test_dedup.bs", O_RDWR);
+    uint32_t entry = 5000;
+    ASSERT_EQ(4, pwrite(fd, &entry, 4, 64 + 4096 / 8 + 4 * 2));
+    close(fd);
+    ASSERT_EQ(nullptr, block_store_deserialize("test_dedup.bs"));
+    ASSERT_EQ(nullptr, block_store_open_wal("test_dedup.bs"));
+    block_store_destroy(bs);
+    std::remove("test_dedup.bs");
+    std::remove("test_dedup_packed.bs");
+    std::remove("test_dedup_incr.bs");
+}
+
+TEST(block_store_snapshot, copy_on_write)
+{
+    ASSERT_EQ(nullptr, block_store_snapshot(nullptr));
+    block_store_t *bs = block_store_create_flags(1024, 512, BLOCK_STORE_CHECKSUMS);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> block(512), back(512);
+    for (size_t id = 0; id < 100; ++id) {
+        std::fill(block.begin(), block.end(), (uint8_t) id);
+        ASSERT_TRUE(block_store_request(bs, id));
+        ASSERT_EQ(512, block_store_write(bs, id, block.data()));
+    }
+    uint8_t *raw = (uint8_t *) block_store_borrow_mut(bs, 50);
+    ASSERT_NE(nullptr, raw);
+    block_store_t *snapshot = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snapshot);
+    ASSERT_EQ(nullptr, block_store_snapshot(snapshot));
+    // A block out on a mutable borrow was copied when the snapshot was taken
+    memset(raw, 0xee, 512);
+    block_store_return(bs, 50);
+
+    // Everything the device does from here on leaves the snapshot alone
+    std::fill(block.begin(), block.end(), 0xaa);
+    ASSERT_EQ(512, block_store_write(bs, 7, block.data()));
+    ASSERT_EQ(3, block_store_pwrite(bs, 8, 100, 3, "xyz"));
+    block_store_release(bs, 9);
+    ASSERT_TRUE(block_store_request(bs, 200));
+    ASSERT_EQ(512, block_store_write(bs, 200, block.data()));
+    size_t ids[2] = {10, 11};
+    struct iovec iov[2] = {{block.data(), 512}, {block.data(), 512}};
+    ASSERT_EQ(2 * 512, block_store_writev(bs, ids, iov, 2));
+    std::vector<uint8_t> range(4 * 512, 0xbb);
+    ASSERT_EQ(4 * 512, block_store_write_range(bs, 12, 4, range.data()));
+
+    ASSERT_EQ(100, block_store_get_used_blocks(snapshot));
+    for (size_t id = 0; id < 100; ++id) {
+        std::fill(block.begin(), block.end(), (uint8_t) id);
+        ASSERT_EQ(512, block_store_read(snapshot, id, back.data()));
+        ASSERT_EQ(block, back) << "block " << id;
+    }
+    ASSERT_EQ(4 * 512, block_store_read_range(snapshot, 12, 4, range.data()));
+    ASSERT_EQ(0x0c, range[0]);
+    ASSERT_EQ(0x0f, range[3 * 512]);
+    const uint8_t *view = (const uint8_t *) block_store_borrow(snapshot, 7);
+    ASSERT_NE(nullptr, view);
+    ASSERT_EQ(512, std::count(view, view + 512, 7));
+    block_store_return(snapshot, 7);
+    view = (const uint8_t *) block_store_borrow(snapshot, 20);
+    ASSERT_EQ(512, std::count(view, view + 512, 20));
+    block_store_return(snapshot, 20);
+    ASSERT_EQ(0, block_store_verify(snapshot));
+
+    // Nothing writes to a snapshot
+    ASSERT_EQ(0, block_store_write(snapshot, 1, block.data()));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(snapshot));
+    ASSERT_FALSE(block_store_request(snapshot, 300));
+    ASSERT_EQ(nullptr, block_store_borrow_mut(snapshot, 1));
+    ASSERT_EQ(0, block_store_serialize_incremental(snapshot, "test_snapshot.bs"));
+
+    // The image is the device as it was
+    ASSERT_LT(0, block_store_serialize(snapshot, "test_snapshot.bs"));
+    ASSERT_LT(0, block_store_serialize_compressed(snapshot, "test_snapshot_packed.bs"));
+    for (const char *name : {"test_snapshot.bs", "test_snapshot_packed.bs"}) {
+        block_store_t *copy = block_store_deserialize(name);
+        ASSERT_NE(nullptr, copy) << name;
+        ASSERT_EQ(100, block_store_get_used_blocks(copy));
+        for (size_t id : {0, 7, 8, 9, 11, 50, 99}) {
+            std::fill(block.begin(), block.end(), (uint8_t) id);
+            ASSERT_EQ(512, block_store_read(copy, id, back.data()));
+            ASSERT_EQ(block, back) << name << " block " << id;
+        }
+        block_store_destroy(copy);
+    }
+
+    // The snapshot keeps going once the device is gone
+    block_store_t *second = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, second);
+    block_store_destroy(bs);
+    for (size_t id = 0; id < 100; ++id) {
+        std::fill(block.begin(), block.end(), (uint8_t) id);
+        ASSERT_EQ(512, block_store_read(snapshot, id, back.data()));
+        ASSERT_EQ(block, back) << "block " << id;
+    }
+    ASSERT_EQ(512, block_store_read(second, 7, back.data()));
+    ASSERT_EQ(512, std::count(back.begin(), back.end(), 0xaa));
+    ASSERT_EQ(0, block_store_verify(second));
+    block_store_destroy(second);
+    block_store_destroy(snapshot);
+    std::remove("test_snapshot.bs");
+    std::remove("test_snapshot_packed.bs");
+}
+
+TEST(block_store_snapshot, dedup)
+{
+    block_store_t *bs = block_store_create_flags(1024, 512, BLOCK_STORE_DEDUP);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> block(512), back(512);
+    for (size_t id = 0; id < 500; ++id) {
+        dedup_fill(block, id);
+        ASSERT_TRUE(block_store_request(bs, id));
+        ASSERT_EQ(512, block_store_write(bs, id, block.data()));
+    }
+    block_store_t *snapshot = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snapshot);
+    // Rewriting a copy nobody else shares, and freeing every copy of one record, then reusing its slot
+    ASSERT_EQ(3, block_store_pwrite(bs, 0, 0, 3, "xyz"));
+    ASSERT_EQ(3, block_store_pwrite(bs, 0, 0, 3, "XYZ"));
+    for (size_t id = 1; id < 500; id += 5) {
+        block_store_release(bs, id);
+    }
+    std::fill(block.begin(), block.end(), 0x42);
+    for (size_t id = 2; id < 500; id += 5) {
+        ASSERT_EQ(512, block_store_write(bs, id, block.data()));
+    }
+    ASSERT_EQ(4, block_store_get_stored_blocks(snapshot));
+    for (size_t id = 0; id < 500; ++id) {
+        dedup_fill(block, id);
+        ASSERT_EQ(512, block_store_read(snapshot, id, back.data()));
+        ASSERT_EQ(block, back) << "block " << id;
+    }
+    ASSERT_LT(0, block_store_serialize(snapshot, "test_snapshot.bs"));
+    block_store_destroy(bs);
+    block_store_t *copy = block_store_deserialize("test_snapshot.bs");
+    ASSERT_NE(nullptr, copy);
+    ASSERT_EQ(4, block_store_get_stored_blocks(copy));
+    for (size_t id = 0; id < 500; ++id) {
+        dedup_fill(block, id);
+        ASSERT_EQ(512, block_store_read(copy, id, back.data()));
+        ASSERT_EQ(block, back) << "block " << id;
+        ASSERT_EQ(512, block_store_read(snapshot, id, back.data()));
+        ASSERT_EQ(block, back) << "block " << id;
+    }
+    block_store_destroy(copy);
+    block_store_destroy(snapshot);
+    std::remove("test_snapshot.bs");
+}
+
+TEST(block_store_snapshot, writers_keep_going)
+{
+    block_store_t *bs = block_store_create_flags(4096, 1024, BLOCK_STORE_THREAD_SAFE);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> block(1024), back(1024);
+    for (size_t id = 0; id < 2048; ++id) {
+        std::fill(block.begin(), block.end(), (uint8_t) id);
+        ASSERT_TRUE(block_store_request(bs, id));
+        ASSERT_EQ(1024, block_store_write(bs, id, block.data()));
+    }
+    block_store_t *snapshot = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snapshot);
+
+    // Writers go on over every block while the snapshot is read and written out
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> writers;
+    for (size_t t = 0; t < 4; ++t) {
+        writers.emplace_back([&, t]() {
+            std::vector<uint8_t> mine(1024, (uint8_t) (0xf0 + t));
+            for (size_t round = 0; !stop.load(); ++round) {
+                block_store_write(bs, (round * 4 + t) % 2048, mine.data());
+            }
+        });
+    }
+    ASSERT_LT(0, block_store_serialize(snapshot, "test_snapshot.bs"));
+    for (size_t id = 0; id < 2048; ++id) {
+        std::fill(block.begin(), block.end(), (uint8_t) id);
+        ASSERT_EQ(1024, block_store_read(snapshot, id, back.data()));
+        ASSERT_EQ(block, back) << "block " << id;
+    }
+    stop.store(true);
+    for (std::thread &writer : writers) {
+        writer.join();
+    }
+
+    block_store_t *copy = block_store_deserialize("test_snapshot.bs");
+    ASSERT_NE(nullptr, copy);
+    for (size_t id = 0; id < 2048; ++id) {
+        std::fill(block.begin(), block.end(), (uint8_t) id);
+        ASSERT_EQ(1024, block_store_read(copy, id, back.data()));
+        ASSERT_EQ(block, back) << "block " << id;
+    }
+    block_store_destroy(copy);
+    block_store_destroy(snapshot);
+    block_store_destroy(bs);
+    std::remove("test_snapshot.bs");
+}
+
+TEST(bitmap, ffz_ffs_across_words)
+{
+    bitmap_t *bitmap = bitmap_create(200);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffs(bitmap));
+    ASSERT_EQ(0, bitmap_ffz(bitmap));
+
+    for (size_t i = 0; i < 130; ++i) {
+        bitmap_set(bitmap, i);
+    }
+    ASSERT_EQ(0, bitmap_ffs(bitmap));
+    ASSERT_EQ(130, bitmap_ffz(bitmap));
+
+    bitmap_reset(bitmap, 0);
+    bitmap_reset(bitmap, 64);
+    ASSERT_EQ(1, bitmap_ffs(bitmap));
+    ASSERT_EQ(0, bitmap_ffz(bitmap));
+    ASSERT_EQ(128, bitmap_total_set(bitmap));
+
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap, ffz_ignores_tail_bits)
+{
+    // 70 bits leaves most of the second word past the end of the bitmap
+    bitmap_t *bitmap = bitmap_create(70);
+    ASSERT_NE(nullptr, bitmap);
+    for (size_t i = 0; i < 70; ++i) {
+        bitmap_set(bitmap, i);
+    }
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+    ASSERT_EQ(70, bitmap_total_set(bitmap));
+
+    bitmap_invert(bitmap);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffs(bitmap));
+    ASSERT_EQ(0, bitmap_total_set(bitmap));
+
+    bitmap_format(bitmap, 0xFF);
+    ASSERT_EQ(70, bitmap_total_set(bitmap));
+
+    bitmap_destroy(bitmap);
+}
+
+static void collect_bit(size_t bit, void *arg) {
+    static_cast<std::vector<size_t> *>(arg)->push_back(bit);
+}
+
+TEST(bitmap, for_each_in_order)
+{
+    bitmap_t *bitmap = bitmap_create(300);
+    ASSERT_NE(nullptr, bitmap);
+    const size_t bits[] = {0, 5, 63, 64, 127, 200, 299};
+    for (size_t bit : bits) {
+        bitmap_set(bitmap, bit);
+    }
+    std::vector<size_t> seen;
+    bitmap_for_each(bitmap, collect_bit, &seen);
+    ASSERT_EQ(std::vector<size_t>(std::begin(bits), std::end(bits)), seen);
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap, export_import_bytes)
+{
+    bitmap_t *bitmap = bitmap_create(20);
+    ASSERT_NE(nullptr, bitmap);
+    bitmap_set(bitmap, 0);
+    bitmap_set(bitmap, 9);
+    bitmap_set(bitmap, 19);
+    ASSERT_EQ(3, bitmap_get_bytes(bitmap));
+
+    // Byte layout is the same as it always was: bit i lives in byte i / 8
+    const uint8_t *bytes = bitmap_export(bitmap);
+    ASSERT_EQ(0x01, bytes[0]);
+    ASSERT_EQ(0x02, bytes[1]);
+    ASSERT_EQ(0x08, bytes[2]);
+
+    bitmap_t *copy = bitmap_import(20, bytes);
+    ASSERT_NE(nullptr, copy);
+    ASSERT_EQ(3, bitmap_total_set(copy));
+    ASSERT_TRUE(bitmap_test(copy, 9));
+
+    uint64_t storage[1] = {0};
+    bitmap_t *overlay = bitmap_overlay(20, storage);
+    ASSERT_NE(nullptr, overlay);
+    bitmap_set(overlay, 9);
+    ASSERT_EQ(0x02, reinterpret_cast<uint8_t *>(storage)[1]);
+
+    bitmap_destroy(overlay);
+    bitmap_destroy(copy);
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap, hierarchical_matches_flat)
+{
+    // Three summary levels: 300000 bits -> 4688 words -> 74 -> 2 -> 1
+    const size_t bits = 300000;
+    bitmap_t *flat = bitmap_create(bits);
+    bitmap_t *tree = bitmap_create_hierarchical(bits);
+    ASSERT_NE(nullptr, flat);
+    ASSERT_NE(nullptr, tree);
+
+    ASSERT_EQ(SIZE_MAX, bitmap_ffs(tree));
+    ASSERT_EQ(0, bitmap_ffz(tree));
+
+    srand(520);
+    for (int i = 0; i < 200000; ++i) {
+        const size_t bit = rand() % bits;
+        if (rand() % 4) {
+            bitmap_set(flat, bit);
+            bitmap_set(tree, bit);
+        } else {
+            bitmap_reset(flat, bit);
+            bitmap_reset(tree, bit);
+        }
+        if (i % 1000 == 0) {
+            ASSERT_EQ(bitmap_ffz(flat), bitmap_ffz(tree));
+            ASSERT_EQ(bitmap_ffs(flat), bitmap_ffs(tree));
+        }
+    }
+
+    bitmap_format(tree, 0xFF);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(tree));
+    bitmap_reset(tree, bits - 1);
+    ASSERT_EQ(bits - 1, bitmap_ffz(tree));
+    bitmap_invert(tree);
+    ASSERT_EQ(bits - 1, bitmap_ffs(tree));
+    ASSERT_EQ(0, bitmap_ffz(tree));
+
+    bitmap_destroy(flat);
+    bitmap_destroy(tree);
+}
+
+TEST(bitmap, summarize_overlay)
+{
+    std::vector<uint64_t> storage(100, ~UINT64_C(0));
+    storage[77] = ~UINT64_C(0) << 3;
+    bitmap_t *bitmap = bitmap_overlay(6400, storage.data());
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_TRUE(bitmap_summarize(bitmap));
+    ASSERT_EQ(77 * 64, bitmap_ffz(bitmap));
+
+    bitmap_set(bitmap, 77 * 64);
+    bitmap_set(bitmap, 77 * 64 + 1);
+    bitmap_set(bitmap, 77 * 64 + 2);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+
+    // Memory changed underneath, summarize again to pick it up
+    storage[3] = 0;
+    ASSERT_TRUE(bitmap_summarize(bitmap));
+    ASSERT_EQ(3 * 64, bitmap_ffz(bitmap));
+
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap, overlay_short_buffer)
+{
+    // 100 bits take 13 bytes, the second word stops 3 bytes short, and whatever follows is left alone
+    alignas(8) uint8_t storage[16];
+    memset(storage, 0, 13);
+    memset(storage + 13, 0xEE, 3);
+    ASSERT_EQ(nullptr, bitmap_overlay(100, storage + 1));
+    bitmap_t *bitmap = bitmap_overlay(100, storage);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_EQ(13, bitmap_get_bytes(bitmap));
+
+    bitmap_set(bitmap, 99);
+    bitmap_set(bitmap, 64);
+    bitmap_flip(bitmap, 70);
+    ASSERT_EQ(0x08, storage[12]);
+    ASSERT_EQ(0x41, storage[8]);
+    bitmap_reset(bitmap, 70);
+    ASSERT_EQ(2, bitmap_total_set(bitmap));
+    ASSERT_EQ(64, bitmap_ffs(bitmap));
+
+    bitmap_set_range(bitmap, 0, 99);
+    ASSERT_EQ(100, bitmap_total_set(bitmap));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+    ASSERT_TRUE(bitmap_test_and_reset(bitmap, 97));
+    ASSERT_EQ(97, bitmap_ffz_claim(bitmap, 90));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz_claim(bitmap, 0));
+    bitmap_invert(bitmap);
+    ASSERT_EQ(0, bitmap_total_set(bitmap));
+    ASSERT_FALSE(bitmap_test_and_set(bitmap, 96));
+    ASSERT_TRUE(bitmap_test_and_set(bitmap, 96));
+
+    // The summary and batch claims go through the same short word
+    ASSERT_TRUE(bitmap_summarize(bitmap));
+    bitmap_set_range(bitmap, 0, 96);
+    ASSERT_EQ(97, bitmap_ffz(bitmap));
+    size_t bits[8];
+    ASSERT_EQ(3, bitmap_claim_zeros(bitmap, 8, bits));
+    ASSERT_EQ(99, bits[2]);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+    ASSERT_EQ(0x0F, storage[12] & 0x0F);
+
+    for (size_t i = 13; i < 16; ++i) {
+        ASSERT_EQ(0xEE, storage[i]) << i;
+    }
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap, set_reset_range)
+{
+    bitmap_t *bitmap = bitmap_create_hierarchical(5000);
+    ASSERT_NE(nullptr, bitmap);
+    bitmap_set_range(bitmap, 0, 4999);
+    ASSERT_EQ(4999, bitmap_ffz(bitmap));
+    ASSERT_EQ(4999, bitmap_total_set(bitmap));
+
+    bitmap_reset_range(bitmap, 60, 200);
+    ASSERT_EQ(60, bitmap_ffz(bitmap));
+    ASSERT_TRUE(bitmap_test(bitmap, 59));
+    ASSERT_FALSE(bitmap_test(bitmap, 259));
+    ASSERT_TRUE(bitmap_test(bitmap, 260));
+    ASSERT_EQ(4799, bitmap_total_set(bitmap));
+
+    bitmap_reset_range(bitmap, 0, 5000);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffs(bitmap));
+    bitmap_set_range(bitmap, 4990, 3);
+    ASSERT_EQ(4990, bitmap_ffs(bitmap));
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap, ffz_run)
+{
+    bitmap_t *bitmap = bitmap_create(1000);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_EQ(0, bitmap_ffz_run(bitmap, 1000));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz_run(bitmap, 1001));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz_run(bitmap, 0));
+
+    // Pepper the map: 0..9 used, 20 used, 64..199 used, 300 used
+    bitmap_set_range(bitmap, 0, 10);
+    bitmap_set(bitmap, 20);
+    bitmap_set_range(bitmap, 64, 136);
+    bitmap_set(bitmap, 300);
+    ASSERT_EQ(10, bitmap_ffz_run(bitmap, 10));
+    ASSERT_EQ(21, bitmap_ffz_run(bitmap, 11));
+    ASSERT_EQ(21, bitmap_ffz_run(bitmap, 43));
+    ASSERT_EQ(200, bitmap_ffz_run(bitmap, 44));
+    ASSERT_EQ(200, bitmap_ffz_run(bitmap, 100));
+    ASSERT_EQ(301, bitmap_ffz_run(bitmap, 101));
+    ASSERT_EQ(301, bitmap_ffz_run(bitmap, 699));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz_run(bitmap, 700));
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap, claim_zeros)
+{
+    bitmap_t *bitmap = bitmap_create_hierarchical(300);
+    ASSERT_NE(nullptr, bitmap);
+    bitmap_set_range(bitmap, 0, 130);
+    bitmap_set(bitmap, 131);
+
+    size_t bits[300];
+    ASSERT_EQ(3, bitmap_claim_zeros(bitmap, 3, bits));
+    ASSERT_EQ(130, bits[0]);
+    ASSERT_EQ(132, bits[1]);
+    ASSERT_EQ(133, bits[2]);
+    ASSERT_EQ(134, bitmap_ffz(bitmap));
+
+    // Asking for more than is left takes everything up to the last bit and no further
+    ASSERT_EQ(166, bitmap_claim_zeros(bitmap, 300, bits));
+    ASSERT_EQ(134, bits[0]);
+    ASSERT_EQ(299, bits[165]);
+    ASSERT_EQ(300, bitmap_total_set(bitmap));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+    ASSERT_EQ(0, bitmap_claim_zeros(bitmap, 1, bits));
+    ASSERT_EQ(0, bitmap_claim_zeros(NULL, 1, bits));
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap, ffz_from)
+{
+    bitmap_t *bitmap = bitmap_create(200);
+    ASSERT_NE(nullptr, bitmap);
+    bitmap_set_range(bitmap, 0, 70);
+    bitmap_set_range(bitmap, 72, 8);
+    bitmap_set_range(bitmap, 90, 100);
+
+    ASSERT_EQ(70, bitmap_ffz_from(bitmap, 0));
+    ASSERT_EQ(71, bitmap_ffz_from(bitmap, 71));
+    ASSERT_EQ(80, bitmap_ffz_from(bitmap, 72));
+    ASSERT_EQ(190, bitmap_ffz_from(bitmap, 90));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz_from(bitmap, 200));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz_from(NULL, 0));
+
+    ASSERT_EQ(70, bitmap_ffz_run_from(bitmap, 0, 2));
+    ASSERT_EQ(80, bitmap_ffz_run_from(bitmap, 71, 2));
+    ASSERT_EQ(190, bitmap_ffz_run_from(bitmap, 85, 10));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz_run_from(bitmap, 85, 11));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz_run_from(bitmap, 199, 2));
+
+    // Runs are 2 at 70, 10 at 80 and 10 at 190
+    ASSERT_EQ(70, bitmap_ffz_run_best(bitmap, 1));
+    ASSERT_EQ(80, bitmap_ffz_run_best(bitmap, 3));
+    bitmap_reset(bitmap, 189);
+    ASSERT_EQ(80, bitmap_ffz_run_best(bitmap, 10));
+    ASSERT_EQ(189, bitmap_ffz_run_best(bitmap, 11));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz_run_best(bitmap, 12));
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap, atomic)
+{
+    bitmap_t *bitmap = bitmap_create(1000);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_FALSE(bitmap_test_and_set(bitmap, 70));
+    ASSERT_TRUE(bitmap_test_and_set(bitmap, 70));
+    ASSERT_TRUE(bitmap_test(bitmap, 70));
+    ASSERT_TRUE(bitmap_test_and_reset(bitmap, 70));
+    ASSERT_FALSE(bitmap_test_and_reset(bitmap, 70));
+
+    // Claims start at the hint and wrap around to the bits below it
+    bitmap_set_range(bitmap, 0, 990);
+    ASSERT_EQ(995, bitmap_ffz_claim(bitmap, 995));
+    ASSERT_EQ(990, bitmap_ffz_claim(bitmap, 5000));
+    ASSERT_EQ(992, bitmap_ffz_claim(bitmap, 992));
+    ASSERT_EQ(999, bitmap_ffz_claim(bitmap, 999));
+    ASSERT_EQ(991, bitmap_ffz_claim(bitmap, 999));
+    bitmap_set_range(bitmap, 990, 10);
+    bitmap_reset(bitmap, 3);
+    ASSERT_EQ(3, bitmap_ffz_claim(bitmap, 4));
+
+    // Threads racing for every bit: each one is won exactly once
+    bitmap_format(bitmap, 0x00);
+    const unsigned threads = 8;
+    std::vector<std::vector<size_t>> won(threads);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            for (size_t bit; (bit = bitmap_ffz_claim(bitmap, t * 100)) != SIZE_MAX;) {
+                won[t].push_back(bit);
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    std::vector<size_t> all;
+    for (const std::vector<size_t> &bits : won) {
+        all.insert(all.end(), bits.begin(), bits.end());
+    }
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(1000, all.size());
+    ASSERT_TRUE(std::adjacent_find(all.begin(), all.end()) == all.end());
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz_claim(bitmap, 0));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz_claim(NULL, 0));
+    bitmap_destroy(bitmap);
+}